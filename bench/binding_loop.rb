@@ -0,0 +1,48 @@
+#*************************************************************************#
+#                                                                         #
+# binding_loop.rb - per-command overhead of the mruby binding             #
+# Copyright (C) 2015 Paolo Bosetti and Matteo Ragni,                      #
+# paolo[dot]bosetti[at]unitn.it and matteo[dot]ragni[at]unitn.it          #
+# Department of Industrial Engineering, University of Trento              #
+#                                                                         #
+# This library is free software.  You can redistribute it and/or          #
+# modify it under the terms of the GNU GENERAL PUBLIC LICENSE 2.0.        #
+#                                                                         #
+# This library is distributed in the hope that it will be useful,         #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+# Artistic License 2.0 for more details.                                  #
+#                                                                         #
+# See the file LICENSE                                                    #
+#                                                                         #
+#*************************************************************************#
+
+# Tight loops of pwd and size against a server, typically the loopback
+# stub (make bench/ftpstub; bench/ftpstub -p 2121 /tmp/root):
+#
+#   mruby bench/binding_loop.rb [host:port] [count] [file]
+#
+# With cache_ttl unset every size call is a round trip, so the difference
+# between two builds of the gem is the binding's own overhead. pwd is
+# answered from the session's working directory after the first call and
+# times the binding alone.
+
+host  = ARGV[0] || '127.0.0.1:2121'
+count = (ARGV[1] || 100000).to_i
+file  = ARGV[2] || 'binding_loop.dat'
+
+FTP.open(host, 'bench', 'bench') do |ftp|
+  ftp.login
+  ftp.size(file) # nil is fine, the reply is what gets timed
+  [:pwd, :size].each do |op|
+    t0 = Time.now
+    if op == :pwd
+      count.times { ftp.pwd }
+    else
+      count.times { ftp.size(file) }
+    end
+    secs = Time.now - t0
+    puts format('%-6s %10.1f calls/s  %8.2f us/call', op, count / secs,
+                secs * 1e6 / count)
+  end
+end
@@ -0,0 +1,310 @@
+/***************************************************************************/
+/*                                                                         */
+/* ftpbench.c - ftplib throughput and latency benchmarks                   */
+/* Copyright (C) 2015 Paolo Bosetti and Matteo Ragni,                      */
+/* paolo[dot]bosetti[at]unitn.it and matteo[dot]ragni[at]unitn.it          */
+/* Department of Industrial Engineering, University of Trento              */
+/*                                                                         */
+/* This library is free software.  You can redistribute it and/or          */
+/* modify it under the terms of the GNU GENERAL PUBLIC LICENSE 2.0.        */
+/*                                                                         */
+/* This library is distributed in the hope that it will be useful,         */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           */
+/* Artistic License 2.0 for more details.                                  */
+/*                                                                         */
+/* See the file LICENSE                                                    */
+/*                                                                         */
+/***************************************************************************/
+
+/*
+Runs against the in-process loopback stub unless -H names a real server:
+
+    ftpbench [-l latency_ms] [-c connects] [-n small_files] [-s large_mb]
+             [-B] [-T [-N]] [-U] [-C policy] [-O depth [-K block_kb]]
+             [-Z codec] [-H host:port [-u user] [-p pass]]
+
+Reports connect+login latency, small-file operations per second and
+large-file throughput in IMAGE and ASCII modes. -B asks for MODE B, so
+that transfers share one data connection when the server supports it.
+-T runs the sessions over FTPS (ftplib built with FTPLIB_TLS, see
+make TLS=1) without checking the certificate; -N makes every data
+connection do a full handshake instead of resuming the TLS session.
+-U downloads binary files through io_uring where the kernel allows it.
+-C keep|drop|direct chooses what the transfers leave in the page cache.
+-O moves disk I/O to a second thread, with a ring of depth buffers of
+block_kb kilobytes (64 by default) between it and the network.
+-Z gzip|zstd compresses uploads and decompresses downloads on the fly;
+throughput counts the uncompressed bytes and ASCII runs are skipped.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "ftplib.h"
+#include "ftpstub.h"
+
+#define SMALL_SIZE 1024
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/* text with lines of varying length, so ASCII mode has work to do */
+static int make_file(const char *path, long size) {
+  FILE *f = fopen(path, "wb");
+  long i;
+  if (f == NULL)
+    return 0;
+  for (i = 0; i < size; i++)
+    fputc((i % 73 == 72) ? '\n' : 'a' + (int)(i * 7 % 26), f);
+  return fclose(f) == 0;
+}
+
+static int block_mode, uring, page_cache, overlap, overlap_kb, codec;
+static int tls = -1;
+
+static netbuf *session(const char *host, const char *user, const char *pass) {
+  netbuf *conn;
+  if (!FtpConnect(host, &conn))
+    return NULL;
+  FtpOptions(FTPLIB_BLOCKMODE, block_mode, conn);
+  FtpOptions(FTPLIB_IOURING, uring, conn);
+  FtpOptions(FTPLIB_PAGECACHE, page_cache, conn);
+  FtpOptions(FTPLIB_OVERLAP, overlap, conn);
+  if (overlap_kb)
+    FtpOptions(FTPLIB_OVERLAPBLOCK, overlap_kb * 1024L, conn);
+  if (codec && !FtpOptions(FTPLIB_COMPRESS, codec, conn)) {
+    fprintf(stderr, "codec not built in\n");
+    FtpQuit(conn);
+    return NULL;
+  }
+  if ((tls != -1 && !FtpAuthTLS(tls, conn)) || !FtpLogin(user, pass, conn)) {
+    FtpQuit(conn);
+    return NULL;
+  }
+  return conn;
+}
+
+static void bench_connect(const char *host, const char *user,
+                          const char *pass, int count) {
+  double *t = malloc(count * sizeof(double)), sum = 0, t0;
+  int i, n = 0;
+  netbuf *conn;
+  for (i = 0; i < count; i++) {
+    t0 = now();
+    if ((conn = session(host, user, pass)) == NULL)
+      continue;
+    t[n] = (now() - t0) * 1e3;
+    sum += t[n++];
+    FtpQuit(conn);
+  }
+  if (n == 0) {
+    printf("%-24s failed\n", "connect+login");
+    free(t);
+    return;
+  }
+  qsort(t, n, sizeof(double), cmp_double);
+  printf("%-24s mean %8.3f ms  p50 %8.3f ms  p99 %8.3f ms  (%d runs)\n",
+         "connect+login", sum / n, t[n / 2], t[(n * 99) / 100], n);
+  free(t);
+}
+
+static void bench_small(netbuf *conn, const char *local, const char *back,
+                        int count) {
+  char remote[64];
+  unsigned int size;
+  double t0;
+  int i, ok;
+  struct {
+    const char *name;
+    int op;
+  } ops[] = {{"small put", 0}, {"small get", 1}, {"small size", 2},
+             {"small delete", 3}};
+  size_t k;
+  for (k = 0; k < sizeof(ops) / sizeof(ops[0]); k++) {
+    t0 = now();
+    for (i = 0, ok = 0; i < count; i++) {
+      sprintf(remote, "small%d", i);
+      switch (ops[k].op) {
+      case 0:
+        ok += FtpPut(local, remote, FTPLIB_IMAGE, conn);
+        break;
+      case 1:
+        ok += FtpGet(back, remote, FTPLIB_IMAGE, conn);
+        break;
+      case 2:
+        ok += FtpSize(remote, &size, FTPLIB_IMAGE, conn);
+        break;
+      default:
+        ok += FtpDelete(remote, conn);
+        break;
+      }
+    }
+    printf("%-24s %10.1f ops/s  (%d/%d ok)\n", ops[k].name,
+           ok / (now() - t0), ok, count);
+  }
+}
+
+static void bench_large(netbuf *conn, const char *local, const char *back,
+                        long size) {
+  const char modes[] = {FTPLIB_IMAGE, FTPLIB_ASCII};
+  char name[32];
+  double t0;
+  unsigned int wire;
+  int m, ok;
+  /* compressed transfers are binary only */
+  for (m = 0; m < (codec ? 1 : 2); m++) {
+    t0 = now();
+    ok = FtpPut(local, "large", modes[m], conn);
+    sprintf(name, "large put %s", modes[m] == FTPLIB_IMAGE ? "IMAGE" : "ASCII");
+    printf("%-24s %10.1f MB/s%s\n", name, size / 1048576.0 / (now() - t0),
+           ok ? "" : "  (failed)");
+    if (codec && ok && FtpSize("large", &wire, FTPLIB_IMAGE, conn))
+      printf("%-24s %10u bytes  (%.1fx)\n", "large compressed", wire,
+             (double)size / (wire ? wire : 1));
+    t0 = now();
+    ok = FtpGet(back, "large", modes[m], conn);
+    sprintf(name, "large get %s", modes[m] == FTPLIB_IMAGE ? "IMAGE" : "ASCII");
+    printf("%-24s %10.1f MB/s%s\n", name, size / 1048576.0 / (now() - t0),
+           ok ? "" : "  (failed)");
+  }
+  FtpDelete("large", conn);
+}
+
+int main(int argc, char **argv) {
+  const char *user = "bench", *pass = "bench", *server = NULL;
+  char host[64], dir[] = "/tmp/ftpbench.XXXXXX";
+  char root[sizeof(dir) + 8], small[sizeof(dir) + 16], large[sizeof(dir) + 16];
+  char back[sizeof(dir) + 16];
+  int c, latency = 0, connects = 50, files = 200;
+  long mb = 64;
+  FtpStub *stub = NULL;
+  FtpSessionStats st;
+  netbuf *conn;
+
+  while ((c = getopt(argc, argv, "l:c:n:s:BTNUC:O:K:Z:H:u:p:")) != -1) {
+    switch (c) {
+    case 'l':
+      latency = atoi(optarg);
+      break;
+    case 'c':
+      connects = atoi(optarg);
+      break;
+    case 'n':
+      files = atoi(optarg);
+      break;
+    case 's':
+      mb = atol(optarg);
+      break;
+    case 'B':
+      block_mode = 1;
+      break;
+    case 'T':
+      tls = FTPLIB_TLS_NOVERIFY | (tls == -1 ? 0 : tls);
+      break;
+    case 'N':
+      tls = FTPLIB_TLS_NOVERIFY | FTPLIB_TLS_NOREUSE;
+      break;
+    case 'U':
+      uring = 1;
+      break;
+    case 'C':
+      page_cache = !strcmp(optarg, "direct") ? FTPLIB_PAGECACHE_DIRECT
+                   : !strcmp(optarg, "drop") ? FTPLIB_PAGECACHE_DROP
+                                             : FTPLIB_PAGECACHE_KEEP;
+      break;
+    case 'O':
+      overlap = atoi(optarg);
+      break;
+    case 'K':
+      overlap_kb = atoi(optarg);
+      break;
+    case 'Z':
+      codec = !strcmp(optarg, "zstd") ? FTPLIB_CODEC_ZSTD : FTPLIB_CODEC_GZIP;
+      break;
+    case 'H':
+      server = optarg;
+      break;
+    case 'u':
+      user = optarg;
+      break;
+    case 'p':
+      pass = optarg;
+      break;
+    default:
+      fprintf(stderr,
+              "usage: %s [-l latency_ms] [-c connects] [-n small_files] "
+              "[-s large_mb] [-B] [-T [-N]] [-U] [-C policy] "
+              "[-O depth [-K block_kb]] [-Z codec] [-H host:port [-u user] "
+              "[-p pass]]\n",
+              argv[0]);
+      return 2;
+    }
+  }
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  sprintf(root, "%s/root", dir);
+  sprintf(small, "%s/small", dir);
+  sprintf(large, "%s/large", dir);
+  sprintf(back, "%s/back", dir);
+  if (!make_file(small, SMALL_SIZE) || !make_file(large, mb * 1048576)) {
+    perror("creating files");
+    return 1;
+  }
+  FtpInit();
+  if (server == NULL) {
+    mkdir(root, 0700);
+    if ((stub = FtpStubStart(root, 0, latency)) == NULL) {
+      perror("ftpstub");
+      return 1;
+    }
+    sprintf(host, "127.0.0.1:%d", FtpStubPort(stub));
+    server = host;
+    printf("loopback stub, %d ms injected latency\n", latency);
+  } else {
+    printf("server %s\n", server);
+  }
+
+  bench_connect(server, user, pass, connects);
+  if ((conn = session(server, user, pass)) == NULL) {
+    fprintf(stderr, "cannot log in to %s\n", server);
+    return 1;
+  }
+  bench_small(conn, small, back, files);
+  if (block_mode)
+    printf("%-24s %s\n", "transfer mode",
+           FtpBlockMode(conn) ? "MODE B" : "stream (MODE B refused)");
+  bench_large(conn, large, back, mb * 1048576);
+  if (FtpStats(&st, conn))
+    printf("%-24s %ld sent, %ld redundant skipped\n", "control commands",
+           st.commands, st.saved);
+  FtpQuit(conn);
+  if (tls != -1 && stub) {
+    long full, resumed;
+    FtpStubTlsStats(&full, &resumed);
+    printf("%-24s %ld full, %ld resumed\n", "data TLS handshakes", full,
+           resumed);
+  }
+
+  if (stub)
+    FtpStubStop(stub);
+  unlink(small);
+  unlink(large);
+  unlink(back);
+  rmdir(root);
+  rmdir(dir);
+  return 0;
+}
@@ -0,0 +1,241 @@
+/***************************************************************************/
+/*                                                                         */
+/* ftpmicro.c - microbenchmarks for the ftplib line and reply primitives   */
+/* Copyright (C) 2015 Paolo Bosetti and Matteo Ragni,                      */
+/* paolo[dot]bosetti[at]unitn.it and matteo[dot]ragni[at]unitn.it          */
+/* Department of Industrial Engineering, University of Trento              */
+/*                                                                         */
+/* This library is free software.  You can redistribute it and/or          */
+/* modify it under the terms of the GNU GENERAL PUBLIC LICENSE 2.0.        */
+/*                                                                         */
+/* This library is distributed in the hope that it will be useful,         */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           */
+/* Artistic License 2.0 for more details.                                  */
+/*                                                                         */
+/* See the file LICENSE                                                    */
+/*                                                                         */
+/***************************************************************************/
+
+/*
+Feeds synthetic buffers through readline(), writeline() and readresp()
+over a socketpair, with a helper thread on the other end:
+
+    ftpmicro [-m megabytes_per_case] [-r replies_per_case]
+
+Needs ftplib.c built with -DFTPLIB_TEST_BUILD.
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "ftplib.h"
+
+#if !defined(FTPLIB_TEST_BUILD)
+#error "ftpmicro needs FTPLIB_TEST_BUILD"
+#endif
+
+#define CHUNK 65536
+#define LINESIZ 8192 /* ftplib buffer size */
+
+struct feeder {
+  int fd;
+  const char *data; /* written reps times, then the socket is shut down */
+  size_t len;
+  long reps;
+  long long drained; /* bytes read when draining instead */
+};
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *feed(void *arg) {
+  struct feeder *f = arg;
+  long i;
+  size_t off;
+  ssize_t w;
+  for (i = 0; i < f->reps; i++) {
+    for (off = 0; off < f->len; off += w)
+      if ((w = write(f->fd, f->data + off, f->len - off)) <= 0)
+        goto done;
+  }
+done:
+  shutdown(f->fd, SHUT_WR);
+  return NULL;
+}
+
+static void *drain(void *arg) {
+  struct feeder *f = arg;
+  char buf[CHUNK];
+  ssize_t r;
+  while ((r = read(f->fd, buf, sizeof(buf))) > 0)
+    f->drained += r;
+  return NULL;
+}
+
+/* pattern repeated to fill about CHUNK bytes */
+static char *fill(const char *pattern, size_t *len) {
+  size_t plen = strlen(pattern), n = CHUNK / plen, i;
+  char *buf;
+  if (n == 0)
+    n = 1;
+  if ((buf = malloc(n * plen)) == NULL)
+    return NULL;
+  for (i = 0; i < n; i++)
+    memcpy(buf + i * plen, pattern, plen);
+  *len = n * plen;
+  return buf;
+}
+
+static void report(const char *name, double secs, long long bytes, long ops,
+                   const char *unit) {
+  printf("%-28s %8.2f ns/byte  %8.1f MB/s", name, secs * 1e9 / bytes,
+         bytes / 1048576.0 / secs);
+  if (ops)
+    printf("  %8.1f ns/%s", secs * 1e9 / ops, unit);
+  printf("\n");
+}
+
+static int pair(int sv[2]) {
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+    perror("socketpair");
+    return 0;
+  }
+  return 1;
+}
+
+static void bench_readline(const char *name, const char *pattern, long total) {
+  struct feeder f;
+  pthread_t th;
+  netbuf *n;
+  char line[LINESIZ];
+  long long bytes = 0;
+  long lines = 0;
+  int sv[2], x;
+  double t0;
+
+  if (!pair(sv) || (f.data = fill(pattern, &f.len)) == NULL)
+    return;
+  f.fd = sv[1];
+  f.reps = total / f.len + 1;
+  n = FtpTestNetbuf(sv[0], FTPLIB_READ);
+  t0 = now();
+  pthread_create(&th, NULL, feed, &f);
+  while ((x = FtpTestReadline(line, sizeof(line), n)) > 0) {
+    bytes += x;
+    lines++;
+  }
+  report(name, now() - t0, bytes, lines, "line");
+  pthread_join(th, NULL);
+  FtpTestFree(n);
+  free((char *)f.data);
+  close(sv[0]);
+  close(sv[1]);
+}
+
+static void bench_writeline(const char *name, const char *pattern,
+                            long total) {
+  struct feeder f = {0};
+  pthread_t th;
+  netbuf *n;
+  char *data;
+  size_t len;
+  long i, reps;
+  int sv[2];
+  double t0;
+
+  if (!pair(sv) || (data = fill(pattern, &len)) == NULL)
+    return;
+  f.fd = sv[1];
+  reps = total / len + 1;
+  n = FtpTestNetbuf(sv[0], FTPLIB_WRITE);
+  t0 = now();
+  pthread_create(&th, NULL, drain, &f);
+  for (i = 0; i < reps; i++)
+    if (FtpTestWriteline(data, len, n) != (int)len)
+      break;
+  shutdown(sv[0], SHUT_WR);
+  pthread_join(th, NULL);
+  report(name, now() - t0, (long long)len * i, 0, NULL);
+  FtpTestFree(n);
+  free(data);
+  close(sv[0]);
+  close(sv[1]);
+}
+
+static void bench_readresp(const char *name, const char *reply, long count) {
+  struct feeder f;
+  pthread_t th;
+  netbuf *n;
+  long i;
+  int sv[2];
+  double t0;
+
+  if (!pair(sv))
+    return;
+  f.fd = sv[1];
+  f.data = reply;
+  f.len = strlen(reply);
+  f.reps = count;
+  n = FtpTestNetbuf(sv[0], FTPLIB_CONTROL);
+  t0 = now();
+  pthread_create(&th, NULL, feed, &f);
+  for (i = 0; i < count; i++)
+    if (!FtpTestReadresp(reply[0], n))
+      break;
+  report(name, now() - t0, (long long)f.len * i, i, "reply");
+  pthread_join(th, NULL);
+  FtpTestFree(n);
+  close(sv[0]);
+  close(sv[1]);
+}
+
+int main(int argc, char **argv) {
+  static const char feat[] = "211-Features:\r\n"
+                             " EPSV\r\n"
+                             " MDTM\r\n"
+                             " MFMT\r\n"
+                             " MLST type*;size*;modify*;perm*;unique*;\r\n"
+                             " REST STREAM\r\n"
+                             " SIZE\r\n"
+                             " TVFS\r\n"
+                             " UTF8\r\n"
+                             "211 End\r\n";
+  char longline[4001];
+  long total = 64L * 1048576, replies = 200000;
+  int c;
+
+  while ((c = getopt(argc, argv, "m:r:")) != -1) {
+    switch (c) {
+    case 'm':
+      total = atol(optarg) * 1048576;
+      break;
+    case 'r':
+      replies = atol(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-m megabytes_per_case] [-r replies]\n",
+              argv[0]);
+      return 2;
+    }
+  }
+  memset(longline, 'x', sizeof(longline) - 3);
+  strcpy(longline + sizeof(longline) - 3, "\r\n");
+
+  bench_readline("readline short lines", "-rw-r--r-- a\r\n", total);
+  bench_readline("readline long lines", longline, total);
+  bench_readline("readline CRLF only", "\r\n", total);
+  bench_writeline("writeline no newlines", "abcdefghijklmnop", total);
+  bench_writeline("writeline short lines", "a line of text\n", total);
+  bench_writeline("writeline LF only", "\n", total);
+  bench_readresp("readresp single line", "200 Command okay.\r\n", replies);
+  bench_readresp("readresp multi-line", feat, replies);
+  return 0;
+}
@@ -0,0 +1,1084 @@
+/***************************************************************************/
+/*                                                                         */
+/* ftpstub.c - minimal loopback FTP server used by the benchmarks          */
+/* Copyright (C) 2015 Paolo Bosetti and Matteo Ragni,                      */
+/* paolo[dot]bosetti[at]unitn.it and matteo[dot]ragni[at]unitn.it          */
+/* Department of Industrial Engineering, University of Trento              */
+/*                                                                         */
+/* This library is free software.  You can redistribute it and/or          */
+/* modify it under the terms of the GNU GENERAL PUBLIC LICENSE 2.0.        */
+/*                                                                         */
+/* This library is distributed in the hope that it will be useful,         */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           */
+/* Artistic License 2.0 for more details.                                  */
+/*                                                                         */
+/* See the file LICENSE                                                    */
+/*                                                                         */
+/***************************************************************************/
+
+/*
+A test double, not a server: one thread per session, no access control
+beyond keeping paths below the root, and PORT connects wherever it is
+told. Supports USER, PASS, SYST, FEAT, NOOP, TYPE, MODE, STRU, PWD, CWD,
+CDUP, PASV, EPSV, PORT, REST, RETR, STOR, APPE, LIST, NLST, SIZE, MDTM,
+DELE, MKD, RMD, ABOR (outside transfers only) and QUIT, plus MLST, MLSD,
+MFMT, HASH (with OPTS HASH), XCRC and XMD5 unless told to act as a legacy
+server. Like common servers it answers SIZE and MDTM on files only.
+Built with -DFTPLIB_TLS it also takes AUTH TLS, PBSZ and PROT, with a
+throwaway self-signed certificate. Build with -DFTPSTUB_MAIN for a
+standalone server (-L for a legacy one):
+
+    ftpstub [-p port] [-l latency_ms] [-L] root
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#if defined(FTPLIB_TLS)
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#else
+typedef struct ssl_st SSL; /* always NULL without TLS */
+#endif
+#include "ftplib.h"
+#include "ftphash.h"
+#include "ftpstub.h"
+
+#define STUB_BUFSIZ 65536
+#define STUB_LINESIZ 1024
+#define STUB_ACCEPT_MS 10000
+#define STUB_BLOCK_EOF 64 /* MODE B descriptor of the last block */
+#define STUB_BLOCK_MAX 65535
+
+struct FtpStub {
+  int sock;
+  int port;
+  int latency_ms;
+  int legacy; /* no RFC 3659 or hash commands */
+  char root[PATH_MAX];
+  pthread_t thread;
+#if defined(FTPLIB_TLS)
+  SSL_CTX *tlsctx;
+#endif
+};
+
+/* data connection handshakes, over all stubs of the process */
+static long tls_full, tls_resumed;
+
+struct stub_session {
+  int ctl;
+  int pasv; /* listening data socket, -1 if none */
+  struct sockaddr_in active; /* PORT address, sin_port 0 if none */
+  int latency_ms;
+  int legacy;
+  int hashalgo;  /* FTPLIB_HASH_* for HASH, set by OPTS HASH */
+  char type;
+  char mode;     /* 'S' stream or 'B' block */
+  int blk;       /* data connection kept open in MODE B, -1 if none */
+  int blkleft;   /* bytes left in the block being received */
+  int blkeof;    /* EOF block received */
+  SSL *ssl;      /* control connection after AUTH TLS */
+  SSL *dssl;     /* data connection of the transfer in progress */
+  SSL *blkssl;   /* kept data connection */
+#if defined(FTPLIB_TLS)
+  SSL_CTX *tlsctx;
+  int prot; /* PROT P: data connections use TLS */
+#endif
+  long long rest;
+  char root[PATH_MAX];
+  char cwd[PATH_MAX];
+  char line[STUB_LINESIZ];
+  char in[STUB_LINESIZ];
+  int inlen;
+};
+
+static void stub_sleep(int ms) {
+  struct timespec ts;
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+  while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+    ;
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t c = write(fd, buf, len);
+    if (c == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    buf += c;
+    len -= c;
+  }
+  return 0;
+}
+
+static int io_write(SSL *ssl, int fd, const char *buf, size_t len) {
+#if !defined(FTPLIB_TLS)
+  (void)ssl;
+#endif
+#if defined(FTPLIB_TLS)
+  if (ssl != NULL)
+    return (len == 0 || SSL_write(ssl, buf, (int)len) == (int)len) ? 0 : -1;
+#endif
+  return write_all(fd, buf, len);
+}
+
+/* 0 at end of file, -1 on error */
+static ssize_t io_read(SSL *ssl, int fd, void *buf, size_t len) {
+  ssize_t c;
+#if !defined(FTPLIB_TLS)
+  (void)ssl;
+#endif
+#if defined(FTPLIB_TLS)
+  if (ssl != NULL) {
+    if ((c = SSL_read(ssl, buf, (int)len)) > 0)
+      return c;
+    return SSL_get_error(ssl, (int)c) == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+  }
+#endif
+  while ((c = read(fd, buf, len)) == -1 && errno == EINTR)
+    ;
+  return c;
+}
+
+/* closes a connection, after close_notify if it uses TLS */
+static void io_close(SSL *ssl, int fd) {
+#if !defined(FTPLIB_TLS)
+  (void)ssl;
+#endif
+#if defined(FTPLIB_TLS)
+  if (ssl != NULL) {
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+  }
+#endif
+  close(fd);
+}
+
+static void drop_kept(struct stub_session *s) {
+  if (s->blk != -1) {
+    io_close(s->blkssl, s->blk);
+    s->blk = -1;
+    s->blkssl = NULL;
+  }
+}
+
+#if defined(FTPLIB_TLS)
+/* server side of a handshake, on the control or a new data connection */
+static SSL *tls_accept(struct stub_session *s, int fd, int data) {
+  SSL *ssl = SSL_new(s->tlsctx);
+  if (ssl == NULL)
+    return NULL;
+  SSL_set_fd(ssl, fd);
+  if (SSL_accept(ssl) != 1) {
+    SSL_free(ssl);
+    return NULL;
+  }
+  if (data)
+    __atomic_add_fetch(SSL_session_reused(ssl) ? &tls_resumed : &tls_full, 1,
+                       __ATOMIC_RELAXED);
+  return ssl;
+}
+#endif
+
+static void reply(struct stub_session *s, const char *fmt, ...) {
+  char buf[STUB_LINESIZ + 64];
+  va_list ap;
+  int len;
+  va_start(ap, fmt);
+  len = vsnprintf(buf, sizeof(buf) - 2, fmt, ap);
+  va_end(ap);
+  if (len < 0)
+    return;
+  if (len > (int)sizeof(buf) - 3)
+    len = sizeof(buf) - 3;
+  strcpy(&buf[len], "\r\n");
+  if (s->latency_ms)
+    stub_sleep(s->latency_ms);
+  io_write(s->ssl, s->ctl, buf, len + 2);
+}
+
+/* next command line without CRLF, 0 on disconnect */
+static int read_command(struct stub_session *s) {
+  char *eol;
+  for (;;) {
+    if ((eol = memchr(s->in, '\n', s->inlen)) != NULL) {
+      int n = eol - s->in;
+      memcpy(s->line, s->in, n);
+      s->line[n] = '\0';
+      if ((n > 0) && (s->line[n - 1] == '\r'))
+        s->line[n - 1] = '\0';
+      memmove(s->in, eol + 1, s->inlen - n - 1);
+      s->inlen -= n + 1;
+      return 1;
+    }
+    if (s->inlen == (int)sizeof(s->in))
+      s->inlen = 0; /* overlong line, drop it */
+    ssize_t c = io_read(s->ssl, s->ctl, s->in + s->inlen,
+                        sizeof(s->in) - s->inlen);
+    if (c <= 0)
+      return 0;
+    s->inlen += c;
+  }
+}
+
+/* virtual path of arg relative to cwd, "." and ".." resolved */
+static void virtual_path(struct stub_session *s, const char *arg, char *out) {
+  char buf[2 * PATH_MAX], *seg, *save = NULL;
+  size_t n = 0;
+  if (arg == NULL || *arg == '\0')
+    arg = ".";
+  if (*arg == '/')
+    snprintf(buf, sizeof(buf), "%s", arg);
+  else
+    snprintf(buf, sizeof(buf), "%s/%s", s->cwd, arg);
+  out[0] = '\0';
+  for (seg = strtok_r(buf, "/", &save); seg; seg = strtok_r(NULL, "/", &save)) {
+    if (strcmp(seg, ".") == 0)
+      continue;
+    if (strcmp(seg, "..") == 0) {
+      while (n > 0 && out[n - 1] != '/')
+        n--;
+      if (n > 0)
+        n--;
+      out[n] = '\0';
+      continue;
+    }
+    if (n + strlen(seg) + 2 >= PATH_MAX)
+      break;
+    out[n++] = '/';
+    strcpy(out + n, seg);
+    n += strlen(seg);
+  }
+  if (n == 0)
+    strcpy(out, "/");
+}
+
+/* the root joined with a virtual path; "" (which no file matches) when
+   the result would not fit in PATH_MAX */
+static void root_path(struct stub_session *s, const char *v, char *out) {
+  size_t r = strlen(s->root), n = strlen(v);
+  if (r + n >= PATH_MAX) {
+    out[0] = '\0';
+    return;
+  }
+  memcpy(out, s->root, r);
+  memcpy(out + r, v, n + 1);
+}
+
+static void real_path(struct stub_session *s, const char *arg, char *out) {
+  char v[PATH_MAX];
+  virtual_path(s, arg, v);
+  root_path(s, v, out);
+}
+
+static int open_pasv(struct stub_session *s, int *port) {
+  struct sockaddr_in sin;
+  socklen_t len = sizeof(sin);
+  if (s->pasv != -1)
+    close(s->pasv);
+  drop_kept(s); /* the client gave up the kept connection */
+  s->active.sin_port = 0;
+  if ((s->pasv = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+    return 0;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(s->pasv, (struct sockaddr *)&sin, sizeof(sin)) == -1 ||
+      listen(s->pasv, 1) == -1 ||
+      getsockname(s->pasv, (struct sockaddr *)&sin, &len) == -1) {
+    close(s->pasv);
+    s->pasv = -1;
+    return 0;
+  }
+  *port = ntohs(sin.sin_port);
+  return 1;
+}
+
+/* a transfer command failed before its data connection: forget PASV and
+   PORT, as servers do, so that a peer connecting in FXP is refused */
+static void cancel_data(struct stub_session *s) {
+  if (s->pasv != -1)
+    close(s->pasv);
+  s->pasv = -1;
+  s->active.sin_port = 0;
+}
+
+/* accepts the pending data connection, or connects to the PORT address;
+   -1 on failure or after a timeout */
+static int accept_data(struct stub_session *s) {
+  struct pollfd p;
+  int fd;
+  if (s->active.sin_port != 0) {
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) != -1 &&
+        connect(fd, (struct sockaddr *)&s->active, sizeof(s->active)) == -1) {
+      close(fd);
+      fd = -1;
+    }
+    s->active.sin_port = 0;
+    return fd;
+  }
+  if (s->pasv == -1)
+    return -1;
+  p.fd = s->pasv;
+  p.events = POLLIN;
+  fd = (poll(&p, 1, STUB_ACCEPT_MS) == 1) ? accept(s->pasv, NULL, NULL) : -1;
+  close(s->pasv);
+  s->pasv = -1;
+  return fd;
+}
+
+/* data connection for a transfer: the one kept open in MODE B, else the
+   client's new passive connection. Sends the preliminary reply, or 425. */
+static int open_data(struct stub_session *s, const char *msg) {
+  int d;
+  s->blkleft = 0;
+  s->blkeof = 0;
+  if (s->blk != -1) {
+    d = s->blk;
+    s->dssl = s->blkssl;
+    s->blk = -1;
+    s->blkssl = NULL;
+    reply(s, "125 Data connection already open; %s", msg);
+    return d;
+  }
+  reply(s, "150 %s", msg);
+  if ((d = accept_data(s)) == -1) {
+    reply(s, "425 Cannot open data connection");
+    return -1;
+  }
+  if (s->mode == 'B') {
+    int on = 1; /* the EOF block must not wait for an ACK */
+    setsockopt(d, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  }
+#if defined(FTPLIB_TLS)
+  if (s->prot && (s->dssl = tls_accept(s, d, 1)) == NULL) {
+    close(d);
+    reply(s, "425 TLS negotiation failed on data connection");
+    return -1;
+  }
+#endif
+  return d;
+}
+
+/* ends a transfer; in MODE B the connection is kept, after sending the
+   EOF block unless the client was the sender */
+static void close_data(struct stub_session *s, int d, int ok, int sent,
+                       const char *msg) {
+  static const char eof[3] = {STUB_BLOCK_EOF, 0, 0};
+  if (!ok) {
+    io_close(s->dssl, d);
+    reply(s, "426 Transfer aborted");
+  } else if (s->mode == 'B' &&
+             (!sent || io_write(s->dssl, d, eof, sizeof(eof)) == 0)) {
+    s->blk = d;
+    s->blkssl = s->dssl;
+    reply(s, "250 %s", msg);
+  } else {
+    io_close(s->dssl, d);
+    reply(s, "226 %s", msg);
+  }
+  s->dssl = NULL;
+}
+
+/* in MODE B each block goes out with one writev(), or as two records
+   under TLS */
+static int write_data(struct stub_session *s, int d, const char *buf,
+                      size_t len) {
+  unsigned char hdr[3];
+  struct iovec iov[2];
+  ssize_t c;
+  size_t n;
+  if (s->mode != 'B')
+    return io_write(s->dssl, d, buf, len);
+  for (; len > 0; buf += n, len -= n) {
+    n = len > STUB_BLOCK_MAX ? STUB_BLOCK_MAX : len;
+    hdr[0] = 0;
+    hdr[1] = n >> 8;
+    hdr[2] = n & 0xff;
+    if (s->dssl != NULL) {
+      if (io_write(s->dssl, d, (char *)hdr, 3) == -1 ||
+          io_write(s->dssl, d, buf, n) == -1)
+        return -1;
+      continue;
+    }
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = 3;
+    iov[1].iov_base = (void *)buf;
+    iov[1].iov_len = n;
+    while ((c = writev(d, iov, 2)) == -1 && errno == EINTR)
+      ;
+    if (c == -1)
+      return -1;
+    if (c < 3 && write_all(d, (char *)hdr + c, 3 - c) == -1)
+      return -1;
+    c = c < 3 ? 0 : c - 3;
+    if ((size_t)c < n && write_all(d, buf + c, n - c) == -1)
+      return -1;
+  }
+  return 0;
+}
+
+static int read_full(SSL *ssl, int d, unsigned char *buf, size_t len) {
+  ssize_t c;
+  while (len > 0) {
+    if ((c = io_read(ssl, d, buf, len)) <= 0)
+      return -1;
+    buf += c;
+    len -= c;
+  }
+  return 0;
+}
+
+/* 0 at end of file, -1 on error */
+static ssize_t read_data(struct stub_session *s, int d, char *buf,
+                         size_t len) {
+  unsigned char hdr[3];
+  ssize_t c;
+  if (s->mode != 'B')
+    return io_read(s->dssl, d, buf, len);
+  while (s->blkleft == 0) {
+    if (s->blkeof)
+      return 0;
+    if (read_full(s->dssl, d, hdr, 3) == -1)
+      return -1;
+    s->blkleft = (hdr[1] << 8) | hdr[2];
+    s->blkeof = (hdr[0] & STUB_BLOCK_EOF) != 0;
+  }
+  if (len > (size_t)s->blkleft)
+    len = s->blkleft;
+  if ((c = io_read(s->dssl, d, buf, len)) <= 0)
+    return -1;
+  s->blkleft -= c;
+  return c;
+}
+
+static void send_file(struct stub_session *s, const char *arg) {
+  char path[PATH_MAX], *buf, *out;
+  FILE *f;
+  int d;
+  size_t n, i, o;
+  real_path(s, arg, path);
+  if ((f = fopen(path, "rb")) == NULL) {
+    cancel_data(s);
+    reply(s, "550 %s: %s", arg, strerror(errno));
+    return;
+  }
+  if (s->rest && fseeko(f, (off_t)s->rest, SEEK_SET) != 0) {
+    fclose(f);
+    cancel_data(s);
+    reply(s, "554 Restart position invalid");
+    return;
+  }
+  s->rest = 0;
+  if ((d = open_data(s, "Opening data connection")) == -1) {
+    fclose(f);
+    return;
+  }
+  buf = malloc(STUB_BUFSIZ);
+  out = malloc(2 * STUB_BUFSIZ);
+  while ((n = fread(buf, 1, STUB_BUFSIZ, f)) > 0) {
+    if (s->type == 'A') {
+      for (i = 0, o = 0; i < n; i++) {
+        if (buf[i] == '\n')
+          out[o++] = '\r';
+        out[o++] = buf[i];
+      }
+      if (write_data(s, d, out, o) == -1)
+        break;
+    } else if (write_data(s, d, buf, n) == -1)
+      break;
+  }
+  free(buf);
+  free(out);
+  fclose(f);
+  close_data(s, d, n == 0, 1, "Transfer complete");
+}
+
+static void recv_file(struct stub_session *s, const char *arg, int append) {
+  char path[PATH_MAX], *buf;
+  FILE *f;
+  int d, cr = 0;
+  ssize_t n, i;
+  real_path(s, arg, path);
+  if ((f = fopen(path, append ? "ab" : "wb")) == NULL) {
+    cancel_data(s);
+    reply(s, "550 %s: %s", arg, strerror(errno));
+    return;
+  }
+  if ((d = open_data(s, "Ok to send data")) == -1) {
+    fclose(f);
+    return;
+  }
+  buf = malloc(STUB_BUFSIZ);
+  while ((n = read_data(s, d, buf, STUB_BUFSIZ)) > 0) {
+    if (s->type == 'A') {
+      /* CRLF to LF, a CR at the end of a read is held back */
+      for (i = 0; i < n; i++) {
+        if (cr && buf[i] != '\n')
+          fputc('\r', f);
+        cr = (buf[i] == '\r');
+        if (!cr)
+          fputc(buf[i], f);
+      }
+    } else {
+      fwrite(buf, 1, n, f);
+    }
+  }
+  if (cr)
+    fputc('\r', f);
+  free(buf);
+  fclose(f);
+  close_data(s, d, n == 0, 0, "Transfer complete");
+}
+
+/* "type=...;size=...;modify=...; name" of an MLST or MLSD entry, 0 if
+   path is gone */
+static int facts_line(const char *path, const char *type, const char *name,
+                      char *out, size_t max) {
+  struct stat st;
+  struct tm tm;
+  char stamp[32];
+  if (stat(path, &st) == -1)
+    return 0;
+  gmtime_r(&st.st_mtime, &tm);
+  strftime(stamp, sizeof(stamp), "%Y%m%d%H%M%S", &tm);
+  if (type == NULL)
+    type = S_ISDIR(st.st_mode) ? "dir" : "file";
+  if (S_ISDIR(st.st_mode))
+    snprintf(out, max, "type=%s;modify=%s; %s", type, stamp, name);
+  else
+    snprintf(out, max, "type=%s;size=%lld;modify=%s; %s", type,
+             (long long)st.st_size, stamp, name);
+  return 1;
+}
+
+/* lowercase hex digest of a whole file, 0 if it cannot be read */
+static int hash_file(const char *path, int algo, char *hex) {
+  FtpHash h;
+  FILE *f;
+  char *buf;
+  size_t n;
+  struct stat st;
+  if (stat(path, &st) != 0 || !S_ISREG(st.st_mode) ||
+      (f = fopen(path, "rb")) == NULL)
+    return 0;
+  if ((buf = malloc(STUB_BUFSIZ)) == NULL) {
+    fclose(f);
+    return 0;
+  }
+  FtpHashInit(&h, algo);
+  while ((n = fread(buf, 1, STUB_BUFSIZ, f)) > 0)
+    FtpHashUpdate(&h, buf, n);
+  free(buf);
+  fclose(f);
+  FtpHashFinal(&h, hex, FTPHASH_HEXSIZ);
+  return 1;
+}
+
+static const char *hash_name(int algo) {
+  switch (algo) {
+  case FTPLIB_HASH_CRC32:
+    return "CRC32";
+  case FTPLIB_HASH_MD5:
+    return "MD5";
+  default:
+    return "SHA-256";
+  }
+}
+
+/* MFMT YYYYMMDDHHMMSS path */
+static void set_mtime(struct stub_session *s, const char *param) {
+  char path[PATH_MAX];
+  struct tm tm;
+  struct timespec ts[2];
+  const char *name;
+  memset(&tm, 0, sizeof(tm));
+  if (param == NULL || strlen(param) < 16 || param[14] != ' ' ||
+      sscanf(param, "%4d%2d%2d%2d%2d%2d", &tm.tm_year, &tm.tm_mon,
+             &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6) {
+    reply(s, "501 MFMT YYYYMMDDHHMMSS path");
+    return;
+  }
+  name = param + 15;
+  tm.tm_year -= 1900;
+  tm.tm_mon -= 1;
+  ts[0].tv_nsec = UTIME_OMIT;
+  ts[1].tv_sec = timegm(&tm);
+  ts[1].tv_nsec = 0;
+  real_path(s, name, path);
+  if (utimensat(AT_FDCWD, path, ts, 0) == 0)
+    reply(s, "213 Modify=%.14s; %s", param, name);
+  else
+    reply(s, "550 %s: %s", name, strerror(errno));
+}
+
+/* LIST (style 'L'), NLST ('N') or MLSD ('M') of a directory */
+static void send_list(struct stub_session *s, const char *arg, int style) {
+  char path[PATH_MAX], file[2 * PATH_MAX], line[PATH_MAX + 128], stamp[32];
+  DIR *dir;
+  struct dirent *de;
+  struct stat st;
+  struct tm tm;
+  int d;
+  if (arg && arg[0] == '-')
+    arg = NULL; /* ls options such as -la */
+  real_path(s, arg, path);
+  if ((dir = opendir(path)) == NULL) {
+    reply(s, "550 %s: %s", arg ? arg : ".", strerror(errno));
+    return;
+  }
+  if ((d = open_data(s, "Here comes the directory listing")) == -1) {
+    closedir(dir);
+    return;
+  }
+  if ((style == 'M') && facts_line(path, "cdir", ".", line, sizeof(line) - 2)) {
+    strcat(line, "\r\n");
+    write_data(s, d, line, strlen(line));
+  }
+  while ((de = readdir(dir)) != NULL) {
+    if (de->d_name[0] == '.')
+      continue;
+    if (style == 'N') {
+      snprintf(line, sizeof(line), "%s\r\n", de->d_name);
+    } else if (style == 'M') {
+      snprintf(file, sizeof(file), "%s/%s", path, de->d_name);
+      if (!facts_line(file, NULL, de->d_name, line, sizeof(line) - 2))
+        continue;
+      strcat(line, "\r\n");
+    } else {
+      snprintf(file, sizeof(file), "%s/%s", path, de->d_name);
+      if (stat(file, &st) == -1)
+        continue;
+      gmtime_r(&st.st_mtime, &tm);
+      strftime(stamp, sizeof(stamp), "%b %d %H:%M", &tm);
+      snprintf(line, sizeof(line), "%s 1 ftp ftp %12lld %s %s\r\n",
+               S_ISDIR(st.st_mode) ? "drwxr-xr-x" : "-rw-r--r--",
+               (long long)st.st_size, stamp, de->d_name);
+    }
+    if (write_data(s, d, line, strlen(line)) == -1)
+      break;
+  }
+  closedir(dir);
+  close_data(s, d, de == NULL, 1, "Directory send OK");
+}
+
+/* commands a legacy stub refuses */
+static int extension(const char *cmd) {
+  static const char *const ext[] = {"MLST", "MLSD", "MFMT", "OPTS",
+                                    "HASH", "XCRC", "XMD5", NULL};
+  int i;
+  for (i = 0; ext[i]; i++)
+    if (!strcmp(cmd, ext[i]))
+      return 1;
+  return 0;
+}
+
+static void *stub_session(void *arg) {
+  struct stub_session *s = arg;
+  char path[PATH_MAX], stamp[32], *cmd, *param;
+  struct stat st;
+  struct tm tm;
+  int port;
+
+  reply(s, "220 ftpstub ready");
+  while (read_command(s)) {
+    cmd = s->line;
+    if ((param = strchr(cmd, ' ')) != NULL)
+      *param++ = '\0';
+    for (char *p = cmd; *p; p++)
+      *p = (*p >= 'a' && *p <= 'z') ? *p - 32 : *p;
+    if (!strcmp(cmd, "USER"))
+      reply(s, "331 Please specify the password");
+    else if (!strcmp(cmd, "PASS"))
+      reply(s, "230 Login successful");
+    else if (!strcmp(cmd, "SYST"))
+      reply(s, "215 UNIX Type: L8");
+    else if (!strcmp(cmd, "NOOP"))
+      reply(s, "200 NOOP ok");
+    else if (!strcmp(cmd, "FEAT"))
+      reply(s, "211-Features:\r\n%s EPSV\r\n MDTM\r\n PASV\r\n"
+               " REST STREAM\r\n SIZE\r\n%s211 End",
+#if defined(FTPLIB_TLS)
+            " AUTH TLS\r\n PBSZ\r\n PROT\r\n",
+#else
+            "",
+#endif
+            s->legacy ? "" : " HASH SHA-256*;MD5;CRC32\r\n MFMT\r\n"
+                             " MLST type*;size*;modify*;\r\n XCRC\r\n"
+                             " XMD5\r\n");
+#if defined(FTPLIB_TLS)
+    else if (!strcmp(cmd, "AUTH")) {
+      if (s->ssl != NULL || param == NULL || strcmp(param, "TLS") != 0)
+        reply(s, "504 AUTH TLS only");
+      else {
+        reply(s, "234 Proceed with negotiation");
+        if ((s->ssl = tls_accept(s, s->ctl, 0)) == NULL)
+          break;
+      }
+    } else if (!strcmp(cmd, "PBSZ"))
+      reply(s, s->ssl ? "200 PBSZ=0" : "503 AUTH TLS first");
+    else if (!strcmp(cmd, "PROT")) {
+      if (s->ssl == NULL)
+        reply(s, "503 AUTH TLS first");
+      else if (param && (param[0] == 'P' || param[0] == 'C')) {
+        s->prot = (param[0] == 'P');
+        drop_kept(s);
+        reply(s, "200 Protection level set to %c", param[0]);
+      } else
+        reply(s, "504 Unsupported protection level");
+    }
+#endif
+    else if (!strcmp(cmd, "TYPE")) {
+      if (param && (param[0] == 'A' || param[0] == 'I')) {
+        s->type = param[0];
+        reply(s, "200 Type set to %c", s->type);
+      } else
+        reply(s, "504 Unsupported type");
+    } else if (!strcmp(cmd, "MODE")) {
+      if (param && (param[0] == 'S' || param[0] == 'B')) {
+        s->mode = param[0];
+        if (s->mode == 'S')
+          drop_kept(s);
+        reply(s, "200 Mode set to %c", s->mode);
+      } else
+        reply(s, "504 Unsupported mode");
+    } else if (!strcmp(cmd, "STRU")) {
+      if (param && param[0] == 'F')
+        reply(s, "200 Ok");
+      else
+        reply(s, "504 Unsupported");
+    } else if (!strcmp(cmd, "PWD"))
+      reply(s, "257 \"%s\" is the current directory", s->cwd);
+    else if (!strcmp(cmd, "CWD") || !strcmp(cmd, "CDUP")) {
+      char v[PATH_MAX];
+      virtual_path(s, strcmp(cmd, "CDUP") ? param : "..", v);
+      root_path(s, v, path);
+      if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+        strcpy(s->cwd, v);
+        reply(s, "250 Directory successfully changed");
+      } else
+        reply(s, "550 Failed to change directory");
+    } else if (!strcmp(cmd, "PASV")) {
+      if (open_pasv(s, &port))
+        reply(s, "227 Entering Passive Mode (127,0,0,1,%d,%d)", port >> 8,
+              port & 0xff);
+      else
+        reply(s, "425 Cannot open passive connection");
+    } else if (!strcmp(cmd, "EPSV")) {
+      if (open_pasv(s, &port))
+        reply(s, "229 Entering Extended Passive Mode (|||%d|)", port);
+      else
+        reply(s, "425 Cannot open passive connection");
+    } else if (!strcmp(cmd, "PORT")) {
+      unsigned int h[6];
+      if (param &&
+          sscanf(param, "%u,%u,%u,%u,%u,%u", &h[0], &h[1], &h[2], &h[3],
+                 &h[4], &h[5]) == 6 &&
+          (h[0] | h[1] | h[2] | h[3] | h[4] | h[5]) < 256) {
+        if (s->pasv != -1)
+          close(s->pasv);
+        s->pasv = -1;
+        drop_kept(s);
+        memset(&s->active, 0, sizeof(s->active));
+        s->active.sin_family = AF_INET;
+        s->active.sin_addr.s_addr =
+            htonl(h[0] << 24 | h[1] << 16 | h[2] << 8 | h[3]);
+        s->active.sin_port = htons(h[4] << 8 | h[5]);
+        reply(s, "200 PORT command successful");
+      } else
+        reply(s, "501 Illegal PORT command");
+    } else if (!strcmp(cmd, "ABOR")) {
+      reply(s, "225 No transfer to abort");
+    } else if (!strcmp(cmd, "REST")) {
+      s->rest = param ? atoll(param) : 0;
+      reply(s, "350 Restart position accepted (%lld)", s->rest);
+    } else if (!strcmp(cmd, "RETR"))
+      send_file(s, param);
+    else if (!strcmp(cmd, "STOR") || !strcmp(cmd, "APPE"))
+      recv_file(s, param, cmd[0] == 'A');
+    else if (!strcmp(cmd, "LIST") || !strcmp(cmd, "NLST"))
+      send_list(s, param, cmd[0]);
+    else if (s->legacy && extension(cmd))
+      reply(s, "502 %s not implemented", cmd);
+    else if (!strcmp(cmd, "MLSD"))
+      send_list(s, param, 'M');
+    else if (!strcmp(cmd, "MLST")) {
+      char v[PATH_MAX], line[PATH_MAX + 128];
+      virtual_path(s, param, v);
+      root_path(s, v, path);
+      if (facts_line(path, NULL, v, line, sizeof(line)))
+        reply(s, "250-Listing %s\r\n %s\r\n250 End", v, line);
+      else
+        reply(s, "550 %s: %s", v, strerror(errno));
+    } else if (!strcmp(cmd, "MFMT"))
+      set_mtime(s, param);
+    else if (!strcmp(cmd, "OPTS") && param && !strncmp(param, "HASH ", 5)) {
+      if (!strcmp(param + 5, "CRC32"))
+        s->hashalgo = FTPLIB_HASH_CRC32;
+      else if (!strcmp(param + 5, "MD5"))
+        s->hashalgo = FTPLIB_HASH_MD5;
+      else if (!strcmp(param + 5, "SHA-256"))
+        s->hashalgo = FTPLIB_HASH_SHA256;
+      else {
+        reply(s, "501 Unknown algorithm");
+        continue;
+      }
+      reply(s, "200 %s", hash_name(s->hashalgo));
+    } else if (!strcmp(cmd, "HASH") || !strcmp(cmd, "XCRC") ||
+               !strcmp(cmd, "XMD5")) {
+      char hex[FTPHASH_HEXSIZ];
+      int algo = (cmd[0] == 'H') ? s->hashalgo
+                 : (cmd[1] == 'C') ? FTPLIB_HASH_CRC32
+                                   : FTPLIB_HASH_MD5;
+      real_path(s, param, path);
+      if (!hash_file(path, algo, hex) || stat(path, &st) != 0)
+        reply(s, "550 %s: cannot read", param ? param : "");
+      else if (cmd[0] == 'H')
+        reply(s, "213 %s 0-%lld %s %s", hash_name(algo),
+              (long long)st.st_size, hex, param);
+      else
+        reply(s, "250 %s", hex);
+    }
+    else if (!strcmp(cmd, "SIZE") || !strcmp(cmd, "MDTM")) {
+      real_path(s, param, path);
+      if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+        reply(s, "550 Could not get file %s", cmd[0] == 'S' ? "size" : "time");
+      else if (cmd[0] == 'S')
+        reply(s, "213 %lld", (long long)st.st_size);
+      else {
+        gmtime_r(&st.st_mtime, &tm);
+        strftime(stamp, sizeof(stamp), "%Y%m%d%H%M%S", &tm);
+        reply(s, "213 %s", stamp);
+      }
+    } else if (!strcmp(cmd, "DELE")) {
+      real_path(s, param, path);
+      reply(s, unlink(path) == 0 ? "250 Delete operation successful"
+                                 : "550 Delete operation failed");
+    } else if (!strcmp(cmd, "MKD")) {
+      real_path(s, param, path);
+      reply(s, mkdir(path, 0777) == 0 ? "257 Created" : "550 Create failed");
+    } else if (!strcmp(cmd, "RMD")) {
+      real_path(s, param, path);
+      reply(s, rmdir(path) == 0 ? "250 Remove directory operation successful"
+                                : "550 Remove directory operation failed");
+    } else if (!strcmp(cmd, "QUIT")) {
+      reply(s, "221 Goodbye");
+      break;
+    } else
+      reply(s, "502 %s not implemented", cmd);
+  }
+  if (s->pasv != -1)
+    close(s->pasv);
+  drop_kept(s);
+  io_close(s->ssl, s->ctl);
+#if defined(FTPLIB_TLS)
+  SSL_CTX_free(s->tlsctx);
+#endif
+  free(s);
+  return NULL;
+}
+
+static void *stub_accept(void *arg) {
+  FtpStub *stub = arg;
+  struct stub_session *s;
+  pthread_t t;
+  int fd, on = 1;
+  while ((fd = accept(stub->sock, NULL, NULL)) != -1 || errno == EINTR) {
+    if (fd == -1)
+      continue;
+    if ((s = calloc(1, sizeof(struct stub_session))) == NULL) {
+      close(fd);
+      continue;
+    }
+    /* replies go out as written, as real servers send them: under Nagle
+       the 226 after a 150 waits for the client's delayed ACK */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    s->ctl = fd;
+    s->pasv = -1;
+    s->blk = -1;
+    s->type = 'A';
+    s->mode = 'S';
+    s->latency_ms = stub->latency_ms;
+    s->legacy = __atomic_load_n(&stub->legacy, __ATOMIC_RELAXED);
+    s->hashalgo = FTPLIB_HASH_SHA256;
+    strcpy(s->root, stub->root);
+    strcpy(s->cwd, "/");
+#if defined(FTPLIB_TLS)
+    /* the session may outlive the stub */
+    if (SSL_CTX_up_ref(stub->tlsctx))
+      s->tlsctx = stub->tlsctx;
+#endif
+    if (pthread_create(&t, NULL, stub_session, s) != 0) {
+#if defined(FTPLIB_TLS)
+      SSL_CTX_free(s->tlsctx);
+#endif
+      close(fd);
+      free(s);
+      continue;
+    }
+    pthread_detach(t);
+  }
+  return NULL;
+}
+
+#if defined(FTPLIB_TLS)
+/* server context with a fresh self-signed certificate for 127.0.0.1 */
+static SSL_CTX *tls_server_ctx(void) {
+  SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+  EVP_PKEY *key = EVP_EC_gen("P-256");
+  X509 *x = X509_new();
+  X509_NAME *name;
+  int ok = (ctx != NULL) && (key != NULL) && (x != NULL);
+  if (ok) {
+    ASN1_INTEGER_set(X509_get_serialNumber(x), 1);
+    X509_gmtime_adj(X509_getm_notBefore(x), 0);
+    X509_gmtime_adj(X509_getm_notAfter(x), 86400L);
+    X509_set_pubkey(x, key);
+    name = X509_get_subject_name(x);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                               (const unsigned char *)"127.0.0.1", -1, -1, 0);
+    X509_set_issuer_name(x, name);
+    ok = X509_sign(x, key, EVP_sha256()) &&
+         SSL_CTX_use_certificate(ctx, x) == 1 &&
+         SSL_CTX_use_PrivateKey(ctx, key) == 1;
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+  }
+  X509_free(x);
+  EVP_PKEY_free(key);
+  if (!ok) {
+    SSL_CTX_free(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+#endif
+
+void FtpStubTlsStats(long *full, long *resumed) {
+  *full = __atomic_load_n(&tls_full, __ATOMIC_RELAXED);
+  *resumed = __atomic_load_n(&tls_resumed, __ATOMIC_RELAXED);
+}
+
+FtpStub *FtpStubStart(const char *root, int port, int latency_ms) {
+  FtpStub *stub;
+  struct sockaddr_in sin;
+  socklen_t len = sizeof(sin);
+  int on = 1;
+
+  /* a client closing a data connection early must not kill the process */
+  signal(SIGPIPE, SIG_IGN);
+  if ((stub = calloc(1, sizeof(FtpStub))) == NULL)
+    return NULL;
+  if (realpath(root, stub->root) == NULL) {
+    free(stub);
+    return NULL;
+  }
+  if (strcmp(stub->root, "/") == 0)
+    stub->root[0] = '\0';
+  stub->latency_ms = latency_ms;
+#if defined(FTPLIB_TLS)
+  if ((stub->tlsctx = tls_server_ctx()) == NULL) {
+    free(stub);
+    return NULL;
+  }
+#endif
+  if ((stub->sock = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+#if defined(FTPLIB_TLS)
+    SSL_CTX_free(stub->tlsctx);
+#endif
+    free(stub);
+    return NULL;
+  }
+  setsockopt(stub->sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(port);
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(stub->sock, (struct sockaddr *)&sin, sizeof(sin)) == -1 ||
+      listen(stub->sock, 64) == -1 ||
+      getsockname(stub->sock, (struct sockaddr *)&sin, &len) == -1 ||
+      pthread_create(&stub->thread, NULL, stub_accept, stub) != 0) {
+    close(stub->sock);
+#if defined(FTPLIB_TLS)
+    SSL_CTX_free(stub->tlsctx);
+#endif
+    free(stub);
+    return NULL;
+  }
+  stub->port = ntohs(sin.sin_port);
+  return stub;
+}
+
+int FtpStubPort(FtpStub *stub) { return stub->port; }
+
+void FtpStubLegacy(FtpStub *stub, int legacy) {
+  __atomic_store_n(&stub->legacy, legacy, __ATOMIC_RELAXED);
+}
+
+void FtpStubStop(FtpStub *stub) {
+  shutdown(stub->sock, SHUT_RDWR);
+  close(stub->sock);
+  pthread_join(stub->thread, NULL);
+#if defined(FTPLIB_TLS)
+  SSL_CTX_free(stub->tlsctx);
+#endif
+  free(stub);
+}
+
+#ifdef FTPSTUB_MAIN
+int main(int argc, char **argv) {
+  FtpStub *stub;
+  int c, port = 2121, latency = 0, legacy = 0;
+  while ((c = getopt(argc, argv, "p:l:L")) != -1) {
+    switch (c) {
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'l':
+      latency = atoi(optarg);
+      break;
+    case 'L':
+      legacy = 1;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-p port] [-l latency_ms] [-L] root\n",
+              argv[0]);
+      return 2;
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "usage: %s [-p port] [-l latency_ms] [-L] root\n", argv[0]);
+    return 2;
+  }
+  if ((stub = FtpStubStart(argv[optind], port, latency)) == NULL) {
+    perror("ftpstub");
+    return 1;
+  }
+  FtpStubLegacy(stub, legacy);
+  printf("ftpstub serving %s on 127.0.0.1:%d\n", argv[optind],
+         FtpStubPort(stub));
+  pause();
+  FtpStubStop(stub);
+  return 0;
+}
+#endif
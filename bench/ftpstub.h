@@ -0,0 +1,50 @@
+/***************************************************************************/
+/*                                                                         */
+/* ftpstub.h - minimal loopback FTP server used by the benchmarks          */
+/* Copyright (C) 2015 Paolo Bosetti and Matteo Ragni,                      */
+/* paolo[dot]bosetti[at]unitn.it and matteo[dot]ragni[at]unitn.it          */
+/* Department of Industrial Engineering, University of Trento              */
+/*                                                                         */
+/* This library is free software.  You can redistribute it and/or          */
+/* modify it under the terms of the GNU GENERAL PUBLIC LICENSE 2.0.        */
+/*                                                                         */
+/* This library is distributed in the hope that it will be useful,         */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           */
+/* Artistic License 2.0 for more details.                                  */
+/*                                                                         */
+/* See the file LICENSE                                                    */
+/*                                                                         */
+/***************************************************************************/
+
+#if !defined(__FTPSTUB_H)
+#define __FTPSTUB_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct FtpStub FtpStub;
+
+/* Serves the files below root on 127.0.0.1, any user and password is
+   accepted. Every control reply is delayed by latency_ms to emulate a
+   distant server. MODE B keeps the data connection open between
+   transfers. port 0 picks a free port. NULL on failure. */
+FtpStub *FtpStubStart(const char *root, int port, int latency_ms);
+/* Port the stub listens on */
+int FtpStubPort(FtpStub *stub);
+/* legacy != 0: sessions opened from now on act like an older server,
+   without MLST, MLSD, MFMT, HASH, XCRC or XMD5 in FEAT or as commands */
+void FtpStubLegacy(FtpStub *stub, int legacy);
+/* Data connection TLS handshakes served so far by all stubs of the
+   process: full ones and session resumptions. Zero without FTPLIB_TLS. */
+void FtpStubTlsStats(long *full, long *resumed);
+/* Stops accepting connections and frees the stub; sessions already
+   open run until their client quits */
+void FtpStubStop(FtpStub *stub);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __FTPSTUB_H */
@@ -0,0 +1,320 @@
+/***************************************************************************/
+/*                                                                         */
+/* ftpthreads.c - concurrent ftplib sessions, meant to run under TSan      */
+/* Copyright (C) 2015 Paolo Bosetti and Matteo Ragni,                      */
+/* paolo[dot]bosetti[at]unitn.it and matteo[dot]ragni[at]unitn.it          */
+/* Department of Industrial Engineering, University of Trento              */
+/*                                                                         */
+/* This library is free software.  You can redistribute it and/or          */
+/* modify it under the terms of the GNU GENERAL PUBLIC LICENSE 2.0.        */
+/*                                                                         */
+/* This library is distributed in the hope that it will be useful,         */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           */
+/* Artistic License 2.0 for more details.                                  */
+/*                                                                         */
+/* See the file LICENSE                                                    */
+/*                                                                         */
+/***************************************************************************/
+
+/*
+Runs independent sessions on separate threads against the loopback stub,
+each with its own debug level, log callback and rate limit, and checks
+that every transfer round-trips and every log line reaches the session
+that produced it. Odd sessions overlap their disk I/O on a second thread
+and digest their transfers there. Against the stub, parallel walks of a
+small tree and of a missing directory run alongside them, with MLSD and
+then with NLST against a legacy stub, and must report every entry with
+its type and the missing directory as failed:
+
+    ftpthreads [-t threads] [-n rounds] [-H host:port [-u user] [-p pass]]
+
+`make tsan` builds it with -fsanitize=thread and runs it; any data race
+between sessions makes ThreadSanitizer fail the run.
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "ftplib.h"
+#include "ftpstub.h"
+#include "ftpwalk.h"
+
+#define WALK_DIRS 4  /* directories below the walk root, each with: */
+#define WALK_FILES 3 /* files, plus one subdirectory holding one file */
+#define WALK_ENTRIES (WALK_DIRS * (WALK_FILES + 3))
+#define WALK_SUBDIRS (WALK_DIRS * 2)
+
+struct worker {
+  int id;
+  int rounds;
+  const char *host, *user, *pass, *dir;
+  netbuf *conn;
+  long logged;  /* log lines received */
+  int foreign;  /* log lines delivered with another session's netbuf */
+  int failures; /* operations that failed or returned wrong data */
+  pthread_t th;
+};
+
+static void log_line(netbuf *ctl, const char *msg, void *arg) {
+  struct worker *w = arg;
+  (void)msg;
+  if (ctl != w->conn)
+    w->foreign++;
+  w->logged++;
+}
+
+static int same_file(const char *a, const char *b) {
+  FILE *fa = fopen(a, "rb"), *fb = fopen(b, "rb");
+  int ca, cb, rv = (fa != NULL) && (fb != NULL);
+  while (rv) {
+    ca = fgetc(fa);
+    cb = fgetc(fb);
+    if (ca != cb)
+      rv = 0;
+    if (ca == EOF)
+      break;
+  }
+  if (fa)
+    fclose(fa);
+  if (fb)
+    fclose(fb);
+  return rv;
+}
+
+static void reply_seen(int idx, const char *reply, void *arg) {
+  (void)idx;
+  (void)reply;
+  ++*(int *)arg;
+}
+
+/* Creates (make != 0) or removes the tree the walker lists */
+static void walk_tree(const char *root, int make) {
+  char path[256];
+  FILE *f;
+  int d, i;
+
+  sprintf(path, "%s/w", root);
+  if (make)
+    mkdir(path, 0700);
+  for (d = 0; d < WALK_DIRS; d++) {
+    sprintf(path, "%s/w/d%d", root, d);
+    if (make)
+      mkdir(path, 0700);
+    sprintf(path, "%s/w/d%d/s", root, d);
+    if (make)
+      mkdir(path, 0700);
+    for (i = 0; i <= WALK_FILES; i++) {
+      if (i < WALK_FILES)
+        sprintf(path, "%s/w/d%d/f%d", root, d, i);
+      else
+        sprintf(path, "%s/w/d%d/s/f", root, d);
+      if (!make)
+        unlink(path);
+      else if ((f = fopen(path, "wb")) != NULL) {
+        fprintf(f, "%d.%d\n", d, i);
+        fclose(f);
+      }
+    }
+    if (!make) {
+      sprintf(path, "%s/w/d%d/s", root, d);
+      rmdir(path);
+      sprintf(path, "%s/w/d%d", root, d);
+      rmdir(path);
+    }
+  }
+  if (!make) {
+    sprintf(path, "%s/w", root);
+    rmdir(path);
+  }
+}
+
+/* Walks root with several worker sessions; returns the number of failures.
+   entries, dirs (entries of type dir) and failed are the counts expected. */
+static int walk(const char *host, const char *user, const char *pass,
+                const char *root, int mlsd, int entries, int dirs,
+                int failed) {
+  FtpWalkOptions opt;
+  FtpWalk *w;
+  const char *path, *facts;
+  int rc, n = 0, nd = 0, bad = 0, logs = 0;
+
+  memset(&opt, 0, sizeof(opt));
+  opt.debug = 3;
+  opt.log = 1;
+  opt.rate_limit = 64L << 20;
+  if ((w = FtpWalkStart(host, user, pass, NULL, root, 4, mlsd, &opt)) ==
+      NULL)
+    return 1;
+  while ((rc = FtpWalkNext(w, &path, &facts)) > 0) {
+    if (rc == FTPWALK_ENTRY) {
+      n++;
+      if (!strncmp(facts, "type=dir;", 9))
+        nd++;
+    } else if (rc == FTPWALK_FAILED)
+      bad++;
+    else
+      logs++;
+  }
+  FtpWalkStop(w);
+  printf("walk %s %s: %d entries, %d dirs, %d failed, %d log lines\n", root,
+         mlsd ? "MLSD" : "NLST", n, nd, bad, logs);
+  return (rc != FTPWALK_DONE) + (n != entries) + (nd != dirs) +
+         (bad != failed) + (logs == 0);
+}
+
+static void *run(void *arg) {
+  struct worker *w = arg;
+  char local[256], back[256], remote[64], line[256];
+  const char *cmds[2];
+  unsigned int size;
+  netbuf *nData;
+  FILE *f;
+  int i, r, replies;
+
+  sprintf(local, "%s/in%d", w->dir, w->id);
+  sprintf(back, "%s/out%d", w->dir, w->id);
+  sprintf(remote, "t%d", w->id);
+  if ((f = fopen(local, "wb")) == NULL) {
+    w->failures++;
+    return NULL;
+  }
+  for (i = 0; i < 20000 + w->id * 997; i++)
+    fputc((i % 61 == 60) ? '\n' : 'a' + (i + w->id) % 26, f);
+  fclose(f);
+
+  if (!FtpConnect(w->host, &w->conn)) {
+    w->failures++;
+    return NULL;
+  }
+  FtpOptions(FTPLIB_DEBUG, 3, w->conn);
+  FtpSetLog(log_line, w, w->conn);
+  FtpOptions(FTPLIB_RATELIMIT, 64L << 20, w->conn);
+  if (w->id & 1) {
+    FtpOptions(FTPLIB_OVERLAP, 2, w->conn);
+    FtpOptions(FTPLIB_OVERLAPBLOCK, FTPLIB_OVERLAP_MINBLOCK, w->conn);
+    FtpOptions(FTPLIB_HASHALGO, FTPLIB_HASH_CRC32, w->conn);
+  }
+  if (!FtpLogin(w->user, w->pass, w->conn)) {
+    w->failures++;
+    FtpQuit(w->conn);
+    return NULL;
+  }
+  for (r = 0; r < w->rounds; r++) {
+    char mode = (r & 1) ? FTPLIB_ASCII : FTPLIB_IMAGE;
+    if (!FtpPut(local, remote, mode, w->conn) ||
+        !FtpGet(back, remote, mode, w->conn) || !same_file(local, back))
+      w->failures++;
+    if (!FtpSize(remote, &size, FTPLIB_IMAGE, w->conn))
+      w->failures++;
+    if (FtpAccess(".", FTPLIB_DIR, FTPLIB_ASCII, w->conn, &nData)) {
+      while (FtpRead(line, sizeof(line), nData) > 0)
+        ;
+      if (!FtpClose(nData))
+        w->failures++;
+    } else
+      w->failures++;
+    cmds[0] = "NOOP";
+    cmds[1] = "PWD";
+    replies = 0;
+    if (FtpPipeline(cmds, 2, reply_seen, &replies, w->conn) != 2 ||
+        replies != 2)
+      w->failures++;
+  }
+  FtpDelete(remote, w->conn);
+  FtpQuit(w->conn);
+  unlink(local);
+  unlink(back);
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  const char *user = "test", *pass = "test", *server = NULL;
+  char host[64], dir[] = "/tmp/ftpthreads.XXXXXX", root[sizeof(dir) + 8];
+  int c, i, nthreads = 8, rounds = 10, failures = 0;
+  struct worker *w;
+  FtpStub *stub = NULL;
+
+  while ((c = getopt(argc, argv, "t:n:H:u:p:")) != -1) {
+    switch (c) {
+    case 't':
+      nthreads = atoi(optarg);
+      break;
+    case 'n':
+      rounds = atoi(optarg);
+      break;
+    case 'H':
+      server = optarg;
+      break;
+    case 'u':
+      user = optarg;
+      break;
+    case 'p':
+      pass = optarg;
+      break;
+    default:
+      fprintf(stderr,
+              "usage: %s [-t threads] [-n rounds] "
+              "[-H host:port [-u user] [-p pass]]\n",
+              argv[0]);
+      return 2;
+    }
+  }
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  FtpInit();
+  if (server == NULL) {
+    sprintf(root, "%s/root", dir);
+    mkdir(root, 0700);
+    if ((stub = FtpStubStart(root, 0, 0)) == NULL) {
+      perror("ftpstub");
+      return 1;
+    }
+    sprintf(host, "127.0.0.1:%d", FtpStubPort(stub));
+    server = host;
+    walk_tree(root, 1);
+  }
+
+  w = calloc(nthreads, sizeof(struct worker));
+  for (i = 0; i < nthreads; i++) {
+    w[i].id = i;
+    w[i].rounds = rounds;
+    w[i].host = server;
+    w[i].user = user;
+    w[i].pass = pass;
+    w[i].dir = dir;
+    pthread_create(&w[i].th, NULL, run, &w[i]);
+  }
+  /* the walker's own threads race the sessions above */
+  if (stub) {
+    failures += walk(server, user, pass, "w", 1, WALK_ENTRIES, WALK_SUBDIRS, 0);
+    failures += walk(server, user, pass, "missing", 1, 0, 0, 1);
+    FtpStubLegacy(stub, 1);
+    failures += walk(server, user, pass, "w", 0, WALK_ENTRIES, WALK_SUBDIRS, 0);
+    failures += walk(server, user, pass, "missing", 0, 0, 0, 1);
+    FtpStubLegacy(stub, 0);
+  }
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(w[i].th, NULL);
+    if (w[i].logged == 0 || w[i].foreign)
+      w[i].failures++;
+    failures += w[i].failures;
+    printf("session %2d: %ld log lines, %d foreign, %d failures\n", i,
+           w[i].logged, w[i].foreign, w[i].failures);
+  }
+  free(w);
+
+  if (stub) {
+    FtpStubStop(stub);
+    walk_tree(root, 0);
+    rmdir(root);
+  }
+  rmdir(dir);
+  printf("%s\n", failures ? "FAILED" : "OK");
+  return failures ? 1 : 0;
+}
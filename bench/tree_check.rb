@@ -0,0 +1,223 @@
+#*************************************************************************#
+#                                                                         #
+# tree_check.rb - mirror, sync_up and friends against the loopback stub   #
+# Copyright (C) 2015 Paolo Bosetti and Matteo Ragni,                      #
+# paolo[dot]bosetti[at]unitn.it and matteo[dot]ragni[at]unitn.it          #
+# Department of Industrial Engineering, University of Trento              #
+#                                                                         #
+# This library is free software.  You can redistribute it and/or          #
+# modify it under the terms of the GNU GENERAL PUBLIC LICENSE 2.0.        #
+#                                                                         #
+# This library is distributed in the hope that it will be useful,         #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+# Artistic License 2.0 for more details.                                  #
+#                                                                         #
+# See the file LICENSE                                                    #
+#                                                                         #
+#*************************************************************************#
+
+# Checks FTP#mirror and FTP#sync_up, with and without :delete, including
+# an entry whose type differs on the two sides, plus FTP#each_entry,
+# FTP::RemoteFile block caching and read-ahead, and FTP::Appender. The
+# stub must serve root from this host, since the remote fixtures are
+# made there directly (make bench/ftpstub):
+#
+#   bench/ftpstub -p 2121 /tmp/root &
+#   mruby bench/tree_check.rb 127.0.0.1:2121 /tmp/root /tmp/local
+#
+# Run it again against a legacy stub (-L): entries then come from NLST
+# and stat_batch, and a dangling symlink, which none of SIZE, MDTM or CWD
+# classifies, checks that mirroring leaves 'unknown' entries alone.
+# The appender's resume after a dropped data connection is not covered:
+# the stub never drops one. Raises at the end if any check failed.
+
+host  = ARGV[0] || '127.0.0.1:2121'
+root  = ARGV[1] || '/tmp/root'
+local = ARGV[2] || '/tmp/local'
+
+$failures = 0
+
+def check(what, ok)
+  puts "#{ok ? 'ok    ' : 'FAILED'} #{what}"
+  $failures += 1 unless ok
+end
+
+def write_file(path, data)
+  File.open(path, 'wb') { |f| f.write(data) }
+end
+
+def read_file(path)
+  File.open(path, 'rb') { |f| f.read }
+end
+
+def rm_tree(path)
+  (FTP::Local.entries(path) || {}).each do |name, facts|
+    if facts['type'] == 'dir' then
+      rm_tree("#{path}/#{name}")
+    else
+      FTP::Local.remove("#{path}/#{name}")
+    end
+  end
+  FTP::Local.remove(path)
+end
+
+def raises?
+  yield
+  false
+rescue RuntimeError
+  true
+end
+
+rbase = "#{root}/tree_check"
+lbase = "#{local}/tree_check"
+ghosts = %w(m/ghost s/ghost).map { |p| "#{rbase}/#{p}" }
+ghosts.each { |g| FTP::Local.remove(g) }
+rm_tree(rbase)
+rm_tree(lbase)
+[root, local, rbase, lbase, "#{rbase}/m", "#{rbase}/m/sub", "#{rbase}/m/clash",
+ "#{lbase}/s", "#{lbase}/s/d"].each do |dir|
+  FTP::Local.mkdir(dir)
+end
+
+FTP.open(host, 'check', 'check') do |ftp|
+  ftp.login
+  legacy = !ftp.features.include?(:mlst)
+  puts "server listings: #{legacy ? 'NLST' : 'MLSD'}"
+
+  # mirror: tree_check/m on the server into lbase/m
+  write_file("#{rbase}/m/a.txt", 'alpha')
+  write_file("#{rbase}/m/sub/b.txt", 'bravo')
+  write_file("#{rbase}/m/clash/c.txt", 'charlie')
+  ldir = "#{lbase}/m"
+  r = ftp.mirror('tree_check/m', ldir)
+  check 'mirror fetches the tree', r[:transferred].size == 3 &&
+        read_file("#{ldir}/sub/b.txt") == 'bravo'
+  r = ftp.mirror('tree_check/m', ldir)
+  check 'mirror again skips unchanged files',
+        r[:transferred].empty? && r[:skipped] == 3
+
+  write_file("#{ldir}/extra.txt", 'extra')
+  r = ftp.mirror('tree_check/m', ldir)
+  check 'mirror keeps local extras without :delete',
+        r[:deleted].empty? && FTP::Local.entries(ldir).has_key?('extra.txt')
+  r = ftp.mirror('tree_check/m', ldir, :delete => true)
+  check 'mirror :delete removes local extras',
+        r[:deleted] == ["#{ldir}/extra.txt"] &&
+        !FTP::Local.entries(ldir).has_key?('extra.txt')
+
+  # a local file where the server has a directory
+  rm_tree("#{ldir}/clash")
+  write_file("#{ldir}/clash", 'file')
+  check 'mirror refuses a type mismatch without :delete',
+        raises? { ftp.mirror('tree_check/m', ldir) } &&
+        read_file("#{ldir}/clash") == 'file'
+  r = ftp.mirror('tree_check/m', ldir, :delete => true)
+  check 'mirror :delete replaces a mismatched entry',
+        r[:deleted].include?("#{ldir}/clash") &&
+        read_file("#{ldir}/clash/c.txt") == 'charlie'
+
+  if legacy then
+    File.symlink('nowhere', "#{rbase}/m/ghost")
+    write_file("#{ldir}/ghost", 'mine')
+    r = ftp.mirror('tree_check/m', ldir, :delete => true)
+    check 'mirror :delete leaves an unknown entry alone',
+          r[:deleted].empty? && r[:transferred].empty? &&
+          read_file("#{ldir}/ghost") == 'mine'
+  end
+
+  # each_entry lists what NLST does
+  names = []
+  count = ftp.each_entry('tree_check/m') { |name, facts| names << name }
+  listed = ftp.nlst('tree_check/m').split("\n").map { |l| l.chomp("\r") }
+  listed = listed.map { |l| l.split('/').last }
+  check 'each_entry yields every entry',
+        count == names.size && names.sort == listed.sort
+
+  # sync_up: lbase/s into tree_check/s on the server
+  sdir = "#{lbase}/s"
+  write_file("#{sdir}/x.txt", 'xray')
+  write_file("#{sdir}/d/y.txt", 'yankee')
+  write_file("#{sdir}/clash", 'file')
+  r = ftp.sync_up(sdir, 'tree_check/s')
+  check 'sync_up uploads the tree', r[:transferred].size == 3 &&
+        read_file("#{rbase}/s/d/y.txt") == 'yankee'
+  r = ftp.sync_up(sdir, 'tree_check/s')
+  check 'sync_up again skips unchanged files',
+        r[:transferred].empty? && r[:skipped] == 3
+
+  write_file("#{rbase}/s/old.txt", 'old')
+  r = ftp.sync_up(sdir, 'tree_check/s')
+  check 'sync_up keeps remote extras without :delete',
+        r[:deleted].empty? &&
+        FTP::Local.entries("#{rbase}/s").has_key?('old.txt')
+  r = ftp.sync_up(sdir, 'tree_check/s', :delete => true)
+  check 'sync_up :delete removes remote extras',
+        r[:deleted] == ['tree_check/s/old.txt'] &&
+        !FTP::Local.entries("#{rbase}/s").has_key?('old.txt')
+
+  # a local directory where the server has a file
+  FTP::Local.remove("#{sdir}/clash")
+  FTP::Local.mkdir("#{sdir}/clash")
+  write_file("#{sdir}/clash/z.txt", 'zulu')
+  check 'sync_up refuses a type mismatch without :delete',
+        raises? { ftp.sync_up(sdir, 'tree_check/s') } &&
+        read_file("#{rbase}/s/clash") == 'file'
+  r = ftp.sync_up(sdir, 'tree_check/s', :delete => true)
+  check 'sync_up :delete replaces a mismatched entry',
+        r[:deleted].include?('tree_check/s/clash') &&
+        read_file("#{rbase}/s/clash/z.txt") == 'zulu'
+
+  if legacy then
+    File.symlink('nowhere', "#{rbase}/s/ghost")
+    write_file("#{sdir}/ghost", 'mine')
+    r = ftp.sync_up(sdir, 'tree_check/s', :delete => true)
+    check 'sync_up skips an unknown entry', r[:skipped] == 4 &&
+          r[:transferred].empty? && r[:deleted].empty?
+    FTP::Local.remove("#{sdir}/ghost")
+    r = ftp.sync_up(sdir, 'tree_check/s', :delete => true)
+    check 'sync_up :delete leaves an unknown entry alone',
+          r[:deleted].empty?
+  end
+
+  # RemoteFile: 10 blocks of 1000 bytes, a cache of 3, read-ahead up to 4
+  data = ''
+  10000.times { |i| data << ('a'.ord + i % 26).chr }
+  write_file("#{rbase}/big.bin", data)
+  $fetches = []
+  def ftp.read_range(path, offset, len)
+    $fetches << len / 1000
+    super
+  end
+  file = ftp.open_remote('tree_check/big.bin', :block_size => 1000,
+                         :cache_blocks => 3, :readahead => 4)
+  out = ''
+  while (part = file.read(700))
+    out << part
+  end
+  check 'RemoteFile reads the whole file', out == data && file.eof?
+  check 'RemoteFile read-ahead doubles up to the cache size',
+        $fetches == [1, 2, 3, 3, 1]
+  $fetches.clear
+  hit = file.pread(9500, 100)
+  first = file.pread(0, 10)
+  evicted = file.pread(7000, 10)
+  check 'RemoteFile keeps the 3 most recent blocks',
+        hit == data[9500, 100] && first == data[0, 10] &&
+        evicted == data[7000, 10] && $fetches == [1, 1]
+
+  # Appender: batches of 4 bytes, reopened for a second run
+  ftp.appender('tree_check/log.txt', :flush_bytes => 4) do |log|
+    log << "one\n" << "two\n"
+    check 'Appender sends full batches', log.stats[:bytes] == 8
+  end
+  ftp.appender('tree_check/log.txt') { |log| log << "three\n" }
+  check 'Appender appends to an existing file',
+        read_file("#{rbase}/log.txt") == "one\ntwo\nthree\n"
+end
+
+ghosts.each { |g| FTP::Local.remove(g) }
+rm_tree(rbase)
+rm_tree(lbase)
+raise RuntimeError, "#{$failures} checks FAILED" if $failures > 0
+puts 'OK'
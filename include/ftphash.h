@@ -0,0 +1,54 @@
+/***************************************************************************/
+/*                                                                         */
+/* ftphash.h - streaming digests computed during ftplib transfers          */
+/* Copyright (C) 2015 Paolo Bosetti and Matteo Ragni,                      */
+/* paolo[dot]bosetti[at]unitn.it and matteo[dot]ragni[at]unitn.it          */
+/* Department of Industrial Engineering, University of Trento              */
+/*                                                                         */
+/* This library is free software.  You can redistribute it and/or          */
+/* modify it under the terms of the GNU GENERAL PUBLIC LICENSE 2.0.        */
+/*                                                                         */
+/* This library is distributed in the hope that it will be useful,         */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           */
+/* Artistic License 2.0 for more details.                                  */
+/*                                                                         */
+/* See the file LICENSE                                                    */
+/*                                                                         */
+/***************************************************************************/
+
+#if !defined(__FTPHASH_H)
+#define __FTPHASH_H
+
+#include <stddef.h>
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* longest digest, as lowercase hex plus terminator */
+#define FTPHASH_HEXSIZ 65
+
+typedef struct FtpHash {
+  int algo; /* FTPLIB_HASH_* code */
+  uint64_t len;
+  union {
+    uint32_t crc;
+    uint32_t md5[4];
+    uint32_t sha256[8];
+  } st;
+  unsigned char blk[64];
+  unsigned int nblk;
+} FtpHash;
+
+void FtpHashInit(FtpHash *h, int algo);
+void FtpHashUpdate(FtpHash *h, const void *buf, size_t len);
+int FtpHashFinal(FtpHash *h, char *hex, int max);
+int FtpHashHexLen(int algo);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __FTPHASH_H */
@@ -44,6 +44,8 @@
 #define FTPLIB_DIR_VERBOSE 2
 #define FTPLIB_FILE_READ 3
 #define FTPLIB_FILE_WRITE 4
+#define FTPLIB_MLSD 5
+#define FTPLIB_FILE_APPEND 6	/* APPE: write at the end of the file */
 
 /* FtpAccess() mode codes */
 #define FTPLIB_ASCII 'A'
@@ -61,6 +63,68 @@
 #define FTPLIB_IDLETIME 3
 #define FTPLIB_CALLBACKARG 4
 #define FTPLIB_CALLBACKBYTES 5
+#define FTPLIB_RATELIMIT 6	/* bytes per second, 0 removes the limit */
+#define FTPLIB_RATEPOOL 7	/* FtpRatePool * shared budget, 0 detaches */
+#define FTPLIB_HASHALGO 8	/* digest computed during file transfers */
+#define FTPLIB_DEBUG 9		/* diagnostic level of this session, 0 is silent */
+#define FTPLIB_BLOCKMODE 10	/* MODE B with a kept data connection, if accepted */
+#define FTPLIB_IOURING 11	/* io_uring for binary downloads, where available */
+#define FTPLIB_PAGECACHE 12	/* FTPLIB_PAGECACHE_* handling of local files */
+#define FTPLIB_OVERLAP 13	/* ring depth of the disk thread, 0 for inline disk I/O */
+#define FTPLIB_OVERLAPBLOCK 14	/* bytes per ring buffer */
+#define FTPLIB_COMPRESS 15	/* FTPLIB_CODEC_* applied by FtpGet/FtpPut */
+
+/* FTPLIB_OVERLAP and FTPLIB_OVERLAPBLOCK ranges */
+#define FTPLIB_OVERLAP_MAXDEPTH 64	/* depth is 0 or 2 to this */
+#define FTPLIB_OVERLAP_MINBLOCK 16384
+#define FTPLIB_OVERLAP_MAXBLOCK (16 << 20)
+
+/* FTPLIB_PAGECACHE values */
+#define FTPLIB_PAGECACHE_KEEP 0		/* plain buffered I/O */
+#define FTPLIB_PAGECACHE_DROP 1		/* drop the file from the cache behind the cursor */
+#define FTPLIB_PAGECACHE_DIRECT 2	/* O_DIRECT for binary downloads, DROP otherwise */
+
+/* FTPLIB_COMPRESS values */
+#define FTPLIB_CODEC_NONE 0
+#define FTPLIB_CODEC_GZIP 1	/* zlib */
+#define FTPLIB_CODEC_ZSTD 2	/* needs ftplib built with FTPLIB_ZSTD */
+
+/* FTPLIB_HASHALGO values */
+#define FTPLIB_HASH_NONE 0
+#define FTPLIB_HASH_CRC32 1
+#define FTPLIB_HASH_MD5 2
+#define FTPLIB_HASH_SHA256 3
+
+/* FtpDigest() return codes */
+#define FTPLIB_DIGEST_MISMATCH -1	/* server digest differs */
+#define FTPLIB_DIGEST_NONE 0		/* no digest computed */
+#define FTPLIB_DIGEST_LOCAL 1		/* computed, server cannot verify */
+#define FTPLIB_DIGEST_VERIFIED 2	/* computed and confirmed by server */
+
+/* FtpAuthTLS() flags */
+#define FTPLIB_TLS_CLEARDATA 1	/* PROT C: data connections stay in the clear */
+#define FTPLIB_TLS_NOVERIFY 2	/* accept any server certificate */
+#define FTPLIB_TLS_NOREUSE 4	/* full TLS handshake on every data connection */
+
+/* FtpFeatures() bits, from the FEAT reply */
+#define FTPLIB_FEAT_HASH 0x0001		/* HASH command (draft-bryan-ftp-hash) */
+#define FTPLIB_FEAT_HASH_CRC32 0x0002
+#define FTPLIB_FEAT_HASH_MD5 0x0004
+#define FTPLIB_FEAT_HASH_SHA256 0x0008
+#define FTPLIB_FEAT_XCRC 0x0010
+#define FTPLIB_FEAT_XMD5 0x0020
+#define FTPLIB_FEAT_MLST 0x0040		/* MLST and MLSD (RFC 3659) */
+#define FTPLIB_FEAT_MFMT 0x0080		/* set modification time */
+#define FTPLIB_FEAT_SIZE 0x0100
+#define FTPLIB_FEAT_MDTM 0x0200
+
+/* trace event codes */
+#define FTPLIB_TRACE_CMD 1		/* command written to control connection */
+#define FTPLIB_TRACE_RESP_FIRST 2	/* first byte of a reply available */
+#define FTPLIB_TRACE_RESP 3		/* final reply line received */
+#define FTPLIB_TRACE_DATA_CONNECT 4	/* data connection established */
+#define FTPLIB_TRACE_DATA_FIRST 5	/* first byte moved on data connection */
+#define FTPLIB_TRACE_XFER_DONE 6	/* transfer completion reply received */
 
 #ifdef __cplusplus
 extern "C" {
@@ -73,8 +137,16 @@ typedef uint32_t fsz_t;
 #endif
 
 typedef struct NetBuf netbuf;
+typedef struct FtpRatePool FtpRatePool;
 typedef int (*FtpCallback)(netbuf *nControl, fsz_t xfered, void *arg);
 
+typedef void (*FtpReplyCallback)(int idx, const char *reply, void *arg);
+
+typedef void (*FtpTraceCallback)(netbuf *nControl, int event, const char *text,
+    uint64_t usec, void *arg);
+
+typedef void (*FtpLogCallback)(netbuf *nControl, const char *msg, void *arg);
+
 typedef struct FtpCallbackOptions {
     FtpCallback cbFunc;		/* function to call */
     void *cbArg;		/* argument to pass to function */
@@ -82,6 +154,13 @@ typedef struct FtpCallbackOptions {
     unsigned int idleTime;	/* callback if this many milliseconds have elapsed */
 } FtpCallbackOptions;
 
+typedef struct FtpSessionStats {
+    long commands;		/* sent on the control connection */
+    long saved;			/* redundant commands skipped, one round trip each */
+} FtpSessionStats;
+
+/* FTPLIB_DEBUG level given to new connections; set it before starting
+   threads, or use FtpOptions() per session */
 GLOBALREF int ftplib_debug;
 GLOBALREF void FtpInit(void);
 GLOBALREF char *FtpLastResponse(netbuf *nControl);
@@ -89,12 +168,22 @@ GLOBALREF int FtpConnect(const char *host, netbuf **nControl);
 GLOBALREF int FtpOptions(int opt, long val, netbuf *nControl);
 GLOBALREF int FtpSetCallback(const FtpCallbackOptions *opt, netbuf *nControl);
 GLOBALREF int FtpClearCallback(netbuf *nControl);
+GLOBALREF int FtpSetTrace(FtpTraceCallback cb, void *arg, netbuf *nControl);
+GLOBALREF int FtpSetLog(FtpLogCallback cb, void *arg, netbuf *nControl);
+GLOBALREF int FtpStats(FtpSessionStats *st, netbuf *nControl);
+GLOBALREF FtpRatePool *FtpRatePoolNew(long rate, long burst);
+GLOBALREF int FtpRatePoolSet(FtpRatePool *pool, long rate, long burst);
+GLOBALREF void FtpRatePoolFree(FtpRatePool *pool);
+GLOBALREF int FtpAuthTLS(int flags, netbuf *nControl);
 GLOBALREF int FtpLogin(const char *user, const char *pass, netbuf *nControl);
+GLOBALREF int FtpFeatures(netbuf *nControl);
+GLOBALREF int FtpRestart(long long offset, netbuf *nControl);
 GLOBALREF int FtpAccess(const char *path, int typ, int mode, netbuf *nControl,
     netbuf **nData);
 GLOBALREF int FtpRead(void *buf, int max, netbuf *nData);
 GLOBALREF int FtpWrite(const void *buf, int len, netbuf *nData);
 GLOBALREF int FtpClose(netbuf *nData);
+GLOBALREF int FtpDataAlive(netbuf *nData);
 GLOBALREF int FtpSite(const char *cmd, netbuf *nControl);
 GLOBALREF int FtpSysType(char *buf, int max, netbuf *nControl);
 GLOBALREF int FtpMkdir(const char *path, netbuf *nControl);
@@ -104,19 +193,40 @@ GLOBALREF int FtpRmdir(const char *path, netbuf *nControl);
 GLOBALREF int FtpPwd(char *path, int max, netbuf *nControl);
 GLOBALREF int FtpNlst(const char *output, const char *path, netbuf *nControl);
 GLOBALREF int FtpDir(const char *output, const char *path, netbuf *nControl);
+GLOBALREF int FtpMlsd(const char *output, const char *path, netbuf *nControl);
+GLOBALREF int FtpPipeline(const char **cmds, int n, FtpReplyCallback cb,
+    void *arg, netbuf *nControl);
 GLOBALREF int FtpSize(const char *path, unsigned int *size, char mode, netbuf *nControl);
 #if defined(__UINT64_MAX)
 GLOBALREF int FtpSizeLong(const char *path, fsz_t *size, char mode, netbuf *nControl);
 #endif
 GLOBALREF int FtpModDate(const char *path, char *dt, int max, netbuf *nControl);
+GLOBALREF int FtpSetModDate(const char *path, const char *dt, netbuf *nControl);
+GLOBALREF int FtpMlst(const char *path, char *facts, int max, netbuf *nControl);
 GLOBALREF int FtpGet(const char *output, const char *path, char mode,
 	netbuf *nControl);
 GLOBALREF int FtpPut(const char *input, const char *path, char mode,
 	netbuf *nControl);
+GLOBALREF int FtpXferServer(const char *srcpath, netbuf *nSrc,
+	const char *dstpath, netbuf *nDst, char mode);
+GLOBALREF int FtpDigest(char *hex, int max, netbuf *nControl);
+GLOBALREF int FtpBlockMode(netbuf *nControl);
 GLOBALREF int FtpRename(const char *src, const char *dst, netbuf *nControl);
 GLOBALREF int FtpDelete(const char *fnm, netbuf *nControl);
 GLOBALREF void FtpQuit(netbuf *nControl);
 
+#if defined(FTPLIB_TEST_BUILD)
+/* line and reply primitives, exposed for bench/ftpmicro.c */
+#define FTPLIB_CONTROL 0
+#define FTPLIB_READ 1
+#define FTPLIB_WRITE 2
+GLOBALREF netbuf *FtpTestNetbuf(int handle, int dir);
+GLOBALREF void FtpTestFree(netbuf *n);
+GLOBALREF int FtpTestReadline(char *buf, int max, netbuf *ctl);
+GLOBALREF int FtpTestWriteline(const char *buf, int len, netbuf *nData);
+GLOBALREF int FtpTestReadresp(char c, netbuf *nControl);
+#endif
+
 #ifdef __cplusplus
 };
 #endif
@@ -0,0 +1,48 @@
+/***************************************************************************/
+/*                                                                         */
+/* ftpuring.h - io_uring download engine for ftplib transfers              */
+/* Copyright (C) 2015 Paolo Bosetti and Matteo Ragni,                      */
+/* paolo[dot]bosetti[at]unitn.it and matteo[dot]ragni[at]unitn.it          */
+/* Department of Industrial Engineering, University of Trento              */
+/*                                                                         */
+/* This library is free software.  You can redistribute it and/or          */
+/* modify it under the terms of the GNU GENERAL PUBLIC LICENSE 2.0.        */
+/*                                                                         */
+/* This library is distributed in the hope that it will be useful,         */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           */
+/* Artistic License 2.0 for more details.                                  */
+/*                                                                         */
+/* See the file LICENSE                                                    */
+/*                                                                         */
+/***************************************************************************/
+
+#if !defined(__FTPURING_H)
+#define __FTPURING_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct FtpUring FtpUring;
+
+/* Called with each block received, in order; returning 0 stops the copy */
+typedef int (*FtpUringFn)(const char *buf, int len, void *arg);
+
+/* Ring of depth buffers of bufsiz bytes, registered with the kernel when
+   the memlock limit allows. NULL with errno set when io_uring cannot be
+   used (non-Linux build, old kernel, seccomp policy). */
+FtpUring *FtpUringNew(int depth, int bufsiz);
+/* Copies the socket to fd, starting at file offset off, until end of
+   file: one socket read and up to depth - 1 file writes in flight.
+   Returns the bytes copied, or -1 with errno set (ECANCELED if fn
+   stopped the copy). */
+long long FtpUringRecvFile(FtpUring *u, int sock, int fd, long long off,
+                           FtpUringFn fn, void *arg);
+void FtpUringFree(FtpUring *u);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __FTPURING_H */
@@ -0,0 +1,65 @@
+/***************************************************************************/
+/*                                                                         */
+/* ftpwalk.h - parallel remote tree enumeration over ftplib sessions       */
+/* Copyright (C) 2015 Paolo Bosetti and Matteo Ragni,                      */
+/* paolo[dot]bosetti[at]unitn.it and matteo[dot]ragni[at]unitn.it          */
+/* Department of Industrial Engineering, University of Trento              */
+/*                                                                         */
+/* This library is free software.  You can redistribute it and/or          */
+/* modify it under the terms of the GNU GENERAL PUBLIC LICENSE 2.0.        */
+/*                                                                         */
+/* This library is distributed in the hope that it will be useful,         */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           */
+/* Artistic License 2.0 for more details.                                  */
+/*                                                                         */
+/* See the file LICENSE                                                    */
+/*                                                                         */
+/***************************************************************************/
+
+#if !defined(__FTPWALK_H)
+#define __FTPWALK_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* FtpWalkNext() return codes */
+#define FTPWALK_ERROR -1 /* no session could log in */
+#define FTPWALK_DONE 0
+#define FTPWALK_ENTRY 1  /* path and its MLSD-style facts line */
+#define FTPWALK_FAILED 2 /* path is a directory that could not be listed */
+#define FTPWALK_LOG 3    /* path is a diagnostic of a worker session */
+
+typedef struct FtpWalk FtpWalk;
+
+/* Settings each worker session takes from the caller's */
+typedef struct FtpWalkOptions {
+  int debug;                /* FTPLIB_DEBUG level */
+  int log;                  /* queue diagnostics as FTPWALK_LOG */
+  long rate_limit;          /* FTPLIB_RATELIMIT */
+  struct FtpRatePool *pool; /* FTPLIB_RATEPOOL, NULL for none */
+  int tls;                  /* FtpAuthTLS() flags + 1, 0 for plain FTP */
+} FtpWalkOptions;
+
+/* Starts worker sessions listing the tree below root breadth-first.
+   Each logs in with user and pass and changes to cwd, when given, so
+   that relative roots resolve as on the caller's session. mlsd selects
+   MLSD listings, otherwise NLST plus pipelined SIZE, MDTM and CWD (a
+   name none of them classifies is reported with type=unknown). opt may
+   be NULL; the pool must outlive the walker. */
+FtpWalk *FtpWalkStart(const char *host, const char *user, const char *pass,
+                      const char *cwd, const char *root, int workers,
+                      int mlsd, const FtpWalkOptions *opt);
+/* Blocks until an entry is available. path and facts stay valid until
+   the next call; facts is "fact=value;...; name", NULL when FAILED or
+   LOG. */
+int FtpWalkNext(FtpWalk *w, const char **path, const char **facts);
+/* Stops the workers, waits for them and frees the walker */
+void FtpWalkStop(FtpWalk *w);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __FTPWALK_H */
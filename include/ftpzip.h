@@ -0,0 +1,53 @@
+/***************************************************************************/
+/*                                                                         */
+/* ftpzip.h - streaming compression of ftplib transfers                    */
+/* Copyright (C) 2015 Paolo Bosetti and Matteo Ragni,                      */
+/* paolo[dot]bosetti[at]unitn.it and matteo[dot]ragni[at]unitn.it          */
+/* Department of Industrial Engineering, University of Trento              */
+/*                                                                         */
+/* This library is free software.  You can redistribute it and/or          */
+/* modify it under the terms of the GNU GENERAL PUBLIC LICENSE 2.0.        */
+/*                                                                         */
+/* This library is distributed in the hope that it will be useful,         */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           */
+/* Artistic License 2.0 for more details.                                  */
+/*                                                                         */
+/* See the file LICENSE                                                    */
+/*                                                                         */
+/***************************************************************************/
+
+#if !defined(__FTPZIP_H)
+#define __FTPZIP_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct FtpZip FtpZip;
+
+/* Called with each block of output, in order; returning 0 stops the run */
+typedef int (*FtpZipFn)(const char *buf, int len, void *arg);
+
+/* 1 if this build has the FTPLIB_CODEC_* codec */
+int FtpZipAvailable(int codec);
+/* Compressor (compress != 0) or decompressor for codec. NULL with errno
+   set: EINVAL for a codec this build lacks, ENOMEM. */
+FtpZip *FtpZipNew(int codec, int compress);
+/* Feeds len bytes of input, passing the output produced to fn; finish
+   ends the stream (compressing) or checks that it ended (decompressing).
+   Returns 1, or 0 on a codec error (see FtpZipError()) or if fn
+   stopped the run. */
+int FtpZipRun(FtpZip *z, const char *buf, int len, int finish, FtpZipFn fn,
+              void *arg);
+/* Why the last FtpZipRun() failed, NULL if fn stopped it */
+const char *FtpZipError(FtpZip *z);
+/* Bytes fed in and handed out so far */
+void FtpZipTotals(FtpZip *z, long long *in, long long *out);
+void FtpZipFree(FtpZip *z);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __FTPZIP_H */
@@ -0,0 +1,92 @@
+#*************************************************************************#
+#                                                                         #
+# appender.rb - batched appends to a remote file                          #
+# Copyright (C) 2015 Paolo Bosetti and Matteo Ragni,                      #
+# paolo[dot]bosetti[at]unitn.it and matteo[dot]ragni[at]unitn.it          #
+# Department of Industrial Engineering, University of Trento              #
+#                                                                         #
+# This library is free software.  You can redistribute it and/or          #
+# modify it under the terms of the GNU GENERAL PUBLIC LICENSE 2.0.        #
+#                                                                         #
+# This library is distributed in the hope that it will be useful,         #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+# Artistic License 2.0 for more details.                                  #
+#                                                                         #
+# See the file LICENSE                                                    #
+#                                                                         #
+#*************************************************************************#
+
+class FTP
+  # Writer appending to a remote file, as returned by FTP#appender. Writes
+  # are batched in memory and the batch goes out through one APPE data
+  # connection, kept open between batches, once it holds :flush_bytes
+  # bytes or its first write is :flush_ms milliseconds old (checked on
+  # each write; call #flush from an idle loop). When the server drops the
+  # connection, the next batch opens a new one and resumes after what the
+  # remote file's SIZE shows already arrived.
+  #
+  # The session is busy until #close: other commands raise meanwhile.
+  class Appender
+    FLUSH_BYTES = 65536
+    FLUSH_MS    = 1000
+
+    attr_reader :path
+
+    def initialize(ftp, path, opts={})
+      @ftp  = ftp
+      @path = path
+      ftp.append_open(path, opts[:flush_bytes] || FLUSH_BYTES,
+                      opts[:flush_ms] || FLUSH_MS)
+    end
+
+    # Batches str; false when a batch that came due could not be sent (it
+    # is kept for the next attempt)
+    def write(str)
+      @ftp.append_write(str.to_s)
+    end
+
+    def <<(str)
+      write(str)
+      self
+    end
+
+    # Sends the batch now; false on failure, the batch being kept
+    def flush
+      @ftp.append_flush
+    end
+
+    # Completes the current file and appends to path from now on, as log
+    # rotation needs
+    def rotate(path)
+      return false unless @ftp.append_rotate(path)
+      @path = path
+      true
+    end
+
+    # Sends the batch and completes the file, giving the session back
+    def close
+      @ftp.append_close
+    end
+
+    # {:bytes => sent, :buffered => batched, :lost => gone with a dropped
+    # connection, :reconnects => data connections reopened}
+    def stats
+      st = @ftp.append_stats
+      {:bytes => st[0], :buffered => st[1], :lost => st[2],
+       :reconnects => st[3]}
+    end
+  end
+
+  # FTP::Appender on path; opts: :flush_bytes, :flush_ms. With a block,
+  # yields it and closes it afterwards.
+  def appender(path, opts={})
+    writer = Appender.new(self, path, opts)
+    return writer unless block_given?
+    begin
+      yield writer
+    ensure
+      writer.close
+    end
+  end
+end
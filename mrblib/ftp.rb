@@ -24,7 +24,8 @@ class FTP
     :to_init   => -1,
     :closed    =>  0,
     :connected =>  1,
-    :logged_in =>  2
+    :logged_in =>  2,
+    :busy      =>  3
   }
   # - Mode
   XFER = {
@@ -43,7 +44,16 @@ class FTP
     end
   end
   
-  attr_reader :hostname, :user
+  # Copies src_path on src_ftp's server to dst_path on dst_ftp's server
+  # (FXP): the two servers exchange the data directly, nothing passes
+  # through this host. Both sessions must be logged in, with plain data
+  # connections. Returns false when a server refuses; each session's
+  # #last_message tells which.
+  def self.copy(src_ftp, src_path, dst_ftp, dst_path, mode=XFER[:binary])
+    src_ftp.copy_to(src_path, dst_ftp, dst_path, mode)
+  end
+
+  attr_reader :hostname, :user, :rate_pool
   def initialize(hostname, user="anonymous", pwd='')
     @hostname = hostname
     @user     = user
@@ -56,16 +66,18 @@ class FTP
     (state == STATE[:closed] ? true : false)
   end
   
-  def getbinaryfile(remote, local)
-    get(remote, local, XFER[:binary])
+  # opts: :decompress => :gzip or :zstd, see #get
+  def getbinaryfile(remote, local, opts={})
+    get(remote, local, XFER[:binary], opts)
   end
   
   def gettextfile(remote, local)
     get(remote, local, XFER[:text])
   end
   
-  def putbinaryfile(local, remote)
-    put(local, remote, XFER[:binary])
+  # opts: :compress => :gzip or :zstd, see #put
+  def putbinaryfile(local, remote, opts={})
+    put(local, remote, XFER[:binary], opts)
   end
   
   def puttextfile(local, remote)
@@ -74,7 +86,262 @@ class FTP
   def inspect
     "#<#{self.class}:0x#{self.hash.abs.to_s(16)} @user=#{@user || 'nil'}, @hostname=#{@hostname}, state=#{self.state}>"
   end
-  
+
+  # Recorded trace as Chrome trace-event JSON (chrome://tracing, Perfetto).
+  # Each command is a span from send to final reply on the "control" row,
+  # each data connection a span up to the completion reply on the "data"
+  # row; first reply byte and first data byte are instant events.
+  def trace_json
+    events = []
+    cmd = nil
+    xfer = nil
+    trace_events.each do |name, ts, text|
+      case name
+      when :cmd
+        cmd = [ts, text]
+      when :resp
+        if cmd then
+          events << trace_event_json(cmd[1].split(' ').first, 'X', cmd[0], 1,
+                                     ts - cmd[0], {'cmd' => cmd[1], 'reply' => text})
+          cmd = nil
+        end
+      when :data_connect
+        xfer = ts
+      when :xfer_done
+        if xfer then
+          events << trace_event_json('transfer', 'X', xfer, 2, ts - xfer,
+                                     {'reply' => text})
+          xfer = nil
+        end
+      else
+        events << trace_event_json(name.to_s, 'i', ts, (name == :data_first ? 2 : 1))
+      end
+    end
+    events << '{"name":"thread_name","ph":"M","pid":1,"tid":1,"args":{"name":"control"}}'
+    events << '{"name":"thread_name","ph":"M","pid":1,"tid":2,"args":{"name":"data"}}'
+    "{\"traceEvents\":[#{events.join(',')}],\"displayTimeUnit\":\"ms\"}"
+  end
+
+  # Downloads the remote tree below remote_dir into local_dir, fetching
+  # only files that are missing locally or differ in size or modification
+  # time; downloads get the remote time so the next run skips them.
+  # With :delete => true, local entries absent on the server are removed.
+  # Returns {:transferred => [...], :failed => [...], :deleted => [...],
+  # :skipped => count}.
+  def mirror(remote_dir, local_dir, opts={})
+    report = {:transferred => [], :failed => [], :deleted => [], :skipped => 0}
+    mirror_tree(remote_dir, local_dir, opts, report)
+    report
+  end
+
+  # Uploads the local tree below local_dir into remote_dir, the reverse of
+  # #mirror. Remote times are set with MFMT where the server supports it,
+  # otherwise a remote file older than the local one counts as changed.
+  def sync_up(local_dir, remote_dir, opts={})
+    report = {:transferred => [], :failed => [], :deleted => [], :skipped => 0}
+    remote = begin
+      remote_entries(remote_dir)
+    rescue RuntimeError
+      mkdir(remote_dir)
+      {}
+    end
+    sync_tree(local_dir, remote_dir, remote, opts, report)
+    report
+  end
+
+  # Remote directory as name => facts, from one MLSD transfer when the
+  # server has it, else from NLST plus pipelined SIZE, MDTM and CWD
+  # lookups. A listed name that none of them classifies gets type
+  # 'unknown': it exists, so mirroring must neither delete nor replace it.
+  def remote_entries(dir)
+    return mlsd(dir) if features.include?(:mlst)
+    names = nlst(dir).split("\n").map { |l| l.chomp("\r").split('/').last }
+    names = names.reject { |n| n.nil? || n.empty? || n == '.' || n == '..' }
+    facts = stat_batch(names.map { |n| path_join(dir, n) })
+    entries = {}
+    names.each_with_index { |n, i| entries[n] = facts[i] || {'type' => 'unknown'} }
+    entries
+  end
+
+  # Yields the name and facts of each entry of the remote directory dir
+  # as its MLSD listing arrives, so memory use does not grow with the size
+  # of the directory. With :names => true, or when the server lacks MLSD,
+  # the listing is NLST and facts is nil. The session is busy meanwhile;
+  # breaking out of the block aborts the listing. Returns the number of
+  # entries yielded.
+  def each_entry(dir='.', opts={})
+    raise ArgumentError, "FTP#each_entry needs a block" unless block_given?
+    listing_open(dir, !opts[:names] && features.include?(:mlst))
+    count = 0
+    begin
+      while (entry = listing_next)
+        count += 1
+        yield entry[0], entry[1]
+      end
+    ensure
+      ok = listing_close
+    end
+    raise RuntimeError, "Cannot list #{dir}: #{last_message}" unless ok
+    count
+  end
+
+  # Enumerates the remote tree below root breadth-first, yielding each
+  # entry's path and facts. With :concurrency => N (N > 1) directories are
+  # listed by N extra sessions in parallel while the block runs here.
+  # Returns {:entries => count, :failed => [unlistable dirs]}.
+  def walk(root='.', opts={}, &block)
+    raise ArgumentError, "FTP#walk needs a block" unless block
+    workers = opts[:concurrency] || 1
+    if workers > 1 then
+      report = walk_parallel(root, workers, &block)
+      return report if report
+    end
+    report = {:entries => 0, :failed => []}
+    queue = [root]
+    until queue.empty?
+      dir = queue.shift
+      begin
+        entries = remote_entries(dir)
+      rescue RuntimeError
+        report[:failed] << dir
+        next
+      end
+      entries.each do |name, facts|
+        path = path_join(dir, name)
+        queue << path if facts['type'] == 'dir'
+        report[:entries] += 1
+        block.call(path, facts)
+      end
+    end
+    report
+  end
+
+  private
+  def path_join(dir, name)
+    dir.end_with?('/') ? "#{dir}#{name}" : "#{dir}/#{name}"
+  end
+
+  def mirror_tree(remote_dir, local_dir, opts, report)
+    FTP::Local.mkdir(local_dir) or raise RuntimeError, "Cannot create #{local_dir}"
+    remote = remote_entries(remote_dir)
+    local = FTP::Local.entries(local_dir) || {}
+    remote.each do |name, facts|
+      rpath, lpath = path_join(remote_dir, name), path_join(local_dir, name)
+      mine = local[name]
+      if mine && mine['type'] != facts['type'] && %w(dir file).include?(facts['type']) then
+        raise RuntimeError, "#{lpath} is a #{mine['type']} on this side" unless opts[:delete]
+        local_remove(lpath, mine, report)
+        mine = nil
+      end
+      case facts['type']
+      when 'dir'
+        mirror_tree(rpath, lpath, opts, report)
+      when 'file'
+        if mine && mine['size'] == facts['size'] &&
+           (facts['modify'].nil? || mine['modify'] == facts['modify']) then
+          report[:skipped] += 1
+        elsif get(rpath, lpath, XFER[:binary]) then
+          FTP::Local.utime(lpath, facts['modify']) if facts['modify']
+          report[:transferred] << rpath
+        else
+          report[:failed] << rpath
+        end
+      end
+    end
+    return unless opts[:delete]
+    local.each do |name, facts|
+      local_remove(path_join(local_dir, name), facts, report) unless remote.has_key?(name)
+    end
+  end
+
+  def local_remove(path, facts, report)
+    if facts['type'] == 'dir' then
+      (FTP::Local.entries(path) || {}).each do |name, f|
+        local_remove(path_join(path, name), f, report)
+      end
+    end
+    report[:deleted] << path if FTP::Local.remove(path)
+  end
+
+  def sync_tree(local_dir, remote_dir, remote, opts, report)
+    local = FTP::Local.entries(local_dir) or raise RuntimeError, "Cannot read #{local_dir}"
+    mfmt = features.include?(:mfmt)
+    local.each do |name, facts|
+      lpath, rpath = path_join(local_dir, name), path_join(remote_dir, name)
+      theirs = remote[name]
+      if theirs && !%w(dir file).include?(theirs['type']) then
+        # Unclassified on the server: leave it alone
+        report[:skipped] += 1
+        next
+      end
+      if theirs && theirs['type'] != facts['type'] then
+        raise RuntimeError, "#{rpath} is a #{theirs['type']} on the server" unless opts[:delete]
+        remote_remove(rpath, theirs, report)
+        theirs = nil
+      end
+      if facts['type'] == 'dir' then
+        mkdir(rpath) unless theirs
+        sync_tree(lpath, rpath, theirs ? remote_entries(rpath) : {}, opts, report)
+      elsif theirs && theirs['size'] == facts['size'] && theirs['modify'] &&
+            (mfmt ? theirs['modify'] == facts['modify'] : theirs['modify'] >= facts['modify']) then
+        report[:skipped] += 1
+      elsif put(lpath, rpath, XFER[:binary]) then
+        set_mdtm(rpath, facts['modify']) if mfmt
+        report[:transferred] << lpath
+      else
+        report[:failed] << lpath
+      end
+    end
+    return unless opts[:delete]
+    remote.each do |name, facts|
+      remote_remove(path_join(remote_dir, name), facts, report) unless local.has_key?(name)
+    end
+  end
+
+  def remote_remove(path, facts, report)
+    if facts['type'] == 'dir' then
+      remote_entries(path).each { |name, f| remote_remove(path_join(path, name), f, report) }
+      rmdir(path)
+    elsif facts['type'] == 'file' then
+      delete(path)
+    else
+      return
+    end
+    report[:deleted] << path
+  end
+
+  def trace_event_json(name, ph, ts, tid, dur=nil, args=nil)
+    json = "{\"name\":#{json_string(name)},\"ph\":\"#{ph}\",\"ts\":#{ts},\"pid\":1,\"tid\":#{tid}"
+    json << ",\"dur\":#{dur}" if dur
+    json << ",\"s\":\"t\"" if ph == 'i'
+    if args then
+      json << ',"args":{' << args.map { |k, v| "#{json_string(k)}:#{json_string(v.to_s)}" }.join(',') << '}'
+    end
+    json << '}'
+  end
+
+  def json_string(str)
+    out = '"'
+    str.each_char do |c|
+      case c
+      when '"'  then out << '\\"'
+      when '\\' then out << '\\\\'
+      when "\n" then out << '\\n'
+      when "\r" then out << '\\r'
+      when "\t" then out << '\\t'
+      else
+        if c.ord < 0x20 then
+          out << "\\u%04x" % c.ord
+        else
+          out << c
+        end
+      end
+    end
+    out << '"'
+  end
+
+  public
+
   alias :quit :close
   alias :connect :open
   alias :list :dir
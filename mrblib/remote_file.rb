@@ -0,0 +1,156 @@
+#*************************************************************************#
+#                                                                         #
+# remote_file.rb - random access to remote files                          #
+# Copyright (C) 2015 Paolo Bosetti and Matteo Ragni,                      #
+# paolo[dot]bosetti[at]unitn.it and matteo[dot]ragni[at]unitn.it          #
+# Department of Industrial Engineering, University of Trento              #
+#                                                                         #
+# This library is free software.  You can redistribute it and/or          #
+# modify it under the terms of the GNU GENERAL PUBLIC LICENSE 2.0.        #
+#                                                                         #
+# This library is distributed in the hope that it will be useful,         #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+# Artistic License 2.0 for more details.                                  #
+#                                                                         #
+# See the file LICENSE                                                    #
+#                                                                         #
+#*************************************************************************#
+
+class FTP
+  # Read-only, random-access view of a remote file, as returned by
+  # FTP#open_remote. Data comes in blocks of :block_size bytes, each
+  # fetched with REST and RETR (FTP#read_range) and kept in a cache of
+  # :cache_blocks blocks, least recently used out first. A miss right after
+  # the previous fetch reads ahead: the window doubles up to :readahead
+  # blocks, and a miss anywhere else shrinks it back to one block.
+  class RemoteFile
+    BLOCK_SIZE   = 65536
+    CACHE_BLOCKS = 64
+    READAHEAD    = 16
+
+    attr_reader :path, :size, :pos
+
+    def initialize(ftp, path, opts={})
+      @ftp      = ftp
+      @path     = path
+      @block    = opts[:block_size] || BLOCK_SIZE
+      @capacity = opts[:cache_blocks] || CACHE_BLOCKS
+      @max      = [opts[:readahead] || READAHEAD, @capacity].min
+      raise ArgumentError, "Block size must be positive" unless @block > 0
+      raise ArgumentError, "Cache must hold a block" unless @capacity > 0
+      @size = ftp.size(path)
+      raise RuntimeError, "Cannot open #{path}: #{ftp.last_message}" unless @size
+      @cache = {}   # block number => data
+      @lru   = []   # block numbers, least recently used first
+      @next  = nil  # block following the last fetch
+      @ahead = 1
+      @pos   = 0
+    end
+
+    # len bytes from offset on, fewer at the end of the file, nil at or
+    # past it. Leaves #pos alone.
+    def pread(offset, len)
+      raise ArgumentError, "Negative offset or length" if offset < 0 || len < 0
+      return (len == 0 ? '' : nil) if offset >= @size
+      len = @size - offset if offset + len > @size
+      out = ''
+      while len > 0
+        n = block_of(offset)
+        data = block(n)
+        skip = offset - n * @block
+        count = [len, data.size - skip].min
+        break if count <= 0
+        out << data[skip, count]
+        offset += count
+        len -= count
+      end
+      out
+    end
+
+    # len bytes from #pos on, advancing it; nil at the end of the file.
+    # Without len, the rest of the file.
+    def read(len=nil)
+      data = pread(@pos, len || [@size - @pos, 0].max)
+      @pos += data.size if data
+      data
+    end
+
+    # Moves #pos, whence being :set, :cur or :end. Returns 0.
+    def seek(offset, whence=:set)
+      case whence
+      when :set, 0 then base = 0
+      when :cur, 1 then base = @pos
+      when :end, 2 then base = @size
+      else raise ArgumentError, "Unknown whence #{whence}"
+      end
+      raise ArgumentError, "Negative position" if base + offset < 0
+      @pos = base + offset
+      0
+    end
+
+    def pos=(offset)
+      seek(offset)
+    end
+    alias tell pos
+
+    def rewind
+      seek(0)
+    end
+
+    def eof?
+      @pos >= @size
+    end
+
+    # Drops the cached blocks; the FTP session stays open.
+    def close
+      @cache = {}
+      @lru = []
+      nil
+    end
+
+    private
+    def block_of(offset)
+      ((offset - offset % @block) / @block).to_i
+    end
+
+    def block(n)
+      data = @cache[n]
+      if data then
+        @lru.delete(n)
+        @lru << n
+        return data
+      end
+      fetch(n)
+      @cache[n] || ''
+    end
+
+    def fetch(n)
+      @ahead = (n == @next) ? [@ahead * 2, @max].min : 1
+      last = block_of(@size - 1)
+      count = 1
+      count += 1 while count < @ahead && n + count <= last && !@cache[n + count]
+      data = @ftp.read_range(@path, n * @block, count * @block)
+      raise RuntimeError, "Cannot read #{@path}: #{@ftp.last_message}" unless data
+      count.times do |i|
+        part = data[i * @block, @block]
+        break if part.nil? || part.empty?
+        store(n + i, part)
+      end
+      @next = n + count
+    end
+
+    def store(n, data)
+      @cache.delete(@lru.shift) while @lru.size >= @capacity
+      @cache[n] = data
+      @lru << n
+    end
+  end
+
+  # FTP::RemoteFile over path, for reading parts of a large remote file
+  # (an archive's header or trailing index) without downloading all of it.
+  # opts: :block_size, :cache_blocks, :readahead.
+  def open_remote(path, opts={})
+    RemoteFile.new(self, path, opts)
+  end
+end
@@ -24,19 +24,35 @@ see http://nbpfaus.net/~pfau/ftplib/ftplib.html
 
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#if !defined(_WIN32)
+#include <pthread.h>
+#endif
 #include "mruby.h"
 #include "mruby/variable.h"
 #include "mruby/string.h"
 #include "mruby/data.h"
 #include "mruby/class.h"
 #include "mruby/value.h"
+#include "mruby/array.h"
+#include "mruby/hash.h"
+#include "mruby/error.h"
 #include "ftplib.h"
+#include "ftphash.h"
+#include "ftpwalk.h"
 
 enum mruby_ftp_state {
   FTP_STATE_TO_INIT = -1, // -1 -> Pseudo state (need initialization)
   FTP_STATE_CLOSED,       //  0 -> State on mrb_ftp_data_init and mrb_ftp_close
   FTP_STATE_CONNECTED,    //  1 -> State on mrb_ftp_connect
-  FTP_STATE_LOGGED_IN     //  2 -> Sate on mrb_ftp_login
+  FTP_STATE_LOGGED_IN,    //  2 -> Sate on mrb_ftp_login
+  FTP_STATE_BUSY          //  3 -> get_async/put_async, appender or listing
 };
 
 enum mruby_ftp_xfer {
@@ -44,34 +60,191 @@ enum mruby_ftp_xfer {
   FTP_XFER_BINARY    // 1 - performs binary transfer
 };
 
+// Listing and metadata cache, keyed by kind and absolute remote path.
+// Entries expire after ttl seconds and are dropped when a mutating
+// command touches their path, their parent or a directory above them.
+#define CACHE_BUCKETS 64
+
+enum ftp_cache_kind {
+  CACHE_LIST = 'L', // FTP#dir
+  CACHE_NLST = 'N', // FTP#nlst
+  CACHE_SIZE = 'S', // FTP#size
+  CACHE_MDTM = 'M'  // FTP#mdtm
+};
+
+struct cache_entry {
+  struct cache_entry *next;
+  char kind;
+  char *path;
+  char *text; // listings and MDTM
+  unsigned long long num; // SIZE
+  double expires;
+};
+
+struct ftp_cache {
+  double ttl;
+  struct cache_entry *bucket[CACHE_BUCKETS];
+};
+
+// Small blocks recycled per session for short-lived strings (cache keys,
+// path scratch), so that repeated calls stop going through malloc. Larger
+// requests get a plain allocation with the same header.
+#define POOL_BLOCK 512
+#define POOL_DEPTH 8
+
+struct pool_block {
+  struct pool_block *next;
+  size_t size;
+};
+
+struct block_pool {
+  struct pool_block *free;
+  int count;
+};
+
+// Listing buffer kept between calls; a larger one is dropped afterwards
+#define LISTING_DEFAULT 4096
+#define LISTING_KEEP (256 * 1024)
+
+// Largest single FtpRead()/FtpWrite() of read_range and appenders
+#define MAX_CHUNK (1 << 20)
+
+// Maximum length of the text recorded with a trace event
+#define TRACE_TEXT_LENGTH 96
+
+// One timestamped protocol event, as reported by ftplib trace hook
+struct trace_event {
+  int event;
+  uint64_t usec;
+  char text[TRACE_TEXT_LENGTH];
+};
+
+// Transfer running on a worker thread for FTP#get_async/put_async. It is
+// shared by the session (until reaped) and the FTP::Transfer handle, and
+// freed when both have let go. The worker only touches this struct and the
+// control connection, never the mruby state.
+struct async_xfer {
+#if !defined(_WIN32)
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+#endif
+  int refs;   // session + handle
+  int joined; // worker thread collected
+  netbuf *conn;
+  char *local, *remote;
+  char mode;
+  int put;
+  // Written by the worker under lock
+  int done;
+  int result;
+  int cancel;
+  fsz_t bytes;
+};
+
+// FTP#appender state: writes batched in memory and pushed through one APPE
+// data connection, kept open between batches. The session stays busy until
+// the appender is closed.
+struct append_state {
+  netbuf *nData; // APPE connection, NULL until the next flush
+  char *path;
+  char *buf; // batched writes
+  size_t len, capa;
+  size_t flush_bytes; // flush once this much is batched...
+  double flush_secs;  // ...or the first batched write is this old
+  double first;       // cache_clock() of that write
+  long long base;     // remote size before the first byte, -1 if unknown
+  long long sent;     // bytes the server has from us, as far as we know
+  long long lost;     // bytes gone with a connection the server dropped
+  int reconnects;
+  int resync; // the connection was lost, check the remote size first
+};
+
+#if defined(_WIN32)
+#define async_lock(a)
+#define async_unlock(a)
+#else
+#define async_lock(a) pthread_mutex_lock(&(a)->lock)
+#define async_unlock(a) pthread_mutex_unlock(&(a)->lock)
+#endif
+
 // Container for netbuf struct and a state variable that identifies the
 // actual state of the ftp server.
 struct netbuf_data {
   netbuf *conn;
   char state;
+  mrb_state *mrb;   // interpreter running callbacks issued by ftplib
+  mrb_value self;   // owning FTP instance, valid while a method runs
+  mrb_value cb_err; // exception raised by a callback (also in @callback_error)
+  // Trace recording
+  int tracing;
+  mrb_value trace_proc; // optional block, kept alive by @trace_proc
+  uint64_t trace_t0;      // clock value of the first recorded event
+  struct trace_event *trace_ev;
+  size_t trace_len, trace_capa;
+  // Progress callback
+  mrb_value progress_proc; // kept alive by @progress_proc
+  unsigned int progress_bytes;
+  unsigned int progress_idle;
+  // Bandwidth limits
+  long rate_limit;        // bytes per second for this session, 0 = none
+  FtpRatePool *rate_pool; // shared budget, kept alive by @rate_pool
+  int hash_algo;          // digest computed during get/put
+  int block_mode;         // ask for MODE B on the next connection
+  int io_uring;           // binary downloads through io_uring, if available
+  int page_cache;         // FTPLIB_PAGECACHE_* for local files
+  int overlap;            // ring depth of the disk thread, 0 for none
+  int overlap_block;      // bytes per ring buffer, 0 for ftplib's default
+  int tls;                // FtpAuthTLS() flags + 1 at login, 0 for plain FTP
+  // Remote metadata
+  char *cwd;                // directory PWD last reported, NULL if unknown
+  long saved;               // PWD/CWD round trips answered from cwd
+  struct ftp_cache *cache;  // listing/SIZE/MDTM cache, NULL if disabled
+  // Scratch memory reused across calls
+  struct block_pool pool;
+  char *listing; // listing_read() result, valid until the next call
+  size_t listing_capa;
+  // Diagnostics
+  int debug;          // FTPLIB_DEBUG level of the session
+  mrb_value log_proc; // kept alive by @log_proc, nil logs to stderr
+  // Symbols interned once per session (symbols belong to an mrb_state)
+  mrb_sym sym_hostname, sym_user, sym_pwd, sym_callback_error;
+  mrb_sym sym_trace[FTPLIB_TRACE_XFER_DONE + 1];
+  // Background transfer holding the control connection, if any
+  struct async_xfer *async;
+  // Open FTP#appender, also holding it
+  struct append_state *append;
+  // Data connection of an open FTP#each_entry listing, also holding it
+  netbuf *entries;
+  int entries_mlsd; // MLSD lines, otherwise NLST names
 };
 
-// FIXME :: substitute with representation of maximum string length
-#define MAX_STRING_LENGTH 2048
+// Names of the digest algorithms, as ftplib FTPLIB_HASH_* codes
+static const char *hash_algo_names[] = {"none", "crc32", "md5", "sha256"};
+static const char *page_cache_names[] = {"keep", "drop", "direct"};
+// Names of the FTPLIB_CODEC_* codecs of put(compress:) and get(decompress:)
+static const char *codec_names[] = {"none", "gzip", "zstd"};
 
-// TODO: Check for portability, esp. on M$
-#ifdef _WIN32
-#warning Untested platform identified!
-#define CONSOLE_STREAM "CON"
-#define NULL_STREAM "NUL"
-#else
-#define CONSOLE_STREAM "/dev/tty"
-#define NULL_STREAM "/dev/null"
-#endif
+// Names of the FtpFeatures() bits, as reported by FTP#features
+static const struct {
+  int bit;
+  const char *name;
+} feature_names[] = {{FTPLIB_FEAT_HASH, "hash"},
+                     {FTPLIB_FEAT_HASH_CRC32, "hash_crc32"},
+                     {FTPLIB_FEAT_HASH_MD5, "hash_md5"},
+                     {FTPLIB_FEAT_HASH_SHA256, "hash_sha256"},
+                     {FTPLIB_FEAT_XCRC, "xcrc"},
+                     {FTPLIB_FEAT_XMD5, "xmd5"},
+                     {FTPLIB_FEAT_MLST, "mlst"},
+                     {FTPLIB_FEAT_MFMT, "mfmt"},
+                     {FTPLIB_FEAT_SIZE, "size"},
+                     {FTPLIB_FEAT_MDTM, "mdtm"}};
 
-#define GRAB_STDOUT(stream_str, chain)                                         \
-  stream_str = (char *)malloc(MAX_STRING_LENGTH * sizeof(char));               \
-  fflush(stdout);                                                              \
-  freopen(NULL_STREAM, "a", stdout);                                           \
-  setbuffer(stdout, stream_str, MAX_STRING_LENGTH);                            \
-  chain;                                                                       \
-  freopen(CONSOLE_STREAM, "a", stdout);                                        \
-  fflush(stdout);
+// Default callback granularity when neither bytes: nor idle_ms: are given
+#define PROGRESS_DEFAULT_BYTES 65536
+
+// FIXME :: substitute with representation of maximum string length
+#define MAX_STRING_LENGTH 2048
 
 #define FTPLIB_SUCCEED 1
 #define FTPLIB_ERROR 0
@@ -84,26 +257,62 @@ struct netbuf_data {
   case FTP_STATE_CONNECTED:                                                    \
     mrb_raise(mrb, E_RUNTIME_ERROR, "Not logged in");                          \
     break;                                                                     \
+  case FTP_STATE_BUSY:                                                         \
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Transfer in progress");                   \
+    break;                                                                     \
   default:                                                                     \
     mrb_raise(mrb, E_RUNTIME_ERROR, "Undefined state, cannot continue");       \
     break;                                                                     \
   }
 
+static void cache_free(struct ftp_cache *cache);
+static void pool_drain(struct block_pool *p);
+static void async_unref(struct async_xfer *a);
+static void async_join(struct async_xfer *a);
+static void append_free(struct append_state *ap);
+static struct netbuf_data *async_settle(struct netbuf_data *data);
+
+// True when the control connection may be used or reconfigured
+#define SESSION_IDLE(data) ((data)->conn && (data)->state != FTP_STATE_BUSY)
+
 // Garbage collector handler, for netbuf_data struct
-static void netbuf_data_destructor(mrb_state *mrb, void *p_) { free(p_); };
+static void netbuf_data_destructor(mrb_state *mrb, void *p_) {
+  struct netbuf_data *data = (struct netbuf_data *)p_;
+  if (data) {
+    free(data->trace_ev);
+    free(data->cwd);
+    cache_free(data->cache);
+    pool_drain(&data->pool);
+    free(data->listing);
+    if (data->async) {
+      // The worker still uses the connection; stop it at the next buffer
+      // and let it finish first
+      async_lock(data->async);
+      data->async->cancel = 1;
+      async_unlock(data->async);
+      async_join(data->async);
+      async_unref(data->async);
+    }
+    // Their data connections go the way of the unclosed control connection:
+    // FtpClose would read the reply, running the hooks in the collector.
+    // each_entry closes its listing itself on the way out.
+    append_free(data->append);
+  }
+  free(p_);
+};
 
-// Macro loads from istanced object the value contained in
-// @data var, that is actually the netbuf for a specif instance
-// Obtains a pointer to allocated struct.
+// FTP instances are MRB_TT_DATA objects carrying the netbuf_data struct
+// directly; the pointer is set by data_init and only ever of that type,
+// so no instance variable lookup or type check is needed per call.
+// Obtains a pointer to allocated struct, reaping a finished background
+// transfer first so that the session is usable again.
 #define CONNECTION_DATA_STRUCT                                                 \
-  DATA_GET_PTR(mrb, mrb_iv_get(mrb, self, mrb_intern_cstr(mrb, "@data")),      \
-               &netbuf_data_type, struct netbuf_data);
-
-// Check routines on @data instance variable
-// Return true if @data is nil
-#define CHECK_DATA_NIL                                                         \
-  mrb_nil_p(mrb_iv_get(mrb, self, mrb_intern_cstr(mrb, "@data")))
-// Raise an error if @data is nil
+  async_settle((struct netbuf_data *)DATA_PTR(self));
+
+// Check routines on the session struct
+// Return true if it was not allocated yet
+#define CHECK_DATA_NIL (DATA_PTR(self) == NULL)
+// Raise an error if it was not allocated
 #define CHECK_DATA_EXISTENCE                                                   \
   if (CHECK_DATA_NIL) {                                                        \
     mrb_raise(mrb, E_RUNTIME_ERROR, "Undefined @state. Use FTP#open");         \
@@ -113,6 +322,618 @@ static void netbuf_data_destructor(mrb_state *mrb, void *p_) { free(p_); };
 const struct mrb_data_type netbuf_data_type = {"netbuf_data",
                                                netbuf_data_destructor};
 
+// Garbage collector handler, for FTP::RatePool
+static void rate_pool_destructor(mrb_state *mrb, void *p_) {
+  FtpRatePoolFree((FtpRatePool *)p_);
+}
+
+const struct mrb_data_type rate_pool_type = {"rate_pool",
+                                             rate_pool_destructor};
+
+// Garbage collector handler, for FTP::Transfer
+static void transfer_destructor(mrb_state *mrb, void *p_) {
+  if (p_)
+    async_unref((struct async_xfer *)p_);
+}
+
+const struct mrb_data_type transfer_type = {"ftp_transfer",
+                                            transfer_destructor};
+
+// Invocation of a Ruby block from inside an ftplib callback. Exceptions
+// must not unwind through ftplib (the control connection would be left
+// mid-reply), so the block runs protected and the exception is re-raised
+// by callback_guard once the ftplib function has returned.
+struct callback_call {
+  mrb_value proc;
+  mrb_int argc;
+  mrb_value argv[3];
+};
+
+static mrb_value callback_body(mrb_state *mrb, mrb_value p) {
+  struct callback_call *call = (struct callback_call *)mrb_cptr(p);
+  return mrb_yield_argv(mrb, call->proc, call->argc, call->argv);
+}
+
+// Returns 0 if the block raised, 1 otherwise; block result in *rv
+static int callback_invoke(struct netbuf_data *data, struct callback_call *call,
+                           mrb_value *rv) {
+  mrb_state *mrb = data->mrb;
+  mrb_bool failed = 0;
+  mrb_value r;
+  if (!mrb_nil_p(data->cb_err))
+    return 0;
+  r = mrb_protect(mrb, callback_body, mrb_cptr_value(mrb, call), &failed);
+  if (failed) {
+    data->cb_err = r;
+    mrb_iv_set(mrb, data->self, data->sym_callback_error, r);
+    return 0;
+  }
+  if (rv)
+    *rv = r;
+  return 1;
+}
+
+// Raise a pending callback exception, otherwise pass through rv
+static int callback_guard(mrb_state *mrb, struct netbuf_data *data, int rv) {
+  if (!mrb_nil_p(data->cb_err)) {
+    mrb_value exc = data->cb_err;
+    data->cb_err = mrb_nil_value();
+    mrb_iv_set(mrb, data->self, data->sym_callback_error,
+               mrb_nil_value());
+    mrb_exc_raise(mrb, exc);
+  }
+  return rv;
+}
+#define GUARDED(call) callback_guard(mrb, data, (call))
+
+// Names of the ftplib trace event codes, as reported to Ruby
+static const char *trace_event_names[] = {
+    "unknown", "cmd", "resp_first", "resp", "data_connect", "data_first",
+    "xfer_done"};
+
+static mrb_value trace_event_sym(struct netbuf_data *data, int event) {
+  if (event < 0 || event > FTPLIB_TRACE_XFER_DONE)
+    event = 0;
+  return mrb_symbol_value(data->sym_trace[event]);
+}
+
+// ftplib trace hook: records the event and yields it to the trace block
+static void trace_hook(netbuf *ctl, int event, const char *text,
+                       uint64_t usec, void *arg) {
+  struct netbuf_data *data = (struct netbuf_data *)arg;
+  struct trace_event *ev;
+  size_t l = 0;
+  if (data->trace_len == data->trace_capa) {
+    size_t capa = data->trace_capa ? data->trace_capa * 2 : 256;
+    ev = realloc(data->trace_ev, capa * sizeof(struct trace_event));
+    if (ev == NULL)
+      return;
+    data->trace_ev = ev;
+    data->trace_capa = capa;
+  }
+  if (data->trace_len == 0)
+    data->trace_t0 = usec; // timestamps are relative to the first event
+  ev = &data->trace_ev[data->trace_len++];
+  ev->event = event;
+  ev->usec = usec - data->trace_t0;
+  if (text) {
+    strncpy(ev->text, text, TRACE_TEXT_LENGTH - 1);
+    ev->text[TRACE_TEXT_LENGTH - 1] = '\0';
+    l = strcspn(ev->text, "\r\n");
+  }
+  ev->text[l] = '\0';
+  if (!mrb_nil_p(data->trace_proc)) {
+    mrb_state *mrb = data->mrb;
+    int ai = mrb_gc_arena_save(mrb);
+    struct callback_call call;
+    call.proc = data->trace_proc;
+    call.argc = 3;
+    call.argv[0] = trace_event_sym(data, event);
+    call.argv[1] = mrb_float_value(mrb, (mrb_float)ev->usec);
+    call.argv[2] = text ? mrb_str_new_cstr(mrb, ev->text) : mrb_nil_value();
+    callback_invoke(data, &call, NULL);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+}
+
+// ftplib progress callback: yields bytes transferred so far to the block.
+// An explicit false from the block (or an exception) aborts the transfer.
+static int progress_hook(netbuf *nData, fsz_t xfered, void *arg) {
+  struct netbuf_data *data = (struct netbuf_data *)arg;
+  mrb_state *mrb = data->mrb;
+  int ai = mrb_gc_arena_save(mrb);
+  mrb_value rv = mrb_nil_value();
+  struct callback_call call;
+  int ok;
+  call.proc = data->progress_proc;
+  call.argc = 1;
+  call.argv[0] = mrb_fixnum_value((mrb_int)xfered);
+  ok = callback_invoke(data, &call, &rv) && !mrb_false_p(rv);
+  mrb_gc_arena_restore(mrb, ai);
+  return ok;
+}
+
+// Installs (or clears) the progress callback on the control connection;
+// ftplib copies it to each data connection it opens.
+static void progress_apply(struct netbuf_data *data) {
+  FtpCallbackOptions opt;
+  if (!SESSION_IDLE(data))
+    return;
+  if (mrb_nil_p(data->progress_proc)) {
+    FtpClearCallback(data->conn);
+    return;
+  }
+  opt.cbFunc = progress_hook;
+  opt.cbArg = data;
+  opt.bytesXferred = data->progress_bytes;
+  opt.idleTime = data->progress_idle;
+  FtpSetCallback(&opt, data->conn);
+}
+
+// Applies the bandwidth limits to the control connection; ftplib copies
+// them to each data connection it opens.
+static void rate_apply(struct netbuf_data *data) {
+  if (!SESSION_IDLE(data))
+    return;
+  FtpOptions(FTPLIB_RATELIMIT, data->rate_limit, data->conn);
+  FtpOptions(FTPLIB_RATEPOOL, (long)data->rate_pool, data->conn);
+}
+
+// ftplib log callback: yields each diagnostic line to the block
+static void log_hook(netbuf *ctl, const char *msg, void *arg) {
+  struct netbuf_data *data = (struct netbuf_data *)arg;
+  mrb_state *mrb = data->mrb;
+  int ai = mrb_gc_arena_save(mrb);
+  struct callback_call call;
+  call.proc = data->log_proc;
+  call.argc = 1;
+  call.argv[0] = mrb_str_new_cstr(mrb, msg);
+  callback_invoke(data, &call, NULL);
+  mrb_gc_arena_restore(mrb, ai);
+}
+
+// Applies debug level and log destination to the control connection
+static void log_apply(struct netbuf_data *data) {
+  if (!SESSION_IDLE(data))
+    return;
+  FtpOptions(FTPLIB_DEBUG, data->debug, data->conn);
+  if (mrb_nil_p(data->log_proc))
+    FtpSetLog(NULL, NULL, data->conn);
+  else
+    FtpSetLog(log_hook, data, data->conn);
+}
+
+// Reads a whole LIST/NLST listing through a data connection into the
+// session's listing buffer (*out, also on failure; valid until the next
+// call). Unlike redirecting stdout this touches no process-wide state and
+// has no size limit.
+static int listing_read(struct netbuf_data *data, const char *path, int typ,
+                        char **out) {
+  netbuf *nData;
+  size_t len = 0;
+  char *nbuf;
+  int l;
+  if (data->listing_capa > LISTING_KEEP) {
+    free(data->listing);
+    data->listing = NULL;
+  }
+  if (!data->listing) {
+    data->listing_capa = 0;
+    if ((data->listing = malloc(LISTING_DEFAULT)) == NULL)
+      return FTPLIB_ERROR;
+    data->listing_capa = LISTING_DEFAULT;
+  }
+  *out = data->listing;
+  data->listing[0] = '\0';
+  if (FtpAccess(path, typ, FTPLIB_ASCII, data->conn, &nData) != FTPLIB_SUCCEED)
+    return FTPLIB_ERROR;
+  for (;;) {
+    if (data->listing_capa - len < MAX_STRING_LENGTH) {
+      if ((nbuf = realloc(data->listing, data->listing_capa * 2)) == NULL) {
+        // Abandon the listing rather than return part of it
+        FtpClose(nData);
+        data->listing[0] = '\0';
+        return FTPLIB_ERROR;
+      }
+      *out = data->listing = nbuf;
+      data->listing_capa *= 2;
+    }
+    // One byte stays free for the terminator
+    l = FtpRead(data->listing + len, (int)(data->listing_capa - len - 1),
+                nData);
+    if (l <= 0)
+      break;
+    len += l;
+  }
+  data->listing[len] = '\0';
+  return FtpClose(nData);
+}
+
+// Applies the per-session settings to a new control connection, and again
+// when a background transfer hands the connection back
+static void session_apply(struct netbuf_data *data) {
+  if (!SESSION_IDLE(data))
+    return;
+  FtpSetTrace(data->tracing ? trace_hook : NULL, data, data->conn);
+  progress_apply(data);
+  rate_apply(data);
+  FtpOptions(FTPLIB_HASHALGO, data->hash_algo, data->conn);
+  FtpOptions(FTPLIB_PAGECACHE, data->page_cache, data->conn);
+  FtpOptions(FTPLIB_OVERLAP, data->overlap, data->conn);
+  if (data->overlap_block)
+    FtpOptions(FTPLIB_OVERLAPBLOCK, data->overlap_block, data->conn);
+  log_apply(data);
+}
+
+// ftplib progress callback of a background transfer: publishes the byte
+// count and stops the transfer once cancel is requested
+static int async_progress(netbuf *nData, fsz_t xfered, void *arg) {
+  struct async_xfer *a = (struct async_xfer *)arg;
+  int go;
+  async_lock(a);
+  a->bytes = xfered;
+  go = !a->cancel;
+  async_unlock(a);
+  return go;
+}
+
+static void *async_main(void *arg) {
+  struct async_xfer *a = (struct async_xfer *)arg;
+  int rv;
+  if (a->put)
+    rv = FtpPut(a->local, a->remote, a->mode, a->conn);
+  else
+    rv = FtpGet(a->local, a->remote, a->mode, a->conn);
+  async_lock(a);
+  a->result = rv;
+  a->done = 1;
+#if !defined(_WIN32)
+  pthread_cond_broadcast(&a->cond);
+#endif
+  async_unlock(a);
+  return NULL;
+}
+
+static int async_done(struct async_xfer *a) {
+  int done;
+  async_lock(a);
+  done = a->done;
+  async_unlock(a);
+  return done;
+}
+
+// Waits for the worker thread, which may still be running
+static void async_join(struct async_xfer *a) {
+#if !defined(_WIN32)
+  if (!a->joined)
+    pthread_join(a->thread, NULL);
+#endif
+  a->joined = 1;
+}
+
+static void async_unref(struct async_xfer *a) {
+  if (--a->refs > 0)
+    return;
+  async_join(a);
+#if !defined(_WIN32)
+  pthread_cond_destroy(&a->cond);
+  pthread_mutex_destroy(&a->lock);
+#endif
+  free(a->local);
+  free(a->remote);
+  free(a);
+}
+
+// Hands the control connection back to the session once its background
+// transfer has finished; a no-op otherwise
+static struct netbuf_data *async_settle(struct netbuf_data *data) {
+  struct async_xfer *a;
+  if (!data || !(a = data->async) || !async_done(a))
+    return data;
+  async_join(a);
+  data->async = NULL;
+  data->state = FTP_STATE_LOGGED_IN;
+  session_apply(data);
+  async_unref(a);
+  return data;
+}
+
+static void *pool_alloc(struct block_pool *p, size_t len) {
+  struct pool_block *b;
+  if (len <= POOL_BLOCK && p->free) {
+    b = p->free;
+    p->free = b->next;
+    p->count--;
+    return b + 1;
+  }
+  if (len < POOL_BLOCK)
+    len = POOL_BLOCK;
+  if ((b = malloc(sizeof(struct pool_block) + len)) == NULL)
+    return NULL;
+  b->size = len;
+  return b + 1;
+}
+
+static void pool_free(struct block_pool *p, void *ptr) {
+  struct pool_block *b;
+  if (!ptr)
+    return;
+  b = (struct pool_block *)ptr - 1;
+  if (b->size != POOL_BLOCK || p->count >= POOL_DEPTH) {
+    free(b);
+    return;
+  }
+  b->next = p->free;
+  p->free = b;
+  p->count++;
+}
+
+static void pool_drain(struct block_pool *p) {
+  struct pool_block *b;
+  while ((b = p->free) != NULL) {
+    p->free = b->next;
+    free(b);
+  }
+  p->count = 0;
+}
+
+// Monotonic seconds, for cache expiry
+static double cache_clock(void) {
+#ifdef _WIN32
+  return (double)time(NULL);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
+static unsigned int cache_hash(char kind, const char *path) {
+  unsigned int h = 2166136261u ^ (unsigned char)kind; // FNV-1a
+  while (*path)
+    h = (h ^ (unsigned char)*path++) * 16777619u;
+  return h % CACHE_BUCKETS;
+}
+
+static void cache_entry_free(struct cache_entry *e) {
+  free(e->path);
+  free(e->text);
+  free(e);
+}
+
+static void cache_clear(struct ftp_cache *cache) {
+  int i;
+  if (!cache)
+    return;
+  for (i = 0; i < CACHE_BUCKETS; i++) {
+    while (cache->bucket[i]) {
+      struct cache_entry *e = cache->bucket[i];
+      cache->bucket[i] = e->next;
+      cache_entry_free(e);
+    }
+  }
+}
+
+static void cache_free(struct ftp_cache *cache) {
+  cache_clear(cache);
+  free(cache);
+}
+
+// Live entry for kind and absolute path, or NULL
+static struct cache_entry *cache_get(struct ftp_cache *cache, char kind,
+                                     const char *path) {
+  struct cache_entry **pe, *e;
+  double now;
+  if (!cache || !path)
+    return NULL;
+  now = cache_clock();
+  pe = &cache->bucket[cache_hash(kind, path)];
+  while ((e = *pe) != NULL) {
+    if (e->expires <= now) {
+      *pe = e->next;
+      cache_entry_free(e);
+      continue;
+    }
+    if (e->kind == kind && strcmp(e->path, path) == 0)
+      return e;
+    pe = &e->next;
+  }
+  return NULL;
+}
+
+// Stores text (copied) or num for kind and absolute path
+static void cache_put(struct ftp_cache *cache, char kind, const char *path,
+                      const char *text, unsigned long long num) {
+  struct cache_entry *e;
+  unsigned int h;
+  if (!cache || !path)
+    return;
+  if ((e = cache_get(cache, kind, path)) == NULL) {
+    if ((e = calloc(1, sizeof(struct cache_entry))) == NULL)
+      return;
+    if ((e->path = strdup(path)) == NULL) {
+      free(e);
+      return;
+    }
+    e->kind = kind;
+    h = cache_hash(kind, path);
+    e->next = cache->bucket[h];
+    cache->bucket[h] = e;
+  }
+  free(e->text);
+  e->text = text ? strdup(text) : NULL;
+  e->num = num;
+  e->expires = cache_clock() + cache->ttl;
+}
+
+// Drops entries for path, its parent directory and anything below path
+static void cache_invalidate(struct ftp_cache *cache, const char *path) {
+  size_t len, plen;
+  const char *slash;
+  int i;
+  if (!cache)
+    return;
+  if (!path) {
+    cache_clear(cache);
+    return;
+  }
+  len = strlen(path);
+  slash = strrchr(path, '/');
+  plen = (slash == NULL) ? 0 : (slash == path) ? 1 : (size_t)(slash - path);
+  for (i = 0; i < CACHE_BUCKETS; i++) {
+    struct cache_entry **pe = &cache->bucket[i], *e;
+    while ((e = *pe) != NULL) {
+      size_t elen = strlen(e->path);
+      if ((elen == len && strcmp(e->path, path) == 0) ||
+          (elen == plen && strncmp(e->path, path, plen) == 0) ||
+          (elen > len && strncmp(e->path, path, len) == 0 &&
+           (e->path[len] == '/' || len == 1))) {
+        *pe = e->next;
+        cache_entry_free(e);
+      } else {
+        pe = &e->next;
+      }
+    }
+  }
+}
+
+// Absolute, normalized remote path: cwd joined with path, "." and ".."
+// resolved. Returns a string from pool, NULL on failure.
+static char *remote_abspath(struct block_pool *pool, const char *cwd,
+                            const char *path) {
+  size_t len = strlen(path) + (cwd ? strlen(cwd) : 0) + 3;
+  char *buf = pool_alloc(pool, len), *seg, *save = NULL;
+  char *res = pool_alloc(pool, len);
+  size_t n = 0;
+  if (!buf || !res) {
+    pool_free(pool, buf);
+    pool_free(pool, res);
+    return NULL;
+  }
+  if (path[0] == '/' || !cwd)
+    snprintf(buf, len, "/%s", path);
+  else
+    snprintf(buf, len, "%s/%s", cwd, path);
+  res[0] = '\0';
+  for (seg = strtok_r(buf, "/", &save); seg; seg = strtok_r(NULL, "/", &save)) {
+    if (strcmp(seg, ".") == 0)
+      continue;
+    if (strcmp(seg, "..") == 0) {
+      while (n > 0 && res[n - 1] != '/')
+        n--;
+      if (n > 0)
+        n--;
+      res[n] = '\0';
+      continue;
+    }
+    res[n++] = '/';
+    strcpy(res + n, seg);
+    n += strlen(seg);
+  }
+  if (n == 0) {
+    res[n++] = '/';
+    res[n] = '\0';
+  }
+  pool_free(pool, buf);
+  return res;
+}
+
+static void cwd_set(struct netbuf_data *data, const char *cwd) {
+  free(data->cwd);
+  data->cwd = cwd ? strdup(cwd) : NULL;
+}
+
+// Cache key for a remote path: absolute form, asking the server for the
+// working directory once if it is not known yet. NULL if cache disabled,
+// release with key_free().
+static char *cache_key(struct netbuf_data *data, const char *path) {
+  if (!data->cache)
+    return NULL;
+  if (path[0] != '/' && !data->cwd) {
+    char buf[MAX_STRING_LENGTH];
+    if (FtpPwd(buf, sizeof(buf), data->conn) != FTPLIB_SUCCEED)
+      return NULL;
+    cwd_set(data, buf);
+  }
+  return remote_abspath(&data->pool, data->cwd, path);
+}
+
+static void key_free(struct netbuf_data *data, char *key) {
+  pool_free(&data->pool, key);
+}
+
+// Invalidate cache entries touched by a mutating command on path
+static void cache_touch(struct netbuf_data *data, const char *path) {
+  char *key;
+  if (!data->cache)
+    return;
+  if ((key = cache_key(data, path)) == NULL) {
+    cache_clear(data->cache);
+    return;
+  }
+  cache_invalidate(data->cache, key);
+  key_free(data, key);
+}
+
+// Integer for a size, Float beyond the Fixnum range
+static mrb_value size_num_value(mrb_state *mrb, unsigned long long n) {
+  if (n > (unsigned long long)MRB_INT_MAX)
+    return mrb_float_value(mrb, (mrb_float)n);
+  return mrb_fixnum_value((mrb_int)n);
+}
+
+static mrb_value size_value(mrb_state *mrb, const char *text) {
+  return size_num_value(mrb, strtoull(text, NULL, 10));
+}
+
+// Parses an MLSD/MLST line "fact=value;...; name" into a Hash of
+// lowercase fact names. Sizes become numbers, times lose their fraction
+// so that they compare with MDTM replies. In a listing the "." and ".."
+// entries give nil, otherwise they are reported as type "dir".
+static mrb_value facts_parse(mrb_state *mrb, char *line, char **name,
+                             int listing) {
+  char *sp, *fact, *value, *save = NULL, *p;
+  mrb_value facts, v;
+  line[strcspn(line, "\r\n")] = '\0';
+  if ((sp = strchr(line, ' ')) == NULL)
+    return mrb_nil_value();
+  *sp = '\0';
+  *name = sp + 1;
+  facts = mrb_hash_new(mrb);
+  for (fact = strtok_r(line, ";", &save); fact;
+       fact = strtok_r(NULL, ";", &save)) {
+    if ((value = strchr(fact, '=')) == NULL)
+      continue;
+    *value++ = '\0';
+    for (p = fact; *p; p++)
+      *p = tolower((unsigned char)*p);
+    if (strcmp(fact, "type") == 0) {
+      for (p = value; *p; p++)
+        *p = tolower((unsigned char)*p);
+      if (strcmp(value, "cdir") == 0 || strcmp(value, "pdir") == 0) {
+        if (listing)
+          return mrb_nil_value();
+        strcpy(value, "dir");
+      }
+    }
+    if (strcmp(fact, "size") == 0 || strcmp(fact, "sizd") == 0) {
+      v = size_value(mrb, value);
+    } else {
+      if (strcmp(fact, "modify") == 0 || strcmp(fact, "create") == 0)
+        value[strcspn(value, ".")] = '\0';
+      v = mrb_str_new_cstr(mrb, value);
+    }
+    mrb_hash_set(mrb, facts, mrb_str_new_cstr(mrb, fact), v);
+  }
+  return facts;
+}
+
+// FtpPipeline() reply collector
+static void pipeline_reply(int idx, const char *reply, void *arg) {
+  char **replies = (char **)arg;
+  replies[idx] = strdup(reply);
+}
+
 // FTP Class methods interface functions
 
 /*
@@ -156,13 +977,24 @@ static mrb_value mrb_ftp_data_init(mrb_state *mrb, mrb_value self) {
   // Check id @data is nil
   if (CHECK_DATA_NIL) {
     // Create a new netbuf_data struct and save in class istance
-    struct netbuf_data *data = malloc(sizeof(struct netbuf_data));
+    struct netbuf_data *data = calloc(1, sizeof(struct netbuf_data));
     if (data) {
-      struct RClass *c = mrb_class_ptr(self);
-      mrb_iv_set(
-          mrb, self, mrb_intern_cstr(mrb, "@data"),
-          mrb_obj_value(Data_Wrap_Struct(mrb, c, &netbuf_data_type, data)));
+      int i;
+      DATA_TYPE(self) = &netbuf_data_type;
+      DATA_PTR(self) = data;
       data->state = FTP_STATE_CLOSED;
+      data->mrb = mrb;
+      data->self = self;
+      data->cb_err = mrb_nil_value();
+      data->trace_proc = mrb_nil_value();
+      data->progress_proc = mrb_nil_value();
+      data->log_proc = mrb_nil_value();
+      data->sym_hostname = mrb_intern_lit(mrb, "@hostname");
+      data->sym_user = mrb_intern_lit(mrb, "@user");
+      data->sym_pwd = mrb_intern_lit(mrb, "@pwd");
+      data->sym_callback_error = mrb_intern_lit(mrb, "@callback_error");
+      for (i = 0; i <= FTPLIB_TRACE_XFER_DONE; i++)
+        data->sym_trace[i] = mrb_intern_cstr(mrb, trace_event_names[i]);
       return mrb_true_value();
     } else {
       // Raise an error when it cannot allocate
@@ -186,14 +1018,19 @@ static mrb_value mrb_ftp_connect(mrb_state *mrb, mrb_value self) {
   if (data) {
     if (data->state == FTP_STATE_CLOSED) {
       // Loading @hostname, as required value
-      mrb_value hostname =
-          mrb_iv_get(mrb, self, mrb_intern_cstr(mrb, "@hostname"));
+      mrb_value hostname = mrb_iv_get(mrb, self, data->sym_hostname);
       const char *host = mrb_str_to_cstr(mrb, hostname);
       // Execute connection
       if (FtpConnect(host, &data->conn) == FTPLIB_ERROR) {
         mrb_raise(mrb, E_RUNTIME_ERROR, "Could not connect");
       }
       data->state = FTP_STATE_CONNECTED;
+      data->saved = 0;
+      session_apply(data);
+      // Not in session_apply: after a refusal ftplib stays in stream mode
+      FtpOptions(FTPLIB_BLOCKMODE, data->block_mode, data->conn);
+      // Cleared by ftplib when the kernel lacks io_uring
+      FtpOptions(FTPLIB_IOURING, data->io_uring, data->conn);
       return self;
     } else {
       // Raise an error if state is not closed
@@ -223,15 +1060,21 @@ static mrb_value mrb_ftp_login(mrb_state *mrb, mrb_value self) {
   data = CONNECTION_DATA_STRUCT;
   if (data) {
     if (data->state == FTP_STATE_CONNECTED) {
-      mrb_value user = mrb_iv_get(mrb, self, mrb_intern_cstr(mrb, "@user"));
-      mrb_value pwd = mrb_iv_get(mrb, self, mrb_intern_cstr(mrb, "@pwd"));
+      mrb_value user = mrb_iv_get(mrb, self, data->sym_user);
+      mrb_value pwd = mrb_iv_get(mrb, self, data->sym_pwd);
       const char *pUser = mrb_str_to_cstr(mrb, user);
       const char *pPwd = mrb_str_to_cstr(mrb, pwd);
       // Executes login function
       if (data->conn) {
-        if (FtpLogin(pUser, pPwd, data->conn) == FTPLIB_SUCCEED) {
+        if (data->tls &&
+            GUARDED(FtpAuthTLS(data->tls - 1, data->conn)) != FTPLIB_SUCCEED) {
+          // FTP#last_message tells a refused AUTH from a bad certificate
+          mrb_raise(mrb, E_RUNTIME_ERROR, "TLS negotiation failed");
+        }
+        if (GUARDED(FtpLogin(pUser, pPwd, data->conn)) == FTPLIB_SUCCEED) {
           // if succeed changes state and
           data->state = FTP_STATE_LOGGED_IN;
+          cwd_set(data, NULL);
           return self;
         } else {
           mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot log in");
@@ -270,20 +1113,17 @@ static mrb_value mrb_ftp_pwd(mrb_state *mrb, mrb_value self) {
   if (data) {
     if (data->conn) {
       if (data->state == FTP_STATE_LOGGED_IN) {
-        // FIXME :: dinamically allocated string? Is the best way?
-        char *pPwd = (char *)malloc(MAX_STRING_LENGTH * sizeof(char));
-        if (pPwd) {
-          if (FtpPwd(pPwd, MAX_STRING_LENGTH, data->conn) == FTPLIB_SUCCEED) {
-            mrb_value rv = mrb_str_new_cstr(mrb, pPwd);
-            free(pPwd);
-            return rv;
-          } else {
-            free(pPwd);
-            mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot execute PWD");
-          }
+        char pPwd[MAX_STRING_LENGTH];
+        if (data->cwd) {
+          data->saved++;
+          return mrb_str_new_cstr(mrb, data->cwd);
+        }
+        if (GUARDED(FtpPwd(pPwd, sizeof(pPwd), data->conn)) ==
+            FTPLIB_SUCCEED) {
+          cwd_set(data, pPwd);
+          return mrb_str_new_cstr(mrb, pPwd);
         } else {
-          mrb_raise(mrb, E_RUNTIME_ERROR,
-                    "Cannot execute pwd (pPwd malloc failed)");
+          mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot execute PWD");
         }
       } else {
         ALREADY_LOGIN_STATE_RAISE
@@ -308,9 +1148,19 @@ static mrb_value mrb_ftp_chdir(mrb_state *mrb, mrb_value self) {
     if (data->conn) {
       if (data->state == FTP_STATE_LOGGED_IN) {
         char *dest_name;
-        mrb_int len;
-        mrb_get_args(mrb, "s", &dest_name, &len);
-        if (FtpChdir((const char *)dest_name, data->conn) == FTPLIB_SUCCEED) {
+        mrb_get_args(mrb, "z", &dest_name);
+        // Already there: no CWD needed. Paths are compared as text with
+        // the directory PWD reported, since symlinks and server rewrites
+        // make anything else a guess ("a/.." need not lead back).
+        if (data->cwd && (strcmp(dest_name, ".") == 0 ||
+                          strcmp(dest_name, data->cwd) == 0)) {
+          data->saved++;
+          return mrb_str_new_cstr(mrb, data->cwd);
+        }
+        if (GUARDED(FtpChdir((const char *)dest_name, data->conn)) ==
+            FTPLIB_SUCCEED) {
+          // Only the server knows where CWD led
+          cwd_set(data, NULL);
           return mrb_ftp_pwd(mrb, self);
         } else {
           mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot execute CD");
@@ -337,7 +1187,8 @@ static mrb_value mrb_ftp_cdup(mrb_state *mrb, mrb_value self) {
   if (data) {
     if (data->conn) {
       if (data->state == FTP_STATE_LOGGED_IN) {
-        if (FtpCDUp(data->conn) == FTPLIB_SUCCEED) {
+        if (GUARDED(FtpCDUp(data->conn)) == FTPLIB_SUCCEED) {
+          cwd_set(data, NULL);
           return mrb_ftp_pwd(mrb, self);
         } else {
           return mrb_false_value();
@@ -368,7 +1219,9 @@ static mrb_value mrb_ftp_mkdir(mrb_state *mrb, mrb_value self) {
         mrb_int dir_len;
         mrb_get_args(mrb, "s", &dir_name, &dir_len);
         if (dir_name) {
-          if (FtpMkdir((const char *)dir_name, data->conn) == FTPLIB_SUCCEED) {
+          cache_touch(data, dir_name);
+          if (GUARDED(FtpMkdir((const char *)dir_name, data->conn)) ==
+              FTPLIB_SUCCEED) {
             return mrb_true_value();
           } else {
             return mrb_false_value();
@@ -403,7 +1256,9 @@ static mrb_value mrb_ftp_rmdir(mrb_state *mrb, mrb_value self) {
         mrb_int dir_len;
         mrb_get_args(mrb, "s", &dir_name, &dir_len);
         if (dir_name) {
-          if (FtpRmdir((const char *)dir_name, data->conn) == FTPLIB_SUCCEED) {
+          cache_touch(data, dir_name);
+          if (GUARDED(FtpRmdir((const char *)dir_name, data->conn)) ==
+              FTPLIB_SUCCEED) {
             return mrb_true_value();
           } else {
             return mrb_false_value();
@@ -440,24 +1295,29 @@ static mrb_value mrb_ftp_dir(mrb_state *mrb, mrb_value self) {
         char *ret_str;
         int result = 0;
         mrb_get_args(mrb, "|s", &dest_name, &len);
-        if (!dest_name) {
-          dest_name = (char *)malloc(5 * sizeof(char));
-          strncpy(dest_name, ".", 4);
+        if (!dest_name)
+          dest_name = (char *)".";
+        char *key;
+        struct cache_entry *hit;
+        // Cached listing, if any
+        key = cache_key(data, dest_name);
+        if ((hit = cache_get(data->cache, CACHE_LIST, key)) != NULL) {
+          key_free(data, key);
+          return mrb_str_new_cstr(mrb, hit->text);
         }
         // Executing command
-        GRAB_STDOUT(ret_str,
-                    result = FtpDir((const char *)NULL, dest_name, data->conn));
+        result = listing_read(data, dest_name, FTPLIB_DIR_VERBOSE, &ret_str);
+        if (!mrb_nil_p(data->cb_err))
+          key_free(data, key);
+        GUARDED(result);
         // Results check
         if (result == FTPLIB_SUCCEED) {
           mrb_value rv = mrb_str_new_cstr(mrb, ret_str);
-          free(ret_str);
-          if (!dest_name)
-            free(dest_name);
+          cache_put(data->cache, CACHE_LIST, key, ret_str, 0);
+          key_free(data, key);
           return rv;
         } else {
-          free(ret_str);
-          if (!dest_name)
-            free(dest_name);
+          key_free(data, key);
           mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot execute DIR");
         }
       } else {
@@ -486,26 +1346,30 @@ static mrb_value mrb_ftp_nlst(mrb_state *mrb, mrb_value self) {
         char *dest_name = (char *)NULL;
         mrb_int len;
         mrb_get_args(mrb, "|s", &dest_name, &len);
-        if (!dest_name) {
-          dest_name = (char *)malloc(5 * sizeof(char));
-          strncpy(dest_name, ".", 4);
+        if (!dest_name)
+          dest_name = (char *)".";
+        // Cached listing, if any
+        char *key = cache_key(data, dest_name);
+        struct cache_entry *hit;
+        if ((hit = cache_get(data->cache, CACHE_NLST, key)) != NULL) {
+          key_free(data, key);
+          return mrb_str_new_cstr(mrb, hit->text);
         }
         // Executing command
         char *ret_str;
         int result = 0;
-        GRAB_STDOUT(ret_str, result = FtpNlst((const char *)NULL, dest_name,
-                                              data->conn));
+        result = listing_read(data, dest_name, FTPLIB_DIR, &ret_str);
+        if (!mrb_nil_p(data->cb_err))
+          key_free(data, key);
+        GUARDED(result);
         // Results check
         if (result == FTPLIB_SUCCEED) {
           mrb_value rv = mrb_str_new_cstr(mrb, ret_str);
-          free(ret_str);
-          if (!dest_name)
-            free(dest_name);
+          cache_put(data->cache, CACHE_NLST, key, ret_str, 0);
+          key_free(data, key);
           return rv;
         } else {
-          free(ret_str);
-          if (!dest_name)
-            free(dest_name);
+          key_free(data, key);
           mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot execute NLST");
         }
       } else {
@@ -522,6 +1386,38 @@ static mrb_value mrb_ftp_nlst(mrb_state *mrb, mrb_value self) {
   }
 }
 
+// Codec named by opts[key] (absent or nil for none), set on the session
+// for one get/put; raises on a codec this build lacks or in text mode
+static int xfer_codec(mrb_state *mrb, struct netbuf_data *data, mrb_value opts,
+                      const char *key, mrb_int mode) {
+  mrb_value name;
+  int i, code = -1;
+  if (mrb_nil_p(opts))
+    return FTPLIB_CODEC_NONE;
+  name = mrb_hash_get(mrb, opts, mrb_symbol_value(mrb_intern_cstr(mrb, key)));
+  if (mrb_nil_p(name))
+    return FTPLIB_CODEC_NONE;
+  if (mrb_symbol_p(name)) {
+    for (i = FTPLIB_CODEC_GZIP; i <= FTPLIB_CODEC_ZSTD; i++) {
+      if (mrb_symbol(name) == mrb_intern_cstr(mrb, codec_names[i]))
+        code = i;
+    }
+  }
+  if (code == -1) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "Unknown codec, use :gzip or :zstd");
+  }
+  if (xfer_mode(mode) != FTPLIB_IMAGE) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "Compressed transfers need binary mode");
+  }
+  // gzip is always there, zstd needs FTPLIB_ZSTD
+  if (!FtpOptions(FTPLIB_COMPRESS, code, data->conn)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "No zstd support in this build");
+  }
+  return code;
+}
+
+// FTP#put(local, remote, mode, compress: :gzip | :zstd): with compress,
+// the upload is compressed on the fly and remote holds the compressed data
 static mrb_value mrb_ftp_put(mrb_state *mrb, mrb_value self) {
   struct netbuf_data *data;
   // Error in case of not initialized @data not initialized.
@@ -532,11 +1428,18 @@ static mrb_value mrb_ftp_put(mrb_state *mrb, mrb_value self) {
       if (data->state == FTP_STATE_LOGGED_IN) {
         char *src_path, *dest_path;
         mrb_int src_len, dest_len, mode;
-        mrb_get_args(mrb, "ssi", &src_path, &src_len, &dest_path, &dest_len,
-                     &mode);
+        mrb_value opts = mrb_nil_value();
+        int rv;
+        mrb_get_args(mrb, "ssi|H", &src_path, &src_len, &dest_path, &dest_len,
+                     &mode, &opts);
         if (src_path && dest_path) {
-          if (FtpPut((const char *)src_path, (const char *)dest_path,
-                     xfer_mode(mode), data->conn) == FTPLIB_SUCCEED) {
+          int codec = xfer_codec(mrb, data, opts, "compress", mode);
+          cache_touch(data, dest_path);
+          rv = FtpPut((const char *)src_path, (const char *)dest_path,
+                      xfer_mode(mode), data->conn);
+          if (codec != FTPLIB_CODEC_NONE)
+            FtpOptions(FTPLIB_COMPRESS, FTPLIB_CODEC_NONE, data->conn);
+          if (GUARDED(rv) == FTPLIB_SUCCEED) {
             return mrb_true_value();
           } else {
             return mrb_false_value();
@@ -559,6 +1462,8 @@ static mrb_value mrb_ftp_put(mrb_state *mrb, mrb_value self) {
   }
 }
 
+// FTP#get(remote, local, mode, decompress: :gzip | :zstd): with
+// decompress, remote holds compressed data and local gets it expanded
 static mrb_value mrb_ftp_get(mrb_state *mrb, mrb_value self) {
   struct netbuf_data *data;
   // Error in case of not initialized @data not initialized.
@@ -569,11 +1474,17 @@ static mrb_value mrb_ftp_get(mrb_state *mrb, mrb_value self) {
       if (data->state == FTP_STATE_LOGGED_IN) {
         char *src_path, *dest_path;
         mrb_int src_len, dest_len, mode;
-        mrb_get_args(mrb, "ssi", &src_path, &src_len, &dest_path, &dest_len,
-                     &mode);
+        mrb_value opts = mrb_nil_value();
+        int rv;
+        mrb_get_args(mrb, "ssi|H", &src_path, &src_len, &dest_path, &dest_len,
+                     &mode, &opts);
         if (src_path && dest_path) {
-          if (FtpGet((const char *)dest_path, (const char *)src_path,
-                     xfer_mode(mode), data->conn) == FTPLIB_SUCCEED) {
+          int codec = xfer_codec(mrb, data, opts, "decompress", mode);
+          rv = FtpGet((const char *)dest_path, (const char *)src_path,
+                      xfer_mode(mode), data->conn);
+          if (codec != FTPLIB_CODEC_NONE)
+            FtpOptions(FTPLIB_COMPRESS, FTPLIB_CODEC_NONE, data->conn);
+          if (GUARDED(rv) == FTPLIB_SUCCEED) {
             return mrb_true_value();
           } else {
             return mrb_false_value();
@@ -596,98 +1507,427 @@ static mrb_value mrb_ftp_get(mrb_state *mrb, mrb_value self) {
   }
 }
 
-static mrb_value mrb_ftp_delete(mrb_state *mrb, mrb_value self) {
-  struct netbuf_data *data;
-  // Error in case of not initialized @data not initialized.
+// FTP#copy_to(src_path, dst_ftp, dst_path, mode): server-to-server (FXP)
+// copy from this session's server to dst_ftp's; see FTP.copy
+static mrb_value mrb_ftp_copy_to(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data, *dst;
+  char *src_path, *dst_path;
+  mrb_int mode;
+  mrb_value dst_ftp;
+  int rv;
   CHECK_DATA_EXISTENCE
   data = CONNECTION_DATA_STRUCT;
-  if (data) {
-    if (data->conn) {
-      if (data->state == FTP_STATE_LOGGED_IN) {
-        char *file_path;
-        mrb_int file_len;
-        mrb_get_args(mrb, "s", &file_path, &file_len);
-        if (file_path) {
-          if (FtpDelete((const char *)file_path, data->conn) ==
-              FTPLIB_SUCCEED) {
-            return mrb_true_value();
-          } else {
-            return mrb_false_value();
-          }
-        } else {
-          mrb_raise(mrb, E_RUNTIME_ERROR,
-                    "Cannot execute DELETE. Error reading file_path");
-        }
-      } else {
-        ALREADY_LOGIN_STATE_RAISE
-      }
-    } else {
-      // ftp state defined but not data->conn
-      mrb_raise(mrb, E_RUNTIME_ERROR,
-                "Unknown Error (unable to read connection internal state)");
-    }
-  } else {
-    // Raise an error if it cannot load data
+  mrb_get_args(mrb, "zozi", &src_path, &dst_ftp, &dst_path, &mode);
+  dst = DATA_GET_PTR(mrb, dst_ftp, &netbuf_data_type, struct netbuf_data);
+  if (data == NULL || dst == NULL) {
     mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot load @data");
   }
+  async_settle(dst);
+  if (data->state != FTP_STATE_LOGGED_IN) {
+    ALREADY_LOGIN_STATE_RAISE
+  }
+  if (dst->state != FTP_STATE_LOGGED_IN) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Destination session is not available");
+  }
+  if (dst == data) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR,
+              "Copy within one server needs a second FTP session");
+  }
+  cache_touch(dst, dst_path);
+  rv = FtpXferServer(src_path, data->conn, dst_path, dst->conn,
+                     xfer_mode(mode));
+  // Log and trace blocks of either session may have raised
+  callback_guard(mrb, dst, rv);
+  return mrb_bool_value(GUARDED(rv) == FTPLIB_SUCCEED);
 }
 
-static mrb_value mrb_ftp_rename(mrb_state *mrb, mrb_value self) {
+// FTP#stats: {:commands => sent on the control connection,
+// :round_trips_saved => TYPE, CWD and PWD commands found redundant}
+static mrb_value mrb_ftp_stats(mrb_state *mrb, mrb_value self) {
   struct netbuf_data *data;
-  // Error in case of not initialized @data not initialized.
+  FtpSessionStats st = {0, 0};
+  mrb_value h;
   CHECK_DATA_EXISTENCE
   data = CONNECTION_DATA_STRUCT;
-  if (data) {
-    if (data->conn) {
-      if (data->state == FTP_STATE_LOGGED_IN) {
-        char *src_path, *dest_path;
-        mrb_int src_len, dest_len;
-        mrb_get_args(mrb, "ss", &src_path, &src_len, &dest_path, &dest_len);
-        if (src_path && dest_path) {
-          if (FtpRename((const char *)src_path, (const char *)dest_path,
-                        data->conn) == FTPLIB_SUCCEED) {
-            return mrb_true_value();
-          } else {
-            return mrb_false_value();
-          }
-        } else {
-          mrb_raise(
-              mrb, E_RUNTIME_ERROR,
-              "Cannot execute RENAME. Error reading src_path or dest_path");
-        }
-      } else {
-        ALREADY_LOGIN_STATE_RAISE
-      }
-    } else {
-      // ftp state defined but not data->conn
-      mrb_raise(mrb, E_RUNTIME_ERROR,
-                "Unknown Error (unable to read connection internal state)");
-    }
-  } else {
-    // Raise an error if it cannot load data
+  if (data == NULL) {
     mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot load @data");
   }
+  if (data->conn)
+    FtpStats(&st, data->conn);
+  h = mrb_hash_new(mrb);
+  mrb_hash_set(mrb, h, mrb_symbol_value(mrb_intern_lit(mrb, "commands")),
+               mrb_fixnum_value(st.commands));
+  mrb_hash_set(mrb, h,
+               mrb_symbol_value(mrb_intern_lit(mrb, "round_trips_saved")),
+               mrb_fixnum_value(st.saved + data->saved));
+  return h;
 }
 
-// FIXME :: Not tested!
-static mrb_value mrb_ftp_size(mrb_state *mrb, mrb_value self) {
+// FTP#read_range(path, offset, len): len bytes of a remote file from
+// offset on (fewer at its end) through REST and RETR in IMAGE mode, or nil
+// on failure. The data connection is closed once len bytes are in, so the
+// server reporting the transfer aborted is not an error here.
+static mrb_value mrb_ftp_read_range(mrb_state *mrb, mrb_value self) {
   struct netbuf_data *data;
-  // Error in case of not initialized @data not initialized.
+  char *path;
+  mrb_int offset, len, got = 0;
+  mrb_value str;
+  netbuf *nData;
+  int l, rv;
   CHECK_DATA_EXISTENCE
   data = CONNECTION_DATA_STRUCT;
-  if (data) {
-    if (data->conn) {
-      if (data->state == FTP_STATE_LOGGED_IN) {
-        char *file_path;
+  mrb_get_args(mrb, "zii", &path, &offset, &len);
+  if (data == NULL || data->conn == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot load @data");
+  }
+  if (data->state != FTP_STATE_LOGGED_IN) {
+    ALREADY_LOGIN_STATE_RAISE
+  }
+  if (offset < 0 || len < 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "Negative offset or length");
+  }
+  str = mrb_str_buf_new(mrb, len);
+  if (len == 0)
+    return str;
+  FtpRestart(offset, data->conn);
+  if (GUARDED(FtpAccess(path, FTPLIB_FILE_READ, FTPLIB_IMAGE, data->conn,
+                        &nData)) != FTPLIB_SUCCEED)
+    return mrb_nil_value();
+  while (got < len) {
+    l = FtpRead(RSTRING_PTR(str) + got,
+                len - got > MAX_CHUNK ? MAX_CHUNK : (int)(len - got), nData);
+    if (l <= 0)
+      break;
+    got += l;
+  }
+  rv = FtpClose(nData);
+  mrb_str_resize(mrb, str, got);
+  if (GUARDED(rv) != FTPLIB_SUCCEED && got < len)
+    return mrb_nil_value();
+  return str;
+}
+
+static void append_free(struct append_state *ap) {
+  if (!ap)
+    return;
+  free(ap->path);
+  free(ap->buf);
+  free(ap);
+}
+
+// Remote size of path in bytes, 0 if it does not exist yet, -1 if unknown
+static long long append_size(netbuf *conn, const char *path) {
+  unsigned int size;
+  if (FtpSize(path, &size, FTPLIB_IMAGE, conn) == FTPLIB_SUCCEED)
+    return strtoll(FtpLastResponse(conn) + 4, NULL, 10);
+  return strncmp(FtpLastResponse(conn), "550", 3) == 0 ? 0 : -1;
+}
+
+// Closes the APPE connection; lost is set when it failed, so that the
+// next one first asks the server how much arrived
+static int append_disconnect(struct append_state *ap, int lost) {
+  int rv = FtpClose(ap->nData);
+  ap->nData = NULL;
+  if (lost) {
+    ap->reconnects++;
+    ap->resync = 1;
+  }
+  return rv;
+}
+
+// Opens the APPE connection. After a lost one, the remote size tells how
+// much of the batch (*skip bytes) the server already has, or how much of
+// earlier batches it dropped; without SIZE the whole batch is sent again.
+static int append_connect(struct netbuf_data *data, size_t *skip) {
+  struct append_state *ap = data->append;
+  long long have;
+  *skip = 0;
+  if (ap->resync && ap->base >= 0 &&
+      (have = append_size(data->conn, ap->path)) >= 0) {
+    have -= ap->base + ap->sent;
+    if (have >= 0) {
+      *skip = have > (long long)ap->len ? ap->len : (size_t)have;
+    } else {
+      ap->lost -= have;
+      ap->sent += have;
+    }
+  }
+  ap->resync = 0;
+  return FtpAccess(ap->path, FTPLIB_FILE_APPEND, FTPLIB_IMAGE, data->conn,
+                   &ap->nData);
+}
+
+// Sends the batch, over a new connection if the server dropped the open
+// one or the first attempt fails. The batch is kept on failure.
+static int append_flush(struct netbuf_data *data) {
+  struct append_state *ap = data->append;
+  size_t done;
+  int n, attempt;
+  if (ap->len == 0)
+    return FTPLIB_SUCCEED;
+  for (attempt = 0; attempt < 2; attempt++) {
+    done = 0;
+    if (ap->nData && !FtpDataAlive(ap->nData))
+      append_disconnect(ap, 1);
+    if (!ap->nData && !append_connect(data, &done))
+      return FTPLIB_ERROR;
+    for (; done < ap->len; done += n) {
+      n = ap->len - done > MAX_CHUNK ? MAX_CHUNK : (int)(ap->len - done);
+      if (FtpWrite(ap->buf + done, n, ap->nData) != n)
+        break;
+    }
+    if (done == ap->len) {
+      ap->sent += ap->len;
+      ap->len = 0;
+      return FTPLIB_SUCCEED;
+    }
+    append_disconnect(ap, 1);
+  }
+  return FTPLIB_ERROR;
+}
+
+// Session with an open appender; raises if there is none
+static struct netbuf_data *append_data(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  CHECK_DATA_EXISTENCE
+  data = CONNECTION_DATA_STRUCT;
+  if (data == NULL || data->append == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "No appender open on this session");
+  }
+  return data;
+}
+
+// FTP#append_open(path, flush_bytes, flush_ms), see FTP#appender
+static mrb_value mrb_ftp_append_open(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  struct append_state *ap;
+  char *path;
+  mrb_int flush_bytes, flush_ms;
+  long long base;
+  CHECK_DATA_EXISTENCE
+  data = CONNECTION_DATA_STRUCT;
+  mrb_get_args(mrb, "zii", &path, &flush_bytes, &flush_ms);
+  if (data == NULL || data->conn == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot load @data");
+  }
+  if (data->state != FTP_STATE_LOGGED_IN) {
+    ALREADY_LOGIN_STATE_RAISE
+  }
+  if (flush_bytes <= 0 || flush_ms < 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "Invalid flush thresholds");
+  }
+  cache_touch(data, path);
+  base = append_size(data->conn, path);
+  callback_guard(mrb, data, 1);
+  if ((ap = calloc(1, sizeof(struct append_state))) == NULL ||
+      (ap->path = strdup(path)) == NULL) {
+    free(ap);
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Could not allocate appender");
+  }
+  ap->flush_bytes = (size_t)flush_bytes;
+  ap->flush_secs = flush_ms / 1000.0;
+  ap->base = base;
+  data->append = ap;
+  data->state = FTP_STATE_BUSY;
+  return mrb_true_value();
+}
+
+// FTP#append_write(str): batches str, sending the batch once it is due;
+// false if that failed (the batch is kept)
+static mrb_value mrb_ftp_append_write(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data = append_data(mrb, self);
+  struct append_state *ap = data->append;
+  char *str, *nbuf;
+  mrb_int len;
+  size_t capa;
+  mrb_get_args(mrb, "s", &str, &len);
+  if (ap->capa - ap->len < (size_t)len) {
+    capa = ap->capa ? ap->capa : ap->flush_bytes;
+    while (capa - ap->len < (size_t)len)
+      capa *= 2;
+    if ((nbuf = realloc(ap->buf, capa)) == NULL) {
+      mrb_raise(mrb, E_RUNTIME_ERROR, "Could not allocate appender batch");
+    }
+    ap->buf = nbuf;
+    ap->capa = capa;
+  }
+  if (ap->len == 0)
+    ap->first = cache_clock();
+  memcpy(ap->buf + ap->len, str, len);
+  ap->len += len;
+  if (ap->len < ap->flush_bytes && cache_clock() - ap->first < ap->flush_secs)
+    return mrb_true_value();
+  return mrb_bool_value(GUARDED(append_flush(data)) == FTPLIB_SUCCEED);
+}
+
+// FTP#append_flush: sends the batch now
+static mrb_value mrb_ftp_append_flush(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data = append_data(mrb, self);
+  return mrb_bool_value(GUARDED(append_flush(data)) == FTPLIB_SUCCEED);
+}
+
+// FTP#append_rotate(path): sends the batch, completes the file and
+// appends to path from now on; false, still on the old file, on failure
+static mrb_value mrb_ftp_append_rotate(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data = append_data(mrb, self);
+  struct append_state *ap = data->append;
+  char *path, *npath;
+  int rv;
+  mrb_get_args(mrb, "z", &path);
+  if ((npath = strdup(path)) == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Could not allocate appender");
+  }
+  rv = append_flush(data);
+  if (rv == FTPLIB_SUCCEED && ap->nData)
+    rv = append_disconnect(ap, 0);
+  if (rv != FTPLIB_SUCCEED) {
+    free(npath);
+    return mrb_bool_value(GUARDED(rv) == FTPLIB_SUCCEED);
+  }
+  free(ap->path);
+  ap->path = npath;
+  cache_touch(data, path);
+  ap->base = append_size(data->conn, path);
+  ap->sent = 0;
+  ap->resync = 0;
+  return mrb_bool_value(GUARDED(rv) == FTPLIB_SUCCEED);
+}
+
+// FTP#append_close: sends the batch and completes the file, giving the
+// session back; false if the batch or the file did not make it
+static mrb_value mrb_ftp_append_close(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data = append_data(mrb, self);
+  struct append_state *ap = data->append;
+  int rv = append_flush(data);
+  if (ap->nData && append_disconnect(ap, 0) != FTPLIB_SUCCEED)
+    rv = FTPLIB_ERROR;
+  data->append = NULL;
+  append_free(ap);
+  data->state = FTP_STATE_LOGGED_IN;
+  session_apply(data);
+  return mrb_bool_value(GUARDED(rv) == FTPLIB_SUCCEED);
+}
+
+// FTP#append_stats: [bytes sent, bytes batched, bytes lost, reconnects]
+static mrb_value mrb_ftp_append_stats(mrb_state *mrb, mrb_value self) {
+  struct append_state *ap = append_data(mrb, self)->append;
+  mrb_value st = mrb_ary_new_capa(mrb, 4);
+  mrb_ary_push(mrb, st, mrb_fixnum_value((mrb_int)ap->sent));
+  mrb_ary_push(mrb, st, mrb_fixnum_value((mrb_int)ap->len));
+  mrb_ary_push(mrb, st, mrb_fixnum_value((mrb_int)ap->lost));
+  mrb_ary_push(mrb, st, mrb_fixnum_value(ap->reconnects));
+  return st;
+}
+
+// Starts get (put == 0) or put on a worker thread and returns an
+// FTP::Transfer. The control connection belongs to the worker until the
+// transfer is reaped, so Ruby callbacks are detached meanwhile and other
+// commands raise; any method of the session or the handle reaps it.
+static mrb_value async_start(mrb_state *mrb, mrb_value self, int put) {
+  struct netbuf_data *data;
+  // Error in case of not initialized @data not initialized.
+  CHECK_DATA_EXISTENCE
+  data = CONNECTION_DATA_STRUCT;
+  if (data) {
+    if (data->conn) {
+      if (data->state == FTP_STATE_LOGGED_IN) {
+        char *src_path, *dest_path;
+        mrb_int src_len, dest_len, mode;
+        struct async_xfer *a;
+        struct RClass *klass;
+        FtpCallbackOptions opt;
+        mrb_value handle;
+        mrb_get_args(mrb, "ssi", &src_path, &src_len, &dest_path, &dest_len,
+                     &mode);
+        klass =
+            mrb_class_get_under(mrb, mrb_class_get(mrb, "FTP"), "Transfer");
+        if ((a = calloc(1, sizeof(struct async_xfer))) == NULL) {
+          mrb_raise(mrb, E_RUNTIME_ERROR, "Could not allocate transfer");
+        }
+        a->local = strdup(put ? src_path : dest_path);
+        a->remote = strdup(put ? dest_path : src_path);
+        if (!a->local || !a->remote) {
+          free(a->local);
+          free(a->remote);
+          free(a);
+          mrb_raise(mrb, E_RUNTIME_ERROR, "Could not allocate transfer");
+        }
+        a->refs = 2;
+        a->conn = data->conn;
+        a->mode = xfer_mode(mode);
+        a->put = put;
+#if !defined(_WIN32)
+        pthread_mutex_init(&a->lock, NULL);
+        pthread_cond_init(&a->cond, NULL);
+#endif
+        // The handle owns one reference from here on
+        handle =
+            mrb_obj_value(Data_Wrap_Struct(mrb, klass, &transfer_type, a));
+        mrb_iv_set(mrb, handle, mrb_intern_lit(mrb, "@ftp"), self);
+        if (put)
+          cache_touch(data, a->remote);
+        // No mruby code may run on the worker thread
+        FtpSetTrace(NULL, NULL, data->conn);
+        FtpSetLog(NULL, NULL, data->conn);
+        opt.cbFunc = async_progress;
+        opt.cbArg = a;
+        opt.bytesXferred = 1;
+        opt.idleTime = 0;
+        FtpSetCallback(&opt, data->conn);
+        data->async = a;
+        data->state = FTP_STATE_BUSY;
+#if defined(_WIN32)
+        async_main(a);
+#else
+        // Without a thread the transfer runs here, as FTP#get/put would
+        if (pthread_create(&a->thread, NULL, async_main, a) != 0) {
+          a->joined = 1;
+          async_main(a);
+        }
+#endif
+        return handle;
+      } else {
+        ALREADY_LOGIN_STATE_RAISE
+      }
+    } else {
+      // ftp state defined but not data->conn
+      mrb_raise(mrb, E_RUNTIME_ERROR,
+                "Unknown Error (unable to read connection internal state)");
+    }
+  } else {
+    // Raise an error if it cannot load data
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot load @data");
+  }
+}
+
+// FTP#get_async(remote, local, mode) -> FTP::Transfer
+static mrb_value mrb_ftp_get_async(mrb_state *mrb, mrb_value self) {
+  return async_start(mrb, self, 0);
+}
+
+// FTP#put_async(local, remote, mode) -> FTP::Transfer
+static mrb_value mrb_ftp_put_async(mrb_state *mrb, mrb_value self) {
+  return async_start(mrb, self, 1);
+}
+
+static mrb_value mrb_ftp_delete(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  // Error in case of not initialized @data not initialized.
+  CHECK_DATA_EXISTENCE
+  data = CONNECTION_DATA_STRUCT;
+  if (data) {
+    if (data->conn) {
+      if (data->state == FTP_STATE_LOGGED_IN) {
+        char *file_path;
         mrb_int file_len;
-        unsigned int file_size;
         mrb_get_args(mrb, "s", &file_path, &file_len);
         if (file_path) {
-          if (FtpSize((const char *)file_path, &file_size, FTPLIB_ASCII,
-                      data->conn) == FTPLIB_SUCCEED) {
-            return mrb_fixnum_value(file_size);
+          cache_touch(data, file_path);
+          if (GUARDED(FtpDelete((const char *)file_path, data->conn)) ==
+              FTPLIB_SUCCEED) {
+            return mrb_true_value();
           } else {
-            return mrb_nil_value();
+            return mrb_false_value();
           }
         } else {
           mrb_raise(mrb, E_RUNTIME_ERROR,
@@ -707,17 +1947,35 @@ static mrb_value mrb_ftp_size(mrb_state *mrb, mrb_value self) {
   }
 }
 
-static mrb_value mrb_ftp_close(mrb_state *mrb, mrb_value self) {
+static mrb_value mrb_ftp_rename(mrb_state *mrb, mrb_value self) {
   struct netbuf_data *data;
   // Error in case of not initialized @data not initialized.
   CHECK_DATA_EXISTENCE
   data = CONNECTION_DATA_STRUCT;
   if (data) {
     if (data->conn) {
-      // Quits from server no matter what the state!
-      FtpQuit(data->conn);
-      data->state = FTP_STATE_CLOSED;
-      return mrb_true_value();
+      if (data->state == FTP_STATE_LOGGED_IN) {
+        char *src_path, *dest_path;
+        mrb_int src_len, dest_len;
+        mrb_get_args(mrb, "ss", &src_path, &src_len, &dest_path, &dest_len);
+        if (src_path && dest_path) {
+          cache_touch(data, src_path);
+          cache_touch(data, dest_path);
+          if (GUARDED(FtpRename((const char *)src_path,
+                                (const char *)dest_path, data->conn)) ==
+              FTPLIB_SUCCEED) {
+            return mrb_true_value();
+          } else {
+            return mrb_false_value();
+          }
+        } else {
+          mrb_raise(
+              mrb, E_RUNTIME_ERROR,
+              "Cannot execute RENAME. Error reading src_path or dest_path");
+        }
+      } else {
+        ALREADY_LOGIN_STATE_RAISE
+      }
     } else {
       // ftp state defined but not data->conn
       mrb_raise(mrb, E_RUNTIME_ERROR,
@@ -729,15 +1987,49 @@ static mrb_value mrb_ftp_close(mrb_state *mrb, mrb_value self) {
   }
 }
 
-static mrb_value mrb_ftp_lastmessage(mrb_state *mrb, mrb_value self) {
+// FTP#size(path): size in bytes, nil when the server refuses SIZE
+static mrb_value mrb_ftp_size(mrb_state *mrb, mrb_value self) {
   struct netbuf_data *data;
   // Error in case of not initialized @data not initialized.
   CHECK_DATA_EXISTENCE
   data = CONNECTION_DATA_STRUCT;
   if (data) {
     if (data->conn) {
-      char *pMsg = FtpLastResponse(data->conn);
-      return mrb_str_new_cstr(mrb, pMsg);
+      if (data->state == FTP_STATE_LOGGED_IN) {
+        char *file_path, *key;
+        mrb_int file_len;
+        unsigned int file_size;
+        unsigned long long size = 0;
+        struct cache_entry *hit;
+        int result;
+        mrb_get_args(mrb, "s", &file_path, &file_len);
+        if (file_path) {
+          key = cache_key(data, file_path);
+          if ((hit = cache_get(data->cache, CACHE_SIZE, key)) != NULL) {
+            key_free(data, key);
+            return size_num_value(mrb, hit->num);
+          }
+          // IMAGE: in ASCII servers refuse SIZE or read the whole file
+          result = FtpSize((const char *)file_path, &file_size, FTPLIB_IMAGE,
+                           data->conn);
+          // file_size wraps past 4 GiB, the 213 reply has the whole size
+          if (result == FTPLIB_SUCCEED) {
+            size = strtoull(FtpLastResponse(data->conn) + 4, NULL, 10);
+            cache_put(data->cache, CACHE_SIZE, key, NULL, size);
+          }
+          key_free(data, key);
+          if (GUARDED(result) == FTPLIB_SUCCEED) {
+            return size_num_value(mrb, size);
+          } else {
+            return mrb_nil_value();
+          }
+        } else {
+          mrb_raise(mrb, E_RUNTIME_ERROR,
+                    "Cannot execute SIZE. Error reading file_path");
+        }
+      } else {
+        ALREADY_LOGIN_STATE_RAISE
+      }
     } else {
       // ftp state defined but not data->conn
       mrb_raise(mrb, E_RUNTIME_ERROR,
@@ -749,22 +2041,55 @@ static mrb_value mrb_ftp_lastmessage(mrb_state *mrb, mrb_value self) {
   }
 }
 
-static mrb_value mrb_ftp_state(mrb_state *mrb, mrb_value self) {
+// Modification time as the raw MDTM "YYYYMMDDHHMMSS" string (UTC)
+static mrb_value mrb_ftp_mdtm(mrb_state *mrb, mrb_value self) {
   struct netbuf_data *data;
-  // Return to be initialize if it finds @data = nil
-  if (CHECK_DATA_NIL) {
-    return mrb_fixnum_value(FTP_STATE_TO_INIT);
-  }
+  // Error in case of not initialized @data not initialized.
+  CHECK_DATA_EXISTENCE
   data = CONNECTION_DATA_STRUCT;
   if (data) {
-    return mrb_fixnum_value(data->state);
+    if (data->conn) {
+      if (data->state == FTP_STATE_LOGGED_IN) {
+        char *file_path, *key;
+        mrb_int file_len;
+        char date[MAX_STRING_LENGTH];
+        struct cache_entry *hit;
+        int result;
+        mrb_get_args(mrb, "s", &file_path, &file_len);
+        key = cache_key(data, file_path);
+        if ((hit = cache_get(data->cache, CACHE_MDTM, key)) != NULL) {
+          key_free(data, key);
+          return mrb_str_new_cstr(mrb, hit->text);
+        }
+        result = FtpModDate((const char *)file_path, date, sizeof(date) - 1,
+                            data->conn);
+        date[sizeof(date) - 1] = '\0';
+        // Reply line keeps its CRLF
+        date[strcspn(date, "\r\n")] = '\0';
+        if (result == FTPLIB_SUCCEED)
+          cache_put(data->cache, CACHE_MDTM, key, date, 0);
+        key_free(data, key);
+        if (GUARDED(result) == FTPLIB_SUCCEED) {
+          return mrb_str_new_cstr(mrb, date);
+        } else {
+          return mrb_nil_value();
+        }
+      } else {
+        ALREADY_LOGIN_STATE_RAISE
+      }
+    } else {
+      // ftp state defined but not data->conn
+      mrb_raise(mrb, E_RUNTIME_ERROR,
+                "Unknown Error (unable to read connection internal state)");
+    }
   } else {
     // Raise an error if it cannot load data
     mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot load @data");
   }
 }
 
-static mrb_value mrb_ftp_site(mrb_state *mrb, mrb_value self) {
+// Directory listing through MLSD: Hash of name => facts Hash
+static mrb_value mrb_ftp_mlsd(mrb_state *mrb, mrb_value self) {
   struct netbuf_data *data;
   // Error in case of not initialized @data not initialized.
   CHECK_DATA_EXISTENCE
@@ -772,19 +2097,26 @@ static mrb_value mrb_ftp_site(mrb_state *mrb, mrb_value self) {
   if (data) {
     if (data->conn) {
       if (data->state == FTP_STATE_LOGGED_IN) {
-        char *arg_str;
-        mrb_int file_len;
-        mrb_get_args(mrb, "s", &arg_str, &file_len);
-        if (arg_str) {
-          if (FtpSite((const char *)arg_str, data->conn) == FTPLIB_SUCCEED) {
-            return mrb_true_value();
-          } else {
-            return mrb_false_value();
-          }
-        } else {
-          mrb_raise(mrb, E_RUNTIME_ERROR,
-                    "Cannot execute SITE. Error reading arg_str");
+        char *path = (char *)".";
+        char line[MAX_STRING_LENGTH], *name;
+        netbuf *nData;
+        mrb_value list, facts;
+        int ai;
+        mrb_get_args(mrb, "|z", &path);
+        if (GUARDED(FtpAccess(path, FTPLIB_MLSD, FTPLIB_ASCII, data->conn,
+                              &nData)) != FTPLIB_SUCCEED)
+          mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot execute MLSD");
+        list = mrb_hash_new(mrb);
+        ai = mrb_gc_arena_save(mrb);
+        while (FtpRead(line, sizeof(line), nData) > 0) {
+          facts = facts_parse(mrb, line, &name, 1);
+          if (!mrb_nil_p(facts))
+            mrb_hash_set(mrb, list, mrb_str_new_cstr(mrb, name), facts);
+          mrb_gc_arena_restore(mrb, ai);
         }
+        if (GUARDED(FtpClose(nData)) != FTPLIB_SUCCEED)
+          mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot execute MLSD");
+        return list;
       } else {
         ALREADY_LOGIN_STATE_RAISE
       }
@@ -799,37 +2131,1521 @@ static mrb_value mrb_ftp_site(mrb_state *mrb, mrb_value self) {
   }
 }
 
-/* ------------------------------------------------------------------------*/
-void mrb_mruby_ftp_gem_init(mrb_state *mrb) {
-  struct RClass *ftp;
-  ftp = mrb_define_class(mrb, "FTP", mrb->object_class);
-  FtpInit();
-  mrb_define_method(mrb, ftp, "data_init", mrb_ftp_data_init, MRB_ARGS_NONE());
-
-  mrb_define_method(mrb, ftp, "open", mrb_ftp_connect, MRB_ARGS_OPT(1));
-  mrb_define_method(mrb, ftp, "login", mrb_ftp_login, MRB_ARGS_NONE());
+// FTP#listing_open(path, mlsd): starts an MLSD (or NLST) listing read
+// one entry at a time, see FTP#each_entry; the session is busy until
+// listing_close
+static mrb_value mrb_ftp_listing_open(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  char *path;
+  mrb_bool mlsd;
+  netbuf *nData;
+  CHECK_DATA_EXISTENCE
+  data = CONNECTION_DATA_STRUCT;
+  mrb_get_args(mrb, "zb", &path, &mlsd);
+  if (data == NULL || data->conn == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot load @data");
+  }
+  if (data->state != FTP_STATE_LOGGED_IN) {
+    ALREADY_LOGIN_STATE_RAISE
+  }
+  if (GUARDED(FtpAccess(path, mlsd ? FTPLIB_MLSD : FTPLIB_DIR, FTPLIB_ASCII,
+                        data->conn, &nData)) != FTPLIB_SUCCEED)
+    mrb_raise(mrb, E_RUNTIME_ERROR,
+              mlsd ? "Cannot execute MLSD" : "Cannot execute NLST");
+  data->entries = nData;
+  data->entries_mlsd = mlsd;
+  data->state = FTP_STATE_BUSY;
+  return mrb_true_value();
+}
 
-  mrb_define_method(mrb, ftp, "chdir", mrb_ftp_chdir, MRB_ARGS_REQ(1));
-  mrb_define_method(mrb, ftp, "cdup", mrb_ftp_cdup, MRB_ARGS_NONE());
-  mrb_define_method(mrb, ftp, "mkdir", mrb_ftp_mkdir, MRB_ARGS_REQ(1));
-  mrb_define_method(mrb, ftp, "rmdir", mrb_ftp_rmdir, MRB_ARGS_REQ(1));
-  mrb_define_method(mrb, ftp, "dir", mrb_ftp_dir, MRB_ARGS_OPT(1));
-  mrb_define_method(mrb, ftp, "nlst", mrb_ftp_nlst, MRB_ARGS_OPT(1));
-  mrb_define_method(mrb, ftp, "pwd", mrb_ftp_pwd, MRB_ARGS_NONE());
+// FTP#listing_next: [name, facts] of the next entry as it arrives, facts
+// being nil for NLST; nil at the end of the listing. "." and ".." are
+// skipped.
+static mrb_value mrb_ftp_listing_next(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  char line[MAX_STRING_LENGTH], *name, *p;
+  mrb_value facts = mrb_nil_value(), entry;
+  int n;
+  CHECK_DATA_EXISTENCE
+  data = CONNECTION_DATA_STRUCT;
+  if (data == NULL || data->entries == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "No listing open on this session");
+  }
+  for (;;) {
+    if ((n = GUARDED(FtpRead(line, sizeof(line), data->entries))) <= 0)
+      return mrb_nil_value();
+    if ((n == (int)sizeof(line) - 1) && (line[n - 1] != '\n')) {
+      // A line longer than the buffer: skip the rest of it rather than
+      // report its pieces as entries
+      while (((n = GUARDED(FtpRead(line, sizeof(line), data->entries))) ==
+              (int)sizeof(line) - 1) &&
+             (line[n - 1] != '\n'))
+        ;
+      if (n <= 0)
+        return mrb_nil_value();
+      continue;
+    }
+    if (data->entries_mlsd) {
+      facts = facts_parse(mrb, line, &name, 1);
+      if (mrb_nil_p(facts))
+        continue;
+    } else {
+      // Some servers list "dir/name"
+      line[strcspn(line, "\r\n")] = '\0';
+      name = (p = strrchr(line, '/')) ? p + 1 : line;
+      if (!*name || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        continue;
+    }
+    entry = mrb_ary_new_capa(mrb, 2);
+    mrb_ary_push(mrb, entry, mrb_str_new_cstr(mrb, name));
+    mrb_ary_push(mrb, entry, facts);
+    return entry;
+  }
+}
 
-  mrb_define_method(mrb, ftp, "put", mrb_ftp_put, MRB_ARGS_REQ(2));
-  mrb_define_method(mrb, ftp, "get", mrb_ftp_get, MRB_ARGS_REQ(2));
-  mrb_define_method(mrb, ftp, "delete", mrb_ftp_delete, MRB_ARGS_REQ(1));
-  mrb_define_method(mrb, ftp, "rename", mrb_ftp_rename, MRB_ARGS_REQ(2));
-  mrb_define_method(mrb, ftp, "size", mrb_ftp_size, MRB_ARGS_REQ(1));
+// FTP#listing_close: ends the listing, aborting it if entries are left,
+// and gives the session back; false if the server reported a failure
+static mrb_value mrb_ftp_listing_close(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  int rv;
+  CHECK_DATA_EXISTENCE
+  data = CONNECTION_DATA_STRUCT;
+  if (data == NULL || data->entries == NULL)
+    return mrb_false_value();
+  rv = FtpClose(data->entries);
+  data->entries = NULL;
+  data->state = FTP_STATE_LOGGED_IN;
+  session_apply(data);
+  return mrb_bool_value(GUARDED(rv) == FTPLIB_SUCCEED);
+}
 
-  mrb_define_method(mrb, ftp, "close", mrb_ftp_close, MRB_ARGS_NONE());
+// Marks in isdir the paths without a SIZE answer that CWD accepts. Each
+// CWD is followed by one back to the working directory, all pipelined,
+// so relative paths resolve against the same directory. Servers answer
+// SIZE and MDTM on directories with 550, as for a missing path.
+static void dir_probe(mrb_state *mrb, struct netbuf_data *data,
+                      mrb_value paths, char **replies, char *isdir) {
+  char home[MAX_STRING_LENGTH], **cmds, **back;
+  mrb_value path;
+  mrb_int i, n = RARRAY_LEN(paths);
+  int ncmds = 0, done, k;
+  if (data->cwd)
+    snprintf(home, sizeof(home), "%s", data->cwd);
+  else if (FtpPwd(home, sizeof(home), data->conn) == FTPLIB_SUCCEED)
+    cwd_set(data, home);
+  else
+    return;
+  cmds = (char **)calloc(2 * n, sizeof(char *));
+  back = (char **)calloc(2 * n, sizeof(char *));
+  if (!cmds || !back) {
+    free(cmds);
+    free(back);
+    return;
+  }
+  for (i = 0; i < n; i++) {
+    if (replies[2 * i + 1] && replies[2 * i + 1][0] == '2')
+      continue;
+    path = mrb_ary_ref(mrb, paths, i);
+    if (!(cmds[ncmds] = malloc(RSTRING_LEN(path) + 5)) ||
+        !(cmds[ncmds + 1] = malloc(strlen(home) + 5)))
+      break;
+    sprintf(cmds[ncmds], "CWD %.*s", (int)RSTRING_LEN(path),
+            RSTRING_PTR(path));
+    sprintf(cmds[ncmds + 1], "CWD %s", home);
+    ncmds += 2;
+  }
+  done = -1;
+  if (i == n && ncmds > 0)
+    done = FtpPipeline((const char **)cmds, ncmds, pipeline_reply, back,
+                       data->conn);
+  for (i = 0, k = 0; done == ncmds && i < n; i++) {
+    if (replies[2 * i + 1] && replies[2 * i + 1][0] == '2')
+      continue;
+    isdir[i] = (back[k][0] == '2');
+    // Where a CWD back failed, the session may be anywhere
+    if (back[k + 1][0] != '2')
+      cwd_set(data, NULL);
+    k += 2;
+  }
+  if (done != -1 && done != ncmds)
+    cwd_set(data, NULL);
+  for (k = 0; k < 2 * n; k++) {
+    free(cmds[k]);
+    free(back[k]);
+  }
+  free(cmds);
+  free(back);
+}
 
-  mrb_define_method(mrb, ftp, "last_message", mrb_ftp_lastmessage,
-                    MRB_ARGS_NONE());
-  mrb_define_method(mrb, ftp, "state", mrb_ftp_state, MRB_ARGS_NONE());
+// SIZE and MDTM for many paths, pipelined. Returns an Array with a facts
+// Hash per path: type "file" when SIZE answers, "dir" when CWD takes a
+// path that SIZE refused (see dir_probe()), "file" without a size when
+// only MDTM answers, nil when nothing does.
+static mrb_value stat_pipeline(mrb_state *mrb, struct netbuf_data *data,
+                               mrb_value paths) {
+  mrb_value list, facts, path;
+  char **cmds, **replies, *key, *isdir;
+  mrb_int i, n;
+  int ncmds, done, ai;
+  n = RARRAY_LEN(paths);
+  for (i = 0; i < n; i++) {
+    path = mrb_ary_ref(mrb, paths, i);
+    if (!mrb_string_p(path) ||
+        memchr(RSTRING_PTR(path), '\0', RSTRING_LEN(path)))
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "paths must be plain Strings");
+  }
+  ncmds = (int)(2 * n + 1);
+  cmds = (char **)calloc(ncmds, sizeof(char *));
+  replies = (char **)calloc(ncmds, sizeof(char *));
+  isdir = (char *)calloc(n + 1, 1);
+  if (!cmds || !replies || !isdir) {
+    free(cmds);
+    free(replies);
+    free(isdir);
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot allocate commands");
+  }
+  // SIZE is only meaningful in binary mode
+  cmds[0] = strdup("TYPE I");
+  for (i = 0; i < n; i++) {
+    path = mrb_ary_ref(mrb, paths, i);
+    cmds[2 * i + 1] = malloc(RSTRING_LEN(path) + 6);
+    cmds[2 * i + 2] = malloc(RSTRING_LEN(path) + 6);
+    if (cmds[2 * i + 1])
+      sprintf(cmds[2 * i + 1], "SIZE %.*s", (int)RSTRING_LEN(path),
+              RSTRING_PTR(path));
+    if (cmds[2 * i + 2])
+      sprintf(cmds[2 * i + 2], "MDTM %.*s", (int)RSTRING_LEN(path),
+              RSTRING_PTR(path));
+  }
+  for (i = 0; i < ncmds && cmds[i]; i++)
+    ;
+  done = (i == ncmds) ? FtpPipeline((const char **)cmds, ncmds,
+                                    pipeline_reply, replies, data->conn)
+                      : 0;
+  for (i = 0; i < ncmds; i++)
+    free(cmds[i]);
+  free(cmds);
+  if (done == ncmds)
+    dir_probe(mrb, data, paths, replies, isdir);
+  list = mrb_ary_new_capa(mrb, n);
+  ai = mrb_gc_arena_save(mrb);
+  for (i = 0; done == ncmds && i < n; i++) {
+    char *size = replies[2 * i + 1], *mdtm = replies[2 * i + 2];
+    int has_size = (size && size[0] == '2');
+    int has_mdtm = (mdtm && mdtm[0] == '2');
+    if (!has_size && !has_mdtm && !isdir[i]) {
+      mrb_ary_push(mrb, list, mrb_nil_value());
+      continue;
+    }
+    facts = mrb_hash_new(mrb);
+    mrb_hash_set(mrb, facts, mrb_str_new_lit(mrb, "type"),
+                 isdir[i] ? mrb_str_new_lit(mrb, "dir")
+                          : mrb_str_new_lit(mrb, "file"));
+    path = mrb_ary_ref(mrb, paths, i);
+    key = cache_key(data, mrb_str_to_cstr(mrb, path));
+    if (has_size) {
+      mrb_hash_set(mrb, facts, mrb_str_new_lit(mrb, "size"),
+                   size_value(mrb, size + 4));
+      cache_put(data->cache, CACHE_SIZE, key, NULL,
+                strtoull(size + 4, NULL, 10));
+    }
+    if (has_mdtm) {
+      mdtm[4 + strcspn(mdtm + 4, ". \r\n")] = '\0';
+      mrb_hash_set(mrb, facts, mrb_str_new_lit(mrb, "modify"),
+                   mrb_str_new_cstr(mrb, mdtm + 4));
+      cache_put(data->cache, CACHE_MDTM, key, mdtm + 4, 0);
+    }
+    key_free(data, key);
+    mrb_ary_push(mrb, list, facts);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  for (i = 0; i < ncmds; i++)
+    free(replies[i]);
+  free(replies);
+  free(isdir);
+  if (GUARDED(done == ncmds) != FTPLIB_SUCCEED)
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot execute SIZE/MDTM");
+  return list;
+}
 
-  mrb_define_method(mrb, ftp, "site", mrb_ftp_site, MRB_ARGS_REQ(1));
+// FTP#stat_batch(paths), see stat_pipeline()
+static mrb_value mrb_ftp_stat_batch(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  // Error in case of not initialized @data not initialized.
+  CHECK_DATA_EXISTENCE
+  data = CONNECTION_DATA_STRUCT;
+  if (data) {
+    if (data->conn) {
+      if (data->state == FTP_STATE_LOGGED_IN) {
+        mrb_value paths;
+        mrb_get_args(mrb, "A", &paths);
+        return stat_pipeline(mrb, data, paths);
+      } else {
+        ALREADY_LOGIN_STATE_RAISE
+      }
+    } else {
+      // ftp state defined but not data->conn
+      mrb_raise(mrb, E_RUNTIME_ERROR,
+                "Unknown Error (unable to read connection internal state)");
+    }
+  } else {
+    // Raise an error if it cannot load data
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot load @data");
+  }
+}
+
+// Facts of one path: a single MLST round trip when the server has it,
+// pipelined SIZE and MDTM otherwise. nil if the path does not exist.
+static mrb_value mrb_ftp_stat(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  // Error in case of not initialized @data not initialized.
+  CHECK_DATA_EXISTENCE
+  data = CONNECTION_DATA_STRUCT;
+  if (data) {
+    if (data->conn) {
+      if (data->state == FTP_STATE_LOGGED_IN) {
+        mrb_value path;
+        char line[MAX_STRING_LENGTH], *name;
+        mrb_get_args(mrb, "S", &path);
+        if (FtpFeatures(data->conn) & FTPLIB_FEAT_MLST) {
+          if (GUARDED(FtpMlst(mrb_str_to_cstr(mrb, path), line, sizeof(line),
+                              data->conn)) != FTPLIB_SUCCEED)
+            return mrb_nil_value();
+          return facts_parse(mrb, line, &name, 0);
+        }
+        return mrb_ary_ref(mrb,
+                           stat_pipeline(mrb, data,
+                                         mrb_ary_new_from_values(mrb, 1,
+                                                                 &path)),
+                           0);
+      } else {
+        ALREADY_LOGIN_STATE_RAISE
+      }
+    } else {
+      // ftp state defined but not data->conn
+      mrb_raise(mrb, E_RUNTIME_ERROR,
+                "Unknown Error (unable to read connection internal state)");
+    }
+  } else {
+    // Raise an error if it cannot load data
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot load @data");
+  }
+}
+
+// FTP#walk_parallel(root, workers) { |path, facts| }: directories are
+// listed by worker sessions, the block runs here as entries arrive.
+// Returns {:entries => count, :failed => [dirs]}, nil when worker
+// sessions are not available on this platform.
+static mrb_value mrb_ftp_walk_parallel(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  // Error in case of not initialized @data not initialized.
+  CHECK_DATA_EXISTENCE
+  data = CONNECTION_DATA_STRUCT;
+  if (data) {
+    if (data->conn) {
+      if (data->state == FTP_STATE_LOGGED_IN) {
+        char *root, line[MAX_STRING_LENGTH], *name;
+        const char *host, *user, *pass, *path, *facts_line;
+        mrb_int workers;
+        mrb_value blk, report, failed, facts;
+        struct callback_call call;
+        FtpWalk *w;
+        FtpWalkOptions opt;
+        mrb_int count = 0;
+        int rc, ai, mlsd;
+        mrb_get_args(mrb, "zi&", &root, &workers, &blk);
+        if (mrb_nil_p(blk))
+          mrb_raise(mrb, E_ARGUMENT_ERROR, "FTP#walk needs a block");
+        host = mrb_str_to_cstr(mrb, mrb_iv_get(mrb, self, data->sym_hostname));
+        user = mrb_str_to_cstr(mrb, mrb_iv_get(mrb, self, data->sym_user));
+        pass = mrb_str_to_cstr(mrb, mrb_iv_get(mrb, self, data->sym_pwd));
+        // Workers start where this session is, so relative roots agree
+        if (!data->cwd && FtpPwd(line, sizeof(line), data->conn))
+          cwd_set(data, line);
+        mlsd = (FtpFeatures(data->conn) & FTPLIB_FEAT_MLST) != 0;
+        // Workers list under this session's limits and diagnostics; their
+        // log lines are queued and yielded here, on this thread
+        opt.debug = data->debug;
+        opt.log = !mrb_nil_p(data->log_proc);
+        opt.rate_limit = data->rate_limit;
+        opt.pool = data->rate_pool;
+        opt.tls = data->tls;
+        GUARDED(1);
+        w = FtpWalkStart(host, user, pass, data->cwd, root, (int)workers,
+                         mlsd, &opt);
+        if (!w)
+          return mrb_nil_value();
+        failed = mrb_ary_new(mrb);
+        ai = mrb_gc_arena_save(mrb);
+        while ((rc = FtpWalkNext(w, &path, &facts_line)) > 0) {
+          // Every branch below leaves objects on the arena, skipped ones
+          // included; failed keeps its strings alive
+          mrb_gc_arena_restore(mrb, ai);
+          if (rc == FTPWALK_FAILED) {
+            mrb_ary_push(mrb, failed, mrb_str_new_cstr(mrb, path));
+            continue;
+          }
+          if (rc == FTPWALK_LOG) {
+            log_hook(data->conn, path, data);
+            continue;
+          }
+          strncpy(line, facts_line, sizeof(line) - 1);
+          line[sizeof(line) - 1] = '\0';
+          facts = facts_parse(mrb, line, &name, 1);
+          if (mrb_nil_p(facts))
+            continue;
+          call.proc = blk;
+          call.argc = 2;
+          call.argv[0] = mrb_str_new_cstr(mrb, path);
+          call.argv[1] = facts;
+          if (!callback_invoke(data, &call, NULL))
+            break;
+          count++;
+        }
+        FtpWalkStop(w);
+        GUARDED(1);
+        if (rc == FTPWALK_ERROR)
+          mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot log in walker sessions");
+        report = mrb_hash_new(mrb);
+        mrb_hash_set(mrb, report,
+                     mrb_symbol_value(mrb_intern_lit(mrb, "entries")),
+                     mrb_fixnum_value(count));
+        mrb_hash_set(mrb, report,
+                     mrb_symbol_value(mrb_intern_lit(mrb, "failed")), failed);
+        return report;
+      } else {
+        ALREADY_LOGIN_STATE_RAISE
+      }
+    } else {
+      // ftp state defined but not data->conn
+      mrb_raise(mrb, E_RUNTIME_ERROR,
+                "Unknown Error (unable to read connection internal state)");
+    }
+  } else {
+    // Raise an error if it cannot load data
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot load @data");
+  }
+}
+
+// Sets the modification time (YYYYMMDDHHMMSS, UTC) through MFMT
+static mrb_value mrb_ftp_set_mdtm(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  // Error in case of not initialized @data not initialized.
+  CHECK_DATA_EXISTENCE
+  data = CONNECTION_DATA_STRUCT;
+  if (data) {
+    if (data->conn) {
+      if (data->state == FTP_STATE_LOGGED_IN) {
+        char *path, *date;
+        mrb_get_args(mrb, "zz", &path, &date);
+        cache_touch(data, path);
+        if (GUARDED(FtpSetModDate(path, date, data->conn)) == FTPLIB_SUCCEED)
+          return mrb_true_value();
+        return mrb_false_value();
+      } else {
+        ALREADY_LOGIN_STATE_RAISE
+      }
+    } else {
+      // ftp state defined but not data->conn
+      mrb_raise(mrb, E_RUNTIME_ERROR,
+                "Unknown Error (unable to read connection internal state)");
+    }
+  } else {
+    // Raise an error if it cannot load data
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot load @data");
+  }
+}
+
+// Extensions announced in the FEAT reply, as an Array of Symbols
+static mrb_value mrb_ftp_features(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  // Error in case of not initialized @data not initialized.
+  CHECK_DATA_EXISTENCE
+  data = CONNECTION_DATA_STRUCT;
+  if (data) {
+    // FEAT on a connection a transfer owns would interleave with its replies
+    if (data->state == FTP_STATE_BUSY) {
+      mrb_raise(mrb, E_RUNTIME_ERROR, "Transfer in progress");
+    }
+    if (data->conn) {
+      mrb_value list = mrb_ary_new(mrb);
+      int feats = FtpFeatures(data->conn);
+      size_t i;
+      GUARDED(1);
+      for (i = 0; i < sizeof(feature_names) / sizeof(feature_names[0]); i++) {
+        if (feats & feature_names[i].bit)
+          mrb_ary_push(mrb, list,
+                       mrb_symbol_value(
+                           mrb_intern_cstr(mrb, feature_names[i].name)));
+      }
+      return list;
+    } else {
+      // ftp state defined but not data->conn
+      mrb_raise(mrb, E_RUNTIME_ERROR,
+                "Unknown Error (unable to read connection internal state)");
+    }
+  } else {
+    // Raise an error if it cannot load data
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot load @data");
+  }
+}
+
+static mrb_value mrb_ftp_close(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  // Error in case of not initialized @data not initialized.
+  CHECK_DATA_EXISTENCE
+  data = CONNECTION_DATA_STRUCT;
+  if (data) {
+    if (data->state == FTP_STATE_BUSY) {
+      mrb_raise(mrb, E_RUNTIME_ERROR, "Transfer in progress");
+    }
+    if (data->conn) {
+      // Quits from server no matter what the state!
+      FtpQuit(data->conn);
+      data->conn = NULL;
+      cwd_set(data, NULL);
+      cache_clear(data->cache);
+      data->state = FTP_STATE_CLOSED;
+      callback_guard(mrb, data, 1);
+      return mrb_true_value();
+    } else {
+      // ftp state defined but not data->conn
+      mrb_raise(mrb, E_RUNTIME_ERROR,
+                "Unknown Error (unable to read connection internal state)");
+    }
+  } else {
+    // Raise an error if it cannot load data
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot load @data");
+  }
+}
+
+static mrb_value mrb_ftp_lastmessage(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  // Error in case of not initialized @data not initialized.
+  CHECK_DATA_EXISTENCE
+  data = CONNECTION_DATA_STRUCT;
+  if (data) {
+    // A background transfer may be writing the response buffer
+    if (data->state == FTP_STATE_BUSY) {
+      mrb_raise(mrb, E_RUNTIME_ERROR, "Transfer in progress");
+    }
+    if (data->conn) {
+      char *pMsg = FtpLastResponse(data->conn);
+      return mrb_str_new_cstr(mrb, pMsg);
+    } else {
+      // ftp state defined but not data->conn
+      mrb_raise(mrb, E_RUNTIME_ERROR,
+                "Unknown Error (unable to read connection internal state)");
+    }
+  } else {
+    // Raise an error if it cannot load data
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot load @data");
+  }
+}
+
+static mrb_value mrb_ftp_state(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  // Return to be initialize if it finds @data = nil
+  if (CHECK_DATA_NIL) {
+    return mrb_fixnum_value(FTP_STATE_TO_INIT);
+  }
+  data = CONNECTION_DATA_STRUCT;
+  if (data) {
+    return mrb_fixnum_value(data->state);
+  } else {
+    // Raise an error if it cannot load data
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot load @data");
+  }
+}
+
+static mrb_value mrb_ftp_site(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  // Error in case of not initialized @data not initialized.
+  CHECK_DATA_EXISTENCE
+  data = CONNECTION_DATA_STRUCT;
+  if (data) {
+    if (data->conn) {
+      if (data->state == FTP_STATE_LOGGED_IN) {
+        char *arg_str;
+        mrb_int file_len;
+        mrb_get_args(mrb, "s", &arg_str, &file_len);
+        if (arg_str) {
+          // SITE commands may change anything
+          cache_clear(data->cache);
+          if (GUARDED(FtpSite((const char *)arg_str, data->conn)) ==
+              FTPLIB_SUCCEED) {
+            return mrb_true_value();
+          } else {
+            return mrb_false_value();
+          }
+        } else {
+          mrb_raise(mrb, E_RUNTIME_ERROR,
+                    "Cannot execute SITE. Error reading arg_str");
+        }
+      } else {
+        ALREADY_LOGIN_STATE_RAISE
+      }
+    } else {
+      // ftp state defined but not data->conn
+      mrb_raise(mrb, E_RUNTIME_ERROR,
+                "Unknown Error (unable to read connection internal state)");
+    }
+  } else {
+    // Raise an error if it cannot load data
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot load @data");
+  }
+}
+
+static mrb_value mrb_ftp_trace_start(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  mrb_value block = mrb_nil_value();
+  // Tracing can be enabled before FTP#open, to catch login too
+  if (CHECK_DATA_NIL) {
+    mrb_ftp_data_init(mrb, self);
+  }
+  data = CONNECTION_DATA_STRUCT;
+  if (data) {
+    mrb_get_args(mrb, "&", &block);
+    // The block is kept alive by the instance variable
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@trace_proc"), block);
+    data->trace_proc = block;
+    data->tracing = 1;
+    if (SESSION_IDLE(data))
+      FtpSetTrace(trace_hook, data, data->conn);
+    return self;
+  } else {
+    // Raise an error if it cannot load data
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot load @data");
+  }
+}
+
+static mrb_value mrb_ftp_trace_stop(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  // Error in case of not initialized @data not initialized.
+  CHECK_DATA_EXISTENCE
+  data = CONNECTION_DATA_STRUCT;
+  if (data) {
+    data->tracing = 0;
+    data->trace_proc = mrb_nil_value();
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@trace_proc"), mrb_nil_value());
+    if (SESSION_IDLE(data))
+      FtpSetTrace(NULL, NULL, data->conn);
+    return self;
+  } else {
+    // Raise an error if it cannot load data
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot load @data");
+  }
+}
+
+// Recorded events as [[name, usec, text], ...]; usec relative to the first
+static mrb_value mrb_ftp_trace_events(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  mrb_value rv;
+  size_t i;
+  // No events if never traced
+  if (CHECK_DATA_NIL) {
+    return mrb_ary_new(mrb);
+  }
+  data = CONNECTION_DATA_STRUCT;
+  if (data) {
+    rv = mrb_ary_new_capa(mrb, (mrb_int)data->trace_len);
+    for (i = 0; i < data->trace_len; i++) {
+      struct trace_event *ev = &data->trace_ev[i];
+      int ai = mrb_gc_arena_save(mrb);
+      mrb_value item[3];
+      item[0] = trace_event_sym(data, ev->event);
+      item[1] = mrb_float_value(mrb, (mrb_float)ev->usec);
+      item[2] = ev->text[0] ? mrb_str_new_cstr(mrb, ev->text) : mrb_nil_value();
+      mrb_ary_push(mrb, rv, mrb_ary_new_from_values(mrb, 3, item));
+      mrb_gc_arena_restore(mrb, ai);
+    }
+    return rv;
+  } else {
+    // Raise an error if it cannot load data
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot load @data");
+  }
+}
+
+// FTP#on_progress(bytes: N, idle_ms: M) { |xfered| ... }
+// Without a block, removes the callback.
+static mrb_value mrb_ftp_on_progress(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  mrb_value opts = mrb_nil_value(), block = mrb_nil_value();
+  // Callback can be set before FTP#open
+  if (CHECK_DATA_NIL) {
+    mrb_ftp_data_init(mrb, self);
+  }
+  data = CONNECTION_DATA_STRUCT;
+  if (data) {
+    mrb_value bytes = mrb_nil_value(), idle = mrb_nil_value();
+    mrb_get_args(mrb, "|H&", &opts, &block);
+    if (!mrb_nil_p(opts)) {
+      bytes = mrb_hash_get(mrb, opts,
+                           mrb_symbol_value(mrb_intern_lit(mrb, "bytes")));
+      idle = mrb_hash_get(mrb, opts,
+                          mrb_symbol_value(mrb_intern_lit(mrb, "idle_ms")));
+    }
+    data->progress_bytes =
+        mrb_nil_p(bytes) ? 0
+                         : (unsigned int)mrb_fixnum(mrb_Integer(mrb, bytes));
+    data->progress_idle =
+        mrb_nil_p(idle) ? 0 : (unsigned int)mrb_fixnum(mrb_Integer(mrb, idle));
+    if (!data->progress_bytes && !data->progress_idle)
+      data->progress_bytes = PROGRESS_DEFAULT_BYTES;
+    // The block is kept alive by the instance variable
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@progress_proc"), block);
+    data->progress_proc = block;
+    progress_apply(data);
+    return self;
+  } else {
+    // Raise an error if it cannot load data
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot load @data");
+  }
+}
+
+static mrb_value mrb_ftp_set_rate_limit(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  mrb_value limit;
+  // Limit can be set before FTP#open
+  if (CHECK_DATA_NIL) {
+    mrb_ftp_data_init(mrb, self);
+  }
+  data = CONNECTION_DATA_STRUCT;
+  if (data) {
+    mrb_get_args(mrb, "o", &limit);
+    data->rate_limit =
+        mrb_nil_p(limit) ? 0 : (long)mrb_fixnum(mrb_Integer(mrb, limit));
+    if (data->rate_limit < 0)
+      data->rate_limit = 0;
+    rate_apply(data);
+    return limit;
+  } else {
+    // Raise an error if it cannot load data
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot load @data");
+  }
+}
+
+static mrb_value mrb_ftp_rate_limit(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  if (CHECK_DATA_NIL) {
+    return mrb_nil_value();
+  }
+  data = CONNECTION_DATA_STRUCT;
+  if (data && data->rate_limit) {
+    return mrb_fixnum_value(data->rate_limit);
+  }
+  return mrb_nil_value();
+}
+
+// FTP#block_mode = true asks for MODE B, keeping one data connection
+// open across transfers; servers refusing it stay in stream mode
+static mrb_value mrb_ftp_set_block_mode(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  mrb_bool on;
+  // Mode can be chosen before FTP#open
+  if (CHECK_DATA_NIL) {
+    mrb_ftp_data_init(mrb, self);
+  }
+  data = CONNECTION_DATA_STRUCT;
+  if (data) {
+    mrb_get_args(mrb, "b", &on);
+    data->block_mode = on;
+    if (SESSION_IDLE(data))
+      FtpOptions(FTPLIB_BLOCKMODE, on, data->conn);
+    return mrb_bool_value(on);
+  } else {
+    // Raise an error if it cannot load data
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot load @data");
+  }
+}
+
+// FTP#io_uring = true downloads binary files through io_uring, with
+// several disk writes in flight; falls back silently where unsupported
+static mrb_value mrb_ftp_set_io_uring(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  mrb_bool on;
+  // Can be chosen before FTP#open
+  if (CHECK_DATA_NIL) {
+    mrb_ftp_data_init(mrb, self);
+  }
+  data = CONNECTION_DATA_STRUCT;
+  if (data) {
+    mrb_get_args(mrb, "b", &on);
+    data->io_uring = on;
+    if (SESSION_IDLE(data))
+      FtpOptions(FTPLIB_IOURING, on, data->conn);
+    return mrb_bool_value(on);
+  } else {
+    // Raise an error if it cannot load data
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot load @data");
+  }
+}
+
+static mrb_value mrb_ftp_io_uring(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  if (CHECK_DATA_NIL) {
+    return mrb_false_value();
+  }
+  data = CONNECTION_DATA_STRUCT;
+  return mrb_bool_value(data && data->io_uring);
+}
+
+// FTP#page_cache = :keep | :drop | :direct: what get/put leave in the
+// OS page cache; :drop evicts the local file behind the transfer, :direct
+// also writes binary downloads with O_DIRECT
+static mrb_value mrb_ftp_set_page_cache(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  mrb_sym mode;
+  int i, code = -1;
+  // Can be chosen before FTP#open
+  if (CHECK_DATA_NIL) {
+    mrb_ftp_data_init(mrb, self);
+  }
+  data = CONNECTION_DATA_STRUCT;
+  if (data) {
+    mrb_get_args(mrb, "n", &mode);
+    for (i = FTPLIB_PAGECACHE_KEEP; i <= FTPLIB_PAGECACHE_DIRECT; i++) {
+      if (mode == mrb_intern_cstr(mrb, page_cache_names[i]))
+        code = i;
+    }
+    if (code == -1) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR,
+                "Unknown page cache policy, use :keep, :drop or :direct");
+    }
+    data->page_cache = code;
+    if (SESSION_IDLE(data))
+      FtpOptions(FTPLIB_PAGECACHE, code, data->conn);
+    return mrb_symbol_value(mode);
+  } else {
+    // Raise an error if it cannot load data
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot load @data");
+  }
+}
+
+static mrb_value mrb_ftp_page_cache(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  int code = FTPLIB_PAGECACHE_KEEP;
+  if (!CHECK_DATA_NIL) {
+    data = CONNECTION_DATA_STRUCT;
+    if (data)
+      code = data->page_cache;
+  }
+  return mrb_symbol_value(mrb_intern_cstr(mrb, page_cache_names[code]));
+}
+
+// FTP#overlap = depth | nil: get/put do their disk I/O on a second thread,
+// with a ring of depth buffers so that disk and network work in parallel
+static mrb_value mrb_ftp_set_overlap(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  mrb_value depth;
+  mrb_int n;
+  // Can be chosen before FTP#open
+  if (CHECK_DATA_NIL) {
+    mrb_ftp_data_init(mrb, self);
+  }
+  data = CONNECTION_DATA_STRUCT;
+  if (data) {
+    mrb_get_args(mrb, "o", &depth);
+    n = mrb_test(depth) ? mrb_fixnum(mrb_Integer(mrb, depth)) : 0;
+    if ((n != 0) && ((n < 2) || (n > FTPLIB_OVERLAP_MAXDEPTH))) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR,
+                "Overlap depth must be between 2 and 64, or nil");
+    }
+    data->overlap = (int)n;
+    if (SESSION_IDLE(data))
+      FtpOptions(FTPLIB_OVERLAP, data->overlap, data->conn);
+    return depth;
+  } else {
+    // Raise an error if it cannot load data
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot load @data");
+  }
+}
+
+static mrb_value mrb_ftp_overlap(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  if (CHECK_DATA_NIL) {
+    return mrb_nil_value();
+  }
+  data = CONNECTION_DATA_STRUCT;
+  if (data && data->overlap) {
+    return mrb_fixnum_value(data->overlap);
+  }
+  return mrb_nil_value();
+}
+
+// FTP#overlap_block = bytes: size of each FTP#overlap buffer
+static mrb_value mrb_ftp_set_overlap_block(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  mrb_int n;
+  // Can be chosen before FTP#open
+  if (CHECK_DATA_NIL) {
+    mrb_ftp_data_init(mrb, self);
+  }
+  data = CONNECTION_DATA_STRUCT;
+  if (data) {
+    mrb_get_args(mrb, "i", &n);
+    if ((n < FTPLIB_OVERLAP_MINBLOCK) || (n > FTPLIB_OVERLAP_MAXBLOCK)) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR,
+                "Overlap block must be between 16 KiB and 16 MiB");
+    }
+    data->overlap_block = (int)n;
+    if (SESSION_IDLE(data))
+      FtpOptions(FTPLIB_OVERLAPBLOCK, data->overlap_block, data->conn);
+    return mrb_fixnum_value(n);
+  } else {
+    // Raise an error if it cannot load data
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot load @data");
+  }
+}
+
+static mrb_value mrb_ftp_overlap_block(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  if (CHECK_DATA_NIL) {
+    return mrb_nil_value();
+  }
+  data = CONNECTION_DATA_STRUCT;
+  if (data && data->overlap_block) {
+    return mrb_fixnum_value(data->overlap_block);
+  }
+  return mrb_nil_value();
+}
+
+// FTP#tls = true | :no_verify | false: AUTH TLS and PROT P at login;
+// :no_verify accepts any server certificate
+static mrb_value mrb_ftp_set_tls(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  mrb_value mode;
+  // Must be chosen before FTP#login
+  if (CHECK_DATA_NIL) {
+    mrb_ftp_data_init(mrb, self);
+  }
+  data = CONNECTION_DATA_STRUCT;
+  if (data) {
+    mrb_get_args(mrb, "o", &mode);
+    if (data->state == FTP_STATE_LOGGED_IN) {
+      mrb_raise(mrb, E_RUNTIME_ERROR, "Already logged in, set tls before");
+    }
+    if (mrb_symbol_p(mode) &&
+        mrb_symbol(mode) == mrb_intern_lit(mrb, "no_verify")) {
+      data->tls = FTPLIB_TLS_NOVERIFY + 1;
+    } else if (mrb_symbol_p(mode)) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "Unknown tls mode, use :no_verify");
+    } else {
+      data->tls = mrb_test(mode) ? 1 : 0;
+    }
+    return mode;
+  } else {
+    // Raise an error if it cannot load data
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot load @data");
+  }
+}
+
+static mrb_value mrb_ftp_tls(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  if (CHECK_DATA_NIL) {
+    return mrb_false_value();
+  }
+  data = CONNECTION_DATA_STRUCT;
+  if (data && data->tls == FTPLIB_TLS_NOVERIFY + 1) {
+    return mrb_symbol_value(mrb_intern_lit(mrb, "no_verify"));
+  }
+  return mrb_bool_value(data && data->tls);
+}
+
+// True once a transfer has run in MODE B
+static mrb_value mrb_ftp_block_mode(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  if (CHECK_DATA_NIL) {
+    return mrb_false_value();
+  }
+  data = CONNECTION_DATA_STRUCT;
+  return mrb_bool_value(data && SESSION_IDLE(data) && FtpBlockMode(data->conn));
+}
+
+// FTP#debug = level; 0 (or nil) silences the session's diagnostics
+static mrb_value mrb_ftp_set_debug(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  mrb_value level;
+  // Level can be set before FTP#open
+  if (CHECK_DATA_NIL) {
+    mrb_ftp_data_init(mrb, self);
+  }
+  data = CONNECTION_DATA_STRUCT;
+  if (data) {
+    mrb_get_args(mrb, "o", &level);
+    data->debug =
+        mrb_nil_p(level) ? 0 : (int)mrb_fixnum(mrb_Integer(mrb, level));
+    log_apply(data);
+    return level;
+  } else {
+    // Raise an error if it cannot load data
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot load @data");
+  }
+}
+
+static mrb_value mrb_ftp_debug(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  if (CHECK_DATA_NIL) {
+    return mrb_fixnum_value(0);
+  }
+  data = CONNECTION_DATA_STRUCT;
+  return mrb_fixnum_value(data ? data->debug : 0);
+}
+
+// FTP#on_log { |message| ... }
+// Without a block, diagnostics go back to stderr.
+static mrb_value mrb_ftp_on_log(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  mrb_value block = mrb_nil_value();
+  // Callback can be set before FTP#open
+  if (CHECK_DATA_NIL) {
+    mrb_ftp_data_init(mrb, self);
+  }
+  data = CONNECTION_DATA_STRUCT;
+  if (data) {
+    mrb_get_args(mrb, "&", &block);
+    // The block is kept alive by the instance variable
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@log_proc"), block);
+    data->log_proc = block;
+    log_apply(data);
+    return self;
+  } else {
+    // Raise an error if it cannot load data
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot load @data");
+  }
+}
+
+static mrb_value mrb_ftp_set_cache_ttl(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  mrb_value ttl;
+  double secs;
+  // Cache can be enabled before FTP#open
+  if (CHECK_DATA_NIL) {
+    mrb_ftp_data_init(mrb, self);
+  }
+  data = CONNECTION_DATA_STRUCT;
+  if (data) {
+    mrb_get_args(mrb, "o", &ttl);
+    secs = mrb_nil_p(ttl) ? 0.0 : (double)mrb_float(mrb_Float(mrb, ttl));
+    if (secs <= 0.0) {
+      cache_free(data->cache);
+      data->cache = NULL;
+    } else {
+      if (!data->cache &&
+          (data->cache = calloc(1, sizeof(struct ftp_cache))) == NULL)
+        mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot allocate cache");
+      data->cache->ttl = secs;
+    }
+    return ttl;
+  } else {
+    // Raise an error if it cannot load data
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot load @data");
+  }
+}
+
+static mrb_value mrb_ftp_cache_ttl(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  if (CHECK_DATA_NIL) {
+    return mrb_nil_value();
+  }
+  data = CONNECTION_DATA_STRUCT;
+  if (data && data->cache) {
+    return mrb_float_value(mrb, data->cache->ttl);
+  }
+  return mrb_nil_value();
+}
+
+static mrb_value mrb_ftp_cache_clear(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  if (CHECK_DATA_NIL) {
+    return self;
+  }
+  data = CONNECTION_DATA_STRUCT;
+  if (data) {
+    cache_clear(data->cache);
+  }
+  return self;
+}
+
+static mrb_value mrb_ftp_set_rate_pool(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  mrb_value pool;
+  // Pool can be set before FTP#open
+  if (CHECK_DATA_NIL) {
+    mrb_ftp_data_init(mrb, self);
+  }
+  data = CONNECTION_DATA_STRUCT;
+  if (data) {
+    mrb_get_args(mrb, "o", &pool);
+    if (mrb_nil_p(pool)) {
+      data->rate_pool = NULL;
+    } else {
+      data->rate_pool = DATA_GET_PTR(mrb, pool, &rate_pool_type, FtpRatePool);
+    }
+    // The pool is kept alive by the instance variable
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@rate_pool"), pool);
+    rate_apply(data);
+    return pool;
+  } else {
+    // Raise an error if it cannot load data
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot load @data");
+  }
+}
+
+// FTP::RatePool.new(bytes_per_second, burst_bytes = nil)
+static mrb_value mrb_rate_pool_init(mrb_state *mrb, mrb_value self) {
+  mrb_int rate, burst = 0;
+  FtpRatePool *pool;
+  mrb_get_args(mrb, "i|i", &rate, &burst);
+  // Sessions may point at the pool: it lives as long as the object
+  if (DATA_PTR(self)) {
+    mrb_raise(mrb, E_RUNTIME_ERROR,
+              "Rate pool already initialized, use set_rate");
+  }
+  pool = FtpRatePoolNew((long)rate, (long)burst);
+  if (!pool) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "Rate must be a positive byte count");
+  }
+  DATA_TYPE(self) = &rate_pool_type;
+  DATA_PTR(self) = pool;
+  return self;
+}
+
+static mrb_value mrb_rate_pool_set_rate(mrb_state *mrb, mrb_value self) {
+  mrb_int rate, burst = 0;
+  FtpRatePool *pool = DATA_GET_PTR(mrb, self, &rate_pool_type, FtpRatePool);
+  mrb_get_args(mrb, "i|i", &rate, &burst);
+  if (!FtpRatePoolSet(pool, (long)rate, (long)burst)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "Rate must be a positive byte count");
+  }
+  return self;
+}
+
+// Reaps the transfer into its session once finished; returns done
+static int transfer_settle(mrb_state *mrb, mrb_value self,
+                           struct async_xfer *a) {
+  mrb_value ftp;
+  if (!async_done(a))
+    return 0;
+  ftp = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "@ftp"));
+  async_settle((struct netbuf_data *)DATA_PTR(ftp));
+  return 1;
+}
+
+static mrb_value mrb_transfer_done(mrb_state *mrb, mrb_value self) {
+  struct async_xfer *a =
+      DATA_GET_PTR(mrb, self, &transfer_type, struct async_xfer);
+  return mrb_bool_value(transfer_settle(mrb, self, a));
+}
+
+// Transfer#wait(timeout = nil): true once finished, false on timeout
+static mrb_value mrb_transfer_wait(mrb_state *mrb, mrb_value self) {
+  struct async_xfer *a =
+      DATA_GET_PTR(mrb, self, &transfer_type, struct async_xfer);
+  mrb_value timeout = mrb_nil_value();
+  mrb_get_args(mrb, "|o", &timeout);
+#if !defined(_WIN32)
+  {
+    struct timespec ts;
+    double secs = 0;
+    if (!mrb_nil_p(timeout)) {
+      secs = (double)mrb_float(mrb_Float(mrb, timeout));
+      if (secs < 0)
+        secs = 0;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec += (time_t)secs;
+      ts.tv_nsec += (long)((secs - (double)(time_t)secs) * 1e9);
+      if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+      }
+    }
+    async_lock(a);
+    while (!a->done) {
+      if (mrb_nil_p(timeout))
+        pthread_cond_wait(&a->cond, &a->lock);
+      else if (pthread_cond_timedwait(&a->cond, &a->lock, &ts) == ETIMEDOUT)
+        break;
+    }
+    async_unlock(a);
+  }
+#endif
+  return mrb_bool_value(transfer_settle(mrb, self, a));
+}
+
+static mrb_value mrb_transfer_bytes(mrb_state *mrb, mrb_value self) {
+  struct async_xfer *a =
+      DATA_GET_PTR(mrb, self, &transfer_type, struct async_xfer);
+  fsz_t bytes;
+  async_lock(a);
+  bytes = a->bytes;
+  async_unlock(a);
+  if (bytes > (fsz_t)MRB_INT_MAX)
+    return mrb_float_value(mrb, (mrb_float)bytes);
+  return mrb_fixnum_value((mrb_int)bytes);
+}
+
+// Transfer#result: nil while running, then true or false as FTP#get/put
+static mrb_value mrb_transfer_result(mrb_state *mrb, mrb_value self) {
+  struct async_xfer *a =
+      DATA_GET_PTR(mrb, self, &transfer_type, struct async_xfer);
+  if (!transfer_settle(mrb, self, a))
+    return mrb_nil_value();
+  return mrb_bool_value(a->result == FTPLIB_SUCCEED);
+}
+
+// Transfer#cancel: asks the worker to stop at the next buffer
+static mrb_value mrb_transfer_cancel(mrb_state *mrb, mrb_value self) {
+  struct async_xfer *a =
+      DATA_GET_PTR(mrb, self, &transfer_type, struct async_xfer);
+  async_lock(a);
+  a->cancel = 1;
+  async_unlock(a);
+  return self;
+}
+
+// FTP#checksum = :crc32 | :md5 | :sha256 | nil
+static mrb_value mrb_ftp_set_checksum(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  mrb_value algo;
+  int i, code = FTPLIB_HASH_NONE;
+  // Algorithm can be set before FTP#open
+  if (CHECK_DATA_NIL) {
+    mrb_ftp_data_init(mrb, self);
+  }
+  data = CONNECTION_DATA_STRUCT;
+  if (data) {
+    mrb_get_args(mrb, "o", &algo);
+    if (!mrb_nil_p(algo)) {
+      if (!mrb_symbol_p(algo)) {
+        mrb_raise(mrb, E_TYPE_ERROR, "Checksum must be a Symbol or nil");
+      }
+      for (i = 1; i <= FTPLIB_HASH_SHA256; i++) {
+        if (mrb_symbol(algo) == mrb_intern_cstr(mrb, hash_algo_names[i]))
+          code = i;
+      }
+      if (code == FTPLIB_HASH_NONE) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR,
+                  "Unknown checksum, use :crc32, :md5 or :sha256");
+      }
+    }
+    data->hash_algo = code;
+    if (SESSION_IDLE(data))
+      FtpOptions(FTPLIB_HASHALGO, code, data->conn);
+    return algo;
+  } else {
+    // Raise an error if it cannot load data
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot load @data");
+  }
+}
+
+static mrb_value mrb_ftp_checksum(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  if (CHECK_DATA_NIL) {
+    return mrb_nil_value();
+  }
+  data = CONNECTION_DATA_STRUCT;
+  if (data && data->hash_algo != FTPLIB_HASH_NONE) {
+    return mrb_symbol_value(
+        mrb_intern_cstr(mrb, hash_algo_names[data->hash_algo]));
+  }
+  return mrb_nil_value();
+}
+
+// Hex digest of the last get/put, nil if none was computed
+static mrb_value mrb_ftp_last_digest(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  char hex[FTPHASH_HEXSIZ];
+  if (CHECK_DATA_NIL) {
+    return mrb_nil_value();
+  }
+  data = CONNECTION_DATA_STRUCT;
+  if (data && SESSION_IDLE(data) &&
+      FtpDigest(hex, sizeof(hex), data->conn) != FTPLIB_DIGEST_NONE) {
+    return mrb_str_new_cstr(mrb, hex);
+  }
+  return mrb_nil_value();
+}
+
+// :verified, :mismatch, :local (server could not check) or nil
+static mrb_value mrb_ftp_last_digest_status(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  if (CHECK_DATA_NIL) {
+    return mrb_nil_value();
+  }
+  data = CONNECTION_DATA_STRUCT;
+  if (data && SESSION_IDLE(data)) {
+    switch (FtpDigest(NULL, 0, data->conn)) {
+    case FTPLIB_DIGEST_VERIFIED:
+      return mrb_symbol_value(mrb_intern_lit(mrb, "verified"));
+    case FTPLIB_DIGEST_MISMATCH:
+      return mrb_symbol_value(mrb_intern_lit(mrb, "mismatch"));
+    case FTPLIB_DIGEST_LOCAL:
+      return mrb_symbol_value(mrb_intern_lit(mrb, "local"));
+    default:
+      break;
+    }
+  }
+  return mrb_nil_value();
+}
+
+static mrb_value mrb_ftp_trace_clear(mrb_state *mrb, mrb_value self) {
+  struct netbuf_data *data;
+  if (!CHECK_DATA_NIL) {
+    data = CONNECTION_DATA_STRUCT;
+    if (data)
+      data->trace_len = 0;
+  }
+  return self;
+}
+
+/* ------------------------------------------------------------------------*/
+// FTP::Local, the local side of FTP#mirror and FTP#sync_up. Entries use
+// the same facts as FTP#mlsd so that both trees compare directly.
+
+// Formats a time_t as the MDTM "YYYYMMDDHHMMSS" UTC stamp
+static void local_stamp(time_t t, char *buf, size_t max) {
+  struct tm tm;
+#ifdef _WIN32
+  gmtime_s(&tm, &t);
+#else
+  gmtime_r(&t, &tm);
+#endif
+  strftime(buf, max, "%Y%m%d%H%M%S", &tm);
+}
+
+// FTP::Local.entries(dir): Hash of name => facts, nil if unreadable
+static mrb_value mrb_local_entries(mrb_state *mrb, mrb_value klass) {
+  char *dir, path[MAX_STRING_LENGTH], stamp[16];
+  DIR *d;
+  struct dirent *de;
+  struct stat st;
+  mrb_value list, facts;
+  int ai;
+  mrb_get_args(mrb, "z", &dir);
+  if ((d = opendir(dir)) == NULL)
+    return mrb_nil_value();
+  list = mrb_hash_new(mrb);
+  ai = mrb_gc_arena_save(mrb);
+  while ((de = readdir(d)) != NULL) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+    if (stat(path, &st) != 0)
+      continue;
+    if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))
+      continue;
+    facts = mrb_hash_new(mrb);
+    mrb_hash_set(mrb, facts, mrb_str_new_lit(mrb, "type"),
+                 S_ISDIR(st.st_mode) ? mrb_str_new_lit(mrb, "dir")
+                                     : mrb_str_new_lit(mrb, "file"));
+    if (S_ISREG(st.st_mode)) {
+      snprintf(path, sizeof(path), "%llu", (unsigned long long)st.st_size);
+      mrb_hash_set(mrb, facts, mrb_str_new_lit(mrb, "size"),
+                   size_value(mrb, path));
+    }
+    local_stamp(st.st_mtime, stamp, sizeof(stamp));
+    mrb_hash_set(mrb, facts, mrb_str_new_lit(mrb, "modify"),
+                 mrb_str_new_cstr(mrb, stamp));
+    mrb_hash_set(mrb, list, mrb_str_new_cstr(mrb, de->d_name), facts);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  closedir(d);
+  return list;
+}
+
+// FTP::Local.mkdir(path): true if created or already a directory
+static mrb_value mrb_local_mkdir(mrb_state *mrb, mrb_value klass) {
+  char *path;
+  struct stat st;
+  mrb_get_args(mrb, "z", &path);
+#ifdef _WIN32
+  if (mkdir(path) == 0)
+#else
+  if (mkdir(path, 0777) == 0)
+#endif
+    return mrb_true_value();
+  return mrb_bool_value(stat(path, &st) == 0 && S_ISDIR(st.st_mode));
+}
+
+// FTP::Local.remove(path): deletes a file or an empty directory
+static mrb_value mrb_local_remove(mrb_state *mrb, mrb_value klass) {
+  char *path;
+  mrb_get_args(mrb, "z", &path);
+  return mrb_bool_value(remove(path) == 0);
+}
+
+// FTP::Local.utime(path, stamp): sets the modification time from an
+// MDTM "YYYYMMDDHHMMSS" UTC stamp
+static mrb_value mrb_local_utime(mrb_state *mrb, mrb_value klass) {
+  char *path, *stamp;
+  struct tm tm;
+  struct utimbuf ut;
+  mrb_get_args(mrb, "zz", &path, &stamp);
+  memset(&tm, 0, sizeof(tm));
+  if (sscanf(stamp, "%4d%2d%2d%2d%2d%2d", &tm.tm_year, &tm.tm_mon,
+             &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "Stamp must be YYYYMMDDHHMMSS");
+  tm.tm_year -= 1900;
+  tm.tm_mon -= 1;
+#ifdef _WIN32
+  ut.modtime = _mkgmtime(&tm);
+#else
+  ut.modtime = timegm(&tm);
+#endif
+  ut.actime = ut.modtime;
+  return mrb_bool_value(utime(path, &ut) == 0);
+}
+
+void mrb_mruby_ftp_gem_init(mrb_state *mrb) {
+  struct RClass *ftp, *pool, *local, *xfer;
+  ftp = mrb_define_class(mrb, "FTP", mrb->object_class);
+  MRB_SET_INSTANCE_TT(ftp, MRB_TT_DATA);
+  FtpInit();
+  mrb_define_method(mrb, ftp, "data_init", mrb_ftp_data_init, MRB_ARGS_NONE());
+
+  mrb_define_method(mrb, ftp, "open", mrb_ftp_connect, MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, ftp, "login", mrb_ftp_login, MRB_ARGS_NONE());
+
+  mrb_define_method(mrb, ftp, "chdir", mrb_ftp_chdir, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, ftp, "cdup", mrb_ftp_cdup, MRB_ARGS_NONE());
+  mrb_define_method(mrb, ftp, "mkdir", mrb_ftp_mkdir, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, ftp, "rmdir", mrb_ftp_rmdir, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, ftp, "dir", mrb_ftp_dir, MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, ftp, "nlst", mrb_ftp_nlst, MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, ftp, "pwd", mrb_ftp_pwd, MRB_ARGS_NONE());
+
+  mrb_define_method(mrb, ftp, "put", mrb_ftp_put, MRB_ARGS_ARG(3, 1));
+  mrb_define_method(mrb, ftp, "get", mrb_ftp_get, MRB_ARGS_ARG(3, 1));
+  mrb_define_method(mrb, ftp, "copy_to", mrb_ftp_copy_to, MRB_ARGS_REQ(4));
+  mrb_define_method(mrb, ftp, "stats", mrb_ftp_stats, MRB_ARGS_NONE());
+  mrb_define_method(mrb, ftp, "read_range", mrb_ftp_read_range,
+                    MRB_ARGS_REQ(3));
+  mrb_define_method(mrb, ftp, "append_open", mrb_ftp_append_open,
+                    MRB_ARGS_REQ(3));
+  mrb_define_method(mrb, ftp, "append_write", mrb_ftp_append_write,
+                    MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, ftp, "append_flush", mrb_ftp_append_flush,
+                    MRB_ARGS_NONE());
+  mrb_define_method(mrb, ftp, "append_rotate", mrb_ftp_append_rotate,
+                    MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, ftp, "append_close", mrb_ftp_append_close,
+                    MRB_ARGS_NONE());
+  mrb_define_method(mrb, ftp, "append_stats", mrb_ftp_append_stats,
+                    MRB_ARGS_NONE());
+  mrb_define_method(mrb, ftp, "get_async", mrb_ftp_get_async, MRB_ARGS_REQ(3));
+  mrb_define_method(mrb, ftp, "put_async", mrb_ftp_put_async, MRB_ARGS_REQ(3));
+  mrb_define_method(mrb, ftp, "delete", mrb_ftp_delete, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, ftp, "rename", mrb_ftp_rename, MRB_ARGS_REQ(2));
+  mrb_define_method(mrb, ftp, "size", mrb_ftp_size, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, ftp, "mdtm", mrb_ftp_mdtm, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, ftp, "set_mdtm", mrb_ftp_set_mdtm, MRB_ARGS_REQ(2));
+  mrb_define_method(mrb, ftp, "mlsd", mrb_ftp_mlsd, MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, ftp, "listing_open", mrb_ftp_listing_open,
+                    MRB_ARGS_REQ(2));
+  mrb_define_method(mrb, ftp, "listing_next", mrb_ftp_listing_next,
+                    MRB_ARGS_NONE());
+  mrb_define_method(mrb, ftp, "listing_close", mrb_ftp_listing_close,
+                    MRB_ARGS_NONE());
+  mrb_define_method(mrb, ftp, "stat_batch", mrb_ftp_stat_batch,
+                    MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, ftp, "stat", mrb_ftp_stat, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, ftp, "walk_parallel", mrb_ftp_walk_parallel,
+                    MRB_ARGS_REQ(2) | MRB_ARGS_BLOCK());
+  mrb_define_method(mrb, ftp, "features", mrb_ftp_features, MRB_ARGS_NONE());
+
+  mrb_define_method(mrb, ftp, "close", mrb_ftp_close, MRB_ARGS_NONE());
+
+  mrb_define_method(mrb, ftp, "last_message", mrb_ftp_lastmessage,
+                    MRB_ARGS_NONE());
+  mrb_define_method(mrb, ftp, "state", mrb_ftp_state, MRB_ARGS_NONE());
+
+  mrb_define_method(mrb, ftp, "site", mrb_ftp_site, MRB_ARGS_REQ(1));
+
+  mrb_define_method(mrb, ftp, "on_progress", mrb_ftp_on_progress,
+                    MRB_ARGS_OPT(1) | MRB_ARGS_BLOCK());
+
+  mrb_define_method(mrb, ftp, "rate_limit=", mrb_ftp_set_rate_limit,
+                    MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, ftp, "rate_limit", mrb_ftp_rate_limit,
+                    MRB_ARGS_NONE());
+  mrb_define_method(mrb, ftp, "rate_pool=", mrb_ftp_set_rate_pool,
+                    MRB_ARGS_REQ(1));
+
+  mrb_define_method(mrb, ftp, "block_mode=", mrb_ftp_set_block_mode,
+                    MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, ftp, "block_mode", mrb_ftp_block_mode,
+                    MRB_ARGS_NONE());
+  mrb_define_method(mrb, ftp, "io_uring=", mrb_ftp_set_io_uring,
+                    MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, ftp, "io_uring", mrb_ftp_io_uring, MRB_ARGS_NONE());
+  mrb_define_method(mrb, ftp, "page_cache=", mrb_ftp_set_page_cache,
+                    MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, ftp, "page_cache", mrb_ftp_page_cache,
+                    MRB_ARGS_NONE());
+  mrb_define_method(mrb, ftp, "overlap=", mrb_ftp_set_overlap,
+                    MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, ftp, "overlap", mrb_ftp_overlap, MRB_ARGS_NONE());
+  mrb_define_method(mrb, ftp, "overlap_block=", mrb_ftp_set_overlap_block,
+                    MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, ftp, "overlap_block", mrb_ftp_overlap_block,
+                    MRB_ARGS_NONE());
+  mrb_define_method(mrb, ftp, "tls=", mrb_ftp_set_tls, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, ftp, "tls", mrb_ftp_tls, MRB_ARGS_NONE());
+  mrb_define_method(mrb, ftp, "debug=", mrb_ftp_set_debug, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, ftp, "debug", mrb_ftp_debug, MRB_ARGS_NONE());
+  mrb_define_method(mrb, ftp, "on_log", mrb_ftp_on_log, MRB_ARGS_BLOCK());
+
+  mrb_define_method(mrb, ftp, "cache_ttl=", mrb_ftp_set_cache_ttl,
+                    MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, ftp, "cache_ttl", mrb_ftp_cache_ttl, MRB_ARGS_NONE());
+  mrb_define_method(mrb, ftp, "cache_clear", mrb_ftp_cache_clear,
+                    MRB_ARGS_NONE());
+
+  mrb_define_method(mrb, ftp, "checksum=", mrb_ftp_set_checksum,
+                    MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, ftp, "checksum", mrb_ftp_checksum, MRB_ARGS_NONE());
+  mrb_define_method(mrb, ftp, "last_digest", mrb_ftp_last_digest,
+                    MRB_ARGS_NONE());
+  mrb_define_method(mrb, ftp, "last_digest_status", mrb_ftp_last_digest_status,
+                    MRB_ARGS_NONE());
+
+  pool = mrb_define_class_under(mrb, ftp, "RatePool", mrb->object_class);
+  MRB_SET_INSTANCE_TT(pool, MRB_TT_DATA);
+  mrb_define_method(mrb, pool, "initialize", mrb_rate_pool_init,
+                    MRB_ARGS_ARG(1, 1));
+  mrb_define_method(mrb, pool, "set_rate", mrb_rate_pool_set_rate,
+                    MRB_ARGS_ARG(1, 1));
+
+  // Handles returned by get_async/put_async
+  xfer = mrb_define_class_under(mrb, ftp, "Transfer", mrb->object_class);
+  MRB_SET_INSTANCE_TT(xfer, MRB_TT_DATA);
+  mrb_undef_class_method(mrb, xfer, "new");
+  mrb_define_method(mrb, xfer, "done?", mrb_transfer_done, MRB_ARGS_NONE());
+  mrb_define_method(mrb, xfer, "wait", mrb_transfer_wait, MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, xfer, "bytes_transferred", mrb_transfer_bytes,
+                    MRB_ARGS_NONE());
+  mrb_define_method(mrb, xfer, "result", mrb_transfer_result, MRB_ARGS_NONE());
+  mrb_define_method(mrb, xfer, "cancel", mrb_transfer_cancel, MRB_ARGS_NONE());
+
+  mrb_define_method(mrb, ftp, "trace_start", mrb_ftp_trace_start,
+                    MRB_ARGS_BLOCK());
+  mrb_define_method(mrb, ftp, "trace_stop", mrb_ftp_trace_stop,
+                    MRB_ARGS_NONE());
+  mrb_define_method(mrb, ftp, "trace_events", mrb_ftp_trace_events,
+                    MRB_ARGS_NONE());
+  mrb_define_method(mrb, ftp, "trace_clear", mrb_ftp_trace_clear,
+                    MRB_ARGS_NONE());
+
+  local = mrb_define_module_under(mrb, ftp, "Local");
+  mrb_define_module_function(mrb, local, "entries", mrb_local_entries,
+                             MRB_ARGS_REQ(1));
+  mrb_define_module_function(mrb, local, "mkdir", mrb_local_mkdir,
+                             MRB_ARGS_REQ(1));
+  mrb_define_module_function(mrb, local, "remove", mrb_local_remove,
+                             MRB_ARGS_REQ(1));
+  mrb_define_module_function(mrb, local, "utime", mrb_local_utime,
+                             MRB_ARGS_REQ(2));
 }
 
 void mrb_mruby_ftp_gem_final(mrb_state *mrb) {}
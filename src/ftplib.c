@@ -17,22 +17,30 @@
 /* 									   */
 /***************************************************************************/
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* O_DIRECT, sync_file_range() */
+#endif
 #if defined(__unix__) || defined(__VMS)
 #include <unistd.h>
 #endif
 #if defined(_WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
 #include <windows.h>
 #endif
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <ctype.h>
+#include <time.h>
 #if defined(__unix__) || defined(__APPLE__)
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #elif defined(VMS)
@@ -41,17 +49,26 @@
 #include <in.h>
 #include <netdb.h>
 #include <inet.h>
-#elif defined(_WIN32)
-#include <winsock.h>
 #endif
-#if defined(__APPLE__)
-#undef _REENTRANT
+#if defined(__unix__) || defined(__APPLE__)
 #include <sys/uio.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
+#endif
+#if !defined(_WIN32)
+#include <pthread.h>
+#endif
+#if defined(FTPLIB_TLS)
+#include <openssl/ssl.h>
+#include <openssl/err.h>
 #endif
 
 #define BUILDING_LIBRARY
 #include "ftplib.h"
+#include "ftphash.h"
+#include "ftpuring.h"
+#include "ftpzip.h"
 
 #if defined(__UINT64_MAX) && !defined(PRIu64)
 #if ULONG_MAX == __UINT32_MAX
@@ -70,7 +87,21 @@
 #define FTPLIB_BUFSIZ 8192
 #define RESPONSE_BUFSIZ 1024
 #define TMP_BUFSIZ 1024
+#define FTPLIB_PIPEDEPTH 32 /* commands in flight in FtpPipeline() */
 #define ACCEPT_TIMEOUT 30
+#define TLS_LINGER 10 /* seconds an upload waits for the server to close */
+#define URING_DEPTH 8       /* io_uring buffers, one socket read in flight */
+#define URING_BUFSIZ 65536
+#define CACHE_WINDOW (8 << 20)    /* page cache dropped this far behind */
+#define DIRECT_BUFSIZ (1 << 20)   /* O_DIRECT write size */
+#define DIRECT_ALIGN 4096
+#define OVERLAP_BLOCK 65536 /* default FTPLIB_OVERLAPBLOCK */
+
+/* MODE B block header: descriptor byte and a 16 bit byte count */
+#define BLOCK_HDRSIZ 3
+#define BLOCK_MAXLEN 65535
+#define BLOCK_EOF 64     /* last block of the file */
+#define BLOCK_RESTART 16 /* block holds a restart marker, not data */
 
 #define FTPLIB_CONTROL 0
 #define FTPLIB_READ 1
@@ -80,6 +111,29 @@
 #define FTPLIB_DEFMODE FTPLIB_PASSIVE
 #endif
 
+#if defined(_WIN32)
+typedef CRITICAL_SECTION ftplib_mutex;
+#define mutex_init(m) InitializeCriticalSection(m)
+#define mutex_lock(m) EnterCriticalSection(m)
+#define mutex_unlock(m) LeaveCriticalSection(m)
+#define mutex_destroy(m) DeleteCriticalSection(m)
+#else
+typedef pthread_mutex_t ftplib_mutex;
+#define mutex_init(m) pthread_mutex_init(m, NULL)
+#define mutex_lock(m) pthread_mutex_lock(m)
+#define mutex_unlock(m) pthread_mutex_unlock(m)
+#define mutex_destroy(m) pthread_mutex_destroy(m)
+#endif
+
+/* token bucket limiting bytes per second, possibly shared by sessions */
+struct FtpRatePool {
+  ftplib_mutex lock;
+  double rate;   /* bytes per second */
+  double burst;  /* bucket depth in bytes */
+  double tokens; /* may go negative: the debt is slept off */
+  uint64_t last; /* clock_usec() at last refill */
+};
+
 struct NetBuf {
   char *cput, *cget;
   int handle;
@@ -95,6 +149,51 @@ struct NetBuf {
   unsigned long int xfered;
   unsigned long int cbbytes;
   unsigned long int xfered1;
+  int cbabort;
+  FtpRatePool *rate; /* own limit, allocated by the control connection */
+  FtpRatePool *pool; /* shared limit, owned by the application */
+  FtpTraceCallback tracecb;
+  void *tracearg;
+  int tracepend;
+  void (*linefn)(const char *line, void *arg); /* multi-line reply body */
+  void *linearg;
+  int features; /* FTPLIB_FEAT_* bits, valid once featsdone is set */
+  int featsdone;
+  int hashalgo; /* FTPLIB_HASH_* digest computed by FtpXfer */
+  int digestst; /* FTPLIB_DIGEST_* status of the last transfer */
+  int debug;    /* diagnostic level, see ftplog() */
+  FtpLogCallback logcb;
+  void *logarg;
+  netbuf *spare;  /* closed data netbuf, reused by the next transfer */
+  char *xferbuf;  /* FtpXfer() block buffer, kept for the session */
+  char *linebuf;  /* ASCII buffer of a data netbuf, kept in IMAGE mode */
+  int wantblock;  /* FTPLIB_BLOCKMODE requested */
+  int xmode;      /* 'B' once the server accepted MODE B */
+  int blockfd;    /* data connection kept after a MODE B transfer, or -1 */
+  int block;      /* data netbuf uses MODE B framing */
+  int blkleft;    /* bytes left in the current block */
+  int blkend;     /* 1 after the EOF block, -1 if the connection broke */
+  int uring;      /* FTPLIB_IOURING requested, cleared if unavailable */
+  FtpUring *ring; /* io_uring engine of the session, or NULL */
+  int pagecache;  /* FTPLIB_PAGECACHE_* policy for local files */
+  char *directbuf; /* aligned O_DIRECT buffer, kept for the session */
+  int ovdepth;     /* FTPLIB_OVERLAP ring depth, 0 when off */
+  int ovblock;     /* FTPLIB_OVERLAPBLOCK */
+  char *ovbuf;     /* ring buffers, kept for the session */
+  size_t ovsize;
+  int codec;       /* FTPLIB_COMPRESS codec of file transfers */
+  long long restart; /* REST offset for the next file transfer, or 0 */
+  int curtype;       /* control: TYPE in effect, 0 if unknown */
+  long commands;     /* control: FtpStats() counters */
+  long saved;
+#if defined(FTPLIB_TLS)
+  SSL_CTX *tlsctx; /* control: context of FtpAuthTLS(), or NULL */
+  int tlsflags;    /* control: FTPLIB_TLS_* flags */
+  char *host;      /* control: server name, checked against certificates */
+  SSL *ssl;        /* TLS on this connection, NULL in the clear */
+  SSL *blockssl;   /* control: TLS of the kept MODE B data connection */
+#endif
+  char digest[FTPHASH_HEXSIZ];
   char response[RESPONSE_BUFSIZ];
 };
 
@@ -119,7 +218,12 @@ int net_read(int fd, char *buf, size_t len) {
 int net_write(int fd, const char *buf, size_t len) {
   int done = 0;
   while (len > 0) {
+#if defined(MSG_NOSIGNAL)
+    /* a peer that went away is an error to report, not a SIGPIPE */
+    int c = send(fd, buf, len, MSG_NOSIGNAL);
+#else
     int c = write(fd, buf, len);
+#endif
     if (c == -1) {
       if (errno != EINTR && errno != EAGAIN)
         return -1;
@@ -172,6 +276,198 @@ char *strdup(const char *src) {
 }
 #endif
 
+/*
+ * clock_usec - monotonic timestamp in microseconds for trace events
+ */
+static uint64_t clock_usec(void) {
+#if defined(_WIN32)
+  return (uint64_t)GetTickCount64() * 1000;
+#elif defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+/*
+ * trace - report an event to the control connection's trace callback
+ */
+#define trace(nControl, event, text)                                           \
+  do {                                                                         \
+    if ((nControl) && (nControl)->tracecb)                                     \
+      (nControl)->tracecb((nControl), (event), (text), clock_usec(),          \
+                          (nControl)->tracearg);                               \
+  } while (0)
+
+/*
+ * ftplog - report a diagnostic when the session's debug level reaches level
+ *
+ * n may be a data connection, whose control connection holds the settings,
+ * or NULL before a session exists, in which case ftplib_debug applies.
+ * Messages go to the session's log callback, otherwise to stderr.
+ */
+static void ftplog(netbuf *n, int level, const char *fmt, ...) {
+  char msg[RESPONSE_BUFSIZ];
+  va_list ap;
+  if (n && n->ctrl)
+    n = n->ctrl;
+  if ((n ? n->debug : ftplib_debug) < level)
+    return;
+  va_start(ap, fmt);
+  vsnprintf(msg, sizeof(msg), fmt, ap);
+  va_end(ap);
+  if (n && n->logcb)
+    n->logcb(n, msg, n->logarg);
+  else
+    fprintf(stderr, "%s\n", msg);
+}
+
+#if defined(FTPLIB_TLS)
+/*
+ * tls_log - log the OpenSSL error queue behind a failed call
+ */
+static void tls_log(netbuf *n, const char *what) {
+  char buf[256];
+  unsigned long e = ERR_get_error();
+
+  if (e == 0)
+    ftplog(n, 1, "%s: %s", what, errno ? strerror(errno) : "failed");
+  for (; e != 0; e = ERR_get_error()) {
+    ERR_error_string_n(e, buf, sizeof(buf));
+    ftplog(n, 1, "%s: %s", what, buf);
+  }
+}
+
+/*
+ * nb_read - read from a connection, through TLS when it has a session
+ *
+ * return -1 on error, 0 at end of stream or bytecount
+ */
+static int nb_read(netbuf *n, char *buf, int len) {
+  int r;
+
+  if (n->ssl == NULL)
+    return net_read(n->handle, buf, len);
+  for (;;) {
+    if ((r = SSL_read(n->ssl, buf, len)) > 0)
+      return r;
+    switch (SSL_get_error(n->ssl, r)) {
+    case SSL_ERROR_ZERO_RETURN:
+      return 0;
+    case SSL_ERROR_SYSCALL:
+      if (errno == EINTR)
+        continue;
+    default:
+      tls_log(n, "SSL_read");
+      return -1;
+    }
+  }
+}
+
+/*
+ * nb_write - write all of buf to a connection, through TLS if active
+ *
+ * return -1 on error or bytecount
+ */
+static int nb_write(netbuf *n, const char *buf, int len) {
+  int w;
+
+  if (n->ssl == NULL)
+    return net_write(n->handle, buf, len);
+  if (len == 0)
+    return 0;
+  for (;;) {
+    if ((w = SSL_write(n->ssl, buf, len)) > 0)
+      return w;
+    if ((SSL_get_error(n->ssl, w) == SSL_ERROR_SYSCALL) && (errno == EINTR))
+      continue;
+    tls_log(n, "SSL_write");
+    return -1;
+  }
+}
+#else
+#define nb_read(n, buf, len) net_read((n)->handle, buf, len)
+#define nb_write(n, buf, len) net_write((n)->handle, buf, len)
+#endif
+
+/*
+ * rate_sleep - suspend the caller for a number of microseconds
+ */
+static void rate_sleep(uint64_t usec) {
+#if defined(_WIN32)
+  Sleep((DWORD)((usec + 999) / 1000));
+#else
+  struct timespec ts;
+  ts.tv_sec = usec / 1000000;
+  ts.tv_nsec = (usec % 1000000) * 1000;
+  while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+    ;
+#endif
+}
+
+/*
+ * rate_take - charge len bytes to a token bucket
+ *
+ * The bytes are always granted; if the bucket goes into debt the caller
+ * sleeps for the time needed to pay it back at the configured rate.
+ */
+static void rate_take(FtpRatePool *r, int len) {
+  uint64_t now, wait = 0;
+  if (len <= 0)
+    return;
+  mutex_lock(&r->lock);
+  now = clock_usec();
+  r->tokens += (double)(now - r->last) * r->rate / 1e6;
+  if (r->tokens > r->burst)
+    r->tokens = r->burst;
+  r->last = now;
+  r->tokens -= len;
+  if (r->tokens < 0)
+    wait = (uint64_t)(-r->tokens * 1e6 / r->rate);
+  mutex_unlock(&r->lock);
+  if (wait)
+    rate_sleep(wait);
+}
+
+/*
+ * rate_limit - apply session and shared limits to a data transfer
+ */
+#define rate_limit(nData, len)                                                 \
+  do {                                                                         \
+    if ((nData)->rate)                                                         \
+      rate_take((nData)->rate, (len));                                         \
+    if ((nData)->pool)                                                         \
+      rate_take((nData)->pool, (len));                                         \
+  } while (0)
+
+/*
+ * data_account - count bytes moved on a data connection
+ *
+ * Raises the first-byte trace event and runs the byte count callback.
+ *
+ * return 0 if the callback aborted the transfer, 1 otherwise
+ */
+static int data_account(netbuf *nData, int len) {
+  if (nData->xfered == 0 && len > 0)
+    trace(nData->ctrl, FTPLIB_TRACE_DATA_FIRST, NULL);
+  nData->xfered += len;
+  if (nData->idlecb && nData->cbbytes) {
+    nData->xfered1 += len;
+    if (nData->xfered1 > nData->cbbytes) {
+      if (nData->idlecb(nData, nData->xfered, nData->idlearg) == 0) {
+        nData->cbabort = 1;
+        return 0;
+      }
+      nData->xfered1 = 0;
+    }
+  }
+  return 1;
+}
+
 /*
  * socket_wait - wait for socket to receive or flush data
  *
@@ -184,6 +480,14 @@ static int socket_wait(netbuf *ctl) {
   int rv = 0;
   if ((ctl->dir == FTPLIB_CONTROL) || (ctl->idlecb == NULL))
     return 1;
+#if defined(FTPLIB_TLS)
+  /* decrypted bytes already buffered would not wake select() */
+  if ((ctl->ssl != NULL) && SSL_pending(ctl->ssl))
+    return 1;
+#endif
+  /* without an idle time the callback is driven by byte count only */
+  if ((ctl->idletime.tv_sec == 0) && (ctl->idletime.tv_usec == 0))
+    return 1;
   if (ctl->dir == FTPLIB_WRITE)
     wfd = &fd;
   else
@@ -203,9 +507,153 @@ static int socket_wait(netbuf *ctl) {
       break;
     }
   } while ((rv = ctl->idlecb(ctl, ctl->xfered, ctl->idlearg)));
+  if (rv == 0)
+    ctl->cbabort = 1;
   return rv;
 }
 
+/*
+ * block_header - read a MODE B block header, skipping restart markers
+ *
+ * return 1 with blkleft set, 0 after the EOF block, -1 on error
+ */
+static int block_header(netbuf *nData) {
+  unsigned char hdr[BLOCK_HDRSIZ];
+  char skip[256];
+  int x, got;
+
+  while (nData->blkleft == 0) {
+    if (nData->blkend)
+      return (nData->blkend == 1) ? 0 : -1;
+    for (got = 0; got < BLOCK_HDRSIZ; got += x)
+      if ((x = nb_read(nData, (char *)hdr + got, BLOCK_HDRSIZ - got)) <= 0) {
+        ftplog(nData, 1, "block header: %s",
+               x ? strerror(errno) : "connection closed");
+        nData->blkend = -1;
+        return -1;
+      }
+    nData->blkleft = (hdr[1] << 8) | hdr[2];
+    if (hdr[0] & BLOCK_EOF)
+      nData->blkend = 1;
+    while ((hdr[0] & BLOCK_RESTART) && (nData->blkleft > 0)) {
+      x = (nData->blkleft < (int)sizeof(skip)) ? nData->blkleft
+                                               : (int)sizeof(skip);
+      if ((x = nb_read(nData, skip, x)) <= 0) {
+        nData->blkend = -1;
+        return -1;
+      }
+      nData->blkleft -= x;
+    }
+  }
+  return 1;
+}
+
+/*
+ * data_read - read from a data connection, unwrapping MODE B blocks
+ *
+ * return -1 on error, 0 at end of file or bytecount
+ */
+static int data_read(netbuf *nData, char *buf, int max) {
+  int x;
+
+  if (!nData->block)
+    return nb_read(nData, buf, max);
+  if ((x = block_header(nData)) != 1)
+    return x;
+  if (max > nData->blkleft)
+    max = nData->blkleft;
+  if ((x = nb_read(nData, buf, max)) <= 0) {
+    nData->blkend = -1;
+    return -1;
+  }
+  nData->blkleft -= x;
+  return x;
+}
+
+#if !defined(_WIN32)
+/*
+ * block_writev - write a block header and its data with one system call
+ *
+ * return count of data bytes sent, -1 on error
+ */
+static int block_writev(netbuf *nData, char *hdr, const char *buf, int len) {
+  struct iovec iov[2];
+  int w;
+
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = BLOCK_HDRSIZ;
+  iov[1].iov_base = (void *)buf;
+  iov[1].iov_len = len;
+  while (((w = writev(nData->handle, iov, 2)) == -1) && (errno == EINTR))
+    ;
+  if (w == -1)
+    return -1;
+  if (w >= BLOCK_HDRSIZ)
+    return w - BLOCK_HDRSIZ;
+  if (net_write(nData->handle, hdr + w, BLOCK_HDRSIZ - w) != BLOCK_HDRSIZ - w)
+    return -1;
+  return 0;
+}
+#endif
+
+/*
+ * block_send - write one MODE B block, header and data together
+ *
+ * return len or -1 on error
+ */
+static int block_send(netbuf *nData, int desc, const char *buf, int len) {
+  char hdr[BLOCK_HDRSIZ];
+  int w;
+
+  hdr[0] = (char)desc;
+  hdr[1] = (char)(len >> 8);
+  hdr[2] = (char)(len & 0xff);
+#if defined(FTPLIB_TLS)
+  if ((nData->ssl != NULL) && (len <= FTPLIB_BUFSIZ)) {
+    /* one TLS record for the block */
+    char rec[BLOCK_HDRSIZ + FTPLIB_BUFSIZ];
+    memcpy(rec, hdr, BLOCK_HDRSIZ);
+    if (len > 0)
+      memcpy(rec + BLOCK_HDRSIZ, buf, len);
+    w = nb_write(nData, rec, BLOCK_HDRSIZ + len);
+    w = (w == BLOCK_HDRSIZ + len) ? len : -1;
+  } else if (nData->ssl != NULL)
+    w = (nb_write(nData, hdr, BLOCK_HDRSIZ) == BLOCK_HDRSIZ) ? 0 : -1;
+  else
+#endif
+#if defined(_WIN32)
+    w = (net_write(nData->handle, hdr, BLOCK_HDRSIZ) == BLOCK_HDRSIZ) ? 0 : -1;
+#else
+    w = block_writev(nData, hdr, buf, len);
+#endif
+  /* w is the count of data bytes already sent */
+  if ((w == -1) ||
+      ((w < len) && (nb_write(nData, buf + w, len - w) != len - w))) {
+    ftplog(nData, 1, "block write: %s", strerror(errno));
+    nData->blkend = -1;
+    return -1;
+  }
+  return len;
+}
+
+/*
+ * data_write - write to a data connection, in MODE B blocks if enabled
+ *
+ * return -1 on error or bytecount
+ */
+static int data_write(netbuf *nData, const char *buf, int len) {
+  int done, n;
+
+  if (!nData->block)
+    return nb_write(nData, buf, len);
+  for (done = 0; done < len; done += n) {
+    n = (len - done > BLOCK_MAXLEN) ? BLOCK_MAXLEN : len - done;
+    if (block_send(nData, 0, buf + done, n) != n)
+      return -1;
+  }
+  return len;
+}
+
 /*
  * read a line of text
  *
@@ -258,14 +706,17 @@ static int readline(char *buf, int max, netbuf *ctl) {
     }
     if (!socket_wait(ctl))
       return retval;
-    if ((x = net_read(ctl->handle, ctl->cput, ctl->cleft)) == -1) {
-      if (ftplib_debug)
-        perror("read");
+    if ((x = data_read(ctl, ctl->cput, ctl->cleft)) == -1) {
+      ftplog(ctl, 1, "read: %s", strerror(errno));
       retval = -1;
       break;
     }
     if (x == 0)
       eof = 1;
+    else if (ctl->tracepend) {
+      ctl->tracepend = 0;
+      trace(ctl, FTPLIB_TRACE_RESP_FIRST, NULL);
+    }
     ctl->cleft -= x;
     ctl->cavail += x;
     ctl->cput += x;
@@ -292,10 +743,9 @@ static int writeline(const char *buf, int len, netbuf *nData) {
       if (nb == FTPLIB_BUFSIZ) {
         if (!socket_wait(nData))
           return x;
-        w = net_write(nData->handle, nbp, FTPLIB_BUFSIZ);
+        w = data_write(nData, nbp, FTPLIB_BUFSIZ);
         if (w != FTPLIB_BUFSIZ) {
-          if (ftplib_debug)
-            printf("net_write(1) returned %d, errno = %d\n", w, errno);
+          ftplog(nData, 1, "net_write(1) returned %d, errno = %d", w, errno);
           return (-1);
         }
         nb = 0;
@@ -305,10 +755,9 @@ static int writeline(const char *buf, int len, netbuf *nData) {
     if (nb == FTPLIB_BUFSIZ) {
       if (!socket_wait(nData))
         return x;
-      w = net_write(nData->handle, nbp, FTPLIB_BUFSIZ);
+      w = data_write(nData, nbp, FTPLIB_BUFSIZ);
       if (w != FTPLIB_BUFSIZ) {
-        if (ftplib_debug)
-          printf("net_write(2) returned %d, errno = %d\n", w, errno);
+        ftplog(nData, 1, "net_write(2) returned %d, errno = %d", w, errno);
         return (-1);
       }
       nb = 0;
@@ -318,10 +767,9 @@ static int writeline(const char *buf, int len, netbuf *nData) {
   if (nb) {
     if (!socket_wait(nData))
       return x;
-    w = net_write(nData->handle, nbp, nb);
+    w = data_write(nData, nbp, nb);
     if (w != nb) {
-      if (ftplib_debug)
-        printf("net_write(3) returned %d, errno = %d\n", w, errno);
+      ftplog(nData, 1, "net_write(3) returned %d, errno = %d", w, errno);
       return (-1);
     }
   }
@@ -336,27 +784,36 @@ static int writeline(const char *buf, int len, netbuf *nData) {
  */
 static int readresp(char c, netbuf *nControl) {
   char match[5];
+  if (nControl->tracecb) {
+    /* a reply already buffered arrived before we started waiting */
+    nControl->tracepend = (nControl->cavail == 0);
+    if (!nControl->tracepend)
+      trace(nControl, FTPLIB_TRACE_RESP_FIRST, NULL);
+  }
   if (readline(nControl->response, RESPONSE_BUFSIZ, nControl) == -1) {
-    if (ftplib_debug)
-      perror("Control socket read failed");
+    ftplog(nControl, 1, "Control socket read failed: %s", strerror(errno));
     return 0;
   }
-  if (ftplib_debug > 1)
-    fprintf(stderr, "%s", nControl->response);
+  ftplog(nControl, 2, "%.*s", (int)strcspn(nControl->response, "\r\n"),
+         nControl->response);
   if (nControl->response[3] == '-') {
     strncpy(match, nControl->response, 3);
     match[3] = ' ';
     match[4] = '\0';
     do {
       if (readline(nControl->response, RESPONSE_BUFSIZ, nControl) == -1) {
-        if (ftplib_debug)
-          perror("Control socket read failed");
+        ftplog(nControl, 1, "Control socket read failed: %s",
+               strerror(errno));
         return 0;
       }
-      if (ftplib_debug > 1)
-        fprintf(stderr, "%s", nControl->response);
+      ftplog(nControl, 2, "%.*s", (int)strcspn(nControl->response, "\r\n"),
+             nControl->response);
+      if (nControl->linefn && strncmp(nControl->response, match, 4))
+        nControl->linefn(nControl->response, nControl->linearg);
     } while (strncmp(nControl->response, match, 4));
   }
+  nControl->tracepend = 0;
+  trace(nControl, FTPLIB_TRACE_RESP, nControl->response);
   if (nControl->response[0] == c)
     return 1;
   return 0;
@@ -391,101 +848,60 @@ GLOBALDEF char *FtpLastResponse(netbuf *nControl) {
  * return 1 if connected, 0 if not
  */
 GLOBALDEF int FtpConnect(const char *host, netbuf **nControl) {
-  int sControl;
-  struct sockaddr_in sin;
-  int on = 1;
+  int sControl = -1;
+  struct addrinfo hints, *res, *ai;
+  int on = 1, i;
   netbuf *ctrl;
   char *lhost;
   char *pnum;
 
-  memset(&sin, 0, sizeof(sin));
-  sin.sin_family = AF_INET;
   lhost = strdup(host);
+  if (lhost == NULL)
+    return 0;
   pnum = strchr(lhost, ':');
   if (pnum == NULL)
     pnum = "ftp";
   else
     *pnum++ = '\0';
-  if (isdigit(*pnum))
-    sin.sin_port = htons(atoi(pnum));
-  else {
-    struct servent *pse;
-#if _REENTRANT
-    struct servent se;
-    char tmpbuf[TMP_BUFSIZ];
-    int i;
-    if ((i = getservbyname_r(pnum, "tcp", &se, tmpbuf, TMP_BUFSIZ, &pse)) !=
-        0) {
-      errno = i;
-      if (ftplib_debug)
-        perror("getservbyname_r");
-      free(lhost);
-      return 0;
-    }
-#else
-    if ((pse = getservbyname(pnum, "tcp")) == NULL) {
-      if (ftplib_debug)
-        perror("getservbyname");
-      free(lhost);
-      return 0;
-    }
-#endif
-    sin.sin_port = pse->s_port;
-  }
-  if ((sin.sin_addr.s_addr = inet_addr(lhost)) == INADDR_NONE) {
-    struct hostent *phe;
-#ifdef _REENTRANT
-    struct hostent he;
-    char tmpbuf[TMP_BUFSIZ];
-    int i, herr;
-    if ((i = gethostbyname_r(lhost, &he, tmpbuf, TMP_BUFSIZ, &phe, &herr)) !=
-        0) {
-      if (ftplib_debug)
-        fprintf(stderr, "gethostbyname: %s\n", hstrerror(herr));
-      free(lhost);
-      return 0;
-    }
-#else
-    if ((phe = gethostbyname(lhost)) == NULL) {
-      if (ftplib_debug)
-        fprintf(stderr, "gethostbyname: %s\n", hstrerror(h_errno));
-      free(lhost);
-      return 0;
-    }
-#endif
-    memcpy((char *)&sin.sin_addr, phe->h_addr, phe->h_length);
-  }
-  free(lhost);
-  sControl = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-  if (sControl == -1) {
-    if (ftplib_debug)
-      perror("socket");
+  /* getaddrinfo() is reentrant, unlike gethostbyname/getservbyname */
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = IPPROTO_TCP;
+  if ((i = getaddrinfo(lhost, pnum, &hints, &res)) != 0) {
+    ftplog(NULL, 1, "getaddrinfo: %s", gai_strerror(i));
+    free(lhost);
     return 0;
   }
-  if (setsockopt(sControl, SOL_SOCKET, SO_REUSEADDR,
-                 SETSOCKOPT_OPTVAL_TYPE & on, sizeof(on)) == -1) {
-    if (ftplib_debug)
-      perror("setsockopt");
+  free(lhost);
+  for (ai = res; ai != NULL; ai = ai->ai_next) {
+    sControl = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (sControl == -1) {
+      ftplog(NULL, 1, "socket: %s", strerror(errno));
+      continue;
+    }
+    if (setsockopt(sControl, SOL_SOCKET, SO_REUSEADDR,
+                   SETSOCKOPT_OPTVAL_TYPE & on, sizeof(on)) == -1) {
+      ftplog(NULL, 1, "setsockopt: %s", strerror(errno));
+    } else if (connect(sControl, ai->ai_addr, ai->ai_addrlen) == -1) {
+      ftplog(NULL, 1, "connect: %s", strerror(errno));
+    } else
+      break;
     net_close(sControl);
-    return 0;
+    sControl = -1;
   }
-  if (connect(sControl, (struct sockaddr *)&sin, sizeof(sin)) == -1) {
-    if (ftplib_debug)
-      perror("connect");
-    net_close(sControl);
+  freeaddrinfo(res);
+  if (sControl == -1)
     return 0;
-  }
   ctrl = calloc(1, sizeof(netbuf));
   if (ctrl == NULL) {
-    if (ftplib_debug)
-      perror("calloc");
+    ftplog(NULL, 1, "calloc: %s", strerror(errno));
     net_close(sControl);
     return 0;
   }
   ctrl->buf = malloc(FTPLIB_BUFSIZ);
   if (ctrl->buf == NULL) {
-    if (ftplib_debug)
-      perror("calloc");
+    ftplog(NULL, 1, "calloc: %s", strerror(errno));
     net_close(sControl);
     free(ctrl);
     return 0;
@@ -494,14 +910,26 @@ GLOBALDEF int FtpConnect(const char *host, netbuf **nControl) {
   ctrl->dir = FTPLIB_CONTROL;
   ctrl->ctrl = NULL;
   ctrl->cmode = FTPLIB_DEFMODE;
+  ctrl->blockfd = -1;
+  ctrl->ovblock = OVERLAP_BLOCK;
+#if defined(FTPLIB_TLS)
+  if ((ctrl->host = strdup(host)) != NULL)
+    ctrl->host[strcspn(ctrl->host, ":")] = '\0';
+#endif
   ctrl->idlecb = NULL;
   ctrl->idletime.tv_sec = ctrl->idletime.tv_usec = 0;
   ctrl->idlearg = NULL;
   ctrl->xfered = 0;
   ctrl->xfered1 = 0;
   ctrl->cbbytes = 0;
+  ctrl->tracecb = NULL;
+  ctrl->tracearg = NULL;
+  ctrl->debug = ftplib_debug;
   if (readresp('2', ctrl) == 0) {
     net_close(sControl);
+#if defined(FTPLIB_TLS)
+    free(ctrl->host);
+#endif
     free(ctrl->buf);
     free(ctrl);
     return 0;
@@ -526,6 +954,100 @@ GLOBALDEF int FtpClearCallback(netbuf *nControl) {
   nControl->cbbytes = 0;
   return 1;
 }
+
+/*
+ * FtpSetTrace - install a callback receiving timestamped protocol events
+ *
+ * Pass a NULL callback to disable tracing.
+ */
+GLOBALDEF int FtpSetTrace(FtpTraceCallback cb, void *arg, netbuf *nControl) {
+  if (nControl->dir != FTPLIB_CONTROL)
+    return 0;
+  nControl->tracecb = cb;
+  nControl->tracearg = cb ? arg : NULL;
+  nControl->tracepend = 0;
+  return 1;
+}
+
+/*
+ * FtpSetLog - send this session's diagnostics to a callback
+ *
+ * Pass a NULL callback to log to stderr again. Only messages at or below
+ * the FTPLIB_DEBUG level set with FtpOptions() are produced.
+ */
+GLOBALDEF int FtpSetLog(FtpLogCallback cb, void *arg, netbuf *nControl) {
+  if (nControl->dir != FTPLIB_CONTROL)
+    return 0;
+  nControl->logcb = cb;
+  nControl->logarg = cb ? arg : NULL;
+  return 1;
+}
+
+/*
+ * FtpStats - report the control connection counters of a session
+ *
+ * return 1 if successful, 0 otherwise
+ */
+GLOBALDEF int FtpStats(FtpSessionStats *st, netbuf *nControl) {
+  if (nControl->dir != FTPLIB_CONTROL)
+    return 0;
+  st->commands = nControl->commands;
+  st->saved = nControl->saved;
+  return 1;
+}
+
+/*
+ * FtpRatePoolNew - create a bandwidth budget that sessions can share
+ *
+ * rate is in bytes per second, burst is the bucket depth in bytes
+ * (0 picks a default of 1/8 s worth of data). The pool must outlive
+ * every session attached to it with FtpOptions(FTPLIB_RATEPOOL).
+ *
+ * return the pool or NULL on error
+ */
+GLOBALDEF FtpRatePool *FtpRatePoolNew(long rate, long burst) {
+  FtpRatePool *pool;
+  if (rate <= 0)
+    return NULL;
+  pool = calloc(1, sizeof(FtpRatePool));
+  if (pool == NULL) {
+    ftplog(NULL, 1, "calloc: %s", strerror(errno));
+    return NULL;
+  }
+  mutex_init(&pool->lock);
+  FtpRatePoolSet(pool, rate, burst);
+  return pool;
+}
+
+/*
+ * FtpRatePoolSet - change the rate and burst of a bandwidth budget
+ *
+ * return 1 if successful, 0 otherwise
+ */
+GLOBALDEF int FtpRatePoolSet(FtpRatePool *pool, long rate, long burst) {
+  if ((pool == NULL) || (rate <= 0))
+    return 0;
+  if (burst <= 0)
+    burst = (rate / 8 > FTPLIB_BUFSIZ) ? rate / 8 : FTPLIB_BUFSIZ;
+  mutex_lock(&pool->lock);
+  pool->rate = rate;
+  pool->burst = burst;
+  pool->tokens = burst;
+  pool->last = clock_usec();
+  mutex_unlock(&pool->lock);
+  return 1;
+}
+
+/*
+ * FtpRatePoolFree - release a bandwidth budget
+ */
+GLOBALDEF void FtpRatePoolFree(FtpRatePool *pool) {
+  if (pool == NULL)
+    return;
+  mutex_destroy(&pool->lock);
+  free(pool);
+}
+
 /*
  * FtpOptions - change connection options
  *
@@ -559,30 +1081,206 @@ GLOBALDEF int FtpOptions(int opt, long val, netbuf *nControl) {
     rv = 1;
     nControl->cbbytes = (int)val;
     break;
+  case FTPLIB_RATELIMIT:
+    if (val <= 0) {
+      FtpRatePoolFree(nControl->rate);
+      nControl->rate = NULL;
+      rv = 1;
+    } else if (nControl->rate)
+      rv = FtpRatePoolSet(nControl->rate, val, 0);
+    else
+      rv = ((nControl->rate = FtpRatePoolNew(val, 0)) != NULL);
+    break;
+  case FTPLIB_RATEPOOL:
+    rv = 1;
+    nControl->pool = (FtpRatePool *)val;
+    break;
+  case FTPLIB_DEBUG:
+    rv = 1;
+    nControl->debug = (int)val;
+    break;
+  case FTPLIB_BLOCKMODE:
+    rv = 1;
+    nControl->wantblock = (val != 0);
+    break;
+  case FTPLIB_IOURING:
+    rv = 1;
+    nControl->uring = (val != 0);
+    break;
+  case FTPLIB_PAGECACHE:
+    v = (int)val;
+    if ((v >= FTPLIB_PAGECACHE_KEEP) && (v <= FTPLIB_PAGECACHE_DIRECT)) {
+      nControl->pagecache = v;
+      rv = 1;
+    }
+    break;
+  case FTPLIB_OVERLAP:
+    v = (int)val;
+#if !defined(_WIN32)
+    if ((v == 0) || ((v >= 2) && (v <= FTPLIB_OVERLAP_MAXDEPTH))) {
+      nControl->ovdepth = v;
+      rv = 1;
+    }
+#endif
+    break;
+  case FTPLIB_OVERLAPBLOCK:
+    if ((val >= FTPLIB_OVERLAP_MINBLOCK) && (val <= FTPLIB_OVERLAP_MAXBLOCK)) {
+      nControl->ovblock = (int)val;
+      rv = 1;
+    }
+    break;
+  case FTPLIB_COMPRESS:
+    v = (int)val;
+    if ((v == FTPLIB_CODEC_NONE) || FtpZipAvailable(v)) {
+      nControl->codec = v;
+      rv = 1;
+    }
+    break;
+  case FTPLIB_HASHALGO:
+    v = (int)val;
+    if ((v == FTPLIB_HASH_NONE) || FtpHashHexLen(v)) {
+      nControl->hashalgo = v;
+      rv = 1;
+    }
+    break;
   }
   return rv;
 }
 
 /*
- * FtpSendCmd - send a command and wait for expected response
+ * cmd_account - count a command going out, forgetting the TYPE in effect
+ * if the command may change it
+ */
+static void cmd_account(const char *cmd, netbuf *nControl) {
+  if (!strncmp(cmd, "TYPE ", 5) || !strncmp(cmd, "USER ", 5) ||
+      !strcmp(cmd, "REIN"))
+    nControl->curtype = 0;
+  nControl->commands++;
+}
+
+/*
+ * send_cmd - send a command without waiting for the reply
  *
- * return 1 if proper response received, 0 otherwise
+ * return 1 if written, 0 otherwise
  */
-static int FtpSendCmd(const char *cmd, char expresp, netbuf *nControl) {
+static int send_cmd(const char *cmd, netbuf *nControl) {
   char buf[TMP_BUFSIZ];
   if (nControl->dir != FTPLIB_CONTROL)
     return 0;
-  if (ftplib_debug > 2)
-    fprintf(stderr, "%s\n", cmd);
+  cmd_account(cmd, nControl);
+  ftplog(nControl, 3, "%s", strncmp(cmd, "PASS ", 5) ? cmd : "PASS ****");
   if ((strlen(cmd) + 3) > sizeof(buf))
     return 0;
   sprintf(buf, "%s\r\n", cmd);
-  if (net_write(nControl->handle, buf, strlen(buf)) <= 0) {
-    if (ftplib_debug)
-      perror("write");
+  if (nb_write(nControl, buf, strlen(buf)) <= 0) {
+    ftplog(nControl, 1, "write: %s", strerror(errno));
     return 0;
   }
-  return readresp(expresp, nControl);
+  if (nControl->tracecb)
+    trace(nControl, FTPLIB_TRACE_CMD,
+          strncmp(cmd, "PASS ", 5) == 0 ? "PASS ****" : cmd);
+  return 1;
+}
+
+/*
+ * FtpSendCmd - send a command and wait for expected response
+ *
+ * return 1 if proper response received, 0 otherwise
+ */
+static int FtpSendCmd(const char *cmd, char expresp, netbuf *nControl) {
+  return send_cmd(cmd, nControl) && readresp(expresp, nControl);
+}
+
+/*
+ * ftp_type - set the representation type, unless it is in effect already
+ *
+ * return 1 if successful, 0 otherwise
+ */
+static int ftp_type(char mode, netbuf *nControl) {
+  char cmd[8];
+  if (nControl->curtype == mode) {
+    nControl->saved++;
+    return 1;
+  }
+  sprintf(cmd, "TYPE %c", mode);
+  if (!FtpSendCmd(cmd, '2', nControl))
+    return 0;
+  nControl->curtype = mode;
+  return 1;
+}
+
+/*
+ * FtpSendCmdLines - send a command, passing each line of a multi-line
+ * reply body to fn
+ *
+ * return 1 if proper response received, 0 otherwise
+ */
+static int FtpSendCmdLines(const char *cmd, char expresp, netbuf *nControl,
+                           void (*fn)(const char *line, void *arg),
+                           void *arg) {
+  int rv;
+  nControl->linefn = fn;
+  nControl->linearg = arg;
+  rv = FtpSendCmd(cmd, expresp, nControl);
+  nControl->linefn = NULL;
+  nControl->linearg = NULL;
+  return rv;
+}
+
+/*
+ * feat_line - collect FEAT reply lines into FTPLIB_FEAT_* bits
+ */
+static void feat_line(const char *line, void *arg) {
+  int *feats = arg;
+  char buf[TMP_BUFSIZ];
+  char *p = buf;
+  while (*line == ' ')
+    line++;
+  while (*line && (*line != '\r') && (*line != '\n') &&
+         (p < buf + sizeof(buf) - 2))
+    *p++ = toupper((unsigned char)*line++);
+  *p++ = ' ';
+  *p = '\0';
+  if (strncmp(buf, "HASH ", 5) == 0) {
+    *feats |= FTPLIB_FEAT_HASH;
+    if (strstr(buf, "CRC32"))
+      *feats |= FTPLIB_FEAT_HASH_CRC32;
+    if (strstr(buf, "MD5"))
+      *feats |= FTPLIB_FEAT_HASH_MD5;
+    if (strstr(buf, "SHA-256"))
+      *feats |= FTPLIB_FEAT_HASH_SHA256;
+  } else if (strncmp(buf, "XCRC ", 5) == 0)
+    *feats |= FTPLIB_FEAT_XCRC;
+  else if (strncmp(buf, "XMD5 ", 5) == 0)
+    *feats |= FTPLIB_FEAT_XMD5;
+  else if (strncmp(buf, "MLST ", 5) == 0)
+    *feats |= FTPLIB_FEAT_MLST;
+  else if (strncmp(buf, "MFMT ", 5) == 0)
+    *feats |= FTPLIB_FEAT_MFMT;
+  else if (strncmp(buf, "SIZE ", 5) == 0)
+    *feats |= FTPLIB_FEAT_SIZE;
+  else if (strncmp(buf, "MDTM ", 5) == 0)
+    *feats |= FTPLIB_FEAT_MDTM;
+}
+
+/*
+ * FtpFeatures - extensions supported by the server
+ *
+ * FEAT is sent once per connection, later calls use the cached reply.
+ *
+ * return FTPLIB_FEAT_* bits, 0 if FEAT is not supported
+ */
+GLOBALDEF int FtpFeatures(netbuf *nControl) {
+  int feats = 0;
+  if (nControl->dir != FTPLIB_CONTROL)
+    return 0;
+  if (!nControl->featsdone) {
+    if (!FtpSendCmdLines("FEAT", '2', nControl, feat_line, &feats))
+      feats = 0;
+    nControl->features = feats;
+    nControl->featsdone = 1;
+  }
+  return nControl->features;
 }
 
 /*
@@ -606,6 +1304,349 @@ GLOBALDEF int FtpLogin(const char *user, const char *pass, netbuf *nControl) {
   return FtpSendCmd(tempbuf, '2', nControl);
 }
 
+/*
+ * data_get - data netbuf for a new transfer
+ *
+ * Takes the one the session kept from its last transfer, if any, so that
+ * a stream of small transfers does not allocate; the ASCII line buffer
+ * stays with the netbuf across IMAGE transfers.
+ *
+ * return NULL if out of memory
+ */
+static netbuf *data_get(netbuf *nControl, int mode) {
+  netbuf *n = nControl->spare;
+  char *lbuf = NULL;
+
+  if (n != NULL) {
+    nControl->spare = NULL;
+    lbuf = n->linebuf;
+    memset(n, 0, sizeof(netbuf));
+  } else if ((n = calloc(1, sizeof(netbuf))) == NULL)
+    return NULL;
+  if ((mode == FTPLIB_ASCII) && (lbuf == NULL) &&
+      ((lbuf = malloc(FTPLIB_BUFSIZ)) == NULL)) {
+    free(n);
+    return NULL;
+  }
+  n->linebuf = lbuf;
+  n->buf = (mode == FTPLIB_ASCII) ? lbuf : NULL;
+  return n;
+}
+
+/*
+ * data_put - hand a closed data netbuf back to its session, or free it
+ */
+static void data_put(netbuf *nData, netbuf *nControl) {
+  if ((nControl != NULL) && (nControl->spare == NULL)) {
+    nControl->spare = nData;
+    return;
+  }
+  free(nData->linebuf);
+  free(nData);
+}
+
+/*
+ * data_open - data netbuf for a connected or listening socket
+ *
+ * return NULL, with the socket closed, if out of memory
+ */
+static netbuf *data_open(netbuf *nControl, int sData, int mode, int dir) {
+  netbuf *ctrl = data_get(nControl, mode);
+
+  if (ctrl == NULL) {
+    ftplog(nControl, 1, "calloc: %s", strerror(errno));
+    net_close(sData);
+    return NULL;
+  }
+  ctrl->handle = sData;
+  ctrl->dir = dir;
+  ctrl->idletime = nControl->idletime;
+  ctrl->idlearg = nControl->idlearg;
+  ctrl->cbbytes = nControl->cbbytes;
+  ctrl->rate = nControl->rate;
+  ctrl->pool = nControl->pool;
+  ctrl->block = (nControl->xmode == 'B');
+#if defined(TCP_NODELAY)
+  /* blocks go out whole, and the EOF block must not wait for an ACK */
+  if (ctrl->block) {
+    int on = 1;
+    setsockopt(sData, IPPROTO_TCP, TCP_NODELAY, SETSOCKOPT_OPTVAL_TYPE & on,
+               sizeof(on));
+  }
+#endif
+  if (ctrl->idletime.tv_sec || ctrl->idletime.tv_usec || ctrl->cbbytes)
+    ctrl->idlecb = nControl->idlecb;
+  else
+    ctrl->idlecb = NULL;
+  return ctrl;
+}
+
+/*
+ * block_drop - close the data connection kept for MODE B, if any
+ */
+static void block_drop(netbuf *nControl) {
+#if defined(FTPLIB_TLS)
+  if (nControl->blockssl != NULL) {
+    SSL_free(nControl->blockssl);
+    nControl->blockssl = NULL;
+  }
+#endif
+  if (nControl->blockfd != -1) {
+    net_close(nControl->blockfd);
+    nControl->blockfd = -1;
+  }
+}
+
+#if defined(FTPLIB_TLS) && !defined(_WIN32)
+/*
+ * tls_idle - whether a readable TLS connection only carried handshake
+ * records, such as TLS 1.3 session tickets sent after an upload
+ *
+ * return 1 if no application data or close is pending
+ */
+static int tls_idle(SSL *ssl, int sData) {
+  int fl, r;
+  char c;
+
+  if ((ssl == NULL) || ((fl = fcntl(sData, F_GETFL)) == -1))
+    return 0;
+  fcntl(sData, F_SETFL, fl | O_NONBLOCK);
+  r = SSL_peek(ssl, &c, 1);
+  r = (r <= 0) && (SSL_get_error(ssl, r) == SSL_ERROR_WANT_READ);
+  fcntl(sData, F_SETFL, fl);
+  ERR_clear_error();
+  return r;
+}
+#else
+#define tls_idle(ssl, sData) 0
+#endif
+
+#if defined(FTPLIB_TLS)
+/*
+ * tls_connect - start TLS on the control or a data connection
+ *
+ * Data connections resume the control connection's TLS session unless
+ * FTPLIB_TLS_NOREUSE is set: that saves a full handshake per transfer,
+ * and servers enforcing session reuse refuse anything else.
+ *
+ * return 1 if successful, 0 otherwise
+ */
+static int tls_connect(netbuf *n, netbuf *nControl) {
+  SSL *ssl;
+  SSL_SESSION *sess;
+
+  if ((ssl = SSL_new(nControl->tlsctx)) == NULL) {
+    tls_log(nControl, "SSL_new");
+    return 0;
+  }
+  SSL_set_fd(ssl, n->handle);
+  if (nControl->host != NULL) {
+    SSL_set_tlsext_host_name(ssl, nControl->host);
+    if (!(nControl->tlsflags & FTPLIB_TLS_NOVERIFY))
+      SSL_set1_host(ssl, nControl->host);
+  }
+  if ((n != nControl) && !(nControl->tlsflags & FTPLIB_TLS_NOREUSE) &&
+      ((sess = SSL_get1_session(nControl->ssl)) != NULL)) {
+    SSL_set_session(ssl, sess);
+    SSL_SESSION_free(sess);
+  }
+  if (SSL_connect(ssl) != 1) {
+    tls_log(nControl, "TLS handshake");
+    sprintf(nControl->response, "TLS handshake failed\n");
+    SSL_free(ssl);
+    return 0;
+  }
+  n->ssl = ssl;
+  if (n != nControl)
+    ftplog(nControl, 2, "TLS data connection, %s handshake%s",
+           SSL_session_reused(ssl) ? "resumed" : "full",
+#if defined(BIO_get_ktls_send)
+           BIO_get_ktls_send(SSL_get_wbio(ssl)) ? ", kTLS" :
+#endif
+                                                  "");
+  return 1;
+}
+
+/*
+ * tls_close - send close_notify and drop the TLS state of a connection
+ *
+ * TLS 1.3 servers send session tickets after the handshake, which an
+ * upload never reads.  Closing a socket with unread input resets the
+ * connection and can cost the server the end of the file, so on a write
+ * connection wait (a bounded time) for the server to close first.
+ */
+static void tls_close(netbuf *n) {
+  struct timeval tv;
+  fd_set fd;
+  char buf[512];
+
+  if (n->ssl == NULL)
+    return;
+  SSL_shutdown(n->ssl);
+  if (n->dir == FTPLIB_WRITE) {
+    shutdown(n->handle, 1);
+    tv.tv_sec = TLS_LINGER;
+    tv.tv_usec = 0;
+    FD_ZERO(&fd);
+    FD_SET(n->handle, &fd);
+    while ((select(n->handle + 1, &fd, NULL, NULL, &tv) > 0) &&
+           (net_read(n->handle, buf, sizeof(buf)) > 0))
+      FD_SET(n->handle, &fd);
+  }
+  SSL_free(n->ssl);
+  n->ssl = NULL;
+}
+
+/* data connections of the session are protected (PROT P) */
+#define tls_data(nControl)                                                    \
+  (((nControl)->ssl != NULL) &&                                                \
+   !((nControl)->tlsflags & FTPLIB_TLS_CLEARDATA))
+#else
+#define tls_close(n)
+#endif
+
+/*
+ * block_take - data connection kept from the last MODE B transfer
+ *
+ * One that turned readable while idle was closed or reset by the server
+ * and is dropped.
+ *
+ * return socket or -1
+ */
+static int block_take(netbuf *nControl) {
+  int sData = nControl->blockfd;
+  struct timeval tv;
+  fd_set mask;
+
+  if ((sData == -1) || (nControl->xmode != 'B')) {
+    block_drop(nControl);
+    return -1;
+  }
+  FD_ZERO(&mask);
+  FD_SET(sData, &mask);
+  tv.tv_sec = tv.tv_usec = 0;
+  if ((select(sData + 1, &mask, NULL, NULL, &tv) == 0) ||
+      tls_idle(nControl->blockssl, sData)) {
+    nControl->blockfd = -1; /* its TLS session, if any, stays in blockssl */
+    return sData;
+  }
+  ftplog(nControl, 2, "kept data connection lost, opening a new one");
+  block_drop(nControl);
+  return -1;
+}
+
+/*
+ * stream_mode - leave MODE B, dropping the kept data connection
+ *
+ * return 1 if successful, 0 otherwise
+ */
+static int stream_mode(netbuf *nControl) {
+  if (nControl->xmode == 'B') {
+    block_drop(nControl);
+    if (!FtpSendCmd("MODE S", '2', nControl))
+      return 0;
+    nControl->xmode = 'S';
+  }
+  return 1;
+}
+
+/*
+ * block_mode - agree on the transfer mode before a data transfer
+ *
+ * MODE B is asked for once; a server refusing it keeps stream mode for
+ * the rest of the session.
+ *
+ * return 1 if successful, 0 otherwise
+ */
+static int block_mode(netbuf *nControl) {
+  if (nControl->wantblock && (nControl->xmode != 'B')) {
+    if (FtpSendCmd("MODE B", '2', nControl))
+      nControl->xmode = 'B';
+    else if (nControl->response[0] == '5') {
+      ftplog(nControl, 2, "MODE B refused, using stream mode");
+      nControl->wantblock = 0;
+    } else
+      return 0;
+  } else if (!nControl->wantblock)
+    return stream_mode(nControl);
+  return 1;
+}
+
+/*
+ * control_free - release a control netbuf and what the session kept
+ */
+static void control_free(netbuf *nControl) {
+  block_drop(nControl);
+#if defined(FTPLIB_TLS)
+  tls_close(nControl);
+  SSL_CTX_free(nControl->tlsctx);
+  free(nControl->host);
+#endif
+  net_close(nControl->handle);
+  FtpRatePoolFree(nControl->rate);
+  FtpUringFree(nControl->ring);
+  free(nControl->directbuf);
+  free(nControl->ovbuf);
+  if (nControl->spare != NULL)
+    data_put(nControl->spare, NULL);
+  free(nControl->xferbuf);
+  free(nControl->buf);
+  free(nControl);
+}
+
+/*
+ * FtpAuthTLS - secure the session with AUTH TLS (RFC 4217)
+ *
+ * Call after FtpConnect() and before FtpLogin().  Data connections are
+ * protected too (PBSZ 0, PROT P) unless flags has FTPLIB_TLS_CLEARDATA.
+ * The server certificate is checked against the default trust store and
+ * the host name unless FTPLIB_TLS_NOVERIFY is set.  Needs ftplib built
+ * with FTPLIB_TLS and OpenSSL.
+ *
+ * return 1 if successful, 0 otherwise
+ */
+GLOBALDEF int FtpAuthTLS(int flags, netbuf *nControl) {
+#if defined(FTPLIB_TLS)
+  SSL_CTX *ctx;
+
+  if ((nControl->dir != FTPLIB_CONTROL) || (nControl->ssl != NULL))
+    return 0;
+  if ((ctx = SSL_CTX_new(TLS_client_method())) == NULL) {
+    tls_log(nControl, "SSL_CTX_new");
+    return 0;
+  }
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+#if defined(SSL_OP_IGNORE_UNEXPECTED_EOF)
+  /* servers often end a data connection without close_notify */
+  SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+#if defined(SSL_OP_ENABLE_KTLS)
+  /* record encryption in the kernel where supported */
+  SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+  if (!(flags & FTPLIB_TLS_NOVERIFY)) {
+    SSL_CTX_set_default_verify_paths(ctx);
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+  }
+  nControl->tlsctx = ctx;
+  nControl->tlsflags = flags;
+  if (!FtpSendCmd("AUTH TLS", '2', nControl) ||
+      !tls_connect(nControl, nControl)) {
+    SSL_CTX_free(ctx);
+    nControl->tlsctx = NULL;
+    return 0;
+  }
+  if (flags & FTPLIB_TLS_CLEARDATA)
+    return 1;
+  return FtpSendCmd("PBSZ 0", '2', nControl) &&
+         FtpSendCmd("PROT P", '2', nControl);
+#else
+  (void)flags;
+  sprintf(nControl->response, "ftplib built without FTPLIB_TLS\n");
+  return 0;
+#endif
+}
+
 /*
  * FtpOpenPort - set up data connection
  *
@@ -620,7 +1661,6 @@ static int FtpOpenPort(netbuf *nControl, netbuf **nData, int mode, int dir) {
   struct linger lng = {0, 0};
   unsigned int l;
   int on = 1;
-  netbuf *ctrl;
   char *cp;
   unsigned int v[6];
   char buf[TMP_BUFSIZ];
@@ -654,49 +1694,43 @@ static int FtpOpenPort(netbuf *nControl, netbuf **nData, int mode, int dir) {
     sin.sa.sa_data[1] = v[1];
   } else {
     if (getsockname(nControl->handle, &sin.sa, &l) < 0) {
-      if (ftplib_debug)
-        perror("getsockname");
+      ftplog(nControl, 1, "getsockname: %s", strerror(errno));
       return -1;
     }
   }
   sData = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
   if (sData == -1) {
-    if (ftplib_debug)
-      perror("socket");
+    ftplog(nControl, 1, "socket: %s", strerror(errno));
     return -1;
   }
   if (setsockopt(sData, SOL_SOCKET, SO_REUSEADDR, SETSOCKOPT_OPTVAL_TYPE & on,
                  sizeof(on)) == -1) {
-    if (ftplib_debug)
-      perror("setsockopt");
+    ftplog(nControl, 1, "setsockopt: %s", strerror(errno));
     net_close(sData);
     return -1;
   }
   if (setsockopt(sData, SOL_SOCKET, SO_LINGER, SETSOCKOPT_OPTVAL_TYPE & lng,
                  sizeof(lng)) == -1) {
-    if (ftplib_debug)
-      perror("setsockopt");
+    ftplog(nControl, 1, "setsockopt: %s", strerror(errno));
     net_close(sData);
     return -1;
   }
   if (nControl->cmode == FTPLIB_PASSIVE) {
     if (connect(sData, &sin.sa, sizeof(sin.sa)) == -1) {
-      if (ftplib_debug)
-        perror("connect");
+      ftplog(nControl, 1, "connect: %s", strerror(errno));
       net_close(sData);
       return -1;
     }
+    trace(nControl, FTPLIB_TRACE_DATA_CONNECT, NULL);
   } else {
     sin.in.sin_port = 0;
     if (bind(sData, &sin.sa, sizeof(sin)) == -1) {
-      if (ftplib_debug)
-        perror("bind");
+      ftplog(nControl, 1, "bind: %s", strerror(errno));
       net_close(sData);
       return -1;
     }
     if (listen(sData, 1) < 0) {
-      if (ftplib_debug)
-        perror("listen");
+      ftplog(nControl, 1, "listen: %s", strerror(errno));
       net_close(sData);
       return -1;
     }
@@ -711,32 +1745,8 @@ static int FtpOpenPort(netbuf *nControl, netbuf **nData, int mode, int dir) {
       return -1;
     }
   }
-  ctrl = calloc(1, sizeof(netbuf));
-  if (ctrl == NULL) {
-    if (ftplib_debug)
-      perror("calloc");
-    net_close(sData);
-    return -1;
-  }
-  if ((mode == 'A') && ((ctrl->buf = malloc(FTPLIB_BUFSIZ)) == NULL)) {
-    if (ftplib_debug)
-      perror("calloc");
-    net_close(sData);
-    free(ctrl);
+  if ((*nData = data_open(nControl, sData, mode, dir)) == NULL)
     return -1;
-  }
-  ctrl->handle = sData;
-  ctrl->dir = dir;
-  ctrl->idletime = nControl->idletime;
-  ctrl->idlearg = nControl->idlearg;
-  ctrl->xfered = 0;
-  ctrl->xfered1 = 0;
-  ctrl->cbbytes = nControl->cbbytes;
-  if (ctrl->idletime.tv_sec || ctrl->idletime.tv_usec || ctrl->cbbytes)
-    ctrl->idlecb = nControl->idlecb;
-  else
-    ctrl->idlecb = NULL;
-  *nData = ctrl;
   return 1;
 }
 
@@ -782,6 +1792,7 @@ static int FtpAcceptConnection(netbuf *nData, netbuf *nControl) {
       if (sData > 0) {
         rv = 1;
         nData->handle = sData;
+        trace(nControl, FTPLIB_TRACE_DATA_CONNECT, NULL);
       } else {
         strncpy(nControl->response, strerror(i), sizeof(nControl->response));
         nData->handle = 0;
@@ -797,6 +1808,21 @@ static int FtpAcceptConnection(netbuf *nData, netbuf *nControl) {
   return rv;
 }
 
+/*
+ * FtpRestart - start the next file transfer at a byte offset
+ *
+ * The offset is sent with REST right before the RETR or STOR of the next
+ * FtpAccess() on a file, which then runs in stream mode: in MODE B the
+ * REST argument is a restart marker, not an offset. An offset of 0
+ * cancels a pending restart.
+ *
+ * return 1
+ */
+GLOBALDEF int FtpRestart(long long offset, netbuf *nControl) {
+  nControl->restart = offset > 0 ? offset : 0;
+  return 1;
+}
+
 /*
  * FtpAccess - return a handle for a data stream
  *
@@ -804,16 +1830,23 @@ static int FtpAcceptConnection(netbuf *nData, netbuf *nControl) {
  */
 GLOBALDEF int FtpAccess(const char *path, int typ, int mode, netbuf *nControl,
                         netbuf **nData) {
-  char buf[TMP_BUFSIZ];
-  int dir;
-  if ((path == NULL) &&
-      ((typ == FTPLIB_FILE_WRITE) || (typ == FTPLIB_FILE_READ))) {
+  char buf[TMP_BUFSIZ], rest[32];
+  int dir, sData, reused;
+  long long offset = nControl->restart;
+
+  nControl->restart = 0;
+  if ((path == NULL) && ((typ == FTPLIB_FILE_WRITE) ||
+                         (typ == FTPLIB_FILE_READ) ||
+                         (typ == FTPLIB_FILE_APPEND))) {
     sprintf(nControl->response, "Missing path argument for file transfer\n");
     return 0;
   }
-  sprintf(buf, "TYPE %c", mode);
-  if (!FtpSendCmd(buf, '2', nControl))
+  if ((typ != FTPLIB_FILE_WRITE) && (typ != FTPLIB_FILE_READ))
+    offset = 0;
+  if (!ftp_type(mode, nControl) ||
+      !(offset ? stream_mode(nControl) : block_mode(nControl)))
     return 0;
+  sprintf(rest, "REST %lld", offset);
   switch (typ) {
   case FTPLIB_DIR:
     strcpy(buf, "NLST");
@@ -831,6 +1864,14 @@ GLOBALDEF int FtpAccess(const char *path, int typ, int mode, netbuf *nControl,
     strcpy(buf, "STOR");
     dir = FTPLIB_WRITE;
     break;
+  case FTPLIB_FILE_APPEND:
+    strcpy(buf, "APPE");
+    dir = FTPLIB_WRITE;
+    break;
+  case FTPLIB_MLSD:
+    strcpy(buf, "MLSD");
+    dir = FTPLIB_READ;
+    break;
   default:
     sprintf(nControl->response, "Invalid open type %d\n", typ);
     return 0;
@@ -842,16 +1883,34 @@ GLOBALDEF int FtpAccess(const char *path, int typ, int mode, netbuf *nControl,
       return 0;
     strcpy(&buf[i], path);
   }
-  if (FtpOpenPort(nControl, nData, mode, dir) == -1)
-    return 0;
-  if (!FtpSendCmd(buf, '1', nControl)) {
+  for (;;) {
+    if ((sData = block_take(nControl)) != -1) {
+      if ((*nData = data_open(nControl, sData, mode, dir)) == NULL) {
+        block_drop(nControl);
+        return 0;
+      }
+#if defined(FTPLIB_TLS)
+      (*nData)->ssl = nControl->blockssl;
+      nControl->blockssl = NULL;
+#endif
+      reused = 1;
+    } else if (FtpOpenPort(nControl, nData, mode, dir) == -1)
+      return 0;
+    else
+      reused = 0;
+    /* REST must come right before the transfer command */
+    if ((offset == 0 || FtpSendCmd(rest, '3', nControl)) &&
+        FtpSendCmd(buf, '1', nControl))
+      break;
     FtpClose(*nData);
     *nData = NULL;
-    return 0;
+    /* the server lost the connection kept for MODE B: open a new one */
+    if (!reused || (strncmp(nControl->response, "425", 3) != 0))
+      return 0;
   }
   (*nData)->ctrl = nControl;
   nControl->data = *nData;
-  if (nControl->cmode == FTPLIB_PORT) {
+  if ((nControl->cmode == FTPLIB_PORT) && !reused) {
     if (!FtpAcceptConnection(*nData, nControl)) {
       FtpClose(*nData);
       *nData = NULL;
@@ -859,6 +1918,15 @@ GLOBALDEF int FtpAccess(const char *path, int typ, int mode, netbuf *nControl,
       return 0;
     }
   }
+#if defined(FTPLIB_TLS)
+  /* the server starts TLS once it has sent the preliminary reply */
+  if (tls_data(nControl) && ((*nData)->ssl == NULL) &&
+      !tls_connect(*nData, nControl)) {
+    FtpClose(*nData);
+    *nData = NULL;
+    return 0;
+  }
+#endif
   return 1;
 }
 
@@ -875,19 +1943,13 @@ GLOBALDEF int FtpRead(void *buf, int max, netbuf *nData) {
     i = socket_wait(nData);
     if (i != 1)
       return 0;
-    i = net_read(nData->handle, buf, max);
+    i = data_read(nData, buf, max);
   }
   if (i == -1)
     return 0;
-  nData->xfered += i;
-  if (nData->idlecb && nData->cbbytes) {
-    nData->xfered1 += i;
-    if (nData->xfered1 > nData->cbbytes) {
-      if (nData->idlecb(nData, nData->xfered, nData->idlearg) == 0)
-        return 0;
-      nData->xfered1 = 0;
-    }
-  }
+  rate_limit(nData, i);
+  if (!data_account(nData, i))
+    return 0;
   return i;
 }
 
@@ -898,22 +1960,18 @@ GLOBALDEF int FtpWrite(const void *buf, int len, netbuf *nData) {
   int i;
   if (nData->dir != FTPLIB_WRITE)
     return 0;
+  rate_limit(nData, len);
   if (nData->buf)
     i = writeline(buf, len, nData);
   else {
-    socket_wait(nData);
-    i = net_write(nData->handle, buf, len);
+    if (!socket_wait(nData))
+      return 0;
+    i = data_write(nData, buf, len);
   }
   if (i == -1)
     return 0;
-  nData->xfered += i;
-  if (nData->idlecb && nData->cbbytes) {
-    nData->xfered1 += i;
-    if (nData->xfered1 > nData->cbbytes) {
-      nData->idlecb(nData, nData->xfered, nData->idlearg);
-      nData->xfered1 = 0;
-    }
-  }
+  if (!data_account(nData, i))
+    return 0;
   return i;
 }
 
@@ -927,38 +1985,92 @@ GLOBALDEF int FtpClose(netbuf *nData) {
     /* potential problem - if buffer flush fails, how to notify user? */
     if (nData->buf != NULL)
       writeline(NULL, 0, nData);
+    if (nData->block && (nData->blkend == 0) &&
+        (block_send(nData, BLOCK_EOF, NULL, 0) == 0))
+      nData->blkend = 1;
   case FTPLIB_READ:
-    if (nData->buf)
-      free(nData->buf);
-    shutdown(nData->handle, 2);
-    net_close(nData->handle);
     ctrl = nData->ctrl;
-    free(nData);
+    /* in MODE B a connection that saw the EOF block serves the next
+       transfer */
+    if (nData->block && (nData->blkend == 1) && (nData->blkleft == 0) &&
+        (ctrl != NULL) && (ctrl->blockfd == -1)) {
+      ctrl->blockfd = nData->handle;
+#if defined(FTPLIB_TLS)
+      ctrl->blockssl = nData->ssl;
+      nData->ssl = NULL;
+#endif
+    } else {
+      tls_close(nData);
+      shutdown(nData->handle, 2);
+      net_close(nData->handle);
+    }
+    data_put(nData, ctrl);
+    if (ctrl == NULL)
+      return 1;
     ctrl->data = NULL;
-    if (ctrl && ctrl->response[0] != '4' && ctrl->response[0] != 5) {
-      return (readresp('2', ctrl));
+    if (ctrl->response[0] != '4' && ctrl->response[0] != '5') {
+      int rv = readresp('2', ctrl);
+      trace(ctrl, FTPLIB_TRACE_XFER_DONE, ctrl->response);
+      /* 226: the server closes the data connection after all */
+      if (!rv || (strncmp(ctrl->response, "226", 3) == 0))
+        block_drop(ctrl);
+      return rv;
     }
+    block_drop(ctrl);
     return 1;
   case FTPLIB_CONTROL:
     if (nData->data) {
       nData->ctrl = NULL;
       FtpClose(nData->data);
     }
-    net_close(nData->handle);
-    free(nData);
+    control_free(nData);
     return 0;
   }
   return 1;
 }
 
 /*
- * FtpSite - send a SITE command
+ * FtpDataAlive - check that an upload may go on writing
  *
- * return 1 if command successful, 0 otherwise
+ * A server sends nothing on the data connection of an upload, nor on the
+ * control connection before the transfer ends: anything to read on either
+ * means it closed or aborted the transfer, and data written from now on
+ * would be lost.
+ *
+ * return 1 if the connection looks usable, 0 otherwise
  */
-GLOBALDEF int FtpSite(const char *cmd, netbuf *nControl) {
-  char buf[TMP_BUFSIZ];
-
+GLOBALDEF int FtpDataAlive(netbuf *nData) {
+  netbuf *ctrl = nData->ctrl;
+  fd_set mask;
+  struct timeval tv;
+  int max;
+
+  if ((nData->dir != FTPLIB_WRITE) || (ctrl == NULL) || (ctrl->cavail > 0))
+    return 0;
+  FD_ZERO(&mask);
+  FD_SET(nData->handle, &mask);
+  FD_SET(ctrl->handle, &mask);
+  max = (nData->handle > ctrl->handle) ? nData->handle : ctrl->handle;
+  tv.tv_sec = tv.tv_usec = 0;
+  switch (select(max + 1, &mask, NULL, NULL, &tv)) {
+  case 0:
+    return 1;
+  case -1:
+    return 0;
+  }
+  if (FD_ISSET(ctrl->handle, &mask) && !tls_idle(ctrl->ssl, ctrl->handle))
+    return 0;
+  return !FD_ISSET(nData->handle, &mask) || tls_idle(nData->ssl, nData->handle);
+}
+
+/*
+ * FtpSite - send a SITE command
+ *
+ * return 1 if command successful, 0 otherwise
+ */
+GLOBALDEF int FtpSite(const char *cmd, netbuf *nControl) {
+  char buf[TMP_BUFSIZ];
+
   if ((strlen(cmd) + 7) > sizeof(buf))
     return 0;
   sprintf(buf, "SITE %s", cmd);
@@ -1069,6 +2181,591 @@ GLOBALDEF int FtpPwd(char *path, int max, netbuf *nControl) {
   return 1;
 }
 
+/*
+ * FtpVerifyDigest - compare the digest of the last transfer with the
+ * one computed by the server, if it offers HASH, XCRC or XMD5
+ *
+ * return 0 on mismatch, 1 otherwise
+ */
+static int FtpVerifyDigest(const char *path, netbuf *nControl) {
+  char cmd[TMP_BUFSIZ];
+  int algo = nControl->hashalgo;
+  int hexlen = FtpHashHexLen(algo);
+  int feats, hashbit;
+  const char *name;
+  char *tok;
+
+  if ((strlen(path) + 16) > sizeof(cmd))
+    return 1;
+  switch (algo) {
+  case FTPLIB_HASH_CRC32:
+    name = "CRC32";
+    hashbit = FTPLIB_FEAT_HASH_CRC32;
+    break;
+  case FTPLIB_HASH_MD5:
+    name = "MD5";
+    hashbit = FTPLIB_FEAT_HASH_MD5;
+    break;
+  default:
+    name = "SHA-256";
+    hashbit = FTPLIB_FEAT_HASH_SHA256;
+    break;
+  }
+  feats = FtpFeatures(nControl);
+  if ((feats & FTPLIB_FEAT_HASH) && (feats & hashbit)) {
+    sprintf(cmd, "OPTS HASH %s", name);
+    if (!FtpSendCmd(cmd, '2', nControl))
+      return 1;
+    sprintf(cmd, "HASH %s", path);
+  } else if ((algo == FTPLIB_HASH_CRC32) && (feats & FTPLIB_FEAT_XCRC))
+    sprintf(cmd, "XCRC %s", path);
+  else if ((algo == FTPLIB_HASH_MD5) && (feats & FTPLIB_FEAT_XMD5))
+    sprintf(cmd, "XMD5 %s", path);
+  else
+    return 1;
+  if (!FtpSendCmd(cmd, '2', nControl))
+    return 1;
+  /* the digest is the reply token made of hexlen hex digits */
+  for (tok = &nControl->response[3]; *tok; tok++) {
+    int i;
+    if ((tok[-1] != ' ') || (*tok == ' '))
+      continue;
+    for (i = 0; (i < hexlen) && isxdigit((unsigned char)tok[i]); i++)
+      ;
+    if ((i != hexlen) || (isxdigit((unsigned char)tok[i])))
+      continue;
+    for (i = 0; i < hexlen; i++)
+      if (tolower((unsigned char)tok[i]) != nControl->digest[i])
+        break;
+    if (i == hexlen) {
+      nControl->digestst = FTPLIB_DIGEST_VERIFIED;
+      return 1;
+    }
+    nControl->digestst = FTPLIB_DIGEST_MISMATCH;
+    snprintf(nControl->response, sizeof(nControl->response),
+             "Checksum mismatch, local %s %s\n", name, nControl->digest);
+    return 0;
+  }
+  return 1;
+}
+
+/* page cache handling of the local file of a transfer */
+struct pagecache {
+  int policy; /* FTPLIB_PAGECACHE_*, as applied */
+  int fd;
+  int write;       /* the local file is being written */
+  long long mark;  /* start of the window not yet handed to writeback */
+};
+
+/*
+ * cache_start - apply the page cache policy to the local file
+ *
+ * Sources of uploads are read sequentially and only once.  Downloads
+ * in IMAGE mode can bypass the cache with O_DIRECT when the file system
+ * allows it; otherwise they drop what they wrote, see cache_behind().
+ */
+static void cache_start(netbuf *nControl, struct pagecache *pc, FILE *local,
+                        int typ, int mode) {
+  pc->policy = nControl->pagecache;
+  pc->fd = fileno(local);
+  pc->write = (typ != FTPLIB_FILE_WRITE);
+  pc->mark = 0;
+  if (pc->policy == FTPLIB_PAGECACHE_KEEP)
+    return;
+#if defined(POSIX_FADV_SEQUENTIAL)
+  if (!pc->write) {
+    posix_fadvise(pc->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(pc->fd, 0, 0, POSIX_FADV_NOREUSE);
+  }
+#endif
+  if ((pc->policy == FTPLIB_PAGECACHE_DIRECT) &&
+      (!pc->write || (typ != FTPLIB_FILE_READ) || (mode != FTPLIB_IMAGE) ||
+       (nControl->codec != FTPLIB_CODEC_NONE)))
+    pc->policy = FTPLIB_PAGECACHE_DROP;
+  if (pc->policy == FTPLIB_PAGECACHE_DIRECT) {
+#if defined(O_DIRECT)
+    if ((nControl->directbuf == NULL) &&
+        (posix_memalign((void **)&nControl->directbuf, DIRECT_ALIGN,
+                        DIRECT_BUFSIZ) != 0))
+      nControl->directbuf = NULL;
+    if ((nControl->directbuf != NULL) &&
+        (fcntl(pc->fd, F_SETFL, fcntl(pc->fd, F_GETFL) | O_DIRECT) == 0))
+      return;
+    ftplog(nControl, 2, "O_DIRECT refused (%s), dropping cache instead",
+           strerror(nControl->directbuf ? errno : ENOMEM));
+#endif
+    pc->policy = FTPLIB_PAGECACHE_DROP;
+  }
+}
+
+/*
+ * cache_behind - drop the local file from the page cache behind pos
+ *
+ * Written data is handed to writeback one window at a time, and the
+ * window before it, by then on disk, is dropped: the transfer never
+ * holds more than two windows of the file in memory.
+ */
+static void cache_behind(struct pagecache *pc, long long pos) {
+  if (pc->policy != FTPLIB_PAGECACHE_DROP)
+    return;
+  while (pos - pc->mark >= CACHE_WINDOW) {
+#if defined(SYNC_FILE_RANGE_WRITE)
+    if (pc->write) {
+      sync_file_range(pc->fd, pc->mark, CACHE_WINDOW, SYNC_FILE_RANGE_WRITE);
+      if (pc->mark >= CACHE_WINDOW)
+        sync_file_range(pc->fd, pc->mark - CACHE_WINDOW, CACHE_WINDOW,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                            SYNC_FILE_RANGE_WAIT_AFTER);
+    }
+#endif
+#if defined(POSIX_FADV_DONTNEED)
+    if (pc->mark >= CACHE_WINDOW)
+      posix_fadvise(pc->fd, pc->mark - CACHE_WINDOW, CACHE_WINDOW,
+                    POSIX_FADV_DONTNEED);
+#endif
+    pc->mark += CACHE_WINDOW;
+  }
+}
+
+/*
+ * cache_end - drop what is left of the local file from the page cache
+ *
+ * Call once the stdio buffer of the file is flushed.
+ */
+static void cache_end(struct pagecache *pc) {
+  long long from = pc->mark >= CACHE_WINDOW ? pc->mark - CACHE_WINDOW : 0;
+  if (pc->policy == FTPLIB_PAGECACHE_KEEP)
+    return;
+#if defined(SYNC_FILE_RANGE_WRITE)
+  if (pc->write)
+    sync_file_range(pc->fd, from, 0,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                        SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+#if defined(POSIX_FADV_DONTNEED)
+  posix_fadvise(pc->fd, from, 0, POSIX_FADV_DONTNEED);
+#endif
+}
+
+#if defined(O_DIRECT)
+/*
+ * direct_recv - download into a file opened with O_DIRECT
+ *
+ * Data collects in an aligned buffer written out whole; the unaligned
+ * tail goes through the page cache and is dropped from it afterwards.
+ *
+ * return 1 if successful, 0 otherwise
+ */
+static int direct_recv(netbuf *nControl, netbuf *nData, struct pagecache *pc,
+                       FtpHash *hash) {
+  char *buf = nControl->directbuf;
+  int fill = 0, eof = 0, l, w;
+  long long pos = 0;
+
+  while (!eof) {
+    if ((l = FtpRead(buf + fill, DIRECT_BUFSIZ - fill, nData)) > 0) {
+      if (hash != NULL)
+        FtpHashUpdate(hash, buf + fill, l);
+      fill += l;
+    } else
+      eof = 1;
+    if ((fill == 0) || ((fill < DIRECT_BUFSIZ) && !eof))
+      continue;
+    if (fill < DIRECT_BUFSIZ) {
+      fcntl(pc->fd, F_SETFL, fcntl(pc->fd, F_GETFL) & ~O_DIRECT);
+      pc->policy = FTPLIB_PAGECACHE_DROP;
+    }
+    for (w = 0; w < fill; w += l) {
+      while (((l = write(pc->fd, buf + w, fill - w)) == -1) && (errno == EINTR))
+        ;
+      if ((l == -1) && (errno == EINVAL) &&
+          (pc->policy == FTPLIB_PAGECACHE_DIRECT)) {
+        /* accepted by fcntl() but not by the file system's writes */
+        ftplog(nControl, 2, "O_DIRECT write refused, dropping cache instead");
+        fcntl(pc->fd, F_SETFL, fcntl(pc->fd, F_GETFL) & ~O_DIRECT);
+        pc->policy = FTPLIB_PAGECACHE_DROP;
+        l = 0;
+        continue;
+      }
+      if (l <= 0) {
+        ftplog(nControl, 1, "localfile write: %s", strerror(errno));
+        return 0;
+      }
+    }
+    cache_behind(pc, pos += fill);
+    fill = 0;
+  }
+  return 1;
+}
+#endif
+
+#if !defined(_WIN32)
+/* ring of blocks between the data connection and a disk thread */
+struct overlap {
+  pthread_mutex_t lock;
+  pthread_cond_t cond; /* a slot was filled or emptied, or the ring ended */
+  pthread_t thread;
+  char *buf;           /* depth slots of size bytes */
+  int len[FTPLIB_OVERLAP_MAXDEPTH];
+  int depth, size;
+  unsigned head;       /* slots filled so far */
+  unsigned tail;       /* slots emptied so far */
+  int done;            /* the producer has no more blocks */
+  int stop;            /* the consumer gave up */
+  int err;             /* errno of the disk thread, read after the join */
+  int write;           /* download: the disk thread writes the local file */
+  FILE *local;
+  FtpHash *hash;
+  struct pagecache *pc;
+};
+
+/* producer: next free slot, NULL once the consumer gave up */
+static char *ring_slot(struct overlap *o) {
+  char *p = NULL;
+  pthread_mutex_lock(&o->lock);
+  while ((o->head - o->tail == (unsigned)o->depth) && !o->stop)
+    pthread_cond_wait(&o->cond, &o->lock);
+  if (!o->stop)
+    p = o->buf + (size_t)(o->head % o->depth) * o->size;
+  pthread_mutex_unlock(&o->lock);
+  return p;
+}
+
+/* producer: hand the slot from ring_slot() over, holding len bytes */
+static void ring_push(struct overlap *o, int len) {
+  pthread_mutex_lock(&o->lock);
+  o->len[o->head % o->depth] = len;
+  o->head++;
+  pthread_cond_signal(&o->cond);
+  pthread_mutex_unlock(&o->lock);
+}
+
+/* consumer: oldest filled slot, NULL once the producer is done */
+static char *ring_peek(struct overlap *o, int *len) {
+  char *p = NULL;
+  pthread_mutex_lock(&o->lock);
+  while ((o->head == o->tail) && !o->done)
+    pthread_cond_wait(&o->cond, &o->lock);
+  if (o->head != o->tail) {
+    p = o->buf + (size_t)(o->tail % o->depth) * o->size;
+    *len = o->len[o->tail % o->depth];
+  }
+  pthread_mutex_unlock(&o->lock);
+  return p;
+}
+
+/* consumer: release the slot from ring_peek() */
+static void ring_pop(struct overlap *o) {
+  pthread_mutex_lock(&o->lock);
+  o->tail++;
+  pthread_cond_signal(&o->cond);
+  pthread_mutex_unlock(&o->lock);
+}
+
+/* end the ring from either side: done for the producer, stop otherwise */
+static void ring_end(struct overlap *o, int *flag) {
+  pthread_mutex_lock(&o->lock);
+  *flag = 1;
+  pthread_cond_signal(&o->cond);
+  pthread_mutex_unlock(&o->lock);
+}
+
+/*
+ * overlap_disk - disk side of an overlapped transfer
+ *
+ * Runs on its own thread: writes downloaded blocks to the local file, or
+ * reads ahead the file being uploaded.  Digest and page cache handling
+ * happen here too, off the network path.
+ */
+static void *overlap_disk(void *arg) {
+  struct overlap *o = arg;
+  long long pos = 0;
+  char *p;
+  int l;
+
+  if (o->write) {
+    while ((p = ring_peek(o, &l)) != NULL) {
+      if (o->hash != NULL)
+        FtpHashUpdate(o->hash, p, l);
+      if (fwrite(p, 1, l, o->local) != (size_t)l) {
+        o->err = errno ? errno : EIO;
+        ring_end(o, &o->stop);
+        break;
+      }
+      cache_behind(o->pc, pos += l);
+      ring_pop(o);
+    }
+  } else {
+    while (((p = ring_slot(o)) != NULL) &&
+           ((l = fread(p, 1, o->size, o->local)) > 0)) {
+      if (o->hash != NULL)
+        FtpHashUpdate(o->hash, p, l);
+      cache_behind(o->pc, pos += l);
+      ring_push(o, l);
+    }
+    if ((p != NULL) && ferror(o->local))
+      o->err = errno ? errno : EIO;
+    ring_end(o, &o->done);
+  }
+  return NULL;
+}
+
+/*
+ * overlap_start - start the disk thread of an overlapped transfer
+ *
+ * The data connection stays on the calling thread, with its callbacks;
+ * a ring of FTPLIB_OVERLAP buffers lets the disk work on one block
+ * while the network moves the next.
+ *
+ * return 1 if the thread runs, 0 to use the inline loops
+ */
+static int overlap_start(netbuf *nControl, struct overlap *o, FILE *local,
+                         int typ, FtpHash *hash, struct pagecache *pc) {
+  size_t need = (size_t)nControl->ovdepth * nControl->ovblock;
+  int err;
+
+  if ((nControl->ovdepth == 0) ||
+      ((typ != FTPLIB_FILE_READ) && (typ != FTPLIB_FILE_WRITE)))
+    return 0;
+  if (nControl->ovsize < need) {
+    free(nControl->ovbuf);
+    nControl->ovsize = 0;
+    if ((nControl->ovbuf = malloc(need)) == NULL) {
+      ftplog(nControl, 1, "malloc: %s", strerror(errno));
+      return 0;
+    }
+    nControl->ovsize = need;
+  }
+  memset(o, 0, sizeof(*o));
+  o->buf = nControl->ovbuf;
+  o->depth = nControl->ovdepth;
+  o->size = nControl->ovblock;
+  o->write = (typ == FTPLIB_FILE_READ);
+  o->local = local;
+  o->hash = hash;
+  o->pc = pc;
+  pthread_mutex_init(&o->lock, NULL);
+  pthread_cond_init(&o->cond, NULL);
+  if ((err = pthread_create(&o->thread, NULL, overlap_disk, o)) != 0) {
+    ftplog(nControl, 1, "pthread_create: %s", strerror(err));
+    pthread_cond_destroy(&o->cond);
+    pthread_mutex_destroy(&o->lock);
+    return 0;
+  }
+  ftplog(nControl, 2, "overlapped transfer, %d buffers of %d bytes",
+         o->depth, o->size);
+  return 1;
+}
+
+/*
+ * overlap_run - network side of an overlapped transfer
+ *
+ * Downloads fill whole slots, so that a line-at-a-time ASCII transfer
+ * does not cost a handoff per line.
+ *
+ * return 1 if successful, 0 otherwise
+ */
+static int overlap_run(netbuf *nControl, netbuf *nData, struct overlap *o) {
+  /* readline() needs room for a buffered line and its terminator */
+  int room = (nData->buf != NULL) ? FTPLIB_BUFSIZ + 1 : 1;
+  int rv = 1, eof = 0, fill, l, c;
+  char *p;
+
+  if (o->write) {
+    while (!eof && ((p = ring_slot(o)) != NULL)) {
+      for (fill = 0; !eof && (o->size - fill >= room); fill += l)
+        if ((l = FtpRead(p + fill, o->size - fill, nData)) <= 0) {
+          eof = 1;
+          l = 0;
+        }
+      if (fill > 0)
+        ring_push(o, fill);
+    }
+    ring_end(o, &o->done);
+  } else {
+    while ((p = ring_peek(o, &l)) != NULL) {
+      if ((c = FtpWrite(p, l, nData)) < l) {
+        if (!nData->cbabort)
+          ftplog(nControl, 1, "short write: passed %d, wrote %d", l, c);
+        rv = 0;
+        break;
+      }
+      ring_pop(o);
+    }
+    ring_end(o, &o->stop);
+  }
+  pthread_join(o->thread, NULL);
+  pthread_cond_destroy(&o->cond);
+  pthread_mutex_destroy(&o->lock);
+  if (o->err) {
+    ftplog(nControl, 1, "localfile %s: %s", o->write ? "write" : "read",
+           strerror(o->err));
+    rv = 0;
+  }
+  return rv;
+}
+#endif
+
+/* digest and accounting of an io_uring download, see uring_block() */
+struct uring_sink {
+  netbuf *nData;
+  FtpHash *hash;
+  struct pagecache *pc;
+  long long got;
+};
+
+/*
+ * uring_block - account for a block received by the io_uring engine
+ *
+ * return 0 to stop the transfer, 1 otherwise
+ */
+static int uring_block(const char *buf, int len, void *arg) {
+  struct uring_sink *sink = arg;
+  if (sink->hash != NULL)
+    FtpHashUpdate(sink->hash, buf, len);
+  /* the ring's writes in flight are far less than a cache window */
+  sink->got += len;
+  cache_behind(sink->pc, sink->got);
+  rate_limit(sink->nData, len);
+  return data_account(sink->nData, len);
+}
+
+/*
+ * uring_usable - whether a download can go through io_uring
+ *
+ * Only plain binary stream downloads into a regular file qualify: ASCII
+ * conversion, MODE B framing, TLS and idle timeouts need the read loop.
+ * The engine is created on first use; if the kernel refuses it the
+ * session falls back to the read loop for good.
+ *
+ * return 1 if FtpXfer() should use nControl->ring
+ */
+static int uring_usable(netbuf *nControl, netbuf *nData, FILE *local) {
+#if defined(__linux__)
+  struct stat st;
+  if (!nControl->uring || (nData->buf != NULL) || nData->block ||
+      (nData->idlecb && (nData->idletime.tv_sec || nData->idletime.tv_usec)))
+    return 0;
+#if defined(FTPLIB_TLS)
+  if (nData->ssl != NULL)
+    return 0;
+#endif
+  if ((fstat(fileno(local), &st) == -1) || !S_ISREG(st.st_mode))
+    return 0;
+  if ((nControl->ring == NULL) &&
+      ((nControl->ring = FtpUringNew(URING_DEPTH, URING_BUFSIZ)) == NULL)) {
+    ftplog(nControl, 2, "io_uring unavailable (%s), using read/write",
+           strerror(errno));
+    nControl->uring = 0;
+    return 0;
+  }
+  ftplog(nControl, 2, "io_uring download, %d buffers of %d bytes",
+         URING_DEPTH, URING_BUFSIZ);
+  return 1;
+#else
+  (void)nControl;
+  (void)nData;
+  (void)local;
+  return 0;
+#endif
+}
+
+/* data connection and local file of a compressed transfer, see zip_xfer() */
+struct zip_sink {
+  netbuf *nData;
+  FILE *local;
+  FtpHash *hash;
+  struct pagecache *pc;
+  long long pos;
+};
+
+/*
+ * zip_send - write a block of compressed data to the server
+ *
+ * return 0 to stop the transfer, 1 otherwise
+ */
+static int zip_send(const char *buf, int len, void *arg) {
+  struct zip_sink *sink = arg;
+  if (sink->hash != NULL)
+    FtpHashUpdate(sink->hash, buf, len);
+  if (FtpWrite(buf, len, sink->nData) < len) {
+    if (!sink->nData->cbabort)
+      ftplog(sink->nData, 1, "short write of compressed data");
+    return 0;
+  }
+  return 1;
+}
+
+/*
+ * zip_store - write a block of decompressed data to the local file
+ *
+ * return 0 to stop the transfer, 1 otherwise
+ */
+static int zip_store(const char *buf, int len, void *arg) {
+  struct zip_sink *sink = arg;
+  if (fwrite(buf, 1, len, sink->local) < (size_t)len) {
+    ftplog(sink->nData, 1, "localfile write: %s", strerror(errno));
+    return 0;
+  }
+  cache_behind(sink->pc, sink->pos += len);
+  return 1;
+}
+
+/*
+ * zip_xfer - file transfer through nControl->codec
+ *
+ * Uploads are compressed on their way to the server and downloads
+ * decompressed on their way to the local file, one FTPLIB_BUFSIZ block
+ * at a time.  The digest covers the bytes on the wire, which are the
+ * server's file.  *why is set to the codec's complaint, if any.
+ *
+ * return 1 if successful, 0 otherwise
+ */
+static int zip_xfer(netbuf *nControl, netbuf *nData, FILE *local, int typ,
+                    FtpHash *hash, struct pagecache *pc, const char **why) {
+  char *dbuf = nControl->xferbuf;
+  struct zip_sink sink;
+  FtpZip *zip;
+  long long in, out;
+  int l, rv = 1;
+  if ((zip = FtpZipNew(nControl->codec, typ == FTPLIB_FILE_WRITE)) == NULL) {
+    ftplog(nControl, 1, "compression: %s", strerror(errno));
+    return 0;
+  }
+  sink.nData = nData;
+  sink.local = local;
+  sink.hash = hash;
+  sink.pc = pc;
+  sink.pos = 0;
+  if (typ == FTPLIB_FILE_WRITE) {
+    while (rv && ((l = fread(dbuf, 1, FTPLIB_BUFSIZ, local)) > 0)) {
+      cache_behind(pc, sink.pos += l);
+      rv = FtpZipRun(zip, dbuf, l, 0, zip_send, &sink);
+    }
+    if (rv && ferror(local)) {
+      ftplog(nControl, 1, "localfile read: %s", strerror(errno));
+      rv = 0;
+    }
+  } else {
+    while (rv && ((l = FtpRead(dbuf, FTPLIB_BUFSIZ, nData)) > 0)) {
+      if (hash != NULL)
+        FtpHashUpdate(hash, dbuf, l);
+      rv = FtpZipRun(zip, dbuf, l, 0, zip_store, &sink);
+    }
+  }
+  /* the end of a download may be a broken connection: the codec tells */
+  if (rv && !nData->cbabort)
+    rv = FtpZipRun(zip, NULL, 0, 1,
+                   typ == FTPLIB_FILE_WRITE ? zip_send : zip_store, &sink);
+  if (!rv && ((*why = FtpZipError(zip)) != NULL))
+    ftplog(nControl, 1, "compressed transfer: %s", *why);
+  FtpZipTotals(zip, &in, &out);
+  ftplog(nControl, 2, "%s %lld bytes into %lld",
+         typ == FTPLIB_FILE_WRITE ? "compressed" : "decompressed", in, out);
+  FtpZipFree(zip);
+  return rv;
+}
+
 /*
  * FtpXfer - issue a command and transfer data
  *
@@ -1080,8 +2777,28 @@ static int FtpXfer(const char *localfile, const char *path, netbuf *nControl,
   char *dbuf;
   FILE *local = NULL;
   netbuf *nData;
-  int rv = 1;
+  int rv = 1, aborted;
+  FtpHash hash;
+  int hashing = (nControl->hashalgo != FTPLIB_HASH_NONE) &&
+                ((typ == FTPLIB_FILE_READ) || (typ == FTPLIB_FILE_WRITE));
+  int zipping = (nControl->codec != FTPLIB_CODEC_NONE) &&
+                ((typ == FTPLIB_FILE_READ) || (typ == FTPLIB_FILE_WRITE));
+  const char *ziperr = NULL;
+  struct pagecache pc;
+  long long pos = 0;
+#if !defined(_WIN32)
+  struct overlap ov;
+#endif
 
+  if ((typ == FTPLIB_FILE_READ) || (typ == FTPLIB_FILE_WRITE)) {
+    nControl->digestst = FTPLIB_DIGEST_NONE;
+    nControl->digest[0] = '\0';
+  }
+  /* line ending conversion would corrupt the compressed stream */
+  if (zipping && (mode != FTPLIB_IMAGE)) {
+    strcpy(nControl->response, "Compressed transfers need IMAGE mode");
+    return 0;
+  }
   if (localfile != NULL) {
     char ac[4];
     memset(ac, 0, sizeof(ac));
@@ -1107,33 +2824,121 @@ static int FtpXfer(const char *localfile, const char *path, netbuf *nControl,
     }
     return 0;
   }
-  dbuf = malloc(FTPLIB_BUFSIZ);
-  if (typ == FTPLIB_FILE_WRITE) {
+  if (nControl->xferbuf == NULL)
+    nControl->xferbuf = malloc(FTPLIB_BUFSIZ);
+  dbuf = nControl->xferbuf;
+  if (hashing)
+    FtpHashInit(&hash, nControl->hashalgo);
+  pc.policy = FTPLIB_PAGECACHE_KEEP;
+  if ((localfile != NULL) &&
+      ((typ == FTPLIB_FILE_READ) || (typ == FTPLIB_FILE_WRITE)))
+    cache_start(nControl, &pc, local, typ, mode);
+  if (dbuf == NULL) {
+    ftplog(nControl, 1, "malloc: %s", strerror(errno));
+    rv = 0;
+  } else if (zipping) {
+    rv = zip_xfer(nControl, nData, local, typ, hashing ? &hash : NULL, &pc,
+                  &ziperr);
+#if defined(O_DIRECT)
+  } else if (pc.policy == FTPLIB_PAGECACHE_DIRECT) {
+    rv = direct_recv(nControl, nData, &pc, hashing ? &hash : NULL);
+#endif
+  } else if ((localfile != NULL) && (typ == FTPLIB_FILE_READ) &&
+             uring_usable(nControl, nData, local)) {
+    struct uring_sink sink;
+    long long off;
+    sink.nData = nData;
+    sink.hash = hashing ? &hash : NULL;
+    sink.pc = &pc;
+    sink.got = 0;
+    fflush(local);
+    off = lseek(fileno(local), 0, SEEK_CUR);
+    if (FtpUringRecvFile(nControl->ring, nData->handle, fileno(local),
+                         off < 0 ? 0 : off, uring_block, &sink) == -1) {
+      if (!nData->cbabort)
+        ftplog(nControl, 1, "io_uring transfer: %s", strerror(errno));
+      rv = 0;
+    }
+#if !defined(_WIN32)
+  } else if (overlap_start(nControl, &ov, local, typ,
+                           hashing ? &hash : NULL, &pc)) {
+    rv = overlap_run(nControl, nData, &ov);
+#endif
+  } else if (typ == FTPLIB_FILE_WRITE) {
     while ((l = fread(dbuf, 1, FTPLIB_BUFSIZ, local)) > 0) {
+      if (hashing)
+        FtpHashUpdate(&hash, dbuf, l);
+      cache_behind(&pc, pos += l);
       if ((c = FtpWrite(dbuf, l, nData)) < l) {
-        printf("short write: passed %d, wrote %d\n", l, c);
+        if (!nData->cbabort)
+          ftplog(nControl, 1, "short write: passed %d, wrote %d", l, c);
         rv = 0;
         break;
       }
     }
   } else {
     while ((l = FtpRead(dbuf, FTPLIB_BUFSIZ, nData)) > 0) {
+      if (hashing)
+        FtpHashUpdate(&hash, dbuf, l);
       if (fwrite(dbuf, 1, l, local) == 0) {
-        if (ftplib_debug)
-          perror("localfile write");
+        ftplog(nControl, 1, "localfile write: %s", strerror(errno));
         rv = 0;
         break;
       }
+      cache_behind(&pc, pos += l);
     }
   }
-  free(dbuf);
   fflush(local);
+  cache_end(&pc);
   if (localfile != NULL)
     fclose(local);
+  aborted = nData->cbabort;
   FtpClose(nData);
+  if (aborted) {
+    strcpy(nControl->response, "Transfer aborted by callback");
+    rv = 0;
+  } else if (ziperr != NULL)
+    snprintf(nControl->response, sizeof(nControl->response),
+             "Compressed data: %s", ziperr);
+  if (rv && hashing && (nControl->response[0] == '2')) {
+    FtpHashFinal(&hash, nControl->digest, sizeof(nControl->digest));
+    nControl->digestst = FTPLIB_DIGEST_LOCAL;
+    /* in ASCII mode the local bytes differ from the server's file */
+    if (mode == FTPLIB_IMAGE)
+      rv = FtpVerifyDigest(path, nControl);
+  }
   return rv;
 }
 
+/*
+ * FtpBlockMode - whether transfers run in MODE B
+ *
+ * Known once a transfer has been started with FTPLIB_BLOCKMODE set.
+ *
+ * return 1 if the server accepted MODE B, 0 in stream mode
+ */
+GLOBALDEF int FtpBlockMode(netbuf *nControl) {
+  return (nControl->dir == FTPLIB_CONTROL) && nControl->wantblock &&
+         (nControl->xmode == 'B');
+}
+
+/*
+ * FtpDigest - digest of the last file transfer
+ *
+ * Copies the lowercase hex digest computed with FTPLIB_HASHALGO.
+ *
+ * return FTPLIB_DIGEST_* status
+ */
+GLOBALDEF int FtpDigest(char *hex, int max, netbuf *nControl) {
+  if (nControl->dir != FTPLIB_CONTROL)
+    return FTPLIB_DIGEST_NONE;
+  if ((hex != NULL) && (max > 0)) {
+    strncpy(hex, nControl->digest, max);
+    hex[max - 1] = '\0';
+  }
+  return nControl->digestst;
+}
+
 /*
  * FtpNlst - issue an NLST command and write response to output
  *
@@ -1154,6 +2959,70 @@ GLOBALDEF int FtpDir(const char *outputfile, const char *path,
   return FtpXfer(outputfile, path, nControl, FTPLIB_DIR_VERBOSE, FTPLIB_ASCII);
 }
 
+/*
+ * FtpMlsd - issue an MLSD command and write response to output
+ *
+ * return 1 if successful, 0 otherwise
+ */
+GLOBALDEF int FtpMlsd(const char *outputfile, const char *path,
+                      netbuf *nControl) {
+  return FtpXfer(outputfile, path, nControl, FTPLIB_MLSD, FTPLIB_ASCII);
+}
+
+/*
+ * FtpPipeline - send several commands without waiting for each reply
+ *
+ * Commands are written FTPLIB_PIPEDEPTH at a time, then their replies
+ * are read in order and passed to cb with the command index.  Saves one
+ * round trip per command for metadata lookups such as SIZE and MDTM.
+ *
+ * return number of replies received, n if all commands were answered
+ */
+GLOBALDEF int FtpPipeline(const char **cmds, int n, FtpReplyCallback cb,
+                          void *arg, netbuf *nControl) {
+  char *buf;
+  int i, j, k, len, done = 0;
+
+  if (nControl->dir != FTPLIB_CONTROL)
+    return 0;
+  if ((buf = malloc(FTPLIB_PIPEDEPTH * TMP_BUFSIZ)) == NULL)
+    return 0;
+  for (i = 0; i < n; i = j) {
+    len = 0;
+    for (j = i; (j < n) && (j < i + FTPLIB_PIPEDEPTH); j++) {
+      if ((strlen(cmds[j]) + 3) > TMP_BUFSIZ)
+        break;
+      ftplog(nControl, 3, "%s", cmds[j]);
+      cmd_account(cmds[j], nControl);
+      len += sprintf(&buf[len], "%s\r\n", cmds[j]);
+    }
+    if ((j == i) || (nb_write(nControl, buf, len) <= 0)) {
+      if (j > i)
+        ftplog(nControl, 1, "write: %s", strerror(errno));
+      break;
+    }
+    if (nControl->tracecb)
+      for (k = i; k < j; k++)
+        trace(nControl, FTPLIB_TRACE_CMD, cmds[k]);
+    for (k = i; k < j; k++) {
+      /* readresp() leaves the buffer empty when the connection fails */
+      nControl->response[0] = '\0';
+      readresp('2', nControl);
+      if (nControl->response[0] == '\0')
+        break;
+      if (!strncmp(cmds[k], "TYPE ", 5) && (nControl->response[0] == '2'))
+        nControl->curtype = cmds[k][5];
+      if (cb)
+        cb(k, nControl->response, arg);
+      done++;
+    }
+    if (k < j)
+      break;
+  }
+  free(buf);
+  return done;
+}
+
 /*
  * FtpSize - determine the size of a remote file
  *
@@ -1167,8 +3036,7 @@ GLOBALDEF int FtpSize(const char *path, unsigned int *size, char mode,
 
   if ((strlen(path) + 7) > sizeof(cmd))
     return 0;
-  sprintf(cmd, "TYPE %c", mode);
-  if (!FtpSendCmd(cmd, '2', nControl))
+  if (!ftp_type(mode, nControl))
     return 0;
   sprintf(cmd, "SIZE %s", path);
   if (!FtpSendCmd(cmd, '2', nControl))
@@ -1196,8 +3064,7 @@ GLOBALDEF int FtpSizeLong(const char *path, fsz_t *size, char mode,
 
   if ((strlen(path) + 7) > sizeof(cmd))
     return 0;
-  sprintf(cmd, "TYPE %c", mode);
-  if (!FtpSendCmd(cmd, '2', nControl))
+  if (!ftp_type(mode, nControl))
     return 0;
   sprintf(cmd, "SIZE %s", path);
   if (!FtpSendCmd(cmd, '2', nControl))
@@ -1232,6 +3099,67 @@ GLOBALDEF int FtpModDate(const char *path, char *dt, int max,
   return rv;
 }
 
+/*
+ * FtpSetModDate - set the modification time of a remote file (MFMT)
+ *
+ * dt is YYYYMMDDHHMMSS in UTC, as returned by FtpModDate
+ *
+ * return 1 if successful, 0 otherwise
+ */
+GLOBALDEF int FtpSetModDate(const char *path, const char *dt,
+                            netbuf *nControl) {
+  char buf[TMP_BUFSIZ];
+
+  if ((strlen(path) + strlen(dt) + 7) > sizeof(buf))
+    return 0;
+  sprintf(buf, "MFMT %s %s", dt, path);
+  return FtpSendCmd(buf, '2', nControl);
+}
+
+/*
+ * mlst_line - keep the facts line of an MLST reply
+ */
+struct mlst_facts {
+  char *buf;
+  int max;
+  int got;
+};
+
+static void mlst_line(const char *line, void *arg) {
+  struct mlst_facts *f = arg;
+  if (f->got || (f->max <= 0))
+    return;
+  if (*line == ' ')
+    line++;
+  strncpy(f->buf, line, f->max);
+  f->buf[f->max - 1] = '\0';
+  f->buf[strcspn(f->buf, "\r\n")] = '\0';
+  f->got = 1;
+}
+
+/*
+ * FtpMlst - facts of a single path in one round trip (RFC 3659)
+ *
+ * copies the "fact=value;...; path" line of the reply to facts
+ *
+ * return 1 if successful, 0 otherwise
+ */
+GLOBALDEF int FtpMlst(const char *path, char *facts, int max,
+                      netbuf *nControl) {
+  char buf[TMP_BUFSIZ];
+  struct mlst_facts f;
+
+  if ((strlen(path) + 6) > sizeof(buf))
+    return 0;
+  f.buf = facts;
+  f.max = max;
+  f.got = 0;
+  sprintf(buf, "MLST %s", path);
+  if (!FtpSendCmdLines(buf, '2', nControl, mlst_line, &f))
+    return 0;
+  return f.got;
+}
+
 /*
  * FtpGet - issue a GET command and write received data to output
  *
@@ -1252,6 +3180,121 @@ GLOBALDEF int FtpPut(const char *inputfile, const char *path, char mode,
   return FtpXfer(inputfile, path, nControl, FTPLIB_FILE_WRITE, mode);
 }
 
+/*
+ * fxp_prepare - set the type of a server-to-server transfer
+ *
+ * The two servers talk stream mode to each other; block_mode() asks for
+ * MODE B again before the next transfer of a session that wants it.
+ *
+ * return 1 if successful, 0 otherwise
+ */
+static int fxp_prepare(netbuf *nControl, char mode) {
+  if (!ftp_type(mode, nControl))
+    return 0;
+  return stream_mode(nControl);
+}
+
+/*
+ * fxp_link - point one server's PORT at the other's PASV address
+ *
+ * return 1 if successful, -1 if PORT was refused, 0 otherwise
+ */
+static int fxp_link(netbuf *nPasv, netbuf *nPort) {
+  char buf[TMP_BUFSIZ];
+  unsigned int v[6];
+  char *cp;
+
+  if (!FtpSendCmd("PASV", '2', nPasv))
+    return 0;
+  if (((cp = strchr(nPasv->response, '(')) == NULL) ||
+      (sscanf(cp + 1, "%u,%u,%u,%u,%u,%u", &v[0], &v[1], &v[2], &v[3], &v[4],
+              &v[5]) != 6))
+    return 0;
+  sprintf(buf, "PORT %u,%u,%u,%u,%u,%u", v[0], v[1], v[2], v[3], v[4], v[5]);
+  if (!FtpSendCmd(buf, '2', nPort))
+    return (nPort->response[0] == '5') ? -1 : 0;
+  return 1;
+}
+
+/*
+ * fxp_abort - abort the half of a server-to-server transfer that started
+ *
+ * Reads replies until the one to ABOR, or a failure.
+ */
+static void fxp_abort(netbuf *nControl) {
+  int i;
+  if (!send_cmd("ABOR", nControl))
+    return;
+  for (i = 0; i < 3; i++) {
+    /* readresp() leaves the buffer empty when the connection fails */
+    nControl->response[0] = '\0';
+    if (readresp('2', nControl) || (nControl->response[0] == '5') ||
+        (nControl->response[0] == '\0'))
+      break;
+  }
+}
+
+/*
+ * FtpXferServer - copy a file from one server to another (FXP)
+ *
+ * The data flows between the two servers: the destination listens and
+ * the source connects to it, or the other way round if the source
+ * refuses to connect to another host.  Progress callbacks do not fire,
+ * since no data passes through this client.  On failure the last
+ * response of the session that failed tells why.
+ *
+ * return 1 if successful, 0 otherwise
+ */
+GLOBALDEF int FtpXferServer(const char *srcpath, netbuf *nSrc,
+                            const char *dstpath, netbuf *nDst, char mode) {
+  char retr[TMP_BUFSIZ], stor[TMP_BUFSIZ];
+  netbuf *nPasv = nDst, *nPort = nSrc;
+  int link, src_ok, dst_ok;
+
+  if ((nSrc->dir != FTPLIB_CONTROL) || (nDst->dir != FTPLIB_CONTROL) ||
+      (nSrc == nDst))
+    return 0;
+  if ((mode != FTPLIB_ASCII) && (mode != FTPLIB_IMAGE)) {
+    sprintf(nDst->response, "Invalid mode %c\n", mode);
+    return 0;
+  }
+  if (((strlen(srcpath) + 6) > sizeof(retr)) ||
+      ((strlen(dstpath) + 6) > sizeof(stor)))
+    return 0;
+  sprintf(retr, "RETR %s", srcpath);
+  sprintf(stor, "STOR %s", dstpath);
+#if defined(FTPLIB_TLS)
+  if (tls_data(nSrc) || tls_data(nDst)) {
+    strcpy(nDst->response, "FXP needs clear data connections\n");
+    return 0;
+  }
+#endif
+  if (!fxp_prepare(nSrc, mode) || !fxp_prepare(nDst, mode))
+    return 0;
+  if ((link = fxp_link(nPasv, nPort)) == -1) {
+    ftplog(nSrc, 2, "PORT refused, the source server listens instead");
+    nPasv = nSrc;
+    nPort = nDst;
+    link = fxp_link(nPasv, nPort);
+  }
+  if (link != 1)
+    return 0;
+  /* the connecting side goes first: its connection waits in the other
+     server's listen queue.  With the source connecting a missing source
+     fails before the destination file is touched; when the source
+     listens STOR comes first, and a refused RETR aborts it, possibly
+     leaving an empty destination file */
+  if (!FtpSendCmd(nPort == nSrc ? retr : stor, '1', nPort))
+    return 0;
+  if (!FtpSendCmd(nPasv == nSrc ? retr : stor, '1', nPasv)) {
+    fxp_abort(nPort);
+    return 0;
+  }
+  src_ok = readresp('2', nSrc);
+  dst_ok = readresp('2', nDst);
+  return src_ok && dst_ok;
+}
+
 /*
  * FtpRename - rename a file at remote
  *
@@ -1296,7 +3339,50 @@ GLOBALDEF void FtpQuit(netbuf *nControl) {
   if (nControl->dir != FTPLIB_CONTROL)
     return;
   FtpSendCmd("QUIT", '2', nControl);
-  net_close(nControl->handle);
-  free(nControl->buf);
-  free(nControl);
+  control_free(nControl);
+}
+
+#if defined(FTPLIB_TEST_BUILD)
+/*
+ * FtpTestNetbuf - wrap a connected socket for the test hooks below
+ *
+ * dir is FTPLIB_CONTROL, FTPLIB_READ or FTPLIB_WRITE
+ * return NULL on failure
+ */
+GLOBALDEF netbuf *FtpTestNetbuf(int handle, int dir) {
+  netbuf *n = calloc(1, sizeof(netbuf));
+  if (n == NULL)
+    return NULL;
+  if ((n->buf = malloc(FTPLIB_BUFSIZ)) == NULL) {
+    free(n);
+    return NULL;
+  }
+  n->handle = handle;
+  n->dir = dir;
+  n->blockfd = -1;
+  n->ctrl = n;
+  n->cput = n->cget = n->buf;
+  n->cleft = FTPLIB_BUFSIZ;
+  return n;
 }
+
+/*
+ * FtpTestFree - release a netbuf from FtpTestNetbuf, the socket stays open
+ */
+GLOBALDEF void FtpTestFree(netbuf *n) {
+  free(n->buf);
+  free(n);
+}
+
+GLOBALDEF int FtpTestReadline(char *buf, int max, netbuf *ctl) {
+  return readline(buf, max, ctl);
+}
+
+GLOBALDEF int FtpTestWriteline(const char *buf, int len, netbuf *nData) {
+  return writeline(buf, len, nData);
+}
+
+GLOBALDEF int FtpTestReadresp(char c, netbuf *nControl) {
+  return readresp(c, nControl);
+}
+#endif
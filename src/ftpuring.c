@@ -0,0 +1,310 @@
+/***************************************************************************/
+/*                                                                         */
+/* ftpuring.c - io_uring download engine for ftplib transfers              */
+/* Copyright (C) 2015 Paolo Bosetti and Matteo Ragni,                      */
+/* paolo[dot]bosetti[at]unitn.it and matteo[dot]ragni[at]unitn.it          */
+/* Department of Industrial Engineering, University of Trento              */
+/*                                                                         */
+/* This library is free software.  You can redistribute it and/or          */
+/* modify it under the terms of the GNU GENERAL PUBLIC LICENSE 2.0.        */
+/*                                                                         */
+/* This library is distributed in the hope that it will be useful,         */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           */
+/* Artistic License 2.0 for more details.                                  */
+/*                                                                         */
+/* See the file LICENSE                                                    */
+/*                                                                         */
+/***************************************************************************/
+
+/*
+Talks to the kernel through the raw io_uring_setup/io_uring_enter/
+io_uring_register system calls, so there is no liburing dependency.
+A download keeps one socket read in flight plus a file write for every
+block already received: the network never waits for the disk and the
+disk sees several writes queued. Blocks go to the caller's callback in
+order before they are written, for digests and progress accounting.
+Elsewhere than Linux, or without the kernel headers, FtpUringNew()
+fails with ENOSYS and ftplib keeps its read/write loop.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "ftpuring.h"
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define FTPURING_LINUX
+#endif
+#endif
+#endif
+
+#if defined(FTPURING_LINUX)
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define URING_ALIGN 4096   /* page aligned buffers, usable with O_DIRECT */
+#define URING_RECV 0x10000 /* user_data flag of the socket read */
+#define URING_MAXDEPTH 1024
+
+struct slot {
+  int len;       /* bytes received into the buffer */
+  int done;      /* bytes of them already written */
+  long long off; /* file offset of the buffer */
+  struct iovec iov;
+};
+
+struct FtpUring {
+  int fd;
+  int depth, bufsiz;
+  int fixed;  /* buffers registered: READ_FIXED/WRITE_FIXED */
+  int broken; /* io_uring_enter() failed with requests in flight */
+  char *bufs;
+  struct slot *slots;
+  int *freelist;
+  void *sqmap, *cqmap;
+  size_t sqlen, cqlen;
+  struct io_uring_sqe *sqes;
+  size_t sqeslen;
+  unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+  unsigned *cqhead, *cqtail, *cqmask;
+  struct io_uring_cqe *cqes;
+};
+
+static int uring_enter(int fd, unsigned submit, unsigned wait) {
+  return (int)syscall(__NR_io_uring_enter, fd, submit, wait,
+                      IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+/* queues a read or write of slot i; the ring never holds more entries
+   than there are buffers, so there is always room */
+static void uring_queue(FtpUring *u, int write, int fd, int i,
+                        long long off) {
+  struct slot *s = &u->slots[i];
+  unsigned tail = *u->sqtail, idx = tail & *u->sqmask;
+  struct io_uring_sqe *sqe = &u->sqes[idx];
+  char *buf = u->bufs + (size_t)i * u->bufsiz;
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->fd = fd;
+  sqe->off = (unsigned long long)off;
+  sqe->user_data = write ? (unsigned)i : (URING_RECV | (unsigned)i);
+  if (u->fixed) {
+    sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+    sqe->addr = (unsigned long long)(uintptr_t)(buf + (write ? s->done : 0));
+    sqe->len = write ? s->len - s->done : u->bufsiz;
+    sqe->buf_index = i;
+  } else {
+    s->iov.iov_base = buf + (write ? s->done : 0);
+    s->iov.iov_len = write ? s->len - s->done : u->bufsiz;
+    sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->addr = (unsigned long long)(uintptr_t)&s->iov;
+    sqe->len = 1;
+  }
+  u->sqarray[idx] = idx;
+  __atomic_store_n(u->sqtail, tail + 1, __ATOMIC_RELEASE);
+}
+
+FtpUring *FtpUringNew(int depth, int bufsiz) {
+  struct io_uring_params p;
+  struct iovec *iov;
+  FtpUring *u;
+  int i;
+
+  if ((depth < 2) || (depth > URING_MAXDEPTH) || (bufsiz <= 0)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if ((u = calloc(1, sizeof(FtpUring))) == NULL)
+    return NULL;
+  memset(&p, 0, sizeof(p));
+  if ((u->fd = (int)syscall(__NR_io_uring_setup, depth, &p)) == -1) {
+    free(u);
+    return NULL;
+  }
+  u->depth = depth;
+  u->bufsiz = bufsiz;
+  u->sqmap = u->cqmap = u->sqes = MAP_FAILED;
+  u->sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if ((p.features & IORING_FEAT_SINGLE_MMAP) && (u->cqlen > u->sqlen))
+    u->sqlen = u->cqlen;
+  u->sqmap = mmap(NULL, u->sqlen, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    u->cqmap = u->sqmap;
+  else
+    u->cqmap = mmap(NULL, u->cqlen, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+  u->sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = mmap(NULL, u->sqeslen, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  u->slots = calloc(depth, sizeof(struct slot));
+  u->freelist = calloc(depth, sizeof(int));
+  if ((u->sqmap != MAP_FAILED) && (u->cqmap != MAP_FAILED) &&
+      (u->sqes != MAP_FAILED) && (u->slots != NULL) &&
+      (u->freelist != NULL) &&
+      (posix_memalign((void **)&u->bufs, URING_ALIGN,
+                      (size_t)depth * bufsiz) != 0))
+    errno = ENOMEM;
+  if (u->bufs == NULL) {
+    i = errno;
+    FtpUringFree(u);
+    errno = i;
+    return NULL;
+  }
+  u->sqhead = (unsigned *)((char *)u->sqmap + p.sq_off.head);
+  u->sqtail = (unsigned *)((char *)u->sqmap + p.sq_off.tail);
+  u->sqmask = (unsigned *)((char *)u->sqmap + p.sq_off.ring_mask);
+  u->sqarray = (unsigned *)((char *)u->sqmap + p.sq_off.array);
+  u->cqhead = (unsigned *)((char *)u->cqmap + p.cq_off.head);
+  u->cqtail = (unsigned *)((char *)u->cqmap + p.cq_off.tail);
+  u->cqmask = (unsigned *)((char *)u->cqmap + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)((char *)u->cqmap + p.cq_off.cqes);
+
+  /* pinning the buffers needs RLIMIT_MEMLOCK; plain READV/WRITEV if not */
+  if ((iov = calloc(depth, sizeof(struct iovec))) != NULL) {
+    for (i = 0; i < depth; i++) {
+      iov[i].iov_base = u->bufs + (size_t)i * bufsiz;
+      iov[i].iov_len = bufsiz;
+    }
+    u->fixed = (syscall(__NR_io_uring_register, u->fd,
+                        IORING_REGISTER_BUFFERS, iov, depth) == 0);
+    free(iov);
+  }
+  return u;
+}
+
+long long FtpUringRecvFile(FtpUring *u, int sock, int fd, long long off,
+                           FtpUringFn fn, void *arg) {
+  struct io_uring_cqe *cqe;
+  unsigned head, tail;
+  long long got = 0;
+  int nfree, inflight = 0, reading = 0, eof = 0, err = 0, cut = 0;
+  int i, res;
+
+  if (u->broken) {
+    errno = EIO;
+    return -1;
+  }
+  for (nfree = 0; nfree < u->depth; nfree++)
+    u->freelist[nfree] = nfree;
+  for (;;) {
+    if (!eof && !err && !reading && (nfree > 0)) {
+      i = u->freelist[--nfree];
+      uring_queue(u, 0, sock, i, 0);
+      reading = 1;
+      inflight++;
+    }
+    if (err && reading && !cut) {
+      /* the pending socket read completes once the socket is shut down */
+      shutdown(sock, SHUT_RD);
+      cut = 1;
+    }
+    if (inflight == 0)
+      break;
+    if (uring_enter(u->fd,
+                    *u->sqtail - __atomic_load_n(u->sqhead, __ATOMIC_ACQUIRE),
+                    1) == -1) {
+      if ((errno == EINTR) || (errno == EAGAIN) || (errno == EBUSY))
+        continue;
+      /* the kernel may still own the buffers: stop using this ring */
+      u->broken = 1;
+      return -1;
+    }
+    head = *u->cqhead;
+    tail = __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      cqe = &u->cqes[head & *u->cqmask];
+      i = (int)(cqe->user_data & (URING_RECV - 1));
+      res = cqe->res;
+      inflight--;
+      if (cqe->user_data & URING_RECV) {
+        reading = 0;
+        if ((res > 0) && !err && (fn == NULL || fn(u->bufs +
+                                  (size_t)i * u->bufsiz, res, arg))) {
+          u->slots[i].len = res;
+          u->slots[i].done = 0;
+          u->slots[i].off = off + got;
+          got += res;
+          uring_queue(u, 1, fd, i, u->slots[i].off);
+          inflight++;
+          continue;
+        }
+        if ((res > 0) && !err)
+          err = ECANCELED;
+        else if (res == 0)
+          eof = 1;
+        else if ((res != -EINTR) && (res != -EAGAIN) && !err)
+          err = -res;
+      } else {
+        if (res > 0)
+          u->slots[i].done += res;
+        else if ((res != -EINTR) && (res != -EAGAIN) && !err)
+          err = res ? -res : EIO;
+        if (!err && (u->slots[i].done < u->slots[i].len)) {
+          /* short write, queue the rest */
+          uring_queue(u, 1, fd, i,
+                      u->slots[i].off + u->slots[i].done);
+          inflight++;
+          continue;
+        }
+      }
+      u->freelist[nfree++] = i;
+    }
+    __atomic_store_n(u->cqhead, head, __ATOMIC_RELEASE);
+  }
+  if (err) {
+    errno = err;
+    return -1;
+  }
+  return got;
+}
+
+void FtpUringFree(FtpUring *u) {
+  if (u == NULL)
+    return;
+  if (u->sqes != MAP_FAILED)
+    munmap(u->sqes, u->sqeslen);
+  if ((u->cqmap != MAP_FAILED) && (u->cqmap != u->sqmap))
+    munmap(u->cqmap, u->cqlen);
+  if (u->sqmap != MAP_FAILED)
+    munmap(u->sqmap, u->sqlen);
+  close(u->fd);
+  free(u->bufs);
+  free(u->slots);
+  free(u->freelist);
+  free(u);
+}
+
+#else
+
+FtpUring *FtpUringNew(int depth, int bufsiz) {
+  (void)depth;
+  (void)bufsiz;
+  errno = ENOSYS;
+  return NULL;
+}
+
+long long FtpUringRecvFile(FtpUring *u, int sock, int fd, long long off,
+                           FtpUringFn fn, void *arg) {
+  (void)u;
+  (void)sock;
+  (void)fd;
+  (void)off;
+  (void)fn;
+  (void)arg;
+  errno = ENOSYS;
+  return -1;
+}
+
+void FtpUringFree(FtpUring *u) { (void)u; }
+
+#endif
@@ -0,0 +1,554 @@
+/***************************************************************************/
+/*                                                                         */
+/* ftpwalk.c - parallel remote tree enumeration over ftplib sessions       */
+/* Copyright (C) 2015 Paolo Bosetti and Matteo Ragni,                      */
+/* paolo[dot]bosetti[at]unitn.it and matteo[dot]ragni[at]unitn.it          */
+/* Department of Industrial Engineering, University of Trento              */
+/*                                                                         */
+/* This library is free software.  You can redistribute it and/or          */
+/* modify it under the terms of the GNU GENERAL PUBLIC LICENSE 2.0.        */
+/*                                                                         */
+/* This library is distributed in the hope that it will be useful,         */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           */
+/* Artistic License 2.0 for more details.                                  */
+/*                                                                         */
+/* See the file LICENSE                                                    */
+/*                                                                         */
+/***************************************************************************/
+
+/*
+Worker threads each own an ftplib session and take directories from a
+shared FIFO, so the tree is listed breadth-first with several data
+connections in flight. Entries are queued for the caller, who consumes
+them with FtpWalkNext() on its own thread: workers never call back.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "ftplib.h"
+#include "ftpwalk.h"
+
+#if !defined(_WIN32)
+#include <pthread.h>
+
+#define WALK_BACKLOG 65536 /* queued entries before workers pause */
+#define WALK_LINESIZ 2048
+
+struct walk_node {
+  struct walk_node *next;
+  char *path;  /* the message of a log line */
+  char *facts; /* NULL for directories to list and failed listings */
+  int log;
+};
+
+struct walk_list {
+  struct walk_node *head, **tail;
+  long count;
+};
+
+struct FtpWalk {
+  pthread_mutex_t lock;
+  pthread_cond_t cond; /* queues changed or a worker quit */
+  struct walk_list dirs; /* still to be listed */
+  struct walk_list out;  /* entries for FtpWalkNext */
+  struct walk_node *cur; /* last node handed out */
+  int busy;              /* workers listing a directory */
+  int live;              /* workers still running */
+  int logged;            /* some worker logged in */
+  int stop;
+  int mlsd;
+  FtpWalkOptions opt;
+  int nthreads;
+  pthread_t *threads;
+  char *host, *user, *pass, *cwd;
+};
+
+static void list_init(struct walk_list *l) {
+  l->head = NULL;
+  l->tail = &l->head;
+  l->count = 0;
+}
+
+static void list_append(struct walk_list *l, struct walk_node *n) {
+  n->next = NULL;
+  *l->tail = n;
+  l->tail = &n->next;
+  l->count++;
+}
+
+static void list_splice(struct walk_list *l, struct walk_list *from) {
+  if (from->head == NULL)
+    return;
+  *l->tail = from->head;
+  l->tail = from->tail;
+  l->count += from->count;
+  list_init(from);
+}
+
+static struct walk_node *list_pop(struct walk_list *l) {
+  struct walk_node *n = l->head;
+  if (n == NULL)
+    return NULL;
+  l->head = n->next;
+  if (l->head == NULL)
+    l->tail = &l->head;
+  l->count--;
+  return n;
+}
+
+static void node_free(struct walk_node *n) {
+  if (n == NULL)
+    return;
+  free(n->path);
+  free(n->facts);
+  free(n);
+}
+
+static void list_free(struct walk_list *l) {
+  struct walk_node *n;
+  while ((n = list_pop(l)) != NULL)
+    node_free(n);
+}
+
+/* dir joined with name, without doubling the separator */
+static char *path_join(const char *dir, const char *name) {
+  size_t len = strlen(dir);
+  char *p = malloc(len + strlen(name) + 2);
+  if (p == NULL)
+    return NULL;
+  if ((len > 0) && (dir[len - 1] == '/'))
+    sprintf(p, "%s%s", dir, name);
+  else
+    sprintf(p, "%s/%s", dir, name);
+  return p;
+}
+
+static int list_add(struct walk_list *l, const char *dir, const char *name,
+                    const char *facts) {
+  struct walk_node *n = calloc(1, sizeof(struct walk_node));
+  if (n == NULL)
+    return 0;
+  n->path = path_join(dir, name);
+  n->facts = facts ? strdup(facts) : NULL;
+  if ((n->path == NULL) || (facts && (n->facts == NULL))) {
+    node_free(n);
+    return 0;
+  }
+  list_append(l, n);
+  return 1;
+}
+
+/*
+ * fact_type - 'd' for a directory, 'c' for the "." and ".." entries,
+ * 'f' for anything else
+ */
+static char fact_type(const char *facts) {
+  const char *p = facts;
+  while (*p && (*p != ' ')) {
+    if (strncasecmp(p, "type=", 5) == 0) {
+      p += 5;
+      if ((strncasecmp(p, "cdir", 4) == 0) || (strncasecmp(p, "pdir", 4) == 0))
+        return 'c';
+      if ((strncasecmp(p, "dir", 3) == 0) && ((p[3] == ';') || (p[3] == ' ')))
+        return 'd';
+      return 'f';
+    }
+    while (*p && (*p != ';') && (*p != ' '))
+      p++;
+    if (*p == ';')
+      p++;
+  }
+  return 'f';
+}
+
+/*
+ * list_mlsd - entries of dir from one MLSD transfer
+ */
+static int list_mlsd(netbuf *conn, const char *dir, struct walk_list *ents,
+                     struct walk_list *subs) {
+  char line[WALK_LINESIZ], *name;
+  netbuf *nData;
+  int ok = 1;
+  char t;
+
+  if (!FtpAccess(dir, FTPLIB_MLSD, FTPLIB_ASCII, conn, &nData))
+    return 0;
+  while (FtpRead(line, sizeof(line), nData) > 0) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if ((name = strchr(line, ' ')) == NULL)
+      continue;
+    name++;
+    if ((t = fact_type(line)) == 'c')
+      continue;
+    if (!list_add(ents, dir, name, line) ||
+        ((t == 'd') && !list_add(subs, dir, name, NULL)))
+      ok = 0;
+  }
+  return FtpClose(nData) && ok;
+}
+
+static void collect_reply(int idx, const char *reply, void *arg) {
+  char **replies = arg;
+  replies[idx] = strdup(reply);
+}
+
+/*
+ * dir_probe - which names without a SIZE answer are directories
+ *
+ * Servers answer SIZE and MDTM on a directory with 550, as for a missing
+ * path.  Each candidate gets a CWD, followed by one back to home, all
+ * pipelined; isdir[i] is set where the first is accepted.
+ *
+ * return 1 if successful, 0 if the session may be left elsewhere
+ */
+static int dir_probe(netbuf *conn, const char *dir, const char *home,
+                     char **names, int n, char **replies, char *isdir) {
+  char **cmds, **back;
+  int ncmds = 0, i, k, ok;
+
+  cmds = calloc(2 * n, sizeof(char *));
+  back = calloc(2 * n, sizeof(char *));
+  ok = (cmds != NULL) && (back != NULL);
+  for (i = 0; ok && (i < n); i++) {
+    char *path;
+    if (replies[2 * i + 1][0] == '2')
+      continue;
+    if ((path = path_join(dir, names[i])) == NULL)
+      ok = 0;
+    else if (((cmds[ncmds] = malloc(strlen(path) + 5)) == NULL) ||
+             ((cmds[ncmds + 1] = malloc(strlen(home) + 5)) == NULL))
+      ok = 0;
+    else {
+      sprintf(cmds[ncmds], "CWD %s", path);
+      sprintf(cmds[ncmds + 1], "CWD %s", home);
+      ncmds += 2;
+    }
+    free(path);
+  }
+  if (ok && ncmds)
+    ok = FtpPipeline((const char **)cmds, ncmds, collect_reply, back,
+                     conn) == ncmds;
+  for (i = 0, k = 0; ok && ncmds && (i < n); i++) {
+    if (replies[2 * i + 1][0] == '2')
+      continue;
+    isdir[i] = (back[k][0] == '2');
+    if (back[k + 1][0] != '2')
+      ok = 0;
+    k += 2;
+  }
+  for (i = 0; cmds && back && (i < 2 * n); i++) {
+    free(cmds[i]);
+    free(back[i]);
+  }
+  free(cmds);
+  free(back);
+  return ok;
+}
+
+/*
+ * list_nlst - entries of dir from NLST, with SIZE and MDTM pipelined
+ * into facts lines shaped like MLSD ones, and directories found with
+ * dir_probe(); a name nothing classifies is reported as type=unknown
+ */
+static int list_nlst(netbuf *conn, const char *dir, const char *home,
+                     struct walk_list *ents, struct walk_list *subs) {
+  char line[WALK_LINESIZ], facts[WALK_LINESIZ], *name, *isdir = NULL;
+  char **names = NULL, **cmds = NULL, **replies = NULL;
+  netbuf *nData;
+  int n = 0, capa = 0, ncmds, i, ok = 1;
+
+  if (!FtpAccess(dir, FTPLIB_DIR, FTPLIB_ASCII, conn, &nData))
+    return 0;
+  while (FtpRead(line, sizeof(line), nData) > 0) {
+    line[strcspn(line, "\r\n")] = '\0';
+    name = strrchr(line, '/') ? strrchr(line, '/') + 1 : line;
+    if ((*name == '\0') || (strcmp(name, ".") == 0) ||
+        (strcmp(name, "..") == 0))
+      continue;
+    if (n == capa) {
+      char **more = realloc(names, (capa = capa ? 2 * capa : 64) *
+                                       sizeof(char *));
+      if (more == NULL) {
+        ok = 0;
+        break;
+      }
+      names = more;
+    }
+    if ((names[n] = strdup(name)) == NULL) {
+      ok = 0;
+      break;
+    }
+    n++;
+  }
+  if (!FtpClose(nData))
+    ok = 0;
+  ncmds = 2 * n + 1;
+  if (ok && n) {
+    cmds = calloc(ncmds, sizeof(char *));
+    replies = calloc(ncmds, sizeof(char *));
+    ok = (cmds != NULL) && (replies != NULL);
+  }
+  if (ok && n) {
+    cmds[0] = strdup("TYPE I");
+    for (i = 0; i < n; i++) {
+      char *path = path_join(dir, names[i]);
+      if (path == NULL)
+        break;
+      cmds[2 * i + 1] = malloc(strlen(path) + 6);
+      cmds[2 * i + 2] = malloc(strlen(path) + 6);
+      if (cmds[2 * i + 1])
+        sprintf(cmds[2 * i + 1], "SIZE %s", path);
+      if (cmds[2 * i + 2])
+        sprintf(cmds[2 * i + 2], "MDTM %s", path);
+      free(path);
+    }
+    for (i = 0; (i < ncmds) && cmds[i]; i++)
+      ;
+    ok = (i == ncmds) && (FtpPipeline((const char **)cmds, ncmds,
+                                      collect_reply, replies, conn) == ncmds);
+    if (ok)
+      ok = ((isdir = calloc(n, 1)) != NULL) &&
+           dir_probe(conn, dir, home, names, n, replies, isdir);
+  }
+  for (i = 0; ok && (i < n); i++) {
+    char *size = replies[2 * i + 1], *mdtm = replies[2 * i + 2];
+    int has_size = (size[0] == '2');
+    int has_mdtm = (mdtm[0] == '2');
+    const char *type = isdir[i] ? "dir"
+                       : (has_size || has_mdtm) ? "file"
+                                                : "unknown";
+    if (has_mdtm)
+      mdtm[4 + strcspn(mdtm + 4, ". \r\n")] = '\0';
+    if (has_size)
+      size[4 + strcspn(size + 4, " \r\n")] = '\0';
+    snprintf(facts, sizeof(facts), "type=%s;%s%s%s%s%s%s %s", type,
+             has_size ? "size=" : "", has_size ? size + 4 : "",
+             has_size ? ";" : "", has_mdtm ? "modify=" : "",
+             has_mdtm ? mdtm + 4 : "", has_mdtm ? ";" : "", names[i]);
+    if (!list_add(ents, dir, names[i], facts) ||
+        (isdir[i] && !list_add(subs, dir, names[i], NULL)))
+      ok = 0;
+  }
+  for (i = 0; cmds && (i < ncmds); i++)
+    free(cmds[i]);
+  for (i = 0; replies && (i < ncmds); i++)
+    free(replies[i]);
+  for (i = 0; i < n; i++)
+    free(names[i]);
+  free(cmds);
+  free(replies);
+  free(names);
+  free(isdir);
+  return ok;
+}
+
+/*
+ * walk_log - queue a worker session's diagnostic for FtpWalkNext()
+ */
+static void walk_log(netbuf *conn, const char *msg, void *arg) {
+  FtpWalk *w = arg;
+  struct walk_node *n = calloc(1, sizeof(struct walk_node));
+  if ((n == NULL) || ((n->path = strdup(msg)) == NULL)) {
+    free(n);
+    return;
+  }
+  n->log = 1;
+  pthread_mutex_lock(&w->lock);
+  list_append(&w->out, n);
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+}
+
+static void *walk_worker(void *arg) {
+  FtpWalk *w = arg;
+  netbuf *conn = NULL;
+  struct walk_node *d;
+  struct walk_list ents, subs;
+  char home[WALK_LINESIZ];
+  int ok, listed;
+
+  ok = FtpConnect(w->host, &conn);
+  if (ok) {
+    FtpOptions(FTPLIB_DEBUG, w->opt.debug, conn);
+    if (w->opt.log)
+      FtpSetLog(walk_log, w, conn);
+    FtpOptions(FTPLIB_RATELIMIT, w->opt.rate_limit, conn);
+    FtpOptions(FTPLIB_RATEPOOL, (long)w->opt.pool, conn);
+    /* a session that cannot secure itself never sends the password */
+    if (w->opt.tls && !FtpAuthTLS(w->opt.tls - 1, conn))
+      ok = 0;
+    /* NLST listings come back here after each directory probe, and any
+       listing after a failure that may have left the session elsewhere */
+    ok = ok && FtpLogin(w->user, w->pass, conn) &&
+         ((w->cwd == NULL) || FtpChdir(w->cwd, conn)) &&
+         FtpPwd(home, sizeof(home), conn);
+  }
+  pthread_mutex_lock(&w->lock);
+  if (ok)
+    w->logged = 1;
+  while (ok) {
+    while (!w->stop && ((w->out.count >= WALK_BACKLOG) ||
+                        ((w->dirs.head == NULL) && w->busy)))
+      pthread_cond_wait(&w->cond, &w->lock);
+    if (w->stop || (w->dirs.head == NULL))
+      break;
+    d = list_pop(&w->dirs);
+    w->busy++;
+    pthread_mutex_unlock(&w->lock);
+
+    list_init(&ents);
+    list_init(&subs);
+    if (w->mlsd)
+      listed = list_mlsd(conn, d->path, &ents, &subs);
+    else
+      listed = list_nlst(conn, d->path, home, &ents, &subs);
+    /* a refused listing may stop half way through the probes: a session
+       that cannot get back home is as good as dropped */
+    if (!listed)
+      ok = FtpChdir(home, conn);
+
+    pthread_mutex_lock(&w->lock);
+    list_splice(&w->out, &ents);
+    list_splice(&w->dirs, &subs);
+    if (listed)
+      node_free(d);
+    else
+      list_append(&w->out, d);
+    w->busy--;
+    pthread_cond_broadcast(&w->cond);
+  }
+  w->live--;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+  if (conn)
+    FtpQuit(conn);
+  return NULL;
+}
+
+FtpWalk *FtpWalkStart(const char *host, const char *user, const char *pass,
+                      const char *cwd, const char *root, int workers,
+                      int mlsd, const FtpWalkOptions *opt) {
+  FtpWalk *w;
+  struct walk_node *r;
+  int i;
+
+  if (workers < 1)
+    workers = 1;
+  if ((w = calloc(1, sizeof(FtpWalk))) == NULL)
+    return NULL;
+  list_init(&w->dirs);
+  list_init(&w->out);
+  w->mlsd = mlsd;
+  if (opt)
+    w->opt = *opt;
+  else
+    w->opt.debug = ftplib_debug;
+  w->host = strdup(host);
+  w->user = strdup(user);
+  w->pass = strdup(pass);
+  w->cwd = cwd ? strdup(cwd) : NULL;
+  w->threads = calloc(workers, sizeof(pthread_t));
+  r = calloc(1, sizeof(struct walk_node));
+  if (r)
+    r->path = strdup(root);
+  if (!w->host || !w->user || !w->pass || (cwd && !w->cwd) || !w->threads ||
+      !r || !r->path) {
+    node_free(r);
+    free(w->host);
+    free(w->user);
+    free(w->pass);
+    free(w->cwd);
+    free(w->threads);
+    free(w);
+    return NULL;
+  }
+  list_append(&w->dirs, r);
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->cond, NULL);
+  pthread_mutex_lock(&w->lock);
+  for (i = 0; i < workers; i++) {
+    if (pthread_create(&w->threads[i], NULL, walk_worker, w) != 0)
+      break;
+    w->live++;
+  }
+  w->nthreads = i;
+  pthread_mutex_unlock(&w->lock);
+  if (w->nthreads == 0) {
+    FtpWalkStop(w);
+    return NULL;
+  }
+  return w;
+}
+
+int FtpWalkNext(FtpWalk *w, const char **path, const char **facts) {
+  struct walk_node *n;
+
+  node_free(w->cur);
+  w->cur = NULL;
+  pthread_mutex_lock(&w->lock);
+  while (w->out.head == NULL) {
+    if ((w->dirs.head == NULL) && (w->busy == 0))
+      break;
+    if (w->live == 0) {
+      if (!w->logged)
+        break;
+      /* every session dropped: what is left cannot be listed */
+      list_splice(&w->out, &w->dirs);
+      break;
+    }
+    pthread_cond_wait(&w->cond, &w->lock);
+  }
+  n = list_pop(&w->out);
+  if (w->out.count == WALK_BACKLOG / 2)
+    pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+  if (n == NULL)
+    return w->logged ? FTPWALK_DONE : FTPWALK_ERROR;
+  w->cur = n;
+  *path = n->path;
+  *facts = n->facts;
+  if (n->log)
+    return FTPWALK_LOG;
+  return n->facts ? FTPWALK_ENTRY : FTPWALK_FAILED;
+}
+
+void FtpWalkStop(FtpWalk *w) {
+  int i;
+
+  pthread_mutex_lock(&w->lock);
+  w->stop = 1;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+  for (i = 0; i < w->nthreads; i++)
+    pthread_join(w->threads[i], NULL);
+  node_free(w->cur);
+  list_free(&w->dirs);
+  list_free(&w->out);
+  pthread_cond_destroy(&w->cond);
+  pthread_mutex_destroy(&w->lock);
+  free(w->threads);
+  free(w->host);
+  free(w->user);
+  free(w->pass);
+  free(w->cwd);
+  free(w);
+}
+
+#else /* _WIN32: no worker threads, callers fall back to a serial walk */
+
+FtpWalk *FtpWalkStart(const char *host, const char *user, const char *pass,
+                      const char *cwd, const char *root, int workers,
+                      int mlsd, const FtpWalkOptions *opt) {
+  return NULL;
+}
+
+int FtpWalkNext(FtpWalk *w, const char **path, const char **facts) {
+  return FTPWALK_ERROR;
+}
+
+void FtpWalkStop(FtpWalk *w) {}
+
+#endif
@@ -0,0 +1,266 @@
+/***************************************************************************/
+/*                                                                         */
+/* ftpzip.c - streaming compression of ftplib transfers                    */
+/* Copyright (C) 2015 Paolo Bosetti and Matteo Ragni,                      */
+/* paolo[dot]bosetti[at]unitn.it and matteo[dot]ragni[at]unitn.it          */
+/* Department of Industrial Engineering, University of Trento              */
+/*                                                                         */
+/* This library is free software.  You can redistribute it and/or          */
+/* modify it under the terms of the GNU GENERAL PUBLIC LICENSE 2.0.        */
+/*                                                                         */
+/* This library is distributed in the hope that it will be useful,         */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           */
+/* Artistic License 2.0 for more details.                                  */
+/*                                                                         */
+/* See the file LICENSE                                                    */
+/*                                                                         */
+/***************************************************************************/
+
+/*
+gzip (RFC 1952, through zlib) and, with FTPLIB_ZSTD, zstd streams fed
+with the buffers passing through FtpXfer. Memory stays bounded whatever
+the file size: the codec's own state (about 256 KiB for zlib, a few MiB
+for zstd at its default level) plus one output block. Decompression
+accepts concatenated gzip members or zstd frames, and fails on a stream
+that stops short of its end.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <zlib.h>
+#if defined(FTPLIB_ZSTD)
+#include <zstd.h>
+#endif
+#include "ftplib.h"
+#include "ftpzip.h"
+
+#define ZIP_BUFSIZ 65536
+
+struct FtpZip {
+  int codec;    /* FTPLIB_CODEC_* */
+  int compress;
+  int ended;    /* decompressing: the last member or frame is complete */
+  const char *error;
+  long long in, out;
+  z_stream gz;
+#if defined(FTPLIB_ZSTD)
+  ZSTD_CCtx *cctx;
+  ZSTD_DCtx *dctx;
+#endif
+  char buf[ZIP_BUFSIZ];
+};
+
+/*
+ * emit - hand len bytes of output to the caller
+ *
+ * return 1 to go on, 0 if fn stopped the run
+ */
+static int emit(FtpZip *z, int len, FtpZipFn fn, void *arg) {
+  if (len == 0)
+    return 1;
+  z->out += len;
+  if (fn(z->buf, len, arg))
+    return 1;
+  z->error = NULL;
+  return 0;
+}
+
+static int gz_error(FtpZip *z, int rc) {
+  z->error = z->gz.msg ? z->gz.msg : (rc == Z_MEM_ERROR ? "out of memory"
+                                                         : "corrupt data");
+  return 0;
+}
+
+static int gz_deflate(FtpZip *z, int finish, FtpZipFn fn, void *arg) {
+  int rc;
+  do {
+    z->gz.next_out = (Bytef *)z->buf;
+    z->gz.avail_out = ZIP_BUFSIZ;
+    rc = deflate(&z->gz, finish ? Z_FINISH : Z_NO_FLUSH);
+    if (rc == Z_STREAM_ERROR)
+      return gz_error(z, rc);
+    if (!emit(z, ZIP_BUFSIZ - z->gz.avail_out, fn, arg))
+      return 0;
+  } while ((z->gz.avail_out == 0) || (finish && (rc != Z_STREAM_END)));
+  return 1;
+}
+
+static int gz_inflate(FtpZip *z, FtpZipFn fn, void *arg) {
+  int rc;
+  for (;;) {
+    z->gz.next_out = (Bytef *)z->buf;
+    z->gz.avail_out = ZIP_BUFSIZ;
+    rc = inflate(&z->gz, Z_NO_FLUSH);
+    if ((rc != Z_OK) && (rc != Z_STREAM_END) && (rc != Z_BUF_ERROR))
+      return gz_error(z, rc);
+    if (!emit(z, ZIP_BUFSIZ - z->gz.avail_out, fn, arg))
+      return 0;
+    if (rc == Z_STREAM_END) {
+      z->ended = 1;
+      if (z->gz.avail_in == 0)
+        return 1;
+      /* another member follows */
+      inflateReset(&z->gz);
+      z->ended = 0;
+    } else if (z->gz.avail_out != 0)
+      return 1;
+  }
+}
+
+#if defined(FTPLIB_ZSTD)
+static int zstd_run(FtpZip *z, const char *buf, int len, int finish,
+                    FtpZipFn fn, void *arg) {
+  ZSTD_inBuffer in;
+  ZSTD_outBuffer out;
+  size_t rc, pos;
+  in.src = buf;
+  in.size = len;
+  in.pos = 0;
+  do {
+    out.dst = z->buf;
+    out.size = ZIP_BUFSIZ;
+    out.pos = 0;
+    pos = in.pos;
+    if (z->compress)
+      rc = ZSTD_compressStream2(z->cctx, &out, &in,
+                                finish ? ZSTD_e_end : ZSTD_e_continue);
+    else
+      rc = ZSTD_decompressStream(z->dctx, &out, &in);
+    if (ZSTD_isError(rc)) {
+      z->error = ZSTD_getErrorName(rc);
+      return 0;
+    }
+    if (!emit(z, (int)out.pos, fn, arg))
+      return 0;
+    /* without progress rc only hints at the next frame */
+    if (!z->compress && ((in.pos > pos) || (out.pos > 0)))
+      z->ended = (rc == 0);
+    /* a full output block may leave more in the codec */
+  } while ((in.pos < in.size) || (out.pos == out.size) ||
+           (z->compress && finish && (rc != 0)));
+  return 1;
+}
+#endif
+
+/*
+ * FtpZipAvailable - whether this build has a codec
+ */
+int FtpZipAvailable(int codec) {
+#if defined(FTPLIB_ZSTD)
+  if (codec == FTPLIB_CODEC_ZSTD)
+    return 1;
+#endif
+  return codec == FTPLIB_CODEC_GZIP;
+}
+
+/*
+ * FtpZipNew - set up a compressor or decompressor
+ *
+ * return the codec, NULL with errno set on error
+ */
+FtpZip *FtpZipNew(int codec, int compress) {
+  FtpZip *z;
+  int rc = Z_OK;
+  if (!FtpZipAvailable(codec)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if ((z = calloc(1, sizeof(FtpZip))) == NULL)
+    return NULL;
+  z->codec = codec;
+  z->compress = compress;
+  switch (codec) {
+  case FTPLIB_CODEC_GZIP:
+    /* window bits + 16: gzip header and trailer instead of zlib's */
+    if (compress)
+      rc = deflateInit2(&z->gz, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                        MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY);
+    else
+      rc = inflateInit2(&z->gz, MAX_WBITS + 16);
+    if (rc != Z_OK) {
+      free(z);
+      errno = ENOMEM;
+      return NULL;
+    }
+    break;
+#if defined(FTPLIB_ZSTD)
+  case FTPLIB_CODEC_ZSTD:
+    if (compress) {
+      if ((z->cctx = ZSTD_createCCtx()) != NULL)
+        ZSTD_CCtx_setParameter(z->cctx, ZSTD_c_checksumFlag, 1);
+    } else
+      z->dctx = ZSTD_createDCtx();
+    if ((z->cctx == NULL) && (z->dctx == NULL)) {
+      free(z);
+      errno = ENOMEM;
+      return NULL;
+    }
+    break;
+#endif
+  }
+  return z;
+}
+
+/*
+ * FtpZipRun - compress or decompress a block of input
+ *
+ * return 1 if successful, 0 otherwise
+ */
+int FtpZipRun(FtpZip *z, const char *buf, int len, int finish, FtpZipFn fn,
+              void *arg) {
+  int rv;
+  z->in += len;
+  z->error = NULL;
+#if defined(FTPLIB_ZSTD)
+  if (z->codec == FTPLIB_CODEC_ZSTD)
+    rv = zstd_run(z, buf, len, finish, fn, arg);
+  else
+#endif
+  {
+    z->gz.next_in = (Bytef *)buf;
+    z->gz.avail_in = len;
+    if (z->compress)
+      rv = gz_deflate(z, finish, fn, arg);
+    else
+      rv = gz_inflate(z, fn, arg);
+  }
+  if (rv && finish && !z->compress && !z->ended) {
+    z->error = "stream ends prematurely";
+    rv = 0;
+  }
+  return rv;
+}
+
+/*
+ * FtpZipError - what the last failed FtpZipRun() ran into
+ */
+const char *FtpZipError(FtpZip *z) {
+  return z->error;
+}
+
+/*
+ * FtpZipTotals - bytes fed in and handed out so far
+ */
+void FtpZipTotals(FtpZip *z, long long *in, long long *out) {
+  *in = z->in;
+  *out = z->out;
+}
+
+void FtpZipFree(FtpZip *z) {
+  if (z == NULL)
+    return;
+#if defined(FTPLIB_ZSTD)
+  ZSTD_freeCCtx(z->cctx);
+  ZSTD_freeDCtx(z->dctx);
+  if (z->codec == FTPLIB_CODEC_GZIP)
+#endif
+  {
+    if (z->compress)
+      deflateEnd(&z->gz);
+    else
+      inflateEnd(&z->gz);
+  }
+  free(z);
+}